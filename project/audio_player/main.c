@@ -1,6 +1,7 @@
 #include "audio_player_process.h"
 #include "audio_manager.h"
 #include "httpclient.h"
+#include "pcm_convert.h"
 
 typedef struct {
     com_player_t    com_player;
@@ -130,7 +131,7 @@ static void http_download_test(void)
             break;
         }
         else {
-            vTaskDelay(200/portTICK_RATE_MS);
+            common_buffer_wait_for(&http_buffer, 1, 1000/portTICK_RATE_MS);
         }
     }		
 			
@@ -141,6 +142,212 @@ static void http_download_test(void)
 	fclose(file_writer);
 }
 
+static int pcm_convert_ref_scale(mad_fixed_t sample)
+{
+    sample += (1L << (MAD_F_FRACBITS - 16));
+
+    if (sample >= MAD_F_ONE)
+        sample = MAD_F_ONE - 1;
+    else if (sample < -MAD_F_ONE)
+        sample = -MAD_F_ONE;
+
+    return sample >> (MAD_F_FRACBITS + 1 - 16);
+}
+
+/* the loop mp3_decoder_task used before pcm_convert */
+static void pcm_convert_ref(uint8_t* out, mad_fixed_t samples[2][1152], int channels, int length)
+{
+    int i, j, tmp, count = 0;
+    for(i = 0; i < length; i++)
+    {
+        for(j = 0; j < channels; j++) {
+            tmp = pcm_convert_ref_scale(samples[j][i]);
+            out[count++] = tmp;
+            out[count++] = tmp >> 8;
+        }
+    }
+}
+
+static uint32_t pcm_convert_test_us(struct timeval* beg)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - beg->tv_sec)*1000000 + (end.tv_usec - beg->tv_usec);
+}
+
+static void pcm_convert_test(void)
+{
+    static mad_fixed_t samples[2][1152];
+    static uint8_t ref_buf[1152*2*2];
+    static int16_t out_buf[1152*2];
+    struct timeval beg;
+    uint32_t ref_us, out_us;
+    int i, j, length, channels, mismatch = 0;
+
+    srand(1);
+
+    /* bit exactness: random lengths, full range input incl. clip and wrap edges */
+    for(i = 0; i < 10000; i++)
+    {
+        length   = 1 + rand()%1152;
+        channels = 1 + rand()%2;
+
+        for(j = 0; j < length; j++) {
+            samples[0][j] = (mad_fixed_t)(((uint32_t)rand() << 16) ^ rand()) >> (rand()%4);
+            samples[1][j] = (rand()%2 ?MAD_F_ONE :-MAD_F_ONE) + rand()%8192 - 4096;
+        }
+
+        pcm_convert_ref(ref_buf, samples, channels, length);
+        pcm_convert_fixed_to_s16(out_buf, samples[0], (2 == channels) ?samples[1] :NULL, length);
+
+        if(0 != memcmp(ref_buf, out_buf, length*channels*2))
+            mismatch++;
+    }
+
+    LOG_I(common, "pcm_convert(%s) bit exact: %s", pcm_convert_get_kernel_name(), (0 == mismatch) ?"pass" :"FAIL");
+
+    /* microbenchmark: stereo 1152 sample frames */
+    for(j = 0; j < 1152; j++) {
+        samples[0][j] = rand()%(2*MAD_F_ONE) - MAD_F_ONE;
+        samples[1][j] = rand()%(2*MAD_F_ONE) - MAD_F_ONE;
+    }
+
+    gettimeofday(&beg, NULL);
+    for(i = 0; i < 100000; i++)
+        pcm_convert_ref(ref_buf, samples, 2, 1152);
+    ref_us = pcm_convert_test_us(&beg);
+
+    gettimeofday(&beg, NULL);
+    for(i = 0; i < 100000; i++)
+        pcm_convert_fixed_to_s16(out_buf, samples[0], samples[1], 1152);
+    out_us = pcm_convert_test_us(&beg);
+
+    LOG_I(common, "100000 stereo frames: loop %u us, %s %u us", ref_us, pcm_convert_get_kernel_name(), out_us);
+}
+
+typedef struct {
+    ring_buffer_t   ring;
+    uint32_t        count;
+    uint64_t        latency_ns;
+    uint64_t        max_latency_ns;
+    
+} ring_buffer_bench_t;
+
+static uint64_t ring_buffer_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void* ring_buffer_bench_producer(void* param)
+{
+    ring_buffer_bench_t* bench = (ring_buffer_bench_t*)param;
+    uint64_t msg[8];
+    uint32_t i;
+
+    /* 64 byte messages into a power of two ring never split */
+    for(i = 0; i < bench->count; i++) {
+        msg[0] = ring_buffer_bench_now();
+        while(0 == ring_buffer_push(&bench->ring, msg, sizeof(msg), false))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void* ring_buffer_bench_consumer(void* param)
+{
+    ring_buffer_bench_t* bench = (ring_buffer_bench_t*)param;
+    uint64_t msg[8], latency;
+    uint32_t i;
+
+    for(i = 0; i < bench->count; i++) {
+        while(0 == ring_buffer_pop(&bench->ring, msg, sizeof(msg), false))
+            sched_yield();
+
+        latency = ring_buffer_bench_now() - msg[0];
+        bench->latency_ns += latency;
+        if(latency > bench->max_latency_ns)
+            bench->max_latency_ns = latency;
+    }
+
+    return NULL;
+}
+
+static void ring_buffer_bench(void)
+{
+    static ring_buffer_bench_t bench;
+    const char* names[] = { "mutex", "spsc" };
+    pthread_t producer, consumer;
+    uint64_t beg, used;
+    int mode;
+
+    for(mode = RING_BUF_MODE_MUTEX; mode <= RING_BUF_MODE_SPSC; mode++)
+    {
+        memset(&bench, 0, sizeof(bench));
+        bench.count = 2000000;
+        ring_buffer_init(&bench.ring, 32*1024, (ring_buffer_mode_t)mode);
+
+        beg = ring_buffer_bench_now();
+        pthread_create(&consumer, NULL, ring_buffer_bench_consumer, &bench);
+        pthread_create(&producer, NULL, ring_buffer_bench_producer, &bench);
+        pthread_join(producer, NULL);
+        pthread_join(consumer, NULL);
+        used = ring_buffer_bench_now() - beg;
+
+        LOG_I(common, "ring_buffer %s: %u MB/s, %u msg/ms, latency avg %u ns max %u us", 
+            names[mode], 
+            (uint32_t)((uint64_t)bench.count*64*1000/used), 
+            (uint32_t)((uint64_t)bench.count*1000000/used), 
+            (uint32_t)(bench.latency_ns/bench.count), 
+            (uint32_t)(bench.max_latency_ns/1000));
+
+        ring_buffer_deinit(&bench.ring);
+    }
+}
+
+static void resampler_bench(void)
+{
+    static const uint32_t rates[][2] = { {22050, 44100}, {16000, 44100}, {44100, 48000}, {48000, 44100} };
+    static const char* names[] = { "low", "medium", "high" };
+    static int16_t in_buf[48000*10];
+    static int16_t out_buf[4096];
+    resampler_t resampler;
+    uint64_t beg, used;
+    int quality, r, i, in_frames, offset, consumed;
+
+    srand(1);
+    for(i = 0; i < (int)(sizeof(in_buf)/sizeof(in_buf[0])); i++)
+        in_buf[i] = rand()%65536 - 32768;
+
+    /* 10 s of mono noise per conversion, cost is per channel */
+    for(quality = RESAMPLER_QUALITY_LOW; quality <= RESAMPLER_QUALITY_HIGH; quality++)
+    {
+        for(r = 0; r < (int)(sizeof(rates)/sizeof(rates[0])); r++)
+        {
+            if(RESAMPLER_SUCCESS != resampler_init(&resampler, rates[r][0], rates[r][1], 1, 1, (resampler_quality_t)quality))
+                continue;
+
+            in_frames = rates[r][0]*10;
+            offset = 0;
+            
+            beg = ring_buffer_bench_now();
+            while(offset < in_frames) {
+                resampler_process(&resampler, in_buf + offset, in_frames - offset, &consumed, out_buf, sizeof(out_buf)/sizeof(out_buf[0]));
+                offset += consumed;
+            }
+            used = ring_buffer_bench_now() - beg;
+
+            LOG_I(common, "resampler(%s) %s %d taps %d -> %d: %u us per channel second, %u x realtime",
+                resampler_get_kernel_name(), names[quality], resampler_get_taps((resampler_quality_t)quality),
+                rates[r][0], rates[r][1], (uint32_t)(used/10000), (uint32_t)(10000000000ULL/used));
+
+            resampler_deinit(&resampler);
+        }
+    }
+}
+
 static void audio_player_test(void)
 {
 	static audio_player_proc_t resource_player;
@@ -157,16 +364,8 @@ static void audio_player_test(void)
     audio_player_start(&resource_player, &resource_player_info, false);vTaskDelay(10000);
     //audio_player_start(&prompt_player, &prompt_player_info, false);
     
-    while(1)
-    {
-		if( AUDIO_PLAYER_STA_IDLE == resource_player.cur_state && 
-			AUDIO_PLAYER_STA_IDLE == prompt_player.cur_state)
-		{
-			break;
-		}
-		
-        vTaskDelay(1000);
-    }
+    audio_player_wait_finish(&resource_player, portMAX_DELAY);
+    audio_player_wait_finish(&prompt_player, portMAX_DELAY);
 	
 	audio_player_deinit(&resource_player);
 	audio_player_deinit(&prompt_player);
@@ -175,6 +374,151 @@ static void audio_player_test(void)
 
 extern char *get_register_url(void);
 extern char *http_get(char *get_url);
+static void common_buffer_bench(void)
+{
+    static uint8_t chunk[4096];
+    common_buffer_t buffer;
+    uint64_t beg, used, bytes = 0;
+    uint32_t size;
+    int round, i;
+
+    common_buffer_init(&buffer, COMMON_BUF_HTTP_NODE_SIZE, COMMON_BUF_HTTP_MAX_SIZE);
+
+    /* http sized refills: fill it up, drain it, 1000 times */
+    beg = ring_buffer_bench_now();
+    for(round = 0; round < 1000; round++) {
+        for(i = 0; i < COMMON_BUF_HTTP_MAX_SIZE/(int)sizeof(chunk); i++)
+            common_buffer_push(&buffer, chunk, sizeof(chunk));
+
+        while(common_buffer_get_count(&buffer) > 0) {
+            size = sizeof(chunk);
+            common_buffer_pop(&buffer, chunk, &size);
+            bytes += size;
+        }
+    }
+    used = ring_buffer_bench_now() - beg;
+
+    LOG_I(common, "common_buffer push+pop: %u MB/s, %u node allocations, %u reused", 
+        (uint32_t)(bytes*1000/used), common_buffer_get_alloc_count(&buffer), common_buffer_get_reuse_count(&buffer));
+
+    common_buffer_deinit(&buffer);
+}
+
+/* pop drains the tail while the producer still fills its reservation */
+static void common_buffer_reserve_test(void)
+{
+    static const uint8_t first[] = "0123456789";
+    static const uint8_t second[] = "abcdefghij";
+    common_buffer_t buffer;
+    uint8_t out[32];
+    uint8_t* p_buf;
+    uint32_t size;
+
+    common_buffer_init(&buffer, 64, 256);
+    common_buffer_push(&buffer, (uint8_t*)first, sizeof(first));
+
+    common_buffer_reserve(&buffer, &p_buf, &size);
+    memcpy(p_buf, second, sizeof(second));
+
+    size = sizeof(out);
+    common_buffer_pop(&buffer, out, &size);
+    if(sizeof(first) != size || 0 != memcmp(out, first, sizeof(first)))
+        LOG_E(common, "common_buffer reserve: first pop %u bytes", size);
+
+    common_buffer_commit(&buffer, sizeof(second));
+
+    size = sizeof(out);
+    common_buffer_pop(&buffer, out, &size);
+    if(sizeof(second) != size || 0 != memcmp(out, second, sizeof(second)))
+        LOG_E(common, "common_buffer reserve: committed bytes lost, got %u", size);
+    else
+        LOG_I(common, "common_buffer reserve: pop during reservation ok");
+
+    common_buffer_deinit(&buffer);
+}
+
+static void* common_buffer_wakeup_waker(void* param)
+{
+    vTaskDelay(50/portTICK_RATE_MS);
+    common_buffer_wakeup((common_buffer_t*)param);
+    return NULL;
+}
+
+/* a wakeup nobody waits for does not cut the next wait short, one with a waiter ends it */
+static void common_buffer_wakeup_test(void)
+{
+    common_buffer_t buffer;
+    pthread_t waker;
+    uint32_t beg, used;
+    int ret;
+
+    common_buffer_init(&buffer, 64, 256);
+
+    common_buffer_wakeup(&buffer);
+    beg = xTaskGetTickCount();
+    ret = common_buffer_wait_for(&buffer, 1, 200/portTICK_RATE_MS);
+    used = xTaskGetTickCount() - beg;
+    if(COMMON_BUF_ERR_TIMEOUT != ret || used < 200/portTICK_RATE_MS)
+        LOG_E(common, "common_buffer wakeup: stale wakeup, ret %d after %u ms", ret, used*portTICK_RATE_MS);
+
+    pthread_create(&waker, NULL, common_buffer_wakeup_waker, &buffer);
+    beg = xTaskGetTickCount();
+    ret = common_buffer_wait_for(&buffer, 1, 2000/portTICK_RATE_MS);
+    used = xTaskGetTickCount() - beg;
+    pthread_join(waker, NULL);
+    if(COMMON_BUF_ERR_WAKEUP != ret || used >= 2000/portTICK_RATE_MS)
+        LOG_E(common, "common_buffer wakeup: waiter not woken, ret %d after %u ms", ret, used*portTICK_RATE_MS);
+    else
+        LOG_I(common, "common_buffer wakeup: ok");
+
+    common_buffer_deinit(&buffer);
+}
+
+/* a move past the end is refused, the running download goes on and no byte is lost */
+static void http_download_move_test(void)
+{
+    common_buffer_t http_buffer;
+    http_download_proc_t http_proc;
+    char* url = "http://47.98.36.22/432506345.mp3";
+    uint8_t buf[512];
+    uint32_t len, got = 0;
+    int total;
+
+    common_buffer_init(&http_buffer, COMMON_BUF_HTTP_NODE_SIZE, COMMON_BUF_HTTP_MAX_SIZE);
+    http_download_init(&http_proc);
+    http_download_start(&http_proc, &http_buffer, url, true);
+
+    while((total = http_download_get_total_length(&http_proc)) <= 0 && false == http_download_is_stopped(&http_proc)) {
+        common_buffer_wait_for(&http_buffer, 1, 100/portTICK_RATE_MS);
+    }
+
+    if(HTTP_DOWNLOAD_PROC_SUCCESS == http_download_move_to(&http_proc, &http_buffer, url, true, total, 0))
+        LOG_E(common, "http_download move: start past the end %d accepted", total);
+
+    while(1)
+    {
+        len = sizeof(buf);
+        if(common_buffer_get_count(&http_buffer) > 0 && COMMON_BUF_SUCCESS == common_buffer_pop(&http_buffer, buf, &len)) {
+            got += len;
+        }
+        else if(true == http_download_is_stopped(&http_proc)) {
+            break;
+        }
+        else {
+            common_buffer_wait_for(&http_buffer, 1, 1000/portTICK_RATE_MS);
+        }
+    }
+
+    if(total != (int)got)
+        LOG_E(common, "http_download move: got %u of %d bytes", got, total);
+    else
+        LOG_I(common, "http_download move: refused move kept the download");
+
+    http_download_stop(&http_proc);
+    http_download_deinit(&http_proc);
+    common_buffer_deinit(&http_buffer);
+}
+
 extern char *header;
 extern char *post_data;
 
@@ -182,6 +526,13 @@ int main(int argc, char* argv[])
 {
 #if 0
 	//com_player_test();
+	//pcm_convert_test();
+	//ring_buffer_bench();
+	//resampler_bench();
+	//common_buffer_bench();
+	//common_buffer_reserve_test();
+	//http_download_move_test();
+	//common_buffer_wakeup_test();
 	//audio_player_test();
 	int i = 0;
 	audio_mgr_init();
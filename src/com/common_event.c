@@ -18,7 +18,7 @@ void common_set_event(common_event_t* common_event, uint32_t events)
 	pthread_mutex_lock(&common_event->mutex);
     
     common_event->event |= events;
-    pthread_cond_signal(&common_event->cond);
+    pthread_cond_broadcast(&common_event->cond);
 
     pthread_mutex_unlock(&common_event->mutex);
 }
@@ -1,5 +1,8 @@
 #include "typedefs.h"
 #include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 uint32_t xTaskGetTickCount(void)
 {
@@ -46,12 +49,18 @@ int f_open(FILE** file, char* path, int mode)
 	
 	if(FA_READ & mode)
 		ret = fopen(path, "rb");
+	else if(FA_OPEN_APPEND & mode)
+		ret = fopen(path, "ab");
 	else
 		ret = fopen(path, "wb");
 	
 	if(NULL == ret)
 		return -1;
 	
+	/* files are read front to back, let the kernel read ahead further */
+	if(FA_READ & mode)
+		posix_fadvise(fileno(ret), 0, 0, POSIX_FADV_SEQUENTIAL);
+	
 	*file = ret;
 	return 0;
 }
@@ -77,6 +86,15 @@ int f_read(FILE** file, uint8_t* buf, int size, UINT* bytes_read)
 	return 0;
 }
 
+int f_write(FILE** file, const uint8_t* buf, int size, UINT* bytes_written)
+{
+	int ret;
+	ret = fwrite(buf, 1, size, *file);
+	
+	*bytes_written = ret;
+	return (ret == size) ?0 :-1;
+}
+
 int f_lseek(FILE** file, int offset)
 {
 	return fseek(*file, offset, SEEK_SET);
@@ -94,6 +112,49 @@ int f_size(FILE** file)
 	return ret;
 }
 
+/* read only view of the whole file, it stays valid after f_close */
+int f_map(FILE** file, const uint8_t** p_addr, int* p_size)
+{
+	struct stat st;
+	void* addr;
+	
+	if(*file == NULL || 0 != fstat(fileno(*file), &st) || st.st_size <= 0)
+		return -1;
+	
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(*file), 0);
+	if(MAP_FAILED == addr)
+		return -1;
+	
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+	
+	*p_addr = (const uint8_t*)addr;
+	*p_size = (int)st.st_size;
+	return 0;
+}
+
+int f_unmap(const uint8_t* addr, int size)
+{
+	if(NULL == addr)
+		return -1;
+	
+	return munmap((void*)addr, size);
+}
+
+int f_unlink(char* path)
+{
+	return unlink(path);
+}
+
+int f_rename(char* old_path, char* new_path)
+{
+	return rename(old_path, new_path);
+}
+
+int f_mkdir(char* path)
+{
+	return mkdir(path, 0755);
+}
+
 int32_t mqtt_msg_send_with_timeout(char *topic, int qos, char *buf, TickType_t xTicksToWait)
 {
 	return 0;
@@ -68,6 +68,7 @@ typedef int FSIZE_t;
 #define FA_OPEN_EXISTING					0x01
 #define FA_WRITE							0x10
 #define FA_READ								0x20
+#define FA_OPEN_APPEND						0x40
 
 #define EventGroupHandle_t 					common_event_t*
 #define xEventGroupCreate()					common_create_event()
@@ -91,6 +92,12 @@ int f_close(FILE** file);
 int f_read(FILE** file, uint8_t* buf, int size, UINT* bytes_read);
 int f_lseek(FILE** file, int offset);
 int f_size(FILE** file);
+int f_write(FILE** file, const uint8_t* buf, int size, UINT* bytes_written);
+int f_map(FILE** file, const uint8_t** p_addr, int* p_size);
+int f_unmap(const uint8_t* addr, int size);
+int f_unlink(char* path);
+int f_rename(char* old_path, char* new_path);
+int f_mkdir(char* path);
 
 int32_t mqtt_msg_send_with_timeout(char *topic, int qos, char *buf, TickType_t xTicksToWait);
 void log_print(const char* module, const char* level, const char* func, int line, const char* fmt, ...);
@@ -0,0 +1,650 @@
+#include "audio_cache.h"
+#include "typedefs.h"
+#include <string.h>
+
+#define malloc(x)   pvPortMalloc(x)
+#define free(x)     vPortFree(x)
+
+log_create_module(audio_cache, PRINT_LEVEL_INFO);
+
+/* 
+ * Web sources kept on disk, one file per URL, named by its hash, and an
+ * index with the validator, length and last use of each. A playback takes
+ * whole entries as they are; an incomplete one is filled by the playback
+ * that opened it, after its validator was compared with the response's.
+ * The least recently used entries go when the budget would be exceeded.
+ */
+
+#define AUDIO_CACHE_INDEX_NAME      "cache.idx"
+#define AUDIO_CACHE_FILE_NAME_SIZE  22              /* "/", 16 hex digits, ".dat" and the '\0', "/cache.idx.tmp" fits too */
+#define AUDIO_CACHE_MAX_DIR_SIZE    (AUDIO_CACHE_MAX_PATH_SIZE - AUDIO_CACHE_FILE_NAME_SIZE)
+#define AUDIO_CACHE_INDEX_MAGIC     0x31494341UL    /* "ACI1" */
+
+/* as stored in the index */
+typedef struct {
+    uint64_t    key;
+    uint32_t    size;
+    uint32_t    total_length;
+    uint32_t    last_used;
+    char        validator[AUDIO_CACHE_VALIDATOR_SIZE];
+    
+} audio_cache_record_t;
+
+typedef struct {
+    bool                    used;
+    int                     users;          /* open sessions, not evicted while any */
+    bool                    writing;        /* a session owns it */
+    audio_cache_record_t    record;
+    
+} audio_cache_entry_t;
+
+static audio_cache_entry_t  g_entries[AUDIO_CACHE_MAX_ENTRIES];
+static audio_cache_stats_t  g_stats;
+static char                 g_dir[AUDIO_CACHE_MAX_DIR_SIZE];
+static uint32_t             g_budget = 0;
+static uint32_t             g_used_bytes = 0;
+static uint32_t             g_sequence = 0;
+static bool                 g_initialized = false;
+static SemaphoreHandle_t    g_mutex = NULL;
+static pthread_once_t       g_mutex_once = PTHREAD_ONCE_INIT;
+
+#define audio_cache_lock()      do { xSemaphoreTake(g_mutex, portMAX_DELAY); } while(0)
+#define audio_cache_unlock()    do { xSemaphoreGive(g_mutex); } while(0)
+
+/* FNV-1a */
+static uint64_t audio_cache_hash(const char* url)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    while('\0' != *url) {
+        hash ^= (uint8_t)*url++;
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static bool audio_cache_file_path(uint64_t key, char* path)
+{
+    int len = snprintf(path, AUDIO_CACHE_MAX_PATH_SIZE, "%s/%016llx.dat", g_dir, (unsigned long long)key);
+    
+    return (len > 0 && len < AUDIO_CACHE_MAX_PATH_SIZE) ?true :false;
+}
+
+static bool audio_cache_index_path(char* path, const char* suffix)
+{
+    int len = snprintf(path, AUDIO_CACHE_MAX_PATH_SIZE, "%s/%s%s", g_dir, AUDIO_CACHE_INDEX_NAME, suffix);
+    
+    return (len > 0 && len < AUDIO_CACHE_MAX_PATH_SIZE) ?true :false;
+}
+
+static int audio_cache_file_size(char* path)
+{
+    FIL file;
+    int size;
+    
+    if(FR_OK != f_open(&file, path, FA_OPEN_EXISTING |FA_READ)) {
+        return -1;
+    }
+
+    size = f_size(&file);
+    f_close(&file);
+
+    return size;
+}
+
+static bool audio_cache_is_whole(audio_cache_entry_t* entry)
+{
+    return (entry->record.total_length > 0 && entry->record.size >= entry->record.total_length) ?true :false;
+}
+
+static int audio_cache_find(uint64_t key)
+{
+    int i;
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++) {
+        if(true == g_entries[i].used && key == g_entries[i].record.key)
+            return i;
+    }
+
+    return -1;
+}
+
+static void audio_cache_remove(int index)
+{
+    char path[AUDIO_CACHE_MAX_PATH_SIZE];
+
+    if(true == audio_cache_file_path(g_entries[index].record.key, path))
+        f_unlink(path);
+
+    g_used_bytes -= g_entries[index].record.size;
+    memset(&g_entries[index], 0, sizeof(audio_cache_entry_t));
+}
+
+/* the least recently used entry no session has open */
+static bool audio_cache_evict(void)
+{
+    int i, lru = -1;
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++)
+    {
+        if(false == g_entries[i].used || g_entries[i].users > 0)
+            continue;
+
+        if(lru < 0 || g_entries[i].record.last_used < g_entries[lru].record.last_used)
+            lru = i;
+    }
+
+    if(lru < 0) {
+        return false;
+    }
+
+    LOG_I(audio_cache, "evict %016llx, %u bytes", (unsigned long long)g_entries[lru].record.key, g_entries[lru].record.size);
+    
+    audio_cache_remove(lru);
+    g_stats.evictions++;
+    
+    return true;
+}
+
+static int audio_cache_alloc(uint64_t key)
+{
+    int i;
+
+    do {
+        for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++)
+        {
+            if(true == g_entries[i].used)
+                continue;
+
+            memset(&g_entries[i], 0, sizeof(audio_cache_entry_t));
+            g_entries[i].used       = true;
+            g_entries[i].record.key = key;
+            return i;
+        }
+    } while(true == audio_cache_evict());
+
+    return -1;
+}
+
+/* written aside and renamed over the old one */
+static void audio_cache_save_index(void)
+{
+    char path[AUDIO_CACHE_MAX_PATH_SIZE], tmp_path[AUDIO_CACHE_MAX_PATH_SIZE];
+    uint32_t header[2] = {AUDIO_CACHE_INDEX_MAGIC, 0};
+    UINT written;
+    FIL file;
+    int i, err = 0;
+
+    if(false == audio_cache_index_path(path, "") || false == audio_cache_index_path(tmp_path, ".tmp") ||
+       FR_OK != f_open(&file, tmp_path, FA_WRITE)) 
+    {
+        LOG_E(audio_cache, "fail to write %s!", tmp_path);
+        return;
+    }
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++) {
+        if(true == g_entries[i].used)
+            header[1]++;
+    }
+
+    err |= f_write(&file, (uint8_t*)header, sizeof(header), &written);
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++) {
+        if(true == g_entries[i].used)
+            err |= f_write(&file, (uint8_t*)&g_entries[i].record, sizeof(audio_cache_record_t), &written);
+    }
+
+    f_close(&file);
+
+    if(FR_OK != err || FR_OK != f_rename(tmp_path, path)) {
+        LOG_E(audio_cache, "fail to write %s!", path);
+        f_unlink(tmp_path);
+    }
+}
+
+/* 
+ * A file may have grown past the size in the index before a crash. Its
+ * validator was saved before the first byte, so what is there is taken.
+ */
+static void audio_cache_load_index(void)
+{
+    char path[AUDIO_CACHE_MAX_PATH_SIZE];
+    uint32_t header[2];
+    audio_cache_record_t record;
+    UINT bytes_read = 0;
+    FIL file;
+    int i, n = 0, size;
+
+    if(false == audio_cache_index_path(path, "") || FR_OK != f_open(&file, path, FA_OPEN_EXISTING |FA_READ)) {
+        return;
+    }
+
+    if(FR_OK != f_read(&file, (uint8_t*)header, sizeof(header), &bytes_read) || 
+        sizeof(header) != bytes_read || AUDIO_CACHE_INDEX_MAGIC != header[0]) 
+    {
+        LOG_W(audio_cache, "%s is not an index, start empty", path);
+        f_close(&file);
+        return;
+    }
+
+    for(i = 0; i < header[1] && n < AUDIO_CACHE_MAX_ENTRIES; i++)
+    {
+        if(FR_OK != f_read(&file, (uint8_t*)&record, sizeof(record), &bytes_read) || sizeof(record) != bytes_read)
+            break;
+
+        record.validator[AUDIO_CACHE_VALIDATOR_SIZE-1] = '\0';
+        if(false == audio_cache_file_path(record.key, path))
+            break;
+        
+        size = audio_cache_file_size(path);
+
+        if(size <= 0 || '\0' == record.validator[0] || 0 == record.total_length || (uint32_t)size > record.total_length) {
+            f_unlink(path);
+            continue;
+        }
+
+        record.size = (uint32_t)size;
+        
+        g_entries[n].used   = true;
+        g_entries[n].record = record;
+        g_used_bytes += record.size;
+        
+        if(g_sequence < record.last_used)
+            g_sequence = record.last_used;
+
+        n++;
+    }
+
+    f_close(&file);
+}
+
+static void audio_cache_create_mutex(void)
+{
+    g_mutex = xSemaphoreCreateMutex();
+}
+
+audio_cache_return_t audio_cache_init(const char* dir, uint32_t budget)
+{
+    int i;
+    
+    if(NULL == dir || strlen(dir) >= AUDIO_CACHE_MAX_DIR_SIZE || 0 == budget) {
+        return AUDIO_CACHE_ERR_PARAM;
+    }
+
+    /* taskENTER_CRITICAL is empty on linux */
+    pthread_once(&g_mutex_once, audio_cache_create_mutex);
+
+    audio_cache_lock();
+
+    if(true == g_initialized) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_SUCCESS;
+    }
+
+    memset(g_entries, 0, sizeof(g_entries));
+    memset(&g_stats, 0, sizeof(g_stats));
+    strcpy(g_dir, dir);
+    
+    g_budget     = budget;
+    g_used_bytes = 0;
+    g_sequence   = 0;
+
+    /* fails when it is there already */
+    f_mkdir(g_dir);
+    
+    audio_cache_load_index();
+
+    while(g_used_bytes > g_budget && true == audio_cache_evict());
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++) {
+        if(true == g_entries[i].used)
+            g_stats.entries++;
+    }
+
+    g_initialized = true;
+    LOG_I(audio_cache, "%s: %u entries, %u of %u bytes", g_dir, g_stats.entries, g_used_bytes, g_budget);
+
+    audio_cache_unlock();
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+audio_cache_return_t audio_cache_deinit(void)
+{
+    if(NULL == g_mutex) {
+        return AUDIO_CACHE_ERR_DISABLED;
+    }
+
+    audio_cache_lock();
+
+    if(true == g_initialized) {
+        audio_cache_save_index();
+        g_initialized = false;
+    }
+    
+    audio_cache_unlock();
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+/* 
+ * Looks url up for one playback. A whole entry is there to be read at
+ * session->path; otherwise the session owns the entry and fills it from
+ * session->size on, see audio_cache_set_validator.
+ */
+audio_cache_return_t audio_cache_open(audio_cache_session_t* session, const char* url)
+{
+    audio_cache_entry_t* entry;
+    uint64_t key;
+    int index;
+    
+    memset(session, 0, sizeof(audio_cache_session_t));
+    session->entry = -1;
+
+    if(NULL == url) {
+        return AUDIO_CACHE_ERR_PARAM;
+    }
+
+    if(NULL == g_mutex) {
+        return AUDIO_CACHE_ERR_DISABLED;
+    }
+
+    audio_cache_lock();
+
+    if(false == g_initialized) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_ERR_DISABLED;
+    }
+
+    key = audio_cache_hash(url);
+    index = audio_cache_find(key);
+    g_stats.lookups++;
+
+    /* another playback is filling it */
+    if(index >= 0 && true == g_entries[index].writing) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_ERR_BUSY;
+    }
+
+    if(false == audio_cache_file_path(key, session->path)) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_ERR_PARAM;
+    }
+
+    if(index < 0) {
+        index = audio_cache_alloc(key);
+    }
+
+    if(index < 0) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_ERR_FULL;
+    }
+
+    entry = &g_entries[index];
+    entry->users++;
+    entry->record.last_used = ++g_sequence;
+
+    session->entry        = index;
+    session->size         = entry->record.size;
+    session->total_length = entry->record.total_length;
+    session->write_pos    = entry->record.size;
+    strcpy(session->validator, entry->record.validator);
+
+    if(true == audio_cache_is_whole(entry)) {
+        g_stats.hits++;
+    }
+    else {
+        if(entry->record.size > 0)
+            g_stats.partial_hits++;
+
+        entry->writing = true;
+        session->owner = true;
+    }
+
+    audio_cache_unlock();
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+audio_cache_return_t audio_cache_close(audio_cache_session_t* session)
+{
+    audio_cache_entry_t* entry;
+    
+    if(NULL != session->file) {
+        f_close(&session->file);
+        session->file = NULL;
+    }
+
+    if(session->entry < 0) {
+        return AUDIO_CACHE_SUCCESS;
+    }
+
+    audio_cache_lock();
+
+    if(true == g_initialized)
+    {
+        entry = &g_entries[session->entry];
+        entry->users--;
+        entry->record.last_used = ++g_sequence;
+        g_stats.bytes_saved += session->served;
+
+        if(true == session->owner)
+        {
+            entry->writing = false;
+            
+            if(0 == entry->record.size && 0 == entry->users)
+                audio_cache_remove(session->entry);
+            
+            audio_cache_save_index();
+        }
+    }
+
+    audio_cache_unlock();
+
+    session->entry   = -1;
+    session->owner   = false;
+    session->writing = false;
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+/* 
+ * From the response headers, before anything is written. A different
+ * validator or length drops what the entry had, AUDIO_CACHE_ERR_CHANGED
+ * when that was something the caller may have read already. Without a
+ * validator nothing is kept, a later resume could not be checked.
+ */
+audio_cache_return_t audio_cache_set_validator(audio_cache_session_t* session, const char* validator, uint32_t total_length)
+{
+    audio_cache_return_t ret = AUDIO_CACHE_SUCCESS;
+    audio_cache_entry_t* entry;
+    bool valid;
+
+    if(session->entry < 0 || false == session->owner) {
+        return AUDIO_CACHE_SUCCESS;
+    }
+
+    if(NULL == validator) {
+        validator = "";
+    }
+
+    valid = (strlen(validator) > 0 && strlen(validator) < AUDIO_CACHE_VALIDATOR_SIZE && total_length > 0) ?true :false;
+
+    audio_cache_lock();
+
+    entry = &g_entries[session->entry];
+
+    if(false == valid || 0 != strcmp(entry->record.validator, validator) || total_length != entry->record.total_length)
+    {
+        if(entry->record.size > 0) {
+            LOG_W(audio_cache, "%016llx changed on the server, drop %u bytes", (unsigned long long)entry->record.key, entry->record.size);
+            ret = AUDIO_CACHE_ERR_CHANGED;
+        }
+
+        if(NULL != session->file) {
+            f_close(&session->file);
+            session->file = NULL;
+        }
+
+        f_unlink(session->path);
+        g_used_bytes -= entry->record.size;
+
+        entry->record.size         = 0;
+        entry->record.total_length = (true == valid) ?total_length :0;
+        strcpy(entry->record.validator, (true == valid) ?validator :"");
+        session->write_pos         = 0;
+
+        /* on disk before the first byte of the new file */
+        audio_cache_save_index();
+    }
+
+    strcpy(session->validator, entry->record.validator);
+    session->total_length = entry->record.total_length;
+    session->writing      = valid;
+
+    audio_cache_unlock();
+    
+    return ret;
+}
+
+/* 
+ * A whole entry the server no longer has: the session takes it over empty
+ * and fills it like a miss. AUDIO_CACHE_ERR_BUSY while others read it.
+ */
+audio_cache_return_t audio_cache_invalidate(audio_cache_session_t* session)
+{
+    audio_cache_entry_t* entry;
+
+    if(session->entry < 0 || true == session->owner) {
+        return AUDIO_CACHE_ERR_PARAM;
+    }
+
+    audio_cache_lock();
+
+    entry = &g_entries[session->entry];
+
+    if(entry->users > 1 || true == entry->writing) {
+        audio_cache_unlock();
+        return AUDIO_CACHE_ERR_BUSY;
+    }
+
+    f_unlink(session->path);
+    g_used_bytes -= entry->record.size;
+    g_stats.hits--;
+
+    entry->record.size         = 0;
+    entry->record.total_length = 0;
+    entry->record.validator[0] = '\0';
+    entry->writing             = true;
+    
+    session->owner        = true;
+    session->size         = 0;
+    session->total_length = 0;
+    session->write_pos    = 0;
+    session->validator[0] = '\0';
+
+    audio_cache_save_index();
+    audio_cache_unlock();
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+/* appends what the playback read at offset, when that continues the file */
+audio_cache_return_t audio_cache_write(audio_cache_session_t* session, uint32_t offset, const uint8_t* buf, uint32_t len)
+{
+    UINT written = 0;
+    bool room;
+
+    if(session->entry < 0 || false == session->writing || offset != session->write_pos) {
+        return AUDIO_CACHE_SUCCESS;
+    }
+
+    if(len > session->total_length - session->write_pos) {
+        len = session->total_length - session->write_pos;
+    }
+
+    if(0 == len) {
+        return AUDIO_CACHE_SUCCESS;
+    }
+
+    audio_cache_lock();
+    
+    while(g_used_bytes + len > g_budget && true == audio_cache_evict());
+
+    room = (g_used_bytes + len <= g_budget) ?true :false;
+    if(true == room) {
+        g_used_bytes += len;
+    }
+    
+    audio_cache_unlock();
+
+    if(false == room) {
+        LOG_W(audio_cache, "budget of %u bytes reached, %s stays partial", g_budget, session->path);
+        session->writing = false;
+        return AUDIO_CACHE_ERR_FULL;
+    }
+
+    if(NULL != session->file || FR_OK == f_open(&session->file, session->path, FA_OPEN_APPEND)) {
+        f_write(&session->file, buf, len, &written);
+    }
+
+    audio_cache_lock();
+    
+    g_entries[session->entry].record.size += written;
+    g_used_bytes       -= len - written;
+    g_stats.bytes_stored += written;
+    
+    audio_cache_unlock();
+
+    session->write_pos += written;
+
+    if(written != len) {
+        LOG_E(audio_cache, "fail to write %s!", session->path);
+        session->writing = false;
+        return AUDIO_CACHE_ERR_FILE;
+    }
+    
+    return AUDIO_CACHE_SUCCESS;
+}
+
+bool audio_cache_is_complete(audio_cache_session_t* session)
+{
+    return (session->entry >= 0 && session->total_length > 0 && session->size >= session->total_length) ?true :false;
+}
+
+void audio_cache_add_served(audio_cache_session_t* session, uint32_t len)
+{
+    if(session->entry >= 0) {
+        session->served += len;
+    }
+}
+
+void audio_cache_get_stats(audio_cache_stats_t* stats)
+{
+    int i;
+    
+    memset(stats, 0, sizeof(audio_cache_stats_t));
+
+    if(NULL == g_mutex) {
+        return;
+    }
+
+    audio_cache_lock();
+
+    *stats = g_stats;
+    stats->entries    = 0;
+    stats->used_bytes = g_used_bytes;
+
+    for(i = 0; i < AUDIO_CACHE_MAX_ENTRIES; i++) {
+        if(true == g_entries[i].used)
+            stats->entries++;
+    }
+    
+    audio_cache_unlock();
+
+    if(stats->lookups > 0) {
+        stats->hit_ratio = (stats->hits + stats->partial_hits) *100 /stats->lookups;
+    }
+}
+
@@ -0,0 +1,61 @@
+#ifndef __AUDIO_CACHE_H
+#define __AUDIO_CACHE_H
+
+#include "typedefs.h"
+
+#define AUDIO_CACHE_MAX_ENTRIES         64
+#define AUDIO_CACHE_MAX_PATH_SIZE       256
+#define AUDIO_CACHE_VALIDATOR_SIZE      128     /* HTTPCLIENT_IF_RANGE_SIZE */
+
+typedef enum {
+    AUDIO_CACHE_SUCCESS = 0,
+    AUDIO_CACHE_ERR_PARAM,
+    AUDIO_CACHE_ERR_DISABLED,
+    AUDIO_CACHE_ERR_BUSY,
+    AUDIO_CACHE_ERR_FULL,
+    AUDIO_CACHE_ERR_FILE,
+    AUDIO_CACHE_ERR_CHANGED,
+
+} audio_cache_return_t;
+
+typedef struct {
+    uint32_t    lookups;
+    uint32_t    hits;               /* played whole from the cache */
+    uint32_t    partial_hits;       /* a cached prefix, the rest downloaded */
+    uint32_t    hit_ratio;          /* hits and partial_hits per 100 lookups */
+    uint64_t    bytes_saved;        /* served from the cache instead of the network */
+    uint64_t    bytes_stored;
+    uint32_t    evictions;
+    uint32_t    entries;
+    uint32_t    used_bytes;
+    
+} audio_cache_stats_t;
+
+/* one playback of a URL, from audio_cache_open to audio_cache_close */
+typedef struct {
+    int         entry;              /* -1 when nothing is cached for this playback */
+    char        path[AUDIO_CACHE_MAX_PATH_SIZE];
+    char        validator[AUDIO_CACHE_VALIDATOR_SIZE];
+    uint32_t    size;               /* of the file, bytes from the start of the resource */
+    uint32_t    total_length;       /* 0 while not known */
+    bool        owner;              /* the one playback filling the entry */
+    bool        writing;            /* the download is appended to the file, once validated */
+    uint32_t    write_pos;
+    FIL         file;               /* NULL while nothing is written */
+    uint32_t    served;             /* for bytes_saved */
+    
+} audio_cache_session_t;
+
+audio_cache_return_t audio_cache_init(const char* dir, uint32_t budget);
+audio_cache_return_t audio_cache_deinit(void);
+audio_cache_return_t audio_cache_open(audio_cache_session_t* session, const char* url);
+audio_cache_return_t audio_cache_close(audio_cache_session_t* session);
+audio_cache_return_t audio_cache_set_validator(audio_cache_session_t* session, const char* validator, uint32_t total_length);
+audio_cache_return_t audio_cache_write(audio_cache_session_t* session, uint32_t offset, const uint8_t* buf, uint32_t len);
+audio_cache_return_t audio_cache_invalidate(audio_cache_session_t* session);
+bool audio_cache_is_complete(audio_cache_session_t* session);
+void audio_cache_add_served(audio_cache_session_t* session, uint32_t len);
+void audio_cache_get_stats(audio_cache_stats_t* stats);
+
+#endif
+
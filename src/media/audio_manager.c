@@ -1,5 +1,6 @@
 #include "audio_manager.h"
 #include "audio_message_queue.h"
+#include "dns_cache.h"
 
 #ifndef DEF_LINUX_PLATFORM
 #include "hal_trng.h"
@@ -22,6 +23,17 @@ log_create_module(audio_manager, PRINT_LEVEL_INFO);
 #define AUDIO_MGR_MAX_SD_CARD_PATH  256
 #define AUDIO_MGR_TASK_STACK_SIZE   (10240/sizeof(StackType_t))
 #define AUDIO_MGR_QUEUE_LENGTH      5
+#define AUDIO_MGR_DEVICE_SAMPLE_RATE    44100       /* every source is resampled to this, the device stays open */
+#define AUDIO_MGR_DEVICE_CHANNELS       2
+#define AUDIO_MGR_RESAMPLER_QUALITY     RESAMPLER_QUALITY_MEDIUM
+
+/* web sources are kept here across plays, both can be set from the build */
+#ifndef AUDIO_MGR_CACHE_DIR
+#define AUDIO_MGR_CACHE_DIR             "/tmp/audio_cache"
+#endif
+#ifndef AUDIO_MGR_CACHE_BUDGET
+#define AUDIO_MGR_CACHE_BUDGET          (64*1024*1024)
+#endif
 
 #define AUDIO_MGR_LOCAL_VAR_UPDATE() do {\
     if(g_audio_local_max <= 0) g_audio_local_max = tf_card_audio_file_num_get();\
@@ -47,6 +59,7 @@ typedef enum {
     AUDIO_MGR_EVENT_PLAYER_PAUSE,
     AUDIO_MGR_EVENT_PLAYER_RESUME,
     AUDIO_MGR_EVENT_PLAYER_PROGRESS,
+    AUDIO_MGR_EVENT_PLAYER_SEEK,
         
 } audio_mgr_event_t;
 
@@ -78,6 +91,12 @@ audio_mgr_return_t audio_mgr_init(void)
 
     audio_msg_queue_init(&g_audio_msg_queue, AUDIO_MGR_QUEUE_LENGTH);
     pcm_trans_init();
+    pcm_trans_set_tx_device_format(AUDIO_MGR_DEVICE_SAMPLE_RATE, AUDIO_MGR_DEVICE_CHANNELS, AUDIO_MGR_RESAMPLER_QUALITY);
+
+    /* without it everything is downloaded every time */
+    if(AUDIO_CACHE_SUCCESS != audio_cache_init(AUDIO_MGR_CACHE_DIR, AUDIO_MGR_CACHE_BUDGET)) {
+        LOG_W(audio_manager, "no audio cache in %s", AUDIO_MGR_CACHE_DIR);
+    }
     
     audio_player_init(&g_prompt_play);
     audio_player_init(&g_resource_play);
@@ -101,6 +120,7 @@ audio_mgr_return_t audio_mgr_deinit(void)
 {
 	audio_player_deinit(&g_prompt_play);
     audio_player_deinit(&g_resource_play);
+    audio_cache_deinit();
 	pcm_trans_deinit();
 	audio_msg_queue_deinit(&g_audio_msg_queue);
 	
@@ -232,7 +252,7 @@ static void audio_mgr_player_prompt_wait(audio_player_info_t* player_info)
         AUDIO_PLAYER_SRC_FLASH == player_info->source &&
         AUDIO_PLAYER_TYPE_PROMPT == player_info->type)
     {
-        vTaskDelay(500/portTICK_RATE_MS);
+        audio_player_wait_finish(&g_prompt_play, portMAX_DELAY);
     }
 }
 
@@ -252,6 +272,11 @@ audio_mgr_return_t audio_mgr_player_start(char *path, audio_src_flag_t src_flag,
         return ret;
     }
 
+    /* the host is looked up while the player stops the last one and starts */
+    if(AUDIO_PLAYER_SRC_WEB == player_info->source) {
+        dns_cache_prefetch_url(player_info->path);
+    }
+
     if(AUDIO_PLAYER_TYPE_RESOURCE == player_info->type) {
         audio_mgr_player_set_audio_next(true);
     }
@@ -383,6 +408,26 @@ audio_mgr_return_t audio_mgr_player_toggle(bool from_key)
     return AUDIO_MGR_SUCCESS;
 }
 
+audio_mgr_return_t audio_mgr_player_seek(uint32_t ms)
+{
+    audio_msg_item_t msg = {AUDIO_MGR_EVENT_PLAYER_SEEK, NULL};
+    audio_mgr_return_t ret;
+
+    msg.data = (uint32_t*)malloc(sizeof(uint32_t));
+    if(NULL == msg.data) {
+        return AUDIO_MGR_ERR_MALLOC;
+    }
+
+    *((uint32_t*)msg.data) = ms;
+    
+    ret = audio_msg_queue_send(&g_audio_msg_queue, &msg, 0);
+    if(AUDIO_MGR_SUCCESS != ret) {
+        free(msg.data);
+    }
+
+    return ret;
+}
+
 static audio_mgr_return_t audio_mgr_player_start_local_inner(void)
 {
     char path[AUDIO_MGR_MAX_SD_CARD_PATH];
@@ -626,6 +671,11 @@ static void audio_resource_player_callback(void* param, audio_player_event_t eve
                 audio_mgr_player_start_next(false);
             }
         }
+        else if(AUDIO_PLAYER_PROC_ERR_CHANGED == audio_player->last_error)
+        {
+            /* the stale cache is gone by now, the new version plays from its start */
+            audio_mgr_player_start(audio_player->player_info.path, AUDIO_SRC_FLAG_HTTP_URL, 0);
+        }
         else
         {
             audio_mgr_player_error_handler(audio_player->last_error);
@@ -708,6 +758,13 @@ void audio_mgr_task(void* param)
             }
             break;
 
+        case AUDIO_MGR_EVENT_PLAYER_SEEK:
+            if(NULL != msg.data) {
+                audio_player_stop(&g_prompt_play);
+                audio_player_seek(&g_resource_play, *((uint32_t*)msg.data));
+            }
+            break;
+
         case AUDIO_MGR_EVENT_PLAYER_PROGRESS:
             if(NULL != msg.data) {
                 audio_mgr_send_mqtt(AUDIO_MGR_MQTT_TYPE_PROGRESS, msg.data);
@@ -43,6 +43,7 @@ audio_mgr_return_t audio_mgr_player_break(void);
 audio_mgr_return_t audio_mgr_player_pause(bool from_key);
 audio_mgr_return_t audio_mgr_player_resume(bool from_key);
 audio_mgr_return_t audio_mgr_player_toggle(bool from_key);
+audio_mgr_return_t audio_mgr_player_seek(uint32_t ms);
 audio_mgr_return_t audio_mgr_player_start_local(void);
 audio_mgr_return_t audio_mgr_player_start_next(bool from_key);
 audio_mgr_return_t audio_mgr_player_start_prev(void);
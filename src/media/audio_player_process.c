@@ -8,20 +8,26 @@
 log_create_module(audio_player_proc, PRINT_LEVEL_INFO);
 
 #define AUDIO_PLAYER_TASK_STACK_SIZE            (10240/sizeof(StackType_t))
+#define AUDIO_PLAYER_REVALIDATE_STACK_SIZE      (4096/sizeof(StackType_t))
 #define AUDIO_PLAYER_MAX_WAIT_TIME              (30000/portTICK_RATE_MS)
-#define AUDIO_PLAYER_MONITOR_INTERVAL           (300/portTICK_RATE_MS)
-#define AUDIO_PLAYER_PROGRESS_INTERVAL          (1000/portTICK_RATE_MS)
+#define AUDIO_PLAYER_MONITOR_INTERVAL           (100/portTICK_RATE_MS)
+#define AUDIO_PLAYER_PROGRESS_INTERVAL          (100/portTICK_RATE_MS)
+#define AUDIO_PLAYER_PROGRESS_LOG_INTERVAL      (1000/portTICK_RATE_MS)
 #define AUDIO_PLAYER_WAIT_10K_TIMEOUT           (5000/portTICK_RATE_MS)
 #define AUDIO_PLAYER_WAIT_HTTP_TIMEOUT          (5000/portTICK_RATE_MS)
-#define AUDIO_PLAYER_WAIT_PROMPT_IDV3_SIZE      (4*1024)
-#define AUDIO_PLAYER_WAIT_RESOURCE_IDV3_SIZE    (25*1024)
+#define AUDIO_PLAYER_WAIT_HEADER_SIZE          (4*1024)        /* ID3v2 header and first frame, the tag body is skipped */
 #define AUDIO_PLAYER_WAIT_HTTP_SIZE             (20*1024)
 #define AUDIO_PLAYER_MAX_REGISTER_SIZE          (10)
+#define AUDIO_PLAYER_DUCK_GAIN                  (PCM_TRANS_GAIN_UNITY/4)
+#define AUDIO_PLAYER_DUCK_RAMP_MS               (200)
 
 static int __player_input_callback(void* param, uint8_t* buf, int size);
 static int __player_seek_callback(void* param, int position);
 static int __player_error_callback(void* param, int error);
 static void audio_player_task(void *param);
+static void audio_player_revalidate_task(void* param);
+static bool audio_player_proc_is_file(audio_player_proc_t* audio_player);
+static void audio_player_proc_cache_store(audio_player_proc_t* audio_player, const uint8_t* buf, uint32_t len);
 
 static audio_player_proc_t*   g_registers[AUDIO_PLAYER_MAX_REGISTER_SIZE];
 static bool                   g_register_initialized = false;
@@ -33,6 +39,7 @@ static void audio_player_unlock(audio_player_proc_t* audio_player);
 static void audio_player_set_event(audio_player_proc_t* audio_player, uint32_t events);
 static uint32_t audio_player_wait_event(audio_player_proc_t* audio_player, uint32_t events, uint32_t timeout);
 static void audio_player_clear_event(audio_player_proc_t* audio_player, uint32_t events);
+static audio_player_return_t audio_player_wait_handle(audio_player_proc_t* audio_player, audio_player_handle_t player_handle, uint32_t timeout);
 
 #define audio_player_common_lock()      do { xSemaphoreTake(g_common_mutex, portMAX_DELAY); } while(0)
 #define audio_player_common_unlock()    do { xSemaphoreGive(g_common_mutex); } while(0)
@@ -51,11 +58,22 @@ audio_player_return_t audio_player_init(audio_player_proc_t* audio_player)
 
     audio_player->cur_state             = AUDIO_PLAYER_STA_IDLE;
     audio_player->event_handle          = xEventGroupCreate();
+    audio_player->finish_handle         = xEventGroupCreate();
     audio_player->mutex_handle          = xSemaphoreCreateMutex();
     audio_player->audio_player_callback = NULL;
 
+    audio_player->cache.entry           = -1;
+    audio_player->revalidate_running    = false;
+    atomic_init(&audio_player->revalidate_result, HTTP_DOWNLOAD_PROC_SUCCESS);
+
     common_buffer_init(&audio_player->http_buffer, COMMON_BUF_HTTP_NODE_SIZE, COMMON_BUF_HTTP_MAX_SIZE);
+#ifdef AUDIO_PLAYER_HTTP_ENGINE
+    /* for many players in one process: all downloads on the one http_engine task */
+    http_download_init_engine(&audio_player->http_proc);
+#else
     http_download_init(&audio_player->http_proc);
+    http_download_set_segment(&audio_player->http_proc, true);
+#endif
     com_player_init(&audio_player->com_player);
 
     xTaskCreate(
@@ -84,6 +102,11 @@ audio_player_return_t audio_player_deinit(audio_player_proc_t* audio_player)
         audio_player->event_handle = NULL;
     }
 
+    if(NULL != audio_player->finish_handle) {
+        vEventGroupDelete(audio_player->finish_handle);
+        audio_player->finish_handle = NULL;
+    }
+
     if(NULL != audio_player->mutex_handle) {
         vSemaphoreDelete(audio_player->mutex_handle);
         audio_player->mutex_handle = NULL;
@@ -136,19 +159,46 @@ audio_player_return_t audio_player_start(audio_player_proc_t* audio_player, audi
 
     LOG_I(audio_player_proc, "audio_player_start time: %d ms", (xTaskGetTickCount()-begTick));
 
-    while(true == wait_finish)
+    if(true == wait_finish) {
+        return audio_player_wait_handle(audio_player, player_handle, portMAX_DELAY);
+    }
+    
+    return AUDIO_PLAYER_PROC_SUCCESS;
+}
+
+/* 
+ * Blocks until what is playing now has finished. AUDIO_PLAYER_PROC_ERR_BREAK
+ * when another start took the player over first.
+ */
+audio_player_return_t audio_player_wait_finish(audio_player_proc_t* audio_player, uint32_t timeout)
+{
+    if(NULL==audio_player) {
+        return AUDIO_PLAYER_PROC_ERR_PARAM;
+    }
+
+    return audio_player_wait_handle(audio_player, audio_player->player_handle, timeout);
+}
+
+static audio_player_return_t audio_player_wait_handle(audio_player_proc_t* audio_player, audio_player_handle_t player_handle, uint32_t timeout)
+{
+    uint32_t begTick = xTaskGetTickCount(), used;
+
+    while(1)
     {
         if(player_handle != audio_player->player_handle) {
             return AUDIO_PLAYER_PROC_ERR_BREAK;
         }
         else if(AUDIO_PLAYER_STA_IDLE == audio_player->cur_state) {
-            break;
+            return AUDIO_PLAYER_PROC_SUCCESS;
+        }
+
+        used = xTaskGetTickCount() - begTick;
+        if(used >= timeout) {
+            return AUDIO_PLAYER_PROC_ERR_TIMEOUT;
         }
 
-        vTaskDelay(300/portTICK_RATE_MS);
+        xEventGroupWaitBits(audio_player->finish_handle, AUDIO_PLAYER_EVENT_FINISH, pdTRUE, pdFALSE, timeout - used);
     }
-    
-    return AUDIO_PLAYER_PROC_SUCCESS;
 }
 
 audio_player_return_t audio_player_stop(audio_player_proc_t* audio_player)
@@ -259,6 +309,41 @@ audio_player_return_t audio_player_break(audio_player_proc_t* audio_player)
     return ret;
 }
 
+audio_player_return_t audio_player_seek(audio_player_proc_t* audio_player, uint32_t ms)
+{
+    audio_player_return_t ret;
+    
+    if(NULL==audio_player) {
+        return AUDIO_PLAYER_PROC_ERR_PARAM;
+    }
+    
+    audio_player_lock(audio_player);
+    
+    if( AUDIO_PLAYER_STA_PLAY == audio_player->cur_state ||
+        AUDIO_PLAYER_STA_PAUSE == audio_player->cur_state )
+    {
+        audio_player->seek_ms     = ms;
+        audio_player->seek_result = AUDIO_PLAYER_PROC_ERR_SEEK;
+        
+        audio_player_set_event(audio_player, AUDIO_PLAYER_EVENT_SEEK);
+
+        if(AUDIO_PLAYER_EVENT_NONE==audio_player_wait_event(audio_player, 
+            AUDIO_PLAYER_EVENT_SEEK_DONE |AUDIO_PLAYER_EVENT_STOP_DONE, AUDIO_PLAYER_MAX_WAIT_TIME))
+        {
+            LOG_E(audio_player_proc, "audio_player_wait_event timeout!");
+        }
+
+        ret = audio_player->seek_result;
+    }
+    else
+    {
+        ret = AUDIO_PLAYER_PROC_ERR_NO_PLAY;
+    }
+
+    audio_player_unlock(audio_player);
+    return ret;
+}
+
 audio_player_return_t audio_player_register_callback(audio_player_proc_t* audio_player, p_audio_player_callback callback)
 {
     audio_player->audio_player_callback = callback;
@@ -337,7 +422,8 @@ static audio_player_return_t __audio_player_unregister(audio_player_proc_t* curr
     return AUDIO_PLAYER_PROC_SUCCESS;
 }
 
-static audio_player_return_t __audio_player_before_start(audio_player_proc_t* curr_player)
+/* a prompt is mixed over the others with them ducked, anything else breaks them */
+static audio_player_return_t __audio_player_before_start(audio_player_proc_t* curr_player, bool allow_mix)
 {
     int i;
     
@@ -348,7 +434,10 @@ static audio_player_return_t __audio_player_before_start(audio_player_proc_t* cu
 
         if(AUDIO_PLAYER_STA_PLAY == g_registers[i]->cur_state)
         {
-            audio_player_break(g_registers[i]);
+            if(true == allow_mix && AUDIO_PLAYER_TYPE_PROMPT == curr_player->player_info.type)
+                com_player_set_gain(&g_registers[i]->com_player, AUDIO_PLAYER_DUCK_GAIN, AUDIO_PLAYER_DUCK_RAMP_MS);
+            else
+                audio_player_break(g_registers[i]);
         }
     }
     
@@ -357,8 +446,31 @@ static audio_player_return_t __audio_player_before_start(audio_player_proc_t* cu
 
 static audio_player_return_t __audio_player_after_stop(audio_player_proc_t* curr_player)
 {
+    bool prompt_playing = false;
     int i;
     
+    for(i = 0; i < AUDIO_PLAYER_MAX_REGISTER_SIZE; i++)
+    {
+        if(NULL == g_registers[i] || curr_player == g_registers[i])
+            continue;
+
+        if(AUDIO_PLAYER_TYPE_PROMPT == g_registers[i]->player_info.type && AUDIO_PLAYER_STA_PLAY == g_registers[i]->cur_state)
+            prompt_playing = true;
+    }
+    
+    for(i = 0; i < AUDIO_PLAYER_MAX_REGISTER_SIZE; i++)
+    {
+        if(NULL == g_registers[i] || curr_player == g_registers[i])
+            continue;
+
+        /* undo the ducking, also for those paused meanwhile; a prompt still playing keeps the rest ducked */
+        if(AUDIO_PLAYER_TYPE_PROMPT == curr_player->player_info.type &&
+            (false == prompt_playing || AUDIO_PLAYER_TYPE_PROMPT == g_registers[i]->player_info.type))
+        {
+            com_player_set_gain(&g_registers[i]->com_player, PCM_TRANS_GAIN_UNITY, AUDIO_PLAYER_DUCK_RAMP_MS);
+        }
+    }
+
     for(i = 0; i < AUDIO_PLAYER_MAX_REGISTER_SIZE; i++)
     {
         if(NULL == g_registers[i] || curr_player == g_registers[i])
@@ -388,7 +500,23 @@ static int __player_input_callback(void* param, uint8_t* buf, int size)
     bool check_read_pos = false;
     bool input_done = false;
 
-    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source)
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source && audio_player->read_pos < audio_player->cache_prefix)
+    {
+        UINT bytes_read = 0;
+
+        if(size > audio_player->cache_prefix - audio_player->read_pos)
+            size = audio_player->cache_prefix - audio_player->read_pos;
+        
+        if(FR_OK != f_read(&audio_player->file_handle, buf, size, &bytes_read) || 0 == bytes_read) {
+            LOG_E(audio_player_proc, "[%d] fail to read the cache of %s!", audio_player->player_handle, audio_player->player_info.path);
+            audio_player->last_error = AUDIO_PLAYER_PROC_ERR_READ_FILE;
+            goto END;
+        }
+
+        read_len = bytes_read;
+        audio_cache_add_served(&audio_player->cache, read_len);
+    }
+    else if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source && false == audio_player->cache_hit)
     {
         if(true==http_download_is_finish(&audio_player->http_proc))
         {
@@ -401,7 +529,7 @@ static int __player_input_callback(void* param, uint8_t* buf, int size)
             uint32_t wait_size, wait_timeout;
 
             if(audio_player->total_length <= 0) {
-                wait_size    = (AUDIO_PLAYER_TYPE_PROMPT==audio_player->player_info.type) ?AUDIO_PLAYER_WAIT_PROMPT_IDV3_SIZE :AUDIO_PLAYER_WAIT_RESOURCE_IDV3_SIZE;
+                wait_size    = AUDIO_PLAYER_WAIT_HEADER_SIZE;
                 wait_timeout = wait_size *AUDIO_PLAYER_WAIT_10K_TIMEOUT /10240 + AUDIO_PLAYER_WAIT_HTTP_TIMEOUT;
             }
             else {
@@ -425,6 +553,9 @@ static int __player_input_callback(void* param, uint8_t* buf, int size)
 
         read_len = size;
         common_buffer_pop(&audio_player->http_buffer, buf, &read_len);
+        audio_player_proc_cache_store(audio_player, buf, read_len);
+        if(AUDIO_PLAYER_PROC_SUCCESS != audio_player->last_error)
+            goto END;
 
         if(audio_player->total_length < audio_player->http_proc.total_length)
             audio_player->total_length = audio_player->http_proc.total_length;
@@ -458,9 +589,15 @@ static int __player_input_callback(void* param, uint8_t* buf, int size)
         check_read_pos = true;
     }
 #endif
-    else if(AUDIO_PLAYER_SRC_SD_CARD == audio_player->player_info.source)
+    else if(true == audio_player_proc_is_file(audio_player))
     {
         UINT bytes_read = 0;
+
+        if(true == audio_player->cache_hit && HTTP_DOWNLOAD_PROC_CHANGED == atomic_load(&audio_player->revalidate_result)) {
+            LOG_W(audio_player_proc, "[%d] %s changed, stop the cached copy", audio_player->player_handle, audio_player->player_info.path);
+            audio_player->last_error = AUDIO_PLAYER_PROC_ERR_CHANGED;
+            goto END;
+        }
         
         if(FR_OK != f_read(&audio_player->file_handle, buf, size, &bytes_read)) {
             LOG_E(audio_player_proc, "[%d] fail to read %s!", audio_player->player_handle, audio_player->player_info.path);
@@ -492,8 +629,59 @@ END:
     return read_len;
 }
 
+/* called by the decoder thread, moves the input to byte position */
 static int __player_seek_callback(void* param, int position)
 {
+    audio_player_proc_t* audio_player = (audio_player_proc_t*)param;
+
+    if(position < 0 || (audio_player->total_length > 0 && (uint32_t)position >= audio_player->total_length)) {
+        return -1;
+    }
+
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source && false == audio_player->cache_hit)
+    {
+        bool range_enable = (AUDIO_PLAYER_TYPE_PROMPT==audio_player->player_info.type) ?false :true;
+
+        if((uint32_t)position < audio_player->cache_prefix)
+        {
+            if(FR_OK != f_lseek(&audio_player->file_handle, (FSIZE_t)position)) {
+                LOG_E(audio_player_proc, "[%d] fail to seek %s!", audio_player->player_handle, audio_player->player_info.path);
+                return -1;
+            }
+
+            /* the download has not gone past the cached prefix, what it buffered is still next */
+            if(audio_player->read_pos <= audio_player->cache_prefix) {
+                audio_player->read_pos = position;
+                return 0;
+            }
+        }
+
+        /* what is buffered belongs to the old position, a new request starts at the new one; when it can not, the old one goes on */
+        http_download_set_if_range(&audio_player->http_proc, audio_player->cache.validator);
+
+        if(HTTP_DOWNLOAD_PROC_SUCCESS != http_download_move_to(&audio_player->http_proc, &audio_player->http_buffer, audio_player->player_info.path, range_enable, 
+            ((uint32_t)position < audio_player->cache_prefix) ?(int)audio_player->cache_prefix :position, 
+            (audio_player->read_pos < audio_player->cache_prefix) ?(int)audio_player->cache_prefix :(int)audio_player->read_pos)) 
+        {
+            LOG_E(audio_player_proc, "[%d] fail to seek %s!", audio_player->player_handle, audio_player->player_info.path);
+            return -1;
+        }
+    }
+    else if(true == audio_player_proc_is_file(audio_player))
+    {
+        /* a closed file is opened at read_pos on resume */
+        if(true == audio_player->file_open_flag && FR_OK != f_lseek(&audio_player->file_handle, (FSIZE_t)position)) {
+            LOG_E(audio_player_proc, "[%d] fail to seek %s!", audio_player->player_handle, audio_player->player_info.path);
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+
+    audio_player->read_pos = position;
+    
     return 0;
 }
 
@@ -518,11 +706,22 @@ static audio_player_return_t audio_player_proc_open_file(audio_player_proc_t* au
         audio_player->file_open_flag = true;
     }
         
-    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source)
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source && false == audio_player->cache_hit)
     {
         bool range_enable = (AUDIO_PLAYER_TYPE_PROMPT==audio_player->player_info.type) ?false :true;
+
+        /* a partial entry is played from its file, the download resumes after it */
+        if(true == range_enable && audio_player->cache.size > 0 && 
+            FR_OK == f_open(&audio_player->file_handle, _T(audio_player->cache.path), FA_OPEN_EXISTING |FA_READ)) 
+        {
+            audio_player->cache_prefix = audio_player->cache.size;
+            audio_player->total_length = audio_player->cache.total_length;
+            LOG_I(audio_player_proc, "[%d] %u bytes cached, download from there", audio_player->player_handle, audio_player->cache_prefix);
+        }
+
+        http_download_set_if_range(&audio_player->http_proc, audio_player->cache.validator);
         
-        if(HTTP_DOWNLOAD_PROC_SUCCESS != http_download_start(&audio_player->http_proc, &audio_player->http_buffer, audio_player->player_info.path, range_enable)) {
+        if(HTTP_DOWNLOAD_PROC_SUCCESS != http_download_start_at(&audio_player->http_proc, &audio_player->http_buffer, audio_player->player_info.path, range_enable, (int)audio_player->cache_prefix)) {
             LOG_E(audio_player_proc, "[%d] fail to open %s!", audio_player->player_handle, audio_player->player_info.path);
             return AUDIO_PLAYER_PROC_ERR_OPEN_FILE;
         }
@@ -538,9 +737,11 @@ static audio_player_return_t audio_player_proc_open_file(audio_player_proc_t* au
         check_total_length = true;
     }
 #endif
-    else if(AUDIO_PLAYER_SRC_SD_CARD == audio_player->player_info.source)
+    else if(true == audio_player_proc_is_file(audio_player))
     {
-        if(FR_OK != f_open(&audio_player->file_handle, _T(audio_player->player_info.path), FA_OPEN_EXISTING |FA_WRITE |FA_READ)) {
+        char* path = (true == audio_player->cache_hit) ?audio_player->cache.path :audio_player->player_info.path;
+        
+        if(FR_OK != f_open(&audio_player->file_handle, _T(path), FA_OPEN_EXISTING |FA_WRITE |FA_READ)) {
             LOG_E(audio_player_proc, "[%d] fail to open %s!", audio_player->player_handle, audio_player->player_info.path);
             return AUDIO_PLAYER_PROC_ERR_OPEN_FILE;
         }
@@ -568,14 +769,14 @@ static audio_player_return_t audio_player_proc_close_file(audio_player_proc_t* a
         return AUDIO_PLAYER_PROC_SUCCESS;
     }
     
-    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source)
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source && false == audio_player->cache_hit)
     {
     }
     else if(AUDIO_PLAYER_SRC_FLASH == audio_player->player_info.source)
     {
         audio_player->file_open_flag = false;
     }
-    else if(AUDIO_PLAYER_SRC_SD_CARD == audio_player->player_info.source)
+    else if(true == audio_player_proc_is_file(audio_player))
     {
         audio_player->file_open_flag = false;
         
@@ -588,31 +789,190 @@ static audio_player_return_t audio_player_proc_close_file(audio_player_proc_t* a
     return AUDIO_PLAYER_PROC_SUCCESS;
 }
 
+/* 
+ * An SD file is decoded straight from its mapping, no read copies. The
+ * mapping outlives pause/resume and is released in audio_player_proc_stop.
+ * Where that fails the decoder reads through f_read.
+ */
+static void audio_player_proc_map_file(audio_player_proc_t* audio_player)
+{
+    if(false == audio_player_proc_is_file(audio_player) || false == audio_player->file_open_flag) {
+        return;
+    }
+
+    if(FR_OK != f_map(&audio_player->file_handle, &audio_player->map_addr, &audio_player->map_size)) {
+        audio_player->map_addr = NULL;
+        audio_player->map_size = 0;
+        LOG_W(audio_player_proc, "[%d] can not map %s, read it", audio_player->player_handle, audio_player->player_info.path);
+        return;
+    }
+
+    com_player_set_input_map(&audio_player->com_player, audio_player->map_addr, (uint32_t)audio_player->map_size);
+}
+
+static void audio_player_proc_unmap_file(audio_player_proc_t* audio_player)
+{
+    if(NULL == audio_player->map_addr) {
+        return;
+    }
+
+    f_unmap(audio_player->map_addr, audio_player->map_size);
+    audio_player->map_addr = NULL;
+    audio_player->map_size = 0;
+}
+
+/* SD files and web sources played whole from the cache are read alike */
+static bool audio_player_proc_is_file(audio_player_proc_t* audio_player)
+{
+    return (AUDIO_PLAYER_SRC_SD_CARD == audio_player->player_info.source || true == audio_player->cache_hit) ?true :false;
+}
+
+static void audio_player_proc_cache_open(audio_player_proc_t* audio_player)
+{
+    audio_player->cache_hit     = false;
+    audio_player->cache_prefix  = 0;
+    audio_player->cache_checked = false;
+    audio_player->cache.entry   = -1;
+
+    if(AUDIO_PLAYER_SRC_WEB != audio_player->player_info.source ||
+        AUDIO_CACHE_SUCCESS != audio_cache_open(&audio_player->cache, audio_player->player_info.path)) 
+    {
+        return;
+    }
+
+    if(true == audio_cache_is_complete(&audio_player->cache)) 
+    {
+        /* played at once, the server is asked meanwhile; a change stops it and the stop drops the entry */
+        atomic_store(&audio_player->revalidate_result, HTTP_DOWNLOAD_PROC_SUCCESS);
+        audio_player->revalidate_running = (0 == xTaskCreate(
+            audio_player_revalidate_task, 
+            "audio_player_revalidate_task", 
+            AUDIO_PLAYER_REVALIDATE_STACK_SIZE, 
+            audio_player,
+            TASK_PRIORITY_NORMAL,
+            &audio_player->revalidate_task)) ?true :false;
+        
+        audio_player->cache_hit = true;
+        audio_cache_add_served(&audio_player->cache, audio_player->cache.size);
+        LOG_I(audio_player_proc, "[%d] play from the cache: %s", audio_player->player_handle, audio_player->cache.path);
+    }
+}
+
+/* what the decoder takes from the download goes to the cache as well */
+static void audio_player_proc_cache_store(audio_player_proc_t* audio_player, const uint8_t* buf, uint32_t len)
+{
+    char validator[AUDIO_CACHE_VALIDATOR_SIZE];
+    int total_length;
+
+    if(false == audio_player->cache.owner || 0 == len) {
+        return;
+    }
+
+    if(false == audio_player->cache_checked)
+    {
+        total_length = http_download_get_total_length(&audio_player->http_proc);
+        if(total_length <= 0) {
+            return;
+        }
+
+        audio_player->cache_checked = true;
+        http_download_get_validator(&audio_player->http_proc, validator, sizeof(validator));
+
+        /* the prefix played so far is the old version, the new one would not go on from it */
+        if(AUDIO_CACHE_ERR_CHANGED == audio_cache_set_validator(&audio_player->cache, validator, (uint32_t)total_length) && 
+            audio_player->cache_prefix > 0) 
+        {
+            LOG_W(audio_player_proc, "[%d] %s changed after %u cached bytes, stop", audio_player->player_handle, audio_player->player_info.path, audio_player->cache_prefix);
+            f_close(&audio_player->file_handle);
+            audio_player->cache_prefix = 0;
+            audio_player->last_error = AUDIO_PLAYER_PROC_ERR_CHANGED;
+            return;
+        }
+    }
+
+    audio_cache_write(&audio_player->cache, audio_player->read_pos, buf, len);
+}
+
+/* the cache_hit is checked with the server, also when that can not be reached it plays */
+static void audio_player_revalidate_task(void* param)
+{
+    audio_player_proc_t* audio_player = (audio_player_proc_t*)param;
+
+    atomic_store(&audio_player->revalidate_result, 
+        http_download_revalidate(audio_player->player_info.path, audio_player->cache.validator, (int)audio_player->cache.total_length));
+
+    vTaskDelete(NULL);
+}
+
+static void audio_player_proc_cache_close(audio_player_proc_t* audio_player)
+{
+    if(audio_player->cache_prefix > 0) {
+        f_close(&audio_player->file_handle);
+        audio_player->cache_prefix = 0;
+    }
+
+    if(true == audio_player->revalidate_running) 
+    {
+        pthread_join(audio_player->revalidate_task, NULL);
+        audio_player->revalidate_running = false;
+
+        /* the next start downloads it again */
+        if(HTTP_DOWNLOAD_PROC_CHANGED == atomic_load(&audio_player->revalidate_result)) {
+            LOG_W(audio_player_proc, "[%d] %s changed, drop the cached copy", audio_player->player_handle, audio_player->player_info.path);
+            audio_cache_invalidate(&audio_player->cache);
+        }
+    }
+
+    audio_cache_close(&audio_player->cache);
+    audio_player->cache_hit = false;
+}
+
 static audio_player_return_t audio_player_proc_start(audio_player_proc_t* audio_player)
 {
     audio_player_return_t ret;
+    com_player_return_t com_ret;
 
     audio_player->total_length          = 0;
     audio_player->read_pos              = 0;
     audio_player->file_open_flag        = false;
     audio_player->progress_monitor_tick = 0;
+    audio_player->progress_log_tick     = 0;
+    audio_player->position_ms           = 0;
+    audio_player->duration_ms           = 0;
 
     LOG_I(audio_player_proc, "[%d] player_path: %s", audio_player->player_handle, audio_player->player_info.path);
+
+    audio_player_proc_cache_open(audio_player);
     
     ret = audio_player_proc_open_file(audio_player);
     if(AUDIO_PLAYER_PROC_SUCCESS != ret) {
         return ret;
     }
 
-    __audio_player_before_start(audio_player);
+    audio_player_proc_map_file(audio_player);
+
+    __audio_player_before_start(audio_player, true);
     __audio_player_register(audio_player);
 
-    if(COM_PLAYER_SUCCESS != com_player_start(
+    /* prompts are short and should sound immediately, resources favour fewer wakeups */
+    com_player_set_profile(&audio_player->com_player, 
+        (AUDIO_PLAYER_TYPE_PROMPT==audio_player->player_info.type) ?PCM_TRANS_PROFILE_LOW_LATENCY :PCM_TRANS_PROFILE_LONG_FORM);
+
+    com_ret = com_player_start(
         &audio_player->com_player, 
         __player_input_callback,
         __player_error_callback,
         __player_seek_callback,
-        audio_player))
+        audio_player);
+
+    /* can not be mixed with what is playing, fall back to breaking it */
+    if(COM_PLAYER_ERR_FORMAT == com_ret) {
+        LOG_W(audio_player_proc, "[%d] format differs from the playing stream, break it", audio_player->player_handle);
+        __audio_player_before_start(audio_player, false);
+        com_ret = com_player_open_output(&audio_player->com_player);
+    }
+
+    if(COM_PLAYER_SUCCESS != com_ret)
     {
         LOG_E(audio_player_proc, "[%d] fail to call play!", audio_player->player_handle);
         return AUDIO_PLAYER_PROC_ERR_PLAYER_START;
@@ -630,9 +990,11 @@ static audio_player_return_t audio_player_proc_stop(audio_player_proc_t* audio_p
     com_player_stop(&audio_player->com_player);
     
     audio_player_proc_close_file(audio_player);
+    audio_player_proc_unmap_file(audio_player);
 
     http_download_stop(&audio_player->http_proc);
     common_buffer_clear(&audio_player->http_buffer);
+    audio_player_proc_cache_close(audio_player);
 
     __audio_player_unregister(audio_player);
     __audio_player_after_stop(audio_player);
@@ -663,7 +1025,10 @@ static audio_player_return_t audio_player_proc_resume(audio_player_proc_t* audio
     http_download_resume(&audio_player->http_proc);
     audio_player_proc_open_file(audio_player);
 
-    com_player_resume(&audio_player->com_player);
+    if(COM_PLAYER_ERR_FORMAT == com_player_resume(&audio_player->com_player)) {
+        __audio_player_before_start(audio_player, false);
+        com_player_resume(&audio_player->com_player);
+    }
 
     if(NULL != audio_player->audio_player_callback) {
         audio_player->audio_player_callback(audio_player, AUDIO_PLAYER_EVENT_RESUME);
@@ -672,28 +1037,68 @@ static audio_player_return_t audio_player_proc_resume(audio_player_proc_t* audio
     return AUDIO_PLAYER_PROC_SUCCESS;
 }
 
+static audio_player_return_t audio_player_proc_seek(audio_player_proc_t* audio_player)
+{
+    com_player_return_t com_ret;
+
+    /* a decoder blocked on the download returns at once */
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source)
+        http_download_pause(&audio_player->http_proc);
+
+    com_ret = com_player_seek(&audio_player->com_player, audio_player->seek_ms, audio_player->total_length);
+
+    if(AUDIO_PLAYER_SRC_WEB == audio_player->player_info.source) {
+        if(AUDIO_PLAYER_STA_PLAY == audio_player->cur_state)
+            http_download_resume(&audio_player->http_proc);
+        else
+            http_download_pause(&audio_player->http_proc);
+    }
+
+    if(COM_PLAYER_SUCCESS != com_ret) {
+        LOG_E(audio_player_proc, "[%d] fail to seek to %d ms!", audio_player->player_handle, audio_player->seek_ms);
+        return AUDIO_PLAYER_PROC_ERR_SEEK;
+    }
+
+    audio_player->progress_monitor_tick = 0;
+
+    if(NULL != audio_player->audio_player_callback) {
+        audio_player->audio_player_callback(audio_player, AUDIO_PLAYER_EVENT_SEEK);
+    }
+    
+    return AUDIO_PLAYER_PROC_SUCCESS;
+}
+
 static audio_player_return_t audio_player_proc_play_monitor(audio_player_proc_t* audio_player)
 {
-    if((xTaskGetTickCount() - audio_player->progress_monitor_tick) > AUDIO_PLAYER_PROGRESS_INTERVAL)
+    if((xTaskGetTickCount() - audio_player->progress_monitor_tick) >= AUDIO_PLAYER_PROGRESS_INTERVAL)
     {
-        int cur, all;
-        if(true == com_player_get_progress(&audio_player->com_player, audio_player->total_length, &cur, &all)) {
-            LOG_I(audio_player_proc, "[%d] progress: %02d:%02d/%02d:%02d", audio_player->player_handle, cur/60, cur%60, all/60, all%60);
+        bool valid = com_player_get_progress_ms(&audio_player->com_player, audio_player->total_length, &audio_player->position_ms, &audio_player->duration_ms);
+        
+        if(true == valid && NULL != audio_player->audio_player_callback) {
+            audio_player->audio_player_callback(audio_player, AUDIO_PLAYER_EVENT_PROGRESS);
         }
-        else {
-            LOG_E(audio_player_proc, "[%d] com_player_get_progress failed", audio_player->player_handle);
+
+        if((xTaskGetTickCount() - audio_player->progress_log_tick) >= AUDIO_PLAYER_PROGRESS_LOG_INTERVAL)
+        {
+            int cur = audio_player->position_ms/1000, all = audio_player->duration_ms/1000;
+            
+            if(true == valid) {
+                LOG_I(audio_player_proc, "[%d] progress: %02d:%02d/%02d:%02d", audio_player->player_handle, cur/60, cur%60, all/60, all%60);
+            }
+            else {
+                LOG_E(audio_player_proc, "[%d] com_player_get_progress failed", audio_player->player_handle);
+            }
+
+            audio_player->progress_log_tick = xTaskGetTickCount();
         }
 
         audio_player->progress_monitor_tick = xTaskGetTickCount();
     }
 
     if(true == com_player_is_done(&audio_player->com_player)) {
-        LOG_I(audio_player_proc, "[%d] all end!", audio_player->player_handle);
+        LOG_I(audio_player_proc, "[%d] all end! stalls avoided: %d", audio_player->player_handle, com_player_get_stalls_avoided(&audio_player->com_player));
         return AUDIO_PLAYER_PROC_ALL_END;
     }
-    else if(true == com_player_auto_resume(&audio_player->com_player)) {
-        LOG_I(audio_player_proc, "[%d] auto resume com_player", audio_player->player_handle);
-    }
     
     return AUDIO_PLAYER_PROC_SUCCESS;
 }
@@ -716,6 +1121,7 @@ void audio_player_task(void *param)
             
             audio_player_set_event(audio_player, AUDIO_PLAYER_EVENT_STOP_DONE);
             audio_player_clear_event(audio_player, AUDIO_PLAYER_EVENT_START_DONE);
+            xEventGroupSetBits(audio_player->finish_handle, AUDIO_PLAYER_EVENT_FINISH);
         
             events = audio_player_wait_event(audio_player, AUDIO_PLAYER_EVENT_START |AUDIO_PLAYER_EVENT_EXIT, portMAX_DELAY);
 
@@ -757,13 +1163,17 @@ void audio_player_task(void *param)
 			break;
 			
 		case AUDIO_PLAYER_STA_PAUSE:
-            events = AUDIO_PLAYER_EVENT_STOP |AUDIO_PLAYER_EVENT_RESUME;
+            events = AUDIO_PLAYER_EVENT_STOP |AUDIO_PLAYER_EVENT_RESUME |AUDIO_PLAYER_EVENT_SEEK;
             events = audio_player_wait_event(audio_player, events, portMAX_DELAY);
 
             if(AUDIO_PLAYER_EVENT_STOP & events) {
                 audio_player->cur_state = AUDIO_PLAYER_STA_STOP;
                 LOG_I(audio_player_proc, "[%d] STA_PAUSE --> STA_STOP", audio_player->player_handle);
             }
+            else if(AUDIO_PLAYER_EVENT_SEEK & events) {
+                audio_player->seek_result = audio_player_proc_seek(audio_player);
+                audio_player_set_event(audio_player, AUDIO_PLAYER_EVENT_SEEK_DONE);
+            }
             else if(AUDIO_PLAYER_EVENT_RESUME & events)
             {
                 ret = audio_player_proc_resume(audio_player);
@@ -807,7 +1217,8 @@ void audio_player_task(void *param)
                 AUDIO_PLAYER_EVENT_STOP |
                 AUDIO_PLAYER_EVENT_RESUME |
                 AUDIO_PLAYER_EVENT_PAUSE |
-                AUDIO_PLAYER_EVENT_BREAK;
+                AUDIO_PLAYER_EVENT_BREAK |
+                AUDIO_PLAYER_EVENT_SEEK;
             
             events = audio_player_wait_event(audio_player, events, AUDIO_PLAYER_MONITOR_INTERVAL);
 
@@ -835,6 +1246,11 @@ void audio_player_task(void *param)
 
                 audio_player_set_event(audio_player, AUDIO_PLAYER_EVENT_BREAK_DONE);
             }
+            else if(AUDIO_PLAYER_EVENT_SEEK & events) {
+                /* a failed seek keeps playing where it was */
+                audio_player->seek_result = audio_player_proc_seek(audio_player);
+                audio_player_set_event(audio_player, AUDIO_PLAYER_EVENT_SEEK_DONE);
+            }
 
             if(AUDIO_PLAYER_PROC_SUCCESS == ret)
                 ret = audio_player_proc_play_monitor(audio_player);
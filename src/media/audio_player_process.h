@@ -4,6 +4,8 @@
 #include "typedefs.h"
 #include "common_player.h"
 #include "http_download_process.h"
+#include "audio_cache.h"
+#include <stdatomic.h>
 
 #define AUDIO_PLAYER_MAX_PATH_SIZE  2048
 
@@ -45,6 +47,9 @@ typedef enum {
     AUDIO_PLAYER_EVENT_PAUSE_DONE    = 0x000200UL,
     AUDIO_PLAYER_EVENT_BREAK_DONE    = 0x000400UL,
     AUDIO_PLAYER_EVENT_PROGRESS      = 0x000800UL,
+    AUDIO_PLAYER_EVENT_SEEK          = 0x001000UL,
+    AUDIO_PLAYER_EVENT_SEEK_DONE     = 0x002000UL,
+    AUDIO_PLAYER_EVENT_FINISH        = 0x004000UL,     /* on finish_handle, the task went idle */
     
 } audio_player_event_t;
 
@@ -63,6 +68,9 @@ typedef enum {
     AUDIO_PLAYER_PROC_ERR_NO_PAUSE,
     AUDIO_PLAYER_PROC_ERR_NO_PLAY,
     AUDIO_PLAYER_PROC_ERR_BREAK,
+    AUDIO_PLAYER_PROC_ERR_SEEK,
+    AUDIO_PLAYER_PROC_ERR_TIMEOUT,
+    AUDIO_PLAYER_PROC_ERR_CHANGED,      /* the web source changed under the cached prefix played, start it again */
     
 } audio_player_return_t;
 
@@ -82,6 +90,7 @@ typedef struct audio_player_proc_s {
     audio_player_state_t            cur_state;
     TaskHandle_t                    task_handle;
     EventGroupHandle_t              event_handle;
+    EventGroupHandle_t              finish_handle;      /* for audio_player_wait_finish only */
     SemaphoreHandle_t               mutex_handle;
     audio_player_handle_t           player_handle;
     audio_player_info_t             player_info;
@@ -92,9 +101,23 @@ typedef struct audio_player_proc_s {
     uint32_t                        prompt_offset;
     uint32_t                        read_pos;
     bool                            file_open_flag;
+    const uint8_t*                  map_addr;           /* SD file mapped for the decoder, NULL when it is read */
+    int                             map_size;
     uint32_t                        progress_monitor_tick;
+    uint32_t                        progress_log_tick;
+    uint32_t                        position_ms;        /* as of the last AUDIO_PLAYER_EVENT_PROGRESS */
+    uint32_t                        duration_ms;
+    uint32_t                        seek_ms;
+    audio_player_return_t           seek_result;
     common_buffer_t                 http_buffer;
     http_download_proc_t            http_proc;
+    audio_cache_session_t           cache;              /* web source on disk, see audio_cache.h */
+    bool                            cache_hit;          /* played whole from cache.path, like an SD file */
+    uint32_t                        cache_prefix;       /* of a partial entry, read through file_handle before http_buffer */
+    bool                            cache_checked;      /* the response's validator went to the cache */
+    TaskHandle_t                    revalidate_task;    /* asks the server about a cache_hit while it plays */
+    bool                            revalidate_running;
+    atomic_int                      revalidate_result;  /* HTTP_DOWNLOAD_PROC_CHANGED stops the cached copy */
     p_audio_player_callback         audio_player_callback;
     
 } audio_player_proc_t;
@@ -106,6 +129,8 @@ audio_player_return_t audio_player_stop(audio_player_proc_t* audio_player);
 audio_player_return_t audio_player_pause(audio_player_proc_t* audio_player);
 audio_player_return_t audio_player_resume(audio_player_proc_t* audio_player);
 audio_player_return_t audio_player_break(audio_player_proc_t* audio_player);
+audio_player_return_t audio_player_seek(audio_player_proc_t* audio_player, uint32_t ms);
+audio_player_return_t audio_player_wait_finish(audio_player_proc_t* audio_player, uint32_t timeout);
 audio_player_return_t audio_player_register_callback(audio_player_proc_t* audio_player, p_audio_player_callback callback);
 
 #endif
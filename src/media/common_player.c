@@ -1,23 +1,38 @@
 #include "common_player.h"
+#include "id3tag.h"
 #include <string.h>
 
 #define malloc(x)   pvPortMalloc(x)
 #define free(x)     vPortFree(x)
 
 #define COM_PLAYER_OUTPUT_SIZE      (32*1024)
+#define COM_PLAYER_LOW_WATERMARK    (COM_PLAYER_OUTPUT_SIZE/2)      /* refill below this */
+#define COM_PLAYER_HIGH_WATERMARK   (COM_PLAYER_OUTPUT_SIZE*3/4)    /* restart pcm above this */
 #define COM_PLAYER_START_TIMEOUT    (15000/portTICK_RATE_MS)
+#define COM_PLAYER_PROBE_SIZE       (4*1024)                        /* holds two frames of any bit rate */
 
+static int __decoder_input_callback(void* param, uint8_t* buf, int size);
 static int __decoder_output_callback(void* param, audio_decoder_info_t* decoder_info, uint8_t* buf, int size);
-static int __pcm_trans_data_request_callback(void* param, uint8_t* buf, int size);
+static int __decoder_output_reserve_callback(void* param, audio_decoder_info_t* decoder_info, uint8_t** p_buf, int size);
+static int __decoder_output_commit_callback(void* param, audio_decoder_info_t* decoder_info, int size);
+static int __pcm_trans_data_peek_callback(void* param, uint8_t** p_buf, int size);
+static void __pcm_trans_data_consume_callback(void* param, int size);
+static void __output_watermark_callback(void* param, ring_buffer_watermark_t watermark);
 
 com_player_return_t com_player_init(com_player_t* com_player)
 {
     memset(com_player, 0, sizeof(com_player_t));
 
     com_player->event_handle = xEventGroupCreate();
+    com_player->pcm_stream = -1;
 	
-    ring_buffer_init(&com_player->output_buffer, COM_PLAYER_OUTPUT_SIZE);
-    //mp3_decoder_init(&com_player->mp3_decoder);
+    /* the decoder thread is the only producer and pcm_trans the only consumer */
+    ring_buffer_init(&com_player->output_buffer, COM_PLAYER_OUTPUT_SIZE, RING_BUF_MODE_SPSC);
+    ring_buffer_set_watermark(&com_player->output_buffer, COM_PLAYER_LOW_WATERMARK, COM_PLAYER_HIGH_WATERMARK, __output_watermark_callback, com_player);
+    com_player->probe_buf = malloc(COM_PLAYER_PROBE_SIZE);
+
+    /* one decoder thread for the life of the player, start/stop only reset it */
+    mp3_decoder_init(&com_player->mp3_decoder);
     
     return COM_PLAYER_SUCCESS;
 }
@@ -29,8 +44,13 @@ com_player_return_t com_player_deinit(com_player_t* com_player)
         com_player->event_handle = NULL;
     }
 
-	//mp3_decoder_deinit(&com_player->mp3_decoder);
+    mp3_decoder_deinit(&com_player->mp3_decoder);
     ring_buffer_deinit(&com_player->output_buffer);
+
+    if(NULL != com_player->probe_buf) {
+        free(com_player->probe_buf);
+        com_player->probe_buf = NULL;
+    }
     
     return COM_PLAYER_SUCCESS;
 }
@@ -59,6 +79,122 @@ static void com_player_clear_event(com_player_t* com_player, uint32_t events)
     xEventGroupClearBits(com_player->event_handle, events);
 }
 
+/* moves what is left of the probe buffer to its start and reads up to full, 0 when nothing came */
+static int com_player_probe_fill(com_player_t* com_player)
+{
+    int count, total = 0;
+
+    com_player->probe_size -= com_player->probe_offset;
+    memmove(com_player->probe_buf, com_player->probe_buf + com_player->probe_offset, com_player->probe_size);
+    com_player->probe_offset = 0;
+
+    while(com_player->probe_size < COM_PLAYER_PROBE_SIZE) {
+        count = com_player->input_callback(com_player->input_param, com_player->probe_buf + com_player->probe_size, COM_PLAYER_PROBE_SIZE - com_player->probe_size);
+        if(count <= 0)
+            break;
+
+        com_player->probe_size += count;
+        com_player->probe_read += count;
+        total += count;
+    }
+
+    return total;
+}
+
+/* source offset of the next byte __decoder_input_callback returns */
+static uint32_t com_player_replay_pos(com_player_t* com_player)
+{
+    return com_player->probe_read - com_player->probe_size + com_player->probe_offset;
+}
+
+/* 
+ * Reads the first bytes on the caller's thread, steps over an ID3v2 tag and
+ * takes the format from the first frame header. Whatever was read after the
+ * tag is replayed to the decoder by __decoder_input_callback. A tag longer
+ * than what was read (cover art) is not read at all, the source is moved
+ * past it through the seek callback.
+ */
+static bool com_player_probe(com_player_t* com_player, mp3_decoder_stream_info_t* stream_info)
+{
+    int tag_size, skip, offset;
+
+    com_player->probe_offset = 0;
+    com_player->probe_size = 0;
+    com_player->probe_tag_size = 0;
+    com_player->probe_read = 0;
+    
+    if(NULL == com_player->probe_buf || 0 == com_player_probe_fill(com_player))
+        return false;
+
+    tag_size = (com_player->probe_size >= 10) ?id3_tag_query(com_player->probe_buf, com_player->probe_size) :0;
+    if(tag_size > 0)
+        com_player->probe_tag_size = tag_size;
+
+    if(tag_size > com_player->probe_size - com_player->probe_offset && NULL != com_player->seek_callback && 
+        0 == com_player->seek_callback(com_player->input_param, com_player_replay_pos(com_player) + tag_size)) 
+    {
+        com_player->probe_read  += tag_size - (com_player->probe_size - com_player->probe_offset);
+        com_player->probe_offset = com_player->probe_size;
+        tag_size = 0;
+
+        if(0 == com_player_probe_fill(com_player))
+            return false;
+    }
+
+    /* where the source can not seek, the tag is read through and dropped */
+    while(tag_size > 0) {
+        skip = (tag_size < com_player->probe_size - com_player->probe_offset) ?tag_size :(com_player->probe_size - com_player->probe_offset);
+        com_player->probe_offset += skip;
+        tag_size -= skip;
+
+        if(tag_size > 0 && 0 == com_player_probe_fill(com_player))
+            return false;
+    }
+
+    if(com_player->probe_size - com_player->probe_offset < COM_PLAYER_PROBE_SIZE/2)
+        com_player_probe_fill(com_player);
+
+    if(false == mp3_decoder_probe(com_player->probe_buf + com_player->probe_offset, com_player->probe_size - com_player->probe_offset, &com_player->decoder_info, stream_info, &offset))
+        return false;
+
+    com_player->probe_offset += offset;
+    stream_info->data_start = com_player_replay_pos(com_player);
+    com_player->decoder_info.tag_size = com_player->probe_tag_size;
+
+    return true;
+}
+
+/* the same for a source mapped in memory, nothing is read or replayed */
+static bool com_player_probe_map(com_player_t* com_player, mp3_decoder_stream_info_t* stream_info)
+{
+    int tag_size, size, offset;
+
+    com_player->probe_offset = 0;
+    com_player->probe_size = 0;
+    com_player->probe_tag_size = 0;
+    com_player->probe_read = 0;
+
+    tag_size = (com_player->input_map_size >= 10) ?id3_tag_query(com_player->input_map, com_player->input_map_size) :0;
+    if(tag_size <= 0)
+        tag_size = 0;
+    else if((uint32_t)tag_size >= com_player->input_map_size)
+        return false;
+
+    com_player->probe_tag_size = tag_size;
+
+    size = com_player->input_map_size - tag_size;
+    if(size > COM_PLAYER_PROBE_SIZE)
+        size = COM_PLAYER_PROBE_SIZE;
+
+    if(false == mp3_decoder_probe(com_player->input_map + tag_size, size, &com_player->decoder_info, stream_info, &offset))
+        return false;
+
+    stream_info->data_start = tag_size + offset;
+    com_player->decoder_info.tag_size = com_player->probe_tag_size;
+
+    return true;
+}
+
 com_player_return_t com_player_start(
     com_player_t* com_player, 
     p_decoder_input_callback input_callback,
@@ -66,33 +202,66 @@ com_player_return_t com_player_start(
     p_decoder_seek_callback seek_callback,
     void* callback_param)
 {
+    mp3_decoder_stream_info_t stream_info;
     uint32_t events;
+    bool probed;
     
     com_player->input_done            = false;
     com_player->wait_decoder          = true;
     com_player->pcm_played            = 0;
+    com_player->position_base         = 0;
+    com_player->duration_ms           = 0;
     com_player->enable_pcm_or_decoder = true;
+    com_player->stalls_avoided        = 0;
+    com_player->start_tick            = xTaskGetTickCount();
 
     com_player->decoder_type = COM_PLAYER_TYPE_MP3;
 
+    com_player->input_callback        = input_callback;
+    com_player->seek_callback         = seek_callback;
+    com_player->input_param           = callback_param;
+
     memset(&com_player->decoder_info, 0, sizeof(audio_decoder_info_t));
 
+    if(NULL != com_player->input_map)
+        probed = com_player_probe_map(com_player, &stream_info);
+    else
+        probed = com_player_probe(com_player, &stream_info);
+
+    if(true == probed) {
+        com_player->data_start = stream_info.data_start;
+        if(stream_info.frames > 0 && com_player->decoder_info.sample_rate > 0)
+            com_player->duration_ms = (uint32_t)((uint64_t)stream_info.frames*stream_info.samples_per_frame*1000/com_player->decoder_info.sample_rate);
+    }
+    else {
+        com_player->data_start = com_player->probe_tag_size;
+    }
+
     if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
-        mp3_decoder_init(&com_player->mp3_decoder);
-        mp3_decoder_register_input_callback(&com_player->mp3_decoder, input_callback, callback_param);
+        mp3_decoder_register_input_callback(&com_player->mp3_decoder, __decoder_input_callback, com_player);
         mp3_decoder_register_error_callback(&com_player->mp3_decoder, error_callback, callback_param);
         mp3_decoder_register_output_callback(&com_player->mp3_decoder, __decoder_output_callback, com_player);
+        mp3_decoder_register_output_reserve_callback(&com_player->mp3_decoder, __decoder_output_reserve_callback, __decoder_output_commit_callback, com_player);
+        mp3_decoder_register_seek_callback(&com_player->mp3_decoder, seek_callback, callback_param);
+        mp3_decoder_set_input_map(&com_player->mp3_decoder, com_player->input_map, com_player->input_map_size);
+        mp3_decoder_set_stream_info(&com_player->mp3_decoder, (true == probed) ?&stream_info :NULL, 
+            (NULL != com_player->input_map) ?com_player->data_start :com_player_replay_pos(com_player));
         mp3_decoder_start(&com_player->mp3_decoder);
     }
 
+    /* the format is known, open the device while the first frames decode */
+    if(true == probed) {
+        LOG_I(common, "probed %d/%d, %d kbps, tag %d, duration %d ms, %d ms after start", 
+            com_player->decoder_info.sample_rate, com_player->decoder_info.channels, com_player->decoder_info.bit_rate/1000,
+            com_player->probe_tag_size, com_player->duration_ms, xTaskGetTickCount() - com_player->start_tick);
+        return com_player_open_output(com_player);
+    }
+
     events = COM_PLAYER_EVENT_DECODER |COM_PLAYER_EVENT_EXIT;
     events = com_player_wait_event(com_player, events, COM_PLAYER_START_TIMEOUT);
 
     if(COM_PLAYER_EVENT_DECODER & events) {
-        pcm_trans_register_data_request_callback(__pcm_trans_data_request_callback, com_player);
-        
-        if(PCM_TRANS_SUCCESS != pcm_trans_start_tx(com_player->decoder_info.sample_rate, com_player->decoder_info.channels, false))
-            return COM_PLAYER_ERR_PCM_TRANS;
+        return com_player_open_output(com_player);
     }
     else if(COM_PLAYER_EVENT_EXIT & events) {
         return COM_PLAYER_ERR_EXIT;
@@ -100,6 +269,32 @@ com_player_return_t com_player_start(
     else {
         return COM_PLAYER_ERR_TIMEOUT;
     }
+}
+
+/* 
+ * Adds the decoded stream to the pcm_trans mixer. COM_PLAYER_ERR_FORMAT: other
+ * streams play a different format, the decoder keeps its output and this can
+ * be called again once they are out of the way.
+ */
+com_player_return_t com_player_open_output(com_player_t* com_player)
+{
+    int ret;
+    
+    if(com_player->pcm_stream >= 0)
+        return COM_PLAYER_SUCCESS;
+
+    pcm_trans_set_tx_profile(com_player->pcm_profile);
+    
+    ret = pcm_trans_open_stream(&com_player->pcm_stream, com_player->decoder_info.sample_rate, com_player->decoder_info.channels, 
+        __pcm_trans_data_peek_callback, __pcm_trans_data_consume_callback, com_player);
+    
+    if(PCM_TRANS_ERR_FORMAT == ret) {
+        com_player->pcm_stream = -1;
+        return COM_PLAYER_ERR_FORMAT;
+    }
+    else if(PCM_TRANS_SUCCESS != ret) {
+        return COM_PLAYER_ERR_PCM_TRANS;
+    }
     
     com_player->wait_decoder = false;
     
@@ -110,28 +305,72 @@ com_player_return_t com_player_stop(com_player_t* com_player)
 {
     com_player->enable_pcm_or_decoder = false;
     
-    pcm_trans_register_data_request_callback(NULL, NULL);
-    pcm_trans_stop_tx();
+    if(com_player->pcm_stream >= 0) {
+        pcm_trans_close_stream(com_player->pcm_stream);
+        com_player->pcm_stream = -1;
+    }
     
+    /* stopped first, the decoder thread may still be inside a callback */
     if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
+        mp3_decoder_stop(&com_player->mp3_decoder);
         mp3_decoder_register_input_callback(&com_player->mp3_decoder, NULL, NULL);
         mp3_decoder_register_output_callback(&com_player->mp3_decoder, NULL, NULL);
-        mp3_decoder_stop(&com_player->mp3_decoder);
-        mp3_decoder_deinit(&com_player->mp3_decoder);
+        mp3_decoder_register_output_reserve_callback(&com_player->mp3_decoder, NULL, NULL, NULL);
+        mp3_decoder_register_seek_callback(&com_player->mp3_decoder, NULL, NULL);
+        mp3_decoder_set_input_map(&com_player->mp3_decoder, NULL, 0);
     }
 
+    com_player->input_map = NULL;
+    com_player->input_map_size = 0;
+
     ring_buffer_clear(&com_player->output_buffer, false);
     com_player_clear_event(com_player, COM_PLAYER_EVENT_ALL);
     
     return COM_PLAYER_SUCCESS;
 }
 
+/* 
+ * Jumps to ms: the decoder moves its input through the seek callback, the
+ * decoded and converted audio of the old position is dropped. Playback goes
+ * on if it was not paused.
+ */
+com_player_return_t com_player_seek(com_player_t* com_player, uint32_t ms, uint32_t total_length)
+{
+    audio_decoder_info_t* info = &com_player->decoder_info;
+    bool enabled = com_player->enable_pcm_or_decoder;
+    com_player_return_t ret = COM_PLAYER_SUCCESS;
+
+    if(COM_PLAYER_TYPE_MP3 != com_player->decoder_type || com_player->pcm_stream < 0)
+        return COM_PLAYER_ERR_SEEK;
+
+    /* no watermark may wake the decoder while it moves */
+    com_player->enable_pcm_or_decoder = false;
+    pcm_trans_pause_stream(com_player->pcm_stream);
+
+    if(MP3_DECODER_SUCCESS != mp3_decoder_seek(&com_player->mp3_decoder, ms, total_length)) {
+        ret = COM_PLAYER_ERR_SEEK;
+    }
+    else {
+        ring_buffer_clear(&com_player->output_buffer, false);
+        pcm_trans_flush_stream(com_player->pcm_stream);
+        com_player->pcm_played = (uint32_t)((uint64_t)ms*info->sample_rate/1000)*info->channels*sizeof(int16_t);
+        com_player->position_base = ms;
+    }
+
+    if(true == enabled) {
+        com_player->enable_pcm_or_decoder = true;
+        mp3_decoder_resume(&com_player->mp3_decoder, false);
+        pcm_trans_resume_stream(com_player->pcm_stream);
+    }
+
+    return ret;
+}
+
 com_player_return_t com_player_pause(com_player_t* com_player)
 {
     com_player->enable_pcm_or_decoder = false;
     
-    pcm_trans_register_data_request_callback(NULL, NULL);
-    pcm_trans_stop_tx();
+    pcm_trans_pause_stream(com_player->pcm_stream);
 
     if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
         mp3_decoder_pause(&com_player->mp3_decoder, false);
@@ -142,17 +381,50 @@ com_player_return_t com_player_pause(com_player_t* com_player)
 
 com_player_return_t com_player_resume(com_player_t* com_player)
 {
+    int ret;
+    
     com_player->enable_pcm_or_decoder = true;
 
-    pcm_trans_register_data_request_callback(__pcm_trans_data_request_callback, com_player);
+    if(com_player->pcm_stream < 0)
+        return com_player_open_output(com_player);
+    
+    pcm_trans_set_tx_profile(com_player->pcm_profile);
     
-    if(PCM_TRANS_SUCCESS != pcm_trans_start_tx(com_player->decoder_info.sample_rate, com_player->decoder_info.channels, false)) {
-         return COM_PLAYER_ERR_PCM_TRANS;
+    ret = pcm_trans_resume_stream(com_player->pcm_stream);
+    if(PCM_TRANS_ERR_FORMAT == ret) {
+        return COM_PLAYER_ERR_FORMAT;
+    }
+    else if(PCM_TRANS_SUCCESS != ret) {
+        return COM_PLAYER_ERR_PCM_TRANS;
     }
     
     return COM_PLAYER_SUCCESS;
 }
 
+/* applied at the next com_player_start/resume */
+void com_player_set_profile(com_player_t* com_player, pcm_trans_profile_t profile)
+{
+    com_player->pcm_profile = profile;
+}
+
+/* 
+ * Before com_player_start: decode data[0, size) in place instead of reading
+ * through the input callback. Kept until com_player_stop, the caller may
+ * release data after it.
+ */
+void com_player_set_input_map(com_player_t* com_player, const uint8_t* data, uint32_t size)
+{
+    com_player->input_map = data;
+    com_player->input_map_size = (NULL != data) ?size :0;
+}
+
+/* Q15 gain of this player in the mix, ramped over ramp_ms */
+void com_player_set_gain(com_player_t* com_player, int gain, int ramp_ms)
+{
+    if(com_player->pcm_stream >= 0)
+        pcm_trans_set_stream_gain(com_player->pcm_stream, gain, ramp_ms);
+}
+
 void com_player_set_done(com_player_t* com_player, bool error_occur)
 {
     if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
@@ -166,54 +438,172 @@ void com_player_set_done(com_player_t* com_player, bool error_occur)
 
 bool com_player_is_done(com_player_t* com_player)
 {
-    return pcm_trans_is_tx_done();
+    return pcm_trans_is_stream_done(com_player->pcm_stream);
 }
 
-bool com_player_auto_resume(com_player_t* com_player)
+uint32_t com_player_get_stalls_avoided(com_player_t* com_player)
+{
+    return com_player->stalls_avoided;
+}
+
+bool com_player_get_progress(com_player_t* com_player, int total_length, int* cur_time, int* all_time)
 {
-    if(true == pcm_trans_is_tx_pause() && true == mp3_decoder_is_pause(&com_player->mp3_decoder)) {
-        pcm_trans_resume_tx();
-        return true;
+    uint32_t position_ms, duration_ms;
+
+    if(false == com_player_get_progress_ms(com_player, total_length, &position_ms, &duration_ms)) {
+        return false;
     }
 
-    return false;
+    *cur_time = position_ms/1000;
+    *all_time = duration_ms/1000;
+    
+    return true;
 }
 
-bool com_player_get_progress(com_player_t* com_player, int total_length, int* cur_time, int* all_time)
+/* 
+ * Position is what the device has played of this stream, not what was handed
+ * to it. Duration is exact with a Xing/VBRI frame count, else estimated from
+ * the first frame's bit rate. Reads no decoder state, fine to poll at 10 Hz.
+ */
+bool com_player_get_progress_ms(com_player_t* com_player, int total_length, uint32_t* position_ms, uint32_t* duration_ms)
 {
     audio_decoder_info_t* info = &com_player->decoder_info;
     
-    if(total_length <= 0 || info->bit_rate <= 0 || info->sample_rate <= 0 || info->channels <= 0) {
+    if(info->sample_rate <= 0 || info->channels <= 0) {
         return false;
     }
 
-    *cur_time = com_player->pcm_played /info->channels /2 /info->sample_rate;
-    *all_time = (total_length - info->tag_size) *8 /info->bit_rate;
+    if(com_player->duration_ms > 0) {
+        *duration_ms = com_player->duration_ms;
+    }
+    else if(total_length > (int)com_player->data_start && info->bit_rate > 0) {
+        *duration_ms = (uint32_t)((uint64_t)(total_length - com_player->data_start)*8000/info->bit_rate);
+    }
+    else {
+        return false;
+    }
+
+    *position_ms = com_player->position_base;
+    if(com_player->pcm_stream >= 0)
+        *position_ms += pcm_trans_get_stream_position(com_player->pcm_stream);
+
+    if(*position_ms > *duration_ms)
+        *position_ms = *duration_ms;
     
     return true;
 }
 
-static int __decoder_output_callback(void* param, audio_decoder_info_t* decoder_info, uint8_t* buf, int size)
+static void __com_player_wake_decoder(com_player_t* com_player)
+{
+    if(false == com_player->enable_pcm_or_decoder)
+        return;
+
+    if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
+        if(true == mp3_decoder_is_output_done(&com_player->mp3_decoder))
+            return;
+
+        if(true == mp3_decoder_is_pause(&com_player->mp3_decoder))
+            com_player->stalls_avoided++;
+
+        mp3_decoder_resume(&com_player->mp3_decoder, false);
+    }
+}
+
+static void __com_player_wake_pcm(com_player_t* com_player)
+{
+    if(false == com_player->enable_pcm_or_decoder || true == com_player->wait_decoder)
+        return;
+
+    if(true == pcm_trans_is_tx_pause())
+        com_player->stalls_avoided++;
+
+    pcm_trans_resume_tx();
+}
+
+/* decoder is woken below the low watermark, pcm_trans above the high one */
+static void __output_watermark_callback(void* param, ring_buffer_watermark_t watermark)
 {
     com_player_t* com_player = (com_player_t*)param;
-    uint32_t count = ring_buffer_push(&com_player->output_buffer, buf, size, false);
 
+    if(RING_BUF_WATERMARK_LOW == watermark)
+        __com_player_wake_decoder(com_player);
+    else
+        __com_player_wake_pcm(com_player);
+}
+
+static void __decoder_output_notify(com_player_t* com_player, audio_decoder_info_t* decoder_info)
+{
     if(true == com_player->wait_decoder) {
+        if(0 == com_player->decoder_info.sample_rate)
+            LOG_I(common, "first pcm %d ms after start", xTaskGetTickCount() - com_player->start_tick);
+        
         memcpy(&com_player->decoder_info, decoder_info, sizeof(audio_decoder_info_t));
+        if(0 == com_player->decoder_info.tag_size)
+            com_player->decoder_info.tag_size = com_player->probe_tag_size;
+        
         com_player_set_event(com_player, COM_PLAYER_EVENT_DECODER);
     }
-    else if(true == com_player->enable_pcm_or_decoder) {
-        pcm_trans_resume_tx();
+}
+
+/* the probed bytes first, then the source */
+static int __decoder_input_callback(void* param, uint8_t* buf, int size)
+{
+    com_player_t* com_player = (com_player_t*)param;
+    int count;
+
+    if(com_player->probe_offset < com_player->probe_size) {
+        count = com_player->probe_size - com_player->probe_offset;
+        count = (count < size) ?count :size;
+        memcpy(buf, com_player->probe_buf + com_player->probe_offset, count);
+        com_player->probe_offset += count;
+        return count;
     }
 
+    if(NULL == com_player->input_callback)
+        return 0;
+
+    return com_player->input_callback(com_player->input_param, buf, size);
+}
+
+static int __decoder_output_callback(void* param, audio_decoder_info_t* decoder_info, uint8_t* buf, int size)
+{
+    com_player_t* com_player = (com_player_t*)param;
+    uint32_t count;
+
+    /* flush: the decoder stopped below the high watermark, play what is there */
+    if(NULL == buf || size <= 0) {
+        __com_player_wake_pcm(com_player);
+        return 0;
+    }
+
+    count = ring_buffer_push(&com_player->output_buffer, buf, size, false);
+
+    __decoder_output_notify(com_player, decoder_info);
+
     return count;
 }
 
-static int __pcm_trans_data_request_callback(void* param, uint8_t* buf, int size)
+static int __decoder_output_reserve_callback(void* param, audio_decoder_info_t* decoder_info, uint8_t** p_buf, int size)
+{
+    com_player_t* com_player = (com_player_t*)param;
+    
+    return ring_buffer_reserve(&com_player->output_buffer, p_buf, size, false);
+}
+
+static int __decoder_output_commit_callback(void* param, audio_decoder_info_t* decoder_info, int size)
+{
+    com_player_t* com_player = (com_player_t*)param;
+    
+    ring_buffer_commit(&com_player->output_buffer, size, false);
+    __decoder_output_notify(com_player, decoder_info);
+
+    return size;
+}
+
+static int __pcm_trans_data_peek_callback(void* param, uint8_t** p_buf, int size)
 {
     com_player_t* com_player = (com_player_t*)param;
     uint32_t count = ring_buffer_get_count(&com_player->output_buffer);
-    uint32_t free_count = ring_buffer_get_free_count(&com_player->output_buffer);
 
     bool output_done = false;
 
@@ -221,21 +611,24 @@ static int __pcm_trans_data_request_callback(void* param, uint8_t* buf, int size
         output_done = mp3_decoder_is_output_done(&com_player->mp3_decoder);
     }
 
-    if(false == output_done && true == com_player->enable_pcm_or_decoder && free_count > count)
-    {
-        if(COM_PLAYER_TYPE_MP3 == com_player->decoder_type) {
-            mp3_decoder_resume(&com_player->mp3_decoder, true);
-        }
+    /* running dry with nothing consumed since, make sure the decoder is awake */
+    if(count <= COM_PLAYER_LOW_WATERMARK) {
+        __com_player_wake_decoder(com_player);
     }
     
     if(true == output_done && count <= 0) {
-        pcm_trans_set_tx_no_data();
+        pcm_trans_set_stream_no_data(com_player->pcm_stream);
         return 0;
     }
 
-    count = ring_buffer_pop(&com_player->output_buffer, buf, size, true);
-    com_player->pcm_played += count;
+    return ring_buffer_peek(&com_player->output_buffer, p_buf, size, true);
+}
 
-    return count;
+static void __pcm_trans_data_consume_callback(void* param, int size)
+{
+    com_player_t* com_player = (com_player_t*)param;
+
+    ring_buffer_consume(&com_player->output_buffer, size, true);
+    com_player->pcm_played += size;
 }
 
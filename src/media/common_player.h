@@ -11,6 +11,8 @@ typedef enum {
     COM_PLAYER_ERR_PCM_TRANS,
     COM_PLAYER_ERR_EXIT,
     COM_PLAYER_ERR_TIMEOUT,
+    COM_PLAYER_ERR_FORMAT,
+    COM_PLAYER_ERR_SEEK,
     
 } com_player_return_t;
 
@@ -37,7 +39,24 @@ typedef struct {
     bool                  wait_decoder;
     bool                  input_done;
     uint32_t              pcm_played;
+    uint32_t              position_base;    /* ms where the stream was opened or last flushed */
+    uint32_t              duration_ms;      /* from a Xing/VBRI frame count, 0 when there is none */
+    uint32_t              data_start;       /* source offset of the first frame */
     bool                  enable_pcm_or_decoder;
+    uint32_t              stalls_avoided;   /* paused decoder/pcm woken by an output watermark */
+    pcm_trans_profile_t   pcm_profile;
+    int                   pcm_stream;       /* pcm_trans mixer slot, -1 when closed */
+    uint32_t              start_tick;       /* com_player_start, for the first pcm latency */
+    uint8_t*              probe_buf;        /* first input bytes, replayed to the decoder */
+    int                   probe_offset;
+    int                   probe_size;
+    uint32_t              probe_tag_size;
+    uint32_t              probe_read;       /* bytes the probe took from the source */
+    const uint8_t*        input_map;        /* whole source in memory, see com_player_set_input_map */
+    uint32_t              input_map_size;
+    p_decoder_input_callback    input_callback;
+    p_decoder_seek_callback     seek_callback;
+    void*                       input_param;
     
 } com_player_t;
 
@@ -53,11 +72,17 @@ com_player_return_t com_player_start(
 com_player_return_t com_player_stop(com_player_t* com_player);
 com_player_return_t com_player_pause(com_player_t* com_player);
 com_player_return_t com_player_resume(com_player_t* com_player);
+com_player_return_t com_player_open_output(com_player_t* com_player);
+com_player_return_t com_player_seek(com_player_t* com_player, uint32_t ms, uint32_t total_length);
+void com_player_set_profile(com_player_t* com_player, pcm_trans_profile_t profile);
+void com_player_set_input_map(com_player_t* com_player, const uint8_t* data, uint32_t size);
+void com_player_set_gain(com_player_t* com_player, int gain, int ramp_ms);
 
 void com_player_set_done(com_player_t* com_player, bool error_occur);
 bool com_player_is_done(com_player_t* com_player);
-bool com_player_auto_resume(com_player_t* com_player);
+uint32_t com_player_get_stalls_avoided(com_player_t* com_player);
 bool com_player_get_progress(com_player_t* com_player, int total_length, int* cur_time, int* all_time);
+bool com_player_get_progress_ms(com_player_t* com_player, int total_length, uint32_t* position_ms, uint32_t* duration_ms);
 
 
 #endif
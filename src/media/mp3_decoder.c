@@ -2,6 +2,7 @@
 #include "typedefs.h"
 #include "mad.h"
 #include "id3tag.h"
+#include "pcm_convert.h"
 #include <string.h>
 
 #define malloc(x)   pvPortMalloc(x)
@@ -11,13 +12,16 @@ log_create_module(mp3_decoder, PRINT_LEVEL_INFO);
 
 #define MP3_DECODER_MAX_WAIT_TIME       (30000/portTICK_RATE_MS)
 #define MP3_DECODER_INPUT_SIZE          (10*1024)
-#define MP3_DECODER_OUTPUT_SIZE     (10*1024)
+#define MP3_DECODER_OUTPUT_SIZE     (1152*2*sizeof(int16_t)) /* one MAD frame, 1152 samples x 2 channels */
 #define MP3_DECODER_TASK_STACK_SIZE (10*1024/sizeof(StackType_t))
 #define MP3_DECODER_MAX_ERR_COUNT   (20)
+#define MP3_DECODER_INDEX_STEP      (32)        /* frames per index entry, ~0.8 s at 44.1 kHz */
+#define MP3_DECODER_INDEX_INIT_SIZE (256)
 
 static void mp3_decoder_task(void* param);
 static uint32_t mp3_decoder_wait_event(mp3_decoder_t* mp3_decoder, uint32_t events, uint32_t timeout);
 static void mp3_decoder_set_event(mp3_decoder_t* mp3_decoder, uint32_t events, bool from_isr);
+static void mp3_decoder_clear_event(mp3_decoder_t* mp3_decoder, uint32_t events, bool from_isr);
 
 mp3_decoder_return_t mp3_decoder_init(mp3_decoder_t* mp3_decoder)
 {
@@ -30,8 +34,19 @@ mp3_decoder_return_t mp3_decoder_init(mp3_decoder_t* mp3_decoder)
     mp3_decoder->error_param     = NULL;
     mp3_decoder->output_callback = NULL;
     mp3_decoder->output_param    = NULL;
+    mp3_decoder->reserve_callback = NULL;
+    mp3_decoder->commit_callback  = NULL;
+    mp3_decoder->reserve_param    = NULL;
+    mp3_decoder->seek_callback    = NULL;
+    mp3_decoder->seek_param       = NULL;
+    mp3_decoder->input_map        = NULL;
+    mp3_decoder->input_map_size   = 0;
+    mp3_decoder->index            = NULL;
+    mp3_decoder->index_count      = 0;
+    mp3_decoder->index_size       = 0;
     mp3_decoder->input_done      = false;
     mp3_decoder->output_done     = false;
+    mp3_decoder->alloc_count     = 0;
 
     xTaskCreate(
         mp3_decoder_task, 
@@ -66,6 +81,11 @@ mp3_decoder_return_t mp3_decoder_deinit(mp3_decoder_t* mp3_decoder)
 #endif
     }
 
+    if(NULL != mp3_decoder->index) {
+        free(mp3_decoder->index);
+        mp3_decoder->index = NULL;
+    }
+
     return MP3_DECODER_SUCCESS;
 }
 
@@ -75,6 +95,8 @@ mp3_decoder_return_t mp3_decoder_start(mp3_decoder_t* mp3_decoder)
         mp3_decoder->input_done = false;
         mp3_decoder->output_done = false;
 
+        mp3_decoder_clear_event(mp3_decoder, MP3_DECODER_EVENT_PAUSE |MP3_DECODER_EVENT_RESUME, false);
+
         mp3_decoder_set_event(mp3_decoder, MP3_DECODER_EVENT_START, false);
     }
 
@@ -108,7 +130,11 @@ mp3_decoder_return_t mp3_decoder_pause(mp3_decoder_t* mp3_decoder, bool from_isr
 
 mp3_decoder_return_t mp3_decoder_resume(mp3_decoder_t* mp3_decoder, bool from_isr)
 {
-    if(MP3_DECODER_STA_PAUSE == mp3_decoder->cur_state) {
+    /* 
+     * also while running: the decoder may be just about to pause itself on a
+     * full output, the pending RESUME then wakes it instead of getting lost 
+     */
+    if(MP3_DECODER_STA_PAUSE == mp3_decoder->cur_state || MP3_DECODER_STA_RUN == mp3_decoder->cur_state) {
         mp3_decoder_set_event(mp3_decoder, MP3_DECODER_EVENT_RESUME, from_isr);
     }
 
@@ -123,6 +149,15 @@ mp3_decoder_return_t mp3_decoder_register_input_callback(mp3_decoder_t* mp3_deco
     return MP3_DECODER_SUCCESS;
 }
 
+/* callback(param, position) moves the input to a source offset, 0 on success */
+mp3_decoder_return_t mp3_decoder_register_seek_callback(mp3_decoder_t* mp3_decoder, p_decoder_seek_callback callback, void* param)
+{
+    mp3_decoder->seek_callback = callback;
+    mp3_decoder->seek_param    = param;
+    
+    return MP3_DECODER_SUCCESS;
+}
+
 mp3_decoder_return_t mp3_decoder_register_error_callback(mp3_decoder_t* mp3_decoder, p_decoder_error_callback callback, void* param)
 {
     mp3_decoder->error_callback = callback;
@@ -139,6 +174,24 @@ mp3_decoder_return_t mp3_decoder_register_output_callback(mp3_decoder_t* mp3_dec
     return MP3_DECODER_SUCCESS;
 }
 
+/* 
+ * Optional zero copy output: when reserve_callback hands out room for a whole
+ * frame the synth output is converted straight into it and committed, the
+ * slab + output_callback path is only used when it does not fit.
+ */
+mp3_decoder_return_t mp3_decoder_register_output_reserve_callback(
+    mp3_decoder_t* mp3_decoder, 
+    p_decoder_output_reserve_callback reserve_callback, 
+    p_decoder_output_commit_callback commit_callback, 
+    void* param)
+{
+    mp3_decoder->reserve_callback = reserve_callback;
+    mp3_decoder->commit_callback  = commit_callback;
+    mp3_decoder->reserve_param    = param;
+    
+    return MP3_DECODER_SUCCESS;
+}
+
 void mp3_decoder_set_input_done(mp3_decoder_t* mp3_decoder)
 {
     mp3_decoder->input_done = true;
@@ -154,6 +207,265 @@ bool mp3_decoder_is_pause(mp3_decoder_t* mp3_decoder)
     return (MP3_DECODER_STA_PAUSE==mp3_decoder->cur_state) ?true :false;
 }
 
+uint32_t mp3_decoder_get_alloc_count(mp3_decoder_t* mp3_decoder)
+{
+    return mp3_decoder->alloc_count;
+}
+
+typedef struct {
+    uint8_t  version;       /* 3: MPEG1, 2: MPEG2, 0: MPEG2.5 */
+    uint8_t  layer;
+    uint8_t  channels;
+    uint32_t sample_rate;
+    uint32_t bit_rate;
+    int      frame_size;
+
+} mp3_decoder_header_t;
+
+static bool mp3_decoder_parse_header(const uint8_t* p, mp3_decoder_header_t* header)
+{
+    static const uint16_t bit_rates[2][3][15] = {
+        {   /* MPEG1, layer I, II, III */
+            { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+            { 0, 32, 48, 56, 64,  80,  96,  112, 128, 160, 192, 224, 256, 320, 384 },
+            { 0, 32, 40, 48, 56,  64,  80,  96,  112, 128, 160, 192, 224, 256, 320 },
+        },
+        {   /* MPEG2/2.5 */
+            { 0, 32, 48, 56, 64,  80,  96,  112, 128, 144, 160, 176, 192, 224, 256 },
+            { 0, 8,  16, 24, 32,  40,  48,  56,  64,  80,  96,  112, 128, 144, 160 },
+            { 0, 8,  16, 24, 32,  40,  48,  56,  64,  80,  96,  112, 128, 144, 160 },
+        },
+    };
+    static const uint16_t sample_rates[3] = { 44100, 48000, 32000 };
+    int bit_rate_index, sample_rate_index, padding, lsf;
+
+    if(0xFF != p[0] || 0xE0 != (p[1] & 0xE0))
+        return false;
+
+    header->version = (p[1] >> 3) & 0x03;
+    header->layer = 4 - ((p[1] >> 1) & 0x03);
+    bit_rate_index = p[2] >> 4;
+    sample_rate_index = (p[2] >> 2) & 0x03;
+    padding = (p[2] >> 1) & 0x01;
+
+    /* free format is left to the decoder */
+    if(1 == header->version || 4 == header->layer || 0 == bit_rate_index || 15 == bit_rate_index || 3 == sample_rate_index)
+        return false;
+
+    lsf = (3 == header->version) ?0 :1;
+    header->sample_rate = sample_rates[sample_rate_index] >> ((3 == header->version) ?0 :(2 == header->version) ?1 :2);
+    header->bit_rate = bit_rates[lsf][header->layer - 1][bit_rate_index]*1000;
+    header->channels = (3 == (p[3] >> 6)) ?1 :2;
+
+    if(1 == header->layer)
+        header->frame_size = (12*header->bit_rate/header->sample_rate + padding)*4;
+    else if(3 == header->layer && 1 == lsf)
+        header->frame_size = 72*header->bit_rate/header->sample_rate + padding;
+    else
+        header->frame_size = 144*header->bit_rate/header->sample_rate + padding;
+
+    return true;
+}
+
+static uint32_t mp3_decoder_read_be(const uint8_t* p, int bytes)
+{
+    uint32_t value = 0;
+
+    while(bytes-- > 0)
+        value = (value << 8) | *p++;
+
+    return value;
+}
+
+/* the VBRI table holds the size of every frames_per_entry frames, resampled to percents here */
+static void mp3_decoder_vbri_to_toc(const uint8_t* table, int entries, int entry_size, int scale, int frames_per_entry, mp3_decoder_stream_info_t* info)
+{
+    uint64_t pos = 0, cur, frame;
+    uint32_t value;
+    int i, seg = 0;
+
+    for(i = 0; i < MP3_DECODER_TOC_SIZE; i++)
+    {
+        frame = (uint64_t)i*info->frames/MP3_DECODER_TOC_SIZE;
+
+        while(seg < entries && (uint64_t)(seg + 1)*frames_per_entry <= frame) {
+            pos += (uint64_t)mp3_decoder_read_be(&table[seg*entry_size], entry_size)*scale;
+            seg++;
+        }
+
+        cur = pos;
+        if(seg < entries)
+            cur += (uint64_t)mp3_decoder_read_be(&table[seg*entry_size], entry_size)*scale*(frame - (uint64_t)seg*frames_per_entry)/frames_per_entry;
+
+        value = (uint32_t)(cur*256/info->bytes);
+        info->toc[i] = (value > 255) ?255 :value;
+    }
+
+    info->has_toc = true;
+}
+
+/* a Xing/Info header sits after the side info of the first frame, a VBRI one 32 bytes after the header */
+static void mp3_decoder_parse_vbr_header(const uint8_t* p, int size, mp3_decoder_header_t* header, mp3_decoder_stream_info_t* info)
+{
+    int offset, flags, entries, entry_size, scale, frames_per_entry;
+
+    if(3 != header->layer)
+        return;
+
+    if(3 == header->version)
+        offset = 4 + ((1 == header->channels) ?17 :32);
+    else
+        offset = 4 + ((1 == header->channels) ?9 :17);
+
+    if(0 == (p[1] & 0x01))
+        offset += 2;
+
+    if(offset + 8 <= size && (0 == memcmp(&p[offset], "Xing", 4) || 0 == memcmp(&p[offset], "Info", 4)))
+    {
+        flags = mp3_decoder_read_be(&p[offset + 4], 4);
+        offset += 8;
+
+        if((flags & 0x01) && offset + 4 <= size) {
+            info->frames = mp3_decoder_read_be(&p[offset], 4);
+            offset += 4;
+        }
+
+        if((flags & 0x02) && offset + 4 <= size) {
+            info->bytes = mp3_decoder_read_be(&p[offset], 4);
+            offset += 4;
+        }
+
+        if((flags & 0x04) && offset + MP3_DECODER_TOC_SIZE <= size) {
+            memcpy(info->toc, &p[offset], MP3_DECODER_TOC_SIZE);
+            info->has_toc = true;
+        }
+
+        return;
+    }
+
+    offset = 4 + 32;
+
+    if(offset + 26 <= size && 0 == memcmp(&p[offset], "VBRI", 4))
+    {
+        info->bytes      = mp3_decoder_read_be(&p[offset + 10], 4);
+        info->frames     = mp3_decoder_read_be(&p[offset + 14], 4);
+        entries          = mp3_decoder_read_be(&p[offset + 18], 2);
+        scale            = mp3_decoder_read_be(&p[offset + 20], 2);
+        entry_size       = mp3_decoder_read_be(&p[offset + 22], 2);
+        frames_per_entry = mp3_decoder_read_be(&p[offset + 24], 2);
+
+        if( entries > 0 && entry_size >= 1 && entry_size <= 4 && frames_per_entry > 0 && 
+            info->frames > 0 && info->bytes > 0 && offset + 26 + entries*entry_size <= size )
+        {
+            mp3_decoder_vbri_to_toc(&p[offset + 26], entries, entry_size, scale, frames_per_entry, info);
+        }
+    }
+}
+
+/* 
+ * Format of the stream from its first frame header, without decoding. A sync
+ * word only counts when the next header, if it is in buf, agrees with it.
+ * *p_offset is where that frame starts. stream_info, if given, gets what a
+ * Xing/Info or VBRI header in that frame tells, data_start relative to buf.
+ */
+bool mp3_decoder_probe(const uint8_t* buf, int size, audio_decoder_info_t* decoder_info, mp3_decoder_stream_info_t* stream_info, int* p_offset)
+{
+    mp3_decoder_header_t header, next;
+    int offset;
+
+    for(offset = 0; offset + 4 <= size; offset++)
+    {
+        if(false == mp3_decoder_parse_header(&buf[offset], &header))
+            continue;
+
+        if(offset + header.frame_size + 4 <= size) {
+            if(false == mp3_decoder_parse_header(&buf[offset + header.frame_size], &next))
+                continue;
+
+            if(next.version != header.version || next.layer != header.layer || next.sample_rate != header.sample_rate)
+                continue;
+        }
+        else if(offset > 0) {
+            /* not at the start and nothing to confirm it with */
+            continue;
+        }
+
+        decoder_info->sample_rate = header.sample_rate;
+        decoder_info->bit_rate = header.bit_rate;
+        decoder_info->channels = header.channels;
+        *p_offset = offset;
+
+        if(NULL != stream_info) {
+            memset(stream_info, 0, sizeof(mp3_decoder_stream_info_t));
+            stream_info->data_start = offset;
+            stream_info->samples_per_frame = (1 == header.layer) ?384 :(3 == header.layer && 3 != header.version) ?576 :1152;
+            mp3_decoder_parse_vbr_header(&buf[offset], size - offset, &header, stream_info);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+/* 
+ * Before mp3_decoder_start: what the probe found, input_pos is the source
+ * offset of the first byte the input callback returns. The frame index of
+ * the previous track is dropped, its memory kept.
+ */
+void mp3_decoder_set_stream_info(mp3_decoder_t* mp3_decoder, const mp3_decoder_stream_info_t* stream_info, uint32_t input_pos)
+{
+    if(NULL != stream_info)
+        memcpy(&mp3_decoder->stream_info, stream_info, sizeof(mp3_decoder_stream_info_t));
+    else
+        memset(&mp3_decoder->stream_info, 0, sizeof(mp3_decoder_stream_info_t));
+
+    mp3_decoder->input_pos         = input_pos;
+    mp3_decoder->frame_count       = 0;
+    mp3_decoder->frame_exact       = true;
+    mp3_decoder->sample_rate       = 0;
+    mp3_decoder->samples_per_frame = mp3_decoder->stream_info.samples_per_frame;
+    mp3_decoder->bit_rate          = 0;
+    mp3_decoder->skip_frames       = 0;
+    mp3_decoder->index_count       = 0;
+}
+
+/* 
+ * Before mp3_decoder_start, NULL to go back to the input callback: the
+ * source is data[0, size), the stream is decoded in place from input_pos
+ * and a seek only moves input_pos. data must stay valid until the stop.
+ */
+void mp3_decoder_set_input_map(mp3_decoder_t* mp3_decoder, const uint8_t* data, uint32_t size)
+{
+    mp3_decoder->input_map      = data;
+    mp3_decoder->input_map_size = (NULL != data) ?size :0;
+}
+
+/* 
+ * Moves decoding to ms, total_length is the source size for streams without
+ * a Xing/VBRI size. The decoder is left paused with nothing buffered, resume
+ * it to go on from there.
+ */
+mp3_decoder_return_t mp3_decoder_seek(mp3_decoder_t* mp3_decoder, uint32_t ms, uint32_t total_length)
+{
+    if(MP3_DECODER_STA_IDLE == mp3_decoder->cur_state || NULL == mp3_decoder->seek_callback)
+        return MP3_DECODER_ERR_SEEK;
+
+    mp3_decoder->seek_ms           = ms;
+    mp3_decoder->seek_total_length = total_length;
+    mp3_decoder->seek_result       = MP3_DECODER_ERR_SEEK;
+
+    mp3_decoder_set_event(mp3_decoder, MP3_DECODER_EVENT_SEEK, false);
+
+    if(MP3_DECODER_EVENT_NONE == mp3_decoder_wait_event(mp3_decoder, 
+        MP3_DECODER_EVENT_SEEK_DONE, MP3_DECODER_MAX_WAIT_TIME))
+    {
+        LOG_E(mp3_decoder, "mp3_decoder_wait_event timeout!");
+    }
+
+    return mp3_decoder->seek_result;
+}
+
 static uint32_t mp3_decoder_wait_event(mp3_decoder_t* mp3_decoder, uint32_t events, uint32_t timeout)
 {
     if(NULL==mp3_decoder->event_handle)
@@ -184,21 +496,6 @@ static void mp3_decoder_clear_event(mp3_decoder_t* mp3_decoder, uint32_t events,
         xEventGroupClearBits(mp3_decoder->event_handle, events);
 }
 
-static signed int scale(mad_fixed_t sample)
-{
-    /* round */
-    sample += (1L << (MAD_F_FRACBITS - 16));
-
-    /* clip */
-    if (sample >= MAD_F_ONE)
-        sample = MAD_F_ONE - 1;
-    else if (sample < -MAD_F_ONE)
-        sample = -MAD_F_ONE;
-
-    /* quantize */
-    return sample >> (MAD_F_FRACBITS + 1 - 16);
-}
-
 typedef struct {
     struct mad_stream stream;
     struct mad_frame frame;
@@ -207,7 +504,8 @@ typedef struct {
 
     uint8_t input_buffer[MP3_DECODER_INPUT_SIZE];
 
-    uint8_t* output_buffer;
+    uint8_t output_buffer[MP3_DECODER_OUTPUT_SIZE];
+    int output_offset;
     int output_size;
     int output_total;
 
@@ -226,16 +524,11 @@ static void mp3_decoder_dealloc_memory(mp3_decoder_memory_t** pp_mem)
     mad_frame_finish(&tmp->frame);
     mad_stream_finish(&tmp->stream);
 
-    if(NULL != tmp->output_buffer) {
-        free(tmp->output_buffer);
-        tmp->output_buffer = NULL;
-    }
-
     free(tmp);
     *pp_mem = NULL;
 }
 
-static void mp3_decoder_alloc_memory(mp3_decoder_memory_t** pp_mem)
+static void mp3_decoder_alloc_memory(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t** pp_mem)
 {
     if(NULL == pp_mem)
         return;
@@ -248,6 +541,8 @@ static void mp3_decoder_alloc_memory(mp3_decoder_memory_t** pp_mem)
         return;
     }
 
+    mp3_decoder->alloc_count++;
+
     memset(tmp, 0, sizeof(mp3_decoder_memory_t));
 
     mad_stream_init(&tmp->stream);
@@ -257,28 +552,61 @@ static void mp3_decoder_alloc_memory(mp3_decoder_memory_t** pp_mem)
     *pp_mem = tmp;
 }
 
+/* 
+ * Next track on the same memory: the decoder state starts over, the layer III
+ * buffers libmad allocated on the first track are kept and only cleared.
+ */
+static void mp3_decoder_reset_memory(mp3_decoder_memory_t* mem)
+{
+    unsigned char (*main_data)[MAD_BUFFER_MDLEN] = mem->stream.main_data;
+    mad_fixed_t (*overlap)[2][32][18] = mem->frame.overlap;
+
+    mad_stream_init(&mem->stream);
+    mad_frame_init(&mem->frame);
+    mad_synth_init(&mem->synth);
+    
+    mem->stream.main_data = main_data;
+    mem->frame.overlap = overlap;
+    mad_frame_mute(&mem->frame);
+
+    memset(&mem->decoder_info, 0, sizeof(audio_decoder_info_t));
+    mem->output_offset = 0;
+    mem->output_size = 0;
+    mem->output_total = 0;
+    mem->decoder_error = 0;
+}
+
 static bool mp3_decoder_output_handler(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t* mem)
 {
-    if(NULL == mem->output_buffer)
+    if(mem->output_size <= 0)
         return true;
 
-    int size = mp3_decoder->output_callback(mp3_decoder->output_param, &mem->decoder_info, mem->output_buffer, mem->output_size);
+    int size = mp3_decoder->output_callback(mp3_decoder->output_param, &mem->decoder_info, &mem->output_buffer[mem->output_offset], mem->output_size);
     mem->output_total += size;
 
     if(size < mem->output_size)
     {
+        /* keep the rest in the slab, it is sent from output_offset next time */
+        mem->output_offset += size;
         mem->output_size -= size;
-        memmove(mem->output_buffer, &mem->output_buffer[size], mem->output_size);
         return false;
     }
 
-    free(mem->output_buffer);
-    mem->output_buffer = NULL;
+    mem->output_offset = 0;
     mem->output_size = 0;
 
     return true;
 }
 
+/* a zero length output tells the consumer that nothing more comes for now */
+static void mp3_decoder_output_flush(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t* mem)
+{
+    p_decoder_output_callback callback = mp3_decoder->output_callback;
+
+    if(NULL != callback)
+        callback(mp3_decoder->output_param, &mem->decoder_info, NULL, 0);
+}
+
 static void mp3_decoder_error_handler(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t* mem)
 {
     if(NULL == mem || NULL == mp3_decoder->error_callback)
@@ -292,6 +620,125 @@ static void mp3_decoder_error_handler(mp3_decoder_t* mp3_decoder, mp3_decoder_me
     }
 }
 
+static void mp3_decoder_index_add(mp3_decoder_t* mp3_decoder, uint32_t position)
+{
+    uint32_t* index;
+    uint32_t size;
+
+    if(mp3_decoder->index_count >= mp3_decoder->index_size)
+    {
+        size = (mp3_decoder->index_size > 0) ?mp3_decoder->index_size*2 :MP3_DECODER_INDEX_INIT_SIZE;
+
+        /* out of memory only stops the index from growing */
+        index = (uint32_t*)malloc(size*sizeof(uint32_t));
+        if(NULL == index)
+            return;
+
+        if(NULL != mp3_decoder->index) {
+            memcpy(index, mp3_decoder->index, mp3_decoder->index_count*sizeof(uint32_t));
+            free(mp3_decoder->index);
+        }
+
+        mp3_decoder->index = index;
+        mp3_decoder->index_size = size;
+    }
+
+    mp3_decoder->index[mp3_decoder->index_count++] = position;
+}
+
+/* 
+ * Called for every frame this_frame points at, decoded or not. Extends the
+ * index while frame_count is known to be exact. false: the frame is one of
+ * those a seek decodes only to land on its target.
+ */
+static bool mp3_decoder_count_frame(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t* mem)
+{
+    if(true == mp3_decoder->frame_exact && mp3_decoder->frame_count == mp3_decoder->index_count*MP3_DECODER_INDEX_STEP)
+        mp3_decoder_index_add(mp3_decoder, mp3_decoder->input_pos - (uint32_t)(mem->stream.bufend - mem->stream.this_frame));
+
+    mp3_decoder->frame_count++;
+
+    if(mp3_decoder->skip_frames > 0) {
+        mp3_decoder->skip_frames--;
+        return false;
+    }
+
+    return true;
+}
+
+/* 
+ * Source offset of seek_ms: from the index when decoding already got there,
+ * else from the Xing/VBRI table, else from the bit rate. Only the index is
+ * exact, the estimates leave frame_count estimated until the next track.
+ */
+static mp3_decoder_return_t mp3_decoder_seek_handler(mp3_decoder_t* mp3_decoder, mp3_decoder_memory_t* mem)
+{
+    mp3_decoder_stream_info_t* info = &mp3_decoder->stream_info;
+    audio_decoder_info_t decoder_info;
+    uint32_t target, frame, position, bytes, x;
+    int a, b;
+    bool exact = false;
+
+    if(NULL == mem || MP3_DECODER_STA_IDLE == mp3_decoder->cur_state || NULL == mp3_decoder->seek_callback)
+        return MP3_DECODER_ERR_SEEK;
+
+    if(0 == mp3_decoder->sample_rate || 0 == mp3_decoder->samples_per_frame)
+        return MP3_DECODER_ERR_SEEK;
+
+    target = (uint32_t)((uint64_t)mp3_decoder->seek_ms*mp3_decoder->sample_rate/1000/mp3_decoder->samples_per_frame);
+    if(info->frames > 0 && target >= info->frames)
+        target = info->frames - 1;
+
+    bytes = info->bytes;
+    if(0 == bytes && mp3_decoder->seek_total_length > info->data_start)
+        bytes = mp3_decoder->seek_total_length - info->data_start;
+
+    if(target/MP3_DECODER_INDEX_STEP < mp3_decoder->index_count)
+    {
+        frame    = target/MP3_DECODER_INDEX_STEP*MP3_DECODER_INDEX_STEP;
+        position = mp3_decoder->index[target/MP3_DECODER_INDEX_STEP];
+        exact    = true;
+    }
+    else if(true == info->has_toc && info->frames > 0 && bytes > 0)
+    {
+        /* percent of the duration in 1/256 steps, linear between the toc points */
+        x = (uint32_t)((uint64_t)target*MP3_DECODER_TOC_SIZE*256/info->frames);
+        a = info->toc[x >> 8];
+        b = ((x >> 8) + 1 < MP3_DECODER_TOC_SIZE) ?info->toc[(x >> 8) + 1] :256;
+        
+        frame    = target;
+        position = info->data_start + (uint32_t)((uint64_t)bytes*(a*256 + (b - a)*(int)(x & 0xFF))/65536);
+    }
+    else if(mp3_decoder->bit_rate > 0)
+    {
+        frame    = target;
+        position = info->data_start + (uint32_t)((uint64_t)target*mp3_decoder->samples_per_frame*(mp3_decoder->bit_rate/8)/mp3_decoder->sample_rate);
+    }
+    else
+    {
+        return MP3_DECODER_ERR_SEEK;
+    }
+
+    if(0 != mp3_decoder->seek_callback(mp3_decoder->seek_param, position))
+        return MP3_DECODER_ERR_SEEK;
+
+    /* resync from there: nothing buffered, the bit reservoir starts over */
+    memcpy(&decoder_info, &mem->decoder_info, sizeof(audio_decoder_info_t));
+    mp3_decoder_reset_memory(mem);
+    memcpy(&mem->decoder_info, &decoder_info, sizeof(audio_decoder_info_t));
+
+    mp3_decoder->input_pos   = position;
+    mp3_decoder->frame_count = frame;
+    mp3_decoder->frame_exact = exact;
+    mp3_decoder->skip_frames = target - frame;
+    mp3_decoder->input_done  = false;
+    mp3_decoder->output_done = false;
+
+    LOG_I(mp3_decoder, "seek %d ms: frame %d at %d (%s)", mp3_decoder->seek_ms, target, position, (true == exact) ?"index" :"estimate");
+
+    return MP3_DECODER_SUCCESS;
+}
+
 static void mp3_decoder_task(void* param)
 {
     mp3_decoder_t* mp3_decoder = (mp3_decoder_t*)param;
@@ -308,7 +755,8 @@ static void mp3_decoder_task(void* param)
             MP3_DECODER_EVENT_STOP |
             MP3_DECODER_EVENT_START |
             MP3_DECODER_EVENT_RESUME |
-            MP3_DECODER_EVENT_PAUSE;
+            MP3_DECODER_EVENT_PAUSE |
+            MP3_DECODER_EVENT_SEEK;
 
         mp3_decoder_error_handler(mp3_decoder, mem);
 
@@ -324,26 +772,42 @@ static void mp3_decoder_task(void* param)
             break;
         }
         else if(MP3_DECODER_EVENT_STOP & events) {
+            /* the memory stays for the next start */
             mp3_decoder->cur_state = MP3_DECODER_STA_IDLE;
-            mp3_decoder_dealloc_memory(&mem);
         
             mp3_decoder_set_event(mp3_decoder, MP3_DECODER_EVENT_STOP_DONE, false);
-            LOG_I(mp3_decoder, "MP3_DECODER_EVENT_STOP");
+            LOG_I(mp3_decoder, "MP3_DECODER_EVENT_STOP, alloc count %d", mp3_decoder->alloc_count);
         }
         else if(MP3_DECODER_EVENT_START & events) {
-            mp3_decoder_alloc_memory(&mem);
+            if(NULL == mem)
+                mp3_decoder_alloc_memory(mp3_decoder, &mem);
+            else
+                mp3_decoder_reset_memory(mem);
 
             mp3_decoder->cur_state = MP3_DECODER_STA_RUN;
             LOG_I(mp3_decoder, "MP3_DECODER_EVENT_START");
         }
-        else if(MP3_DECODER_EVENT_RESUME & events) {
-            mp3_decoder->cur_state = MP3_DECODER_STA_RUN;
-            //LOG_I(mp3_decoder, "MP3_DECODER_EVENT_RESUME");
+        else if(MP3_DECODER_EVENT_SEEK & events) {
+            mp3_decoder->seek_result = mp3_decoder_seek_handler(mp3_decoder, mem);
+
+            /* the caller resumes once its own buffers are flushed */
+            if(MP3_DECODER_SUCCESS == mp3_decoder->seek_result)
+                mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
+
+            mp3_decoder_set_event(mp3_decoder, MP3_DECODER_EVENT_SEEK_DONE, false);
+        }
+        else if(MP3_DECODER_STA_IDLE == mp3_decoder->cur_state) {
+            /* a pause/resume that raced the last stop */
+            continue;
         }
         else if(MP3_DECODER_EVENT_PAUSE & events) {
             mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
             //LOG_I(mp3_decoder, "MP3_DECODER_EVENT_PAUSE");
         }
+        else if(MP3_DECODER_EVENT_RESUME & events) {
+            mp3_decoder->cur_state = MP3_DECODER_STA_RUN;
+            //LOG_I(mp3_decoder, "MP3_DECODER_EVENT_RESUME");
+        }
 
         if(MP3_DECODER_STA_RUN != mp3_decoder->cur_state || NULL == mem)
             continue;
@@ -362,24 +826,42 @@ static void mp3_decoder_task(void* param)
             if(true == mp3_decoder->input_done) {
                 mp3_decoder->output_done = true;
                 mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
+                mp3_decoder_output_flush(mp3_decoder, mem);
                 LOG_I(mp3_decoder, "mp3_decoder input done");
                 continue;
             }
 
-            if(NULL != mem->stream.next_frame)
+            if(NULL != mp3_decoder->input_map)
             {
-                remain_size = mem->stream.bufend - mem->stream.next_frame;
-                input_size  = MP3_DECODER_INPUT_SIZE - remain_size;
-                memmove(mem->input_buffer, mem->stream.next_frame, remain_size);
+                /* mapped: the rest of the source at once, decoded in place */
+                input_size = (mp3_decoder->input_pos < mp3_decoder->input_map_size) ?(int)(mp3_decoder->input_map_size - mp3_decoder->input_pos) :0;
+
+                if(input_size > 0) {
+                    mad_stream_buffer(&mem->stream, mp3_decoder->input_map + mp3_decoder->input_pos, input_size);
+                    mp3_decoder->input_pos  = mp3_decoder->input_map_size;
+                    mp3_decoder->input_done = true;
+                }
             }
+            else
+            {
+                if(NULL != mem->stream.next_frame)
+                {
+                    remain_size = mem->stream.bufend - mem->stream.next_frame;
+                    input_size  = MP3_DECODER_INPUT_SIZE - remain_size;
+                    memmove(mem->input_buffer, mem->stream.next_frame, remain_size);
+                }
 
-            input_size = mp3_decoder->input_callback(mp3_decoder->input_param, &mem->input_buffer[remain_size], input_size);
-            
-            if(input_size > 0) {
-                mad_stream_buffer(&mem->stream, mem->input_buffer, input_size + remain_size);
+                input_size = mp3_decoder->input_callback(mp3_decoder->input_param, &mem->input_buffer[remain_size], input_size);
+                
+                if(input_size > 0) {
+                    mp3_decoder->input_pos += input_size;
+                    mad_stream_buffer(&mem->stream, mem->input_buffer, input_size + remain_size);
+                }
             }
-            else {
+
+            if(input_size <= 0) {
                 mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
+                mp3_decoder_output_flush(mp3_decoder, mem);
                 LOG_I(mp3_decoder, "mp3_decoder pause because no input");
                 continue;
             }
@@ -403,6 +885,9 @@ static void mp3_decoder_task(void* param)
                     mad_stream_skip(&mem->stream, tagsize);
             }
             else if(MAD_RECOVERABLE(mem->stream.error)) {
+                /* a frame that failed to decode still takes its place in the stream */
+                if(mem->stream.error >= MAD_ERROR_BADCRC)
+                    mp3_decoder_count_frame(mp3_decoder, mem);
             }
             else {
                 mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
@@ -417,28 +902,47 @@ static void mp3_decoder_task(void* param)
             mem->decoder_error = 0;
         }
 
+        mp3_decoder->sample_rate       = mem->frame.header.samplerate;
+        mp3_decoder->samples_per_frame = 32*MAD_NSBSAMPLES(&mem->frame.header);
+        mp3_decoder->bit_rate          = mem->frame.header.bitrate;
+
         /* ---------------- [step 4] output pcm ---------------- */
         mad_synth_frame(&mem->synth, &mem->frame);
+
+        if(false == mp3_decoder_count_frame(mp3_decoder, mem))
+            continue;
         mem->decoder_info.sample_rate = mem->frame.header.samplerate;
         mem->decoder_info.bit_rate    = mem->frame.header.bitrate;
         mem->decoder_info.channels    = mem->synth.pcm.channels;
 
+        mem->output_offset = 0;
         mem->output_size = mem->synth.pcm.length*mem->synth.pcm.channels*sizeof(uint16_t);
-        mem->output_buffer = (uint8_t*)malloc(mem->output_size);
 
-        if(NULL != mem->output_buffer)
+        if(NULL != mp3_decoder->reserve_callback && NULL != mp3_decoder->commit_callback)
         {
-            int i, j, tmp, count = 0;
-            for(i = 0; i < mem->synth.pcm.length; i++)
+            uint8_t* output = NULL;
+            
+            if(mp3_decoder->reserve_callback(mp3_decoder->reserve_param, &mem->decoder_info, &output, mem->output_size) >= mem->output_size)
             {
-                for(j = 0; j < mem->synth.pcm.channels; j++) {
-                    tmp = scale(mem->synth.pcm.samples[j][i]);
-                    mem->output_buffer[count++] = tmp;
-                    mem->output_buffer[count++] = tmp >> 8;
-                }
+                pcm_convert_fixed_to_s16(
+                    (int16_t*)output, 
+                    mem->synth.pcm.samples[0], 
+                    (2 == mem->synth.pcm.channels) ?mem->synth.pcm.samples[1] :NULL, 
+                    mem->synth.pcm.length);
+
+                mp3_decoder->commit_callback(mp3_decoder->reserve_param, &mem->decoder_info, mem->output_size);
+                mem->output_total += mem->output_size;
+                mem->output_size = 0;
+                continue;
             }
         }
 
+        pcm_convert_fixed_to_s16(
+            (int16_t*)mem->output_buffer, 
+            mem->synth.pcm.samples[0], 
+            (2 == mem->synth.pcm.channels) ?mem->synth.pcm.samples[1] :NULL, 
+            mem->synth.pcm.length);
+
         if(false == mp3_decoder_output_handler(mp3_decoder, mem)) {
             mp3_decoder->cur_state = MP3_DECODER_STA_PAUSE;
         }
@@ -7,6 +7,7 @@
 typedef enum {
     MP3_DECODER_SUCCESS = 0,
     MP3_DECODER_ERR_MALLOC,
+    MP3_DECODER_ERR_SEEK,
 
 } mp3_decoder_return_t;
 
@@ -20,6 +21,8 @@ typedef enum {
     MP3_DECODER_EVENT_EXIT_DONE  = 0x000010UL,
     MP3_DECODER_EVENT_STOP       = 0x000020UL,
     MP3_DECODER_EVENT_STOP_DONE  = 0x000040UL,
+    MP3_DECODER_EVENT_SEEK       = 0x000080UL,
+    MP3_DECODER_EVENT_SEEK_DONE  = 0x000100UL,
 
 } mp3_decoder_event_t;
 
@@ -39,10 +42,25 @@ typedef struct {
 
 } audio_decoder_info_t;
 
+#define MP3_DECODER_TOC_SIZE        100
+
+/* what the first frame tells about the whole stream, see mp3_decoder_probe */
+typedef struct {
+    uint32_t data_start;                    /* source offset of the first frame */
+    uint32_t samples_per_frame;
+    uint32_t frames;                        /* from a Xing/Info or VBRI header, 0 when there is none */
+    uint32_t bytes;                         /* audio bytes from data_start, 0 when unknown */
+    bool     has_toc;
+    uint8_t  toc[MP3_DECODER_TOC_SIZE];     /* offset at each percent of the duration, in 1/256 of bytes */
+
+} mp3_decoder_stream_info_t;
+
 typedef int(*p_decoder_input_callback)(void* param, uint8_t* buf, int size);
 typedef int(*p_decoder_error_callback)(void* param, int error);
 typedef int(*p_decoder_seek_callback)(void* param, int position);
 typedef int(*p_decoder_output_callback)(void* param, audio_decoder_info_t* decoder_info, uint8_t* buf, int size);
+typedef int(*p_decoder_output_reserve_callback)(void* param, audio_decoder_info_t* decoder_info, uint8_t** p_buf, int size);
+typedef int(*p_decoder_output_commit_callback)(void* param, audio_decoder_info_t* decoder_info, int size);
 
 typedef struct {
     TaskHandle_t        task_handle;
@@ -51,6 +69,7 @@ typedef struct {
     mp3_decoder_state_t cur_state;
     bool                input_done;
     bool                output_done;
+    uint32_t            alloc_count;    /* heap allocations made by the decode path */
     
     p_decoder_input_callback    input_callback;
     void*                       input_param;
@@ -58,6 +77,29 @@ typedef struct {
     void*                       error_param;
     p_decoder_output_callback   output_callback;
     void*                       output_param;
+    p_decoder_output_reserve_callback   reserve_callback;
+    p_decoder_output_commit_callback    commit_callback;
+    void*                               reserve_param;
+    p_decoder_seek_callback     seek_callback;
+    void*                       seek_param;
+    const uint8_t*              input_map;      /* whole source in memory, replaces input_callback */
+    uint32_t                    input_map_size;
+
+    /* seek state, owned by the decoder thread while it runs */
+    mp3_decoder_stream_info_t   stream_info;
+    uint32_t            input_pos;          /* source offset of the next input byte */
+    uint32_t            frame_count;        /* frames since data_start */
+    bool                frame_exact;        /* false after a seek that had to estimate frame_count */
+    uint32_t            sample_rate;
+    uint32_t            samples_per_frame;
+    uint32_t            bit_rate;
+    uint32_t            skip_frames;        /* decoded but not output, to land on the exact frame */
+    uint32_t*           index;              /* source offset of every MP3_DECODER_INDEX_STEP th frame */
+    uint32_t            index_count;
+    uint32_t            index_size;
+    uint32_t            seek_ms;
+    uint32_t            seek_total_length;
+    mp3_decoder_return_t seek_result;
 
 } mp3_decoder_t;
 
@@ -68,11 +110,22 @@ mp3_decoder_return_t mp3_decoder_stop(mp3_decoder_t* mp3_decoder);
 mp3_decoder_return_t mp3_decoder_pause(mp3_decoder_t* mp3_decoder, bool from_isr);
 mp3_decoder_return_t mp3_decoder_resume(mp3_decoder_t* mp3_decoder, bool from_isr);
 mp3_decoder_return_t mp3_decoder_register_input_callback(mp3_decoder_t* mp3_decoder, p_decoder_input_callback callback, void* param);
+mp3_decoder_return_t mp3_decoder_register_seek_callback(mp3_decoder_t* mp3_decoder, p_decoder_seek_callback callback, void* param);
 mp3_decoder_return_t mp3_decoder_register_error_callback(mp3_decoder_t* mp3_decoder, p_decoder_error_callback callback, void* param);
 mp3_decoder_return_t mp3_decoder_register_output_callback(mp3_decoder_t* mp3_decoder, p_decoder_output_callback callback, void* param);
+mp3_decoder_return_t mp3_decoder_register_output_reserve_callback(
+    mp3_decoder_t* mp3_decoder, 
+    p_decoder_output_reserve_callback reserve_callback, 
+    p_decoder_output_commit_callback commit_callback, 
+    void* param);
 
 void mp3_decoder_set_input_done(mp3_decoder_t* mp3_decoder);
 bool mp3_decoder_is_output_done(mp3_decoder_t* mp3_decoder);
 bool mp3_decoder_is_pause(mp3_decoder_t* mp3_decoder);
+uint32_t mp3_decoder_get_alloc_count(mp3_decoder_t* mp3_decoder);
+bool mp3_decoder_probe(const uint8_t* buf, int size, audio_decoder_info_t* decoder_info, mp3_decoder_stream_info_t* stream_info, int* p_offset);
+void mp3_decoder_set_stream_info(mp3_decoder_t* mp3_decoder, const mp3_decoder_stream_info_t* stream_info, uint32_t input_pos);
+void mp3_decoder_set_input_map(mp3_decoder_t* mp3_decoder, const uint8_t* data, uint32_t size);
+mp3_decoder_return_t mp3_decoder_seek(mp3_decoder_t* mp3_decoder, uint32_t ms, uint32_t total_length);
 
 #endif
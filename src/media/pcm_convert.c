@@ -0,0 +1,309 @@
+#include "pcm_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCM_CONVERT_X86
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PCM_CONVERT_NEON
+#endif
+
+log_create_module(pcm_convert, PRINT_LEVEL_INFO);
+
+#define PCM_CONVERT_ROUND   (1L << (MAD_F_FRACBITS - 16))
+#define PCM_CONVERT_SHIFT   (MAD_F_FRACBITS + 1 - 16)
+
+/*
+ * The vector kernels shift first and let the signed saturating pack do the
+ * clipping. For every input this gives the same result as scale(): anything
+ * at or above MAD_F_ONE ends up >= 32768 after the shift and saturates to
+ * 32767, anything below -MAD_F_ONE saturates to -32768.
+ */
+
+static int16_t scale(mad_fixed_t sample)
+{
+    /* round */
+    sample += PCM_CONVERT_ROUND;
+
+    /* clip */
+    if (sample >= MAD_F_ONE)
+        sample = MAD_F_ONE - 1;
+    else if (sample < -MAD_F_ONE)
+        sample = -MAD_F_ONE;
+
+    /* quantize */
+    return sample >> PCM_CONVERT_SHIFT;
+}
+
+static void pcm_convert_tail(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int beg, int length)
+{
+    int i;
+
+    if(NULL == right) {
+        for(i = beg; i < length; i++)
+            out[i] = scale(left[i]);
+    }
+    else {
+        for(i = beg; i < length; i++) {
+            out[2*i]   = scale(left[i]);
+            out[2*i+1] = scale(right[i]);
+        }
+    }
+}
+
+void pcm_convert_fixed_to_s16_scalar(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    pcm_convert_tail(out, left, right, 0, length);
+}
+
+static void pcm_mix_tail(int16_t* dst, const int16_t* src, int beg, int samples, int gain)
+{
+    int32_t sum;
+    int i;
+
+    for(i = beg; i < samples; i++) {
+        if(gain >= PCM_CONVERT_GAIN_UNITY)
+            sum = dst[i] + src[i];
+        else
+            sum = dst[i] + ((src[i]*gain + (1 << 14)) >> 15);
+
+        dst[i] = (sum > INT16_MAX) ?INT16_MAX :(sum < INT16_MIN) ?INT16_MIN :sum;
+    }
+}
+
+void pcm_convert_mix_s16_scalar(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    pcm_mix_tail(dst, src, 0, samples, gain);
+}
+
+#ifdef PCM_CONVERT_X86
+__attribute__((target("sse2")))
+static void pcm_convert_sse2(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    const __m128i round = _mm_set1_epi32(PCM_CONVERT_ROUND);
+    __m128i l, r;
+    int i = 0;
+
+    for(; i + 8 <= length; i += 8)
+    {
+        l = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)&left[i]), round), PCM_CONVERT_SHIFT),
+            _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)&left[i+4]), round), PCM_CONVERT_SHIFT));
+
+        if(NULL == right) {
+            _mm_storeu_si128((__m128i*)&out[i], l);
+            continue;
+        }
+
+        r = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)&right[i]), round), PCM_CONVERT_SHIFT),
+            _mm_srai_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)&right[i+4]), round), PCM_CONVERT_SHIFT));
+
+        _mm_storeu_si128((__m128i*)&out[2*i],   _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128((__m128i*)&out[2*i+8], _mm_unpackhi_epi16(l, r));
+    }
+
+    pcm_convert_tail(out, left, right, i, length);
+}
+
+__attribute__((target("sse2")))
+static void pcm_mix_sse2(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    const __m128i g = _mm_set1_epi16((gain >= PCM_CONVERT_GAIN_UNITY) ?0 :gain);
+    const __m128i round = _mm_set1_epi32(1 << 14);
+    __m128i s, lo, hi;
+    int i = 0;
+
+    for(; i + 8 <= samples; i += 8)
+    {
+        s = _mm_loadu_si128((const __m128i*)&src[i]);
+
+        if(gain < PCM_CONVERT_GAIN_UNITY) {
+            /* 16x16 -> 32 bit products, round and back to 16 bit */
+            lo = _mm_mullo_epi16(s, g);
+            hi = _mm_mulhi_epi16(s, g);
+            s = _mm_packs_epi32(
+                _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 15),
+                _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 15));
+        }
+
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_adds_epi16(_mm_loadu_si128((const __m128i*)&dst[i]), s));
+    }
+
+    pcm_mix_tail(dst, src, i, samples, gain);
+}
+
+__attribute__((target("avx2")))
+static void pcm_mix_avx2(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    const __m256i g = _mm256_set1_epi16((gain >= PCM_CONVERT_GAIN_UNITY) ?0 :gain);
+    const __m256i round = _mm256_set1_epi32(1 << 14);
+    __m256i s, lo, hi;
+    int i = 0;
+
+    for(; i + 16 <= samples; i += 16)
+    {
+        s = _mm256_loadu_si256((const __m256i*)&src[i]);
+
+        /* unpack and pack both stay within their 128-bit lane, so the order is kept */
+        if(gain < PCM_CONVERT_GAIN_UNITY) {
+            lo = _mm256_mullo_epi16(s, g);
+            hi = _mm256_mulhi_epi16(s, g);
+            s = _mm256_packs_epi32(
+                _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), round), 15),
+                _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), round), 15));
+        }
+
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_adds_epi16(_mm256_loadu_si256((const __m256i*)&dst[i]), s));
+    }
+
+    pcm_mix_tail(dst, src, i, samples, gain);
+}
+
+__attribute__((target("avx2")))
+static void pcm_convert_avx2(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    const __m256i round = _mm256_set1_epi32(PCM_CONVERT_ROUND);
+    __m256i l, r;
+    int i = 0;
+
+    for(; i + 16 <= length; i += 16)
+    {
+        /* packs works per 128-bit lane: l = frames 0-3,8-11 | 4-7,12-15 */
+        l = _mm256_packs_epi32(
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&left[i]), round), PCM_CONVERT_SHIFT),
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&left[i+8]), round), PCM_CONVERT_SHIFT));
+
+        if(NULL == right) {
+            _mm256_storeu_si256((__m256i*)&out[i], _mm256_permute4x64_epi64(l, 0xD8));
+            continue;
+        }
+
+        r = _mm256_packs_epi32(
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&right[i]), round), PCM_CONVERT_SHIFT),
+            _mm256_srai_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&right[i+8]), round), PCM_CONVERT_SHIFT));
+
+        /* the in-lane unpack puts the frames back in order */
+        _mm256_storeu_si256((__m256i*)&out[2*i],    _mm256_unpacklo_epi16(l, r));
+        _mm256_storeu_si256((__m256i*)&out[2*i+16], _mm256_unpackhi_epi16(l, r));
+    }
+
+    pcm_convert_tail(out, left, right, i, length);
+}
+#endif
+
+#ifdef PCM_CONVERT_NEON
+static void pcm_convert_neon(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    const int32x4_t round = vdupq_n_s32(PCM_CONVERT_ROUND);
+    int16x8x2_t v;
+    int i = 0;
+
+    for(; i + 8 <= length; i += 8)
+    {
+        v.val[0] = vcombine_s16(
+            vqshrn_n_s32(vaddq_s32(vld1q_s32((const int32_t*)&left[i]), round), PCM_CONVERT_SHIFT),
+            vqshrn_n_s32(vaddq_s32(vld1q_s32((const int32_t*)&left[i+4]), round), PCM_CONVERT_SHIFT));
+
+        if(NULL == right) {
+            vst1q_s16(&out[i], v.val[0]);
+            continue;
+        }
+
+        v.val[1] = vcombine_s16(
+            vqshrn_n_s32(vaddq_s32(vld1q_s32((const int32_t*)&right[i]), round), PCM_CONVERT_SHIFT),
+            vqshrn_n_s32(vaddq_s32(vld1q_s32((const int32_t*)&right[i+4]), round), PCM_CONVERT_SHIFT));
+
+        vst2q_s16(&out[2*i], v);
+    }
+
+    pcm_convert_tail(out, left, right, i, length);
+}
+
+static void pcm_mix_neon(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    int16x8_t s;
+    int i = 0;
+
+    for(; i + 8 <= samples; i += 8)
+    {
+        s = vld1q_s16(&src[i]);
+
+        /* vqrdmulh: (2*s*g + (1 << 15)) >> 16, the same rounding as the scalar path */
+        if(gain < PCM_CONVERT_GAIN_UNITY)
+            s = vqrdmulhq_n_s16(s, gain);
+
+        vst1q_s16(&dst[i], vqaddq_s16(vld1q_s16(&dst[i]), s));
+    }
+
+    pcm_mix_tail(dst, src, i, samples, gain);
+}
+#endif
+
+static void pcm_convert_select(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length);
+static void pcm_mix_select(int16_t* dst, const int16_t* src, int samples, int gain);
+
+static p_pcm_convert_func pcm_convert_kernel = pcm_convert_select;
+static p_pcm_mix_func pcm_mix_kernel = pcm_mix_select;
+static const char* pcm_convert_kernel_name = "none";
+
+static void pcm_convert_pick(void)
+{
+    p_pcm_convert_func kernel = pcm_convert_fixed_to_s16_scalar;
+    p_pcm_mix_func mix = pcm_convert_mix_s16_scalar;
+    const char* name = "scalar";
+
+#if defined(PCM_CONVERT_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernel = pcm_convert_avx2;
+        mix = pcm_mix_avx2;
+        name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        kernel = pcm_convert_sse2;
+        mix = pcm_mix_sse2;
+        name = "sse2";
+    }
+#elif defined(PCM_CONVERT_NEON)
+    kernel = pcm_convert_neon;
+    mix = pcm_mix_neon;
+    name = "neon";
+#endif
+
+    /* every caller picks the same kernels, so racing here is harmless */
+    pcm_convert_kernel_name = name;
+    pcm_convert_kernel = kernel;
+    pcm_mix_kernel = mix;
+    LOG_I(pcm_convert, "pcm convert kernel: %s", name);
+}
+
+static void pcm_convert_select(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    pcm_convert_pick();
+    pcm_convert_kernel(out, left, right, length);
+}
+
+static void pcm_mix_select(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    pcm_convert_pick();
+    pcm_mix_kernel(dst, src, samples, gain);
+}
+
+void pcm_convert_fixed_to_s16(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length)
+{
+    pcm_convert_kernel(out, left, right, length);
+}
+
+void pcm_convert_mix_s16(int16_t* dst, const int16_t* src, int samples, int gain)
+{
+    pcm_mix_kernel(dst, src, samples, gain);
+}
+
+const char* pcm_convert_get_kernel_name(void)
+{
+    if(pcm_convert_select == pcm_convert_kernel)
+        pcm_convert_pick();
+
+    return pcm_convert_kernel_name;
+}
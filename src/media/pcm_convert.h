@@ -0,0 +1,22 @@
+#ifndef __PCM_CONVERT_H
+#define __PCM_CONVERT_H
+
+#include "typedefs.h"
+#include "mad.h"
+
+/* left/right are the planar mad_synth channels, right is NULL for mono.
+ * out receives length frames of interleaved S16 (little endian targets). */
+typedef void(*p_pcm_convert_func)(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length);
+
+/* dst[i] = sat16(dst[i] + round(src[i]*gain >> 15)), gain is Q15 in [0, PCM_CONVERT_GAIN_UNITY] */
+typedef void(*p_pcm_mix_func)(int16_t* dst, const int16_t* src, int samples, int gain);
+
+#define PCM_CONVERT_GAIN_UNITY  32768
+
+void pcm_convert_fixed_to_s16(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length);
+void pcm_convert_fixed_to_s16_scalar(int16_t* out, const mad_fixed_t* left, const mad_fixed_t* right, int length);
+void pcm_convert_mix_s16(int16_t* dst, const int16_t* src, int samples, int gain);
+void pcm_convert_mix_s16_scalar(int16_t* dst, const int16_t* src, int samples, int gain);
+const char* pcm_convert_get_kernel_name(void);
+
+#endif
@@ -0,0 +1,459 @@
+#include "pcm_sink.h"
+#include <sys/timerfd.h>
+
+#define malloc(x)           pvPortMalloc(x)
+#define free(x)             vPortFree(x)
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+#define WAV_HEADER_SIZE     44
+
+/* 
+ * wav/null/memory sinks share a software clock: when paced, frames leave
+ * the "buffer" at the sample rate and a timerfd wakes the writer once per
+ * period while it is full, otherwise everything is taken at once.
+ */
+typedef struct {
+    int         timer_fd;
+    bool        clock_running;
+    bool        paused;
+    uint64_t    anchor_us;
+    uint64_t    anchor_frames;      /* frames played at anchor_us */
+    FILE*       file;               /* wav */
+    uint32_t    data_size;          /* wav */
+    uint32_t    capture_pos;        /* memory */
+
+} pcm_sink_soft_t;
+
+static const pcm_sink_ops_t pcm_sink_wav_ops;
+static const pcm_sink_ops_t pcm_sink_null_ops;
+static const pcm_sink_ops_t pcm_sink_memory_ops;
+
+static uint64_t pcm_sink_now_us(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static uint64_t pcm_sink_soft_played(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+    uint64_t played;
+
+    if(false == sink->config.paced)
+        return sink->frames_written;
+
+    if(false == soft->clock_running || true == soft->paused)
+        return soft->anchor_frames;
+
+    played = soft->anchor_frames + (pcm_sink_now_us() - soft->anchor_us)*sink->sample_rate/1000000;
+    
+    /* ran dry, a device would underrun and restart from here */
+    if(played > sink->frames_written) {
+        soft->anchor_us = pcm_sink_now_us();
+        soft->anchor_frames = sink->frames_written;
+        played = sink->frames_written;
+    }
+
+    return played;
+}
+
+static int pcm_sink_soft_room(pcm_sink_t* sink)
+{
+    uint64_t queued;
+
+    if(false == sink->config.paced)
+        return INT32_MAX;
+
+    queued = sink->frames_written - pcm_sink_soft_played(sink);
+    return (queued < sink->buffer_frames) ?(int)(sink->buffer_frames - queued) :0;
+}
+
+static int pcm_sink_soft_open(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft;
+    struct itimerspec its;
+
+    soft = malloc(sizeof(pcm_sink_soft_t));
+    if(NULL == soft)
+        return -ENOMEM;
+
+    memset(soft, 0, sizeof(pcm_sink_soft_t));
+    soft->timer_fd = -1;
+    
+    sink->buffer_frames = (uint64_t)sink->buffer_time*sink->sample_rate/1000000;
+    sink->period_frames = (uint64_t)sink->period_time*sink->sample_rate/1000000;
+    if(0 == sink->period_frames)
+        sink->period_frames = 1;
+    if(sink->buffer_frames < sink->period_frames)
+        sink->buffer_frames = sink->period_frames;
+    
+    if(true == sink->config.paced) {
+        soft->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |TFD_CLOEXEC);
+        if(soft->timer_fd < 0) {
+            free(soft);
+            return -errno;
+        }
+
+        memset(&its, 0, sizeof(its));
+        its.it_interval.tv_sec = sink->period_time/1000000;
+        its.it_interval.tv_nsec = (sink->period_time%1000000)*1000;
+        its.it_value = its.it_interval;
+        timerfd_settime(soft->timer_fd, 0, &its, NULL);
+    }
+
+    sink->priv = soft;
+    return 0;
+}
+
+static void pcm_sink_soft_close(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    if(soft->timer_fd >= 0)
+        close(soft->timer_fd);
+    
+    free(soft);
+}
+
+/* frames the software clock accepts now, starting it on the first write */
+static int pcm_sink_soft_take(pcm_sink_t* sink, int frames)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    if(true == sink->config.paced && false == soft->clock_running) {
+        soft->clock_running = true;
+        soft->anchor_us = pcm_sink_now_us();
+        soft->anchor_frames = 0;
+    }
+
+    return min(frames, pcm_sink_soft_room(sink));
+}
+
+static int pcm_sink_soft_pause(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    if(false == soft->paused) {
+        soft->anchor_frames = pcm_sink_soft_played(sink);
+        soft->paused = true;
+    }
+    
+    return 0;
+}
+
+static int pcm_sink_soft_resume(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    if(true == soft->paused) {
+        soft->anchor_us = pcm_sink_now_us();
+        soft->paused = false;
+    }
+    
+    return 0;
+}
+
+static int pcm_sink_soft_delay(pcm_sink_t* sink)
+{
+    return sink->frames_written - pcm_sink_soft_played(sink);
+}
+
+static int pcm_sink_soft_drain(pcm_sink_t* sink, int timeout)
+{
+    uint64_t wait_ms = (uint64_t)pcm_sink_soft_delay(sink)*1000/sink->sample_rate;
+
+    if(wait_ms > 0)
+        usleep(min(wait_ms, (uint64_t)timeout)*1000);
+    
+    return 0;
+}
+
+static int pcm_sink_soft_poll_descriptors_count(pcm_sink_t* sink)
+{
+    return (true == sink->config.paced) ?1 :0;
+}
+
+/* only hand out the timer while full, otherwise the writer should not block */
+static int pcm_sink_soft_poll_descriptors(pcm_sink_t* sink, struct pollfd* fds, int space)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    if(soft->timer_fd < 0 || space < 1 || pcm_sink_soft_room(sink) > 0)
+        return 0;
+
+    fds[0].fd = soft->timer_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return 1;
+}
+
+static bool pcm_sink_soft_poll_ready(pcm_sink_t* sink, struct pollfd* fds, int count)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+    uint64_t expirations;
+
+    if(count > 0 && (POLLIN & fds[0].revents))
+        read(soft->timer_fd, &expirations, sizeof(expirations));
+
+    return (pcm_sink_soft_room(sink) > 0) ?true :false;
+}
+
+static void pcm_sink_put_le16(uint8_t* p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void pcm_sink_put_le32(uint8_t* p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static int pcm_sink_wav_write_header(pcm_sink_t* sink, uint32_t data_size)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+    uint8_t header[WAV_HEADER_SIZE];
+
+    memcpy(&header[0], "RIFF", 4);
+    pcm_sink_put_le32(&header[4], WAV_HEADER_SIZE - 8 + data_size);
+    memcpy(&header[8], "WAVEfmt ", 8);
+    pcm_sink_put_le32(&header[16], 16);
+    pcm_sink_put_le16(&header[20], 1);
+    pcm_sink_put_le16(&header[22], sink->channels);
+    pcm_sink_put_le32(&header[24], sink->sample_rate);
+    pcm_sink_put_le32(&header[28], sink->sample_rate*sink->frame_size);
+    pcm_sink_put_le16(&header[32], sink->frame_size);
+    pcm_sink_put_le16(&header[34], 16);
+    memcpy(&header[36], "data", 4);
+    pcm_sink_put_le32(&header[40], data_size);
+
+    fseek(soft->file, 0, SEEK_SET);
+    return (1 == fwrite(header, WAV_HEADER_SIZE, 1, soft->file)) ?0 :-EIO;
+}
+
+static int pcm_sink_wav_open(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft;
+    int err;
+
+    if((err = pcm_sink_soft_open(sink)) < 0)
+        return err;
+
+    soft = sink->priv;
+    soft->file = fopen(sink->config.path, "wb");
+    if(NULL == soft->file) {
+        err = -errno;
+        pcm_sink_soft_close(sink);
+        return err;
+    }
+
+    /* sizes are patched in on close */
+    if((err = pcm_sink_wav_write_header(sink, 0)) < 0) {
+        fclose(soft->file);
+        pcm_sink_soft_close(sink);
+        return err;
+    }
+    
+    return 0;
+}
+
+static void pcm_sink_wav_close(pcm_sink_t* sink)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+
+    pcm_sink_wav_write_header(sink, soft->data_size);
+    fclose(soft->file);
+    pcm_sink_soft_close(sink);
+}
+
+static int pcm_sink_wav_write(pcm_sink_t* sink, const uint8_t* buf, int frames)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+    
+    frames = pcm_sink_soft_take(sink, frames);
+    if(frames > 0) {
+        if(1 != fwrite(buf, frames*sink->frame_size, 1, soft->file))
+            return -EIO;
+        
+        soft->data_size += frames*sink->frame_size;
+    }
+    
+    return frames;
+}
+
+static int pcm_sink_null_write(pcm_sink_t* sink, const uint8_t* buf, int frames)
+{
+    return pcm_sink_soft_take(sink, frames);
+}
+
+/* keeps the first capture_size bytes, the rest is counted and dropped */
+static int pcm_sink_memory_write(pcm_sink_t* sink, const uint8_t* buf, int frames)
+{
+    pcm_sink_soft_t* soft = sink->priv;
+    int size;
+    
+    frames = pcm_sink_soft_take(sink, frames);
+    
+    if(NULL != sink->config.capture_buf && soft->capture_pos < sink->config.capture_size) {
+        size = min((uint32_t)(frames*sink->frame_size), sink->config.capture_size - soft->capture_pos);
+        memcpy(sink->config.capture_buf + soft->capture_pos, buf, size);
+        soft->capture_pos += size;
+    }
+    
+    return frames;
+}
+
+static const pcm_sink_ops_t pcm_sink_wav_ops = {
+    .open                   = pcm_sink_wav_open,
+    .close                  = pcm_sink_wav_close,
+    .write                  = pcm_sink_wav_write,
+    .pause                  = pcm_sink_soft_pause,
+    .resume                 = pcm_sink_soft_resume,
+    .drain                  = pcm_sink_soft_drain,
+    .delay                  = pcm_sink_soft_delay,
+    .poll_descriptors_count = pcm_sink_soft_poll_descriptors_count,
+    .poll_descriptors       = pcm_sink_soft_poll_descriptors,
+    .poll_ready             = pcm_sink_soft_poll_ready,
+};
+
+static const pcm_sink_ops_t pcm_sink_null_ops = {
+    .open                   = pcm_sink_soft_open,
+    .close                  = pcm_sink_soft_close,
+    .write                  = pcm_sink_null_write,
+    .pause                  = pcm_sink_soft_pause,
+    .resume                 = pcm_sink_soft_resume,
+    .drain                  = pcm_sink_soft_drain,
+    .delay                  = pcm_sink_soft_delay,
+    .poll_descriptors_count = pcm_sink_soft_poll_descriptors_count,
+    .poll_descriptors       = pcm_sink_soft_poll_descriptors,
+    .poll_ready             = pcm_sink_soft_poll_ready,
+};
+
+static const pcm_sink_ops_t pcm_sink_memory_ops = {
+    .open                   = pcm_sink_soft_open,
+    .close                  = pcm_sink_soft_close,
+    .write                  = pcm_sink_memory_write,
+    .pause                  = pcm_sink_soft_pause,
+    .resume                 = pcm_sink_soft_resume,
+    .drain                  = pcm_sink_soft_drain,
+    .delay                  = pcm_sink_soft_delay,
+    .poll_descriptors_count = pcm_sink_soft_poll_descriptors_count,
+    .poll_descriptors       = pcm_sink_soft_poll_descriptors,
+    .poll_ready             = pcm_sink_soft_poll_ready,
+};
+
+int pcm_sink_open(pcm_sink_t* sink, const pcm_sink_config_t* config, uint32_t sample_rate, uint8_t channels, uint32_t buffer_time, uint32_t period_time, bool prefer_mmap)
+{
+    int err;
+    
+    memset(sink, 0, sizeof(pcm_sink_t));
+    sink->config = *config;
+    sink->sample_rate = sample_rate;
+    sink->channels = channels;
+    sink->frame_size = channels*sizeof(int16_t);
+    sink->buffer_time = buffer_time;
+    sink->period_time = period_time;
+    sink->prefer_mmap = prefer_mmap;
+
+    switch(config->type) {
+#ifdef PCM_SINK_WITH_ALSA
+        case PCM_SINK_ALSA:     sink->ops = &pcm_sink_alsa_ops;     break;
+#endif
+        case PCM_SINK_WAV:      sink->ops = &pcm_sink_wav_ops;      break;
+        case PCM_SINK_NULL:     sink->ops = &pcm_sink_null_ops;     break;
+        case PCM_SINK_MEMORY:   sink->ops = &pcm_sink_memory_ops;   break;
+        default:
+            return -EINVAL;
+    }
+
+    if((err = sink->ops->open(sink)) < 0) {
+        sink->ops = NULL;
+        return err;
+    }
+
+    return 0;
+}
+
+void pcm_sink_close(pcm_sink_t* sink)
+{
+    if(NULL != sink->ops) {
+        sink->ops->close(sink);
+        sink->ops = NULL;
+    }
+}
+
+int pcm_sink_write(pcm_sink_t* sink, const uint8_t* buf, int frames)
+{
+    int written = sink->ops->write(sink, buf, frames);
+    
+    if(written > 0)
+        sink->frames_written += written;
+    
+    return written;
+}
+
+int pcm_sink_pause(pcm_sink_t* sink)
+{
+    return sink->ops->pause(sink);
+}
+
+int pcm_sink_resume(pcm_sink_t* sink)
+{
+    return sink->ops->resume(sink);
+}
+
+int pcm_sink_drain(pcm_sink_t* sink, int timeout)
+{
+    return sink->ops->drain(sink, timeout);
+}
+
+/* 
+ * Frames written and not played yet. alsa may say less than 0 after an
+ * xrun, or more than was written after a prepare: callers take it from
+ * frames_written, so it is kept within 0..frames_written.
+ */
+int pcm_sink_delay(pcm_sink_t* sink)
+{
+    int delay = sink->ops->delay(sink);
+
+    if(delay < 0)
+        return 0;
+
+    if((uint64_t)delay > sink->frames_written)
+        return (int)sink->frames_written;
+
+    return delay;
+}
+
+int pcm_sink_poll_descriptors_count(pcm_sink_t* sink)
+{
+    return sink->ops->poll_descriptors_count(sink);
+}
+
+int pcm_sink_poll_descriptors(pcm_sink_t* sink, struct pollfd* fds, int space)
+{
+    return sink->ops->poll_descriptors(sink, fds, space);
+}
+
+bool pcm_sink_poll_ready(pcm_sink_t* sink, struct pollfd* fds, int count)
+{
+    return sink->ops->poll_ready(sink, fds, count);
+}
+
+const char* pcm_sink_type_name(pcm_sink_type_t type)
+{
+    switch(type) {
+        case PCM_SINK_ALSA:     return "alsa";
+        case PCM_SINK_WAV:      return "wav";
+        case PCM_SINK_NULL:     return "null";
+        case PCM_SINK_MEMORY:   return "memory";
+        default:                return "unknown";
+    }
+}
+
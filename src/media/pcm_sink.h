@@ -0,0 +1,75 @@
+#ifndef __PCM_SINK_H
+#define __PCM_SINK_H
+
+#include "typedefs.h"
+#include <poll.h>
+
+#define PCM_SINK_MAX_PATH_SIZE      256
+
+typedef enum {
+    PCM_SINK_ALSA = 0,
+    PCM_SINK_WAV,
+    PCM_SINK_NULL,
+    PCM_SINK_MEMORY,
+
+} pcm_sink_type_t;
+
+typedef struct {
+    pcm_sink_type_t     type;
+    bool                paced;                          /* wav/null/memory: play in real time, else as fast as possible */
+    char                path[PCM_SINK_MAX_PATH_SIZE];   /* alsa device or wav file */
+    uint8_t*            capture_buf;                    /* memory sink */
+    uint32_t            capture_size;
+
+} pcm_sink_config_t;
+
+typedef struct pcm_sink_s pcm_sink_t;
+
+/* write returns frames taken (0 when full, wait on poll) or a negative error */
+typedef struct {
+    int  (*open)(pcm_sink_t* sink);
+    void (*close)(pcm_sink_t* sink);
+    int  (*write)(pcm_sink_t* sink, const uint8_t* buf, int frames);
+    int  (*pause)(pcm_sink_t* sink);
+    int  (*resume)(pcm_sink_t* sink);
+    int  (*drain)(pcm_sink_t* sink, int timeout);
+    int  (*delay)(pcm_sink_t* sink);
+    int  (*poll_descriptors_count)(pcm_sink_t* sink);
+    int  (*poll_descriptors)(pcm_sink_t* sink, struct pollfd* fds, int space);
+    bool (*poll_ready)(pcm_sink_t* sink, struct pollfd* fds, int count);
+
+} pcm_sink_ops_t;
+
+struct pcm_sink_s {
+    const pcm_sink_ops_t*   ops;
+    pcm_sink_config_t       config;
+    uint32_t                sample_rate;
+    uint8_t                 channels;
+    int                     frame_size;
+    uint32_t                buffer_time;        /* us, requested */
+    uint32_t                period_time;        /* us, requested */
+    bool                    prefer_mmap;
+    uint32_t                buffer_frames;      /* granted by open */
+    uint32_t                period_frames;      /* granted by open */
+    uint64_t                frames_written;
+    void*                   priv;
+};
+
+#ifdef PCM_SINK_WITH_ALSA
+extern const pcm_sink_ops_t pcm_sink_alsa_ops;
+#endif
+
+int pcm_sink_open(pcm_sink_t* sink, const pcm_sink_config_t* config, uint32_t sample_rate, uint8_t channels, uint32_t buffer_time, uint32_t period_time, bool prefer_mmap);
+void pcm_sink_close(pcm_sink_t* sink);
+int pcm_sink_write(pcm_sink_t* sink, const uint8_t* buf, int frames);
+int pcm_sink_pause(pcm_sink_t* sink);
+int pcm_sink_resume(pcm_sink_t* sink);
+int pcm_sink_drain(pcm_sink_t* sink, int timeout);
+int pcm_sink_delay(pcm_sink_t* sink);
+int pcm_sink_poll_descriptors_count(pcm_sink_t* sink);
+int pcm_sink_poll_descriptors(pcm_sink_t* sink, struct pollfd* fds, int space);
+bool pcm_sink_poll_ready(pcm_sink_t* sink, struct pollfd* fds, int count);
+const char* pcm_sink_type_name(pcm_sink_type_t type);
+
+#endif
+
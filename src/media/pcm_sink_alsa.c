@@ -0,0 +1,268 @@
+#include "pcm_sink.h"
+#include <alsa/asoundlib.h>
+
+#define malloc(x)           pvPortMalloc(x)
+#define free(x)             vPortFree(x)
+
+log_create_module(pcm_sink, PRINT_LEVEL_INFO);
+
+typedef struct {
+    snd_pcm_t*          handle;
+    snd_pcm_access_t    access;
+    bool                can_pause;
+    snd_pcm_uframes_t   buffer_size;
+    snd_pcm_uframes_t   start_threshold;
+
+} pcm_sink_alsa_t;
+
+/* explicit hw/sw params, falls back to rw access if the device can not mmap */
+static int pcm_sink_alsa_config(pcm_sink_t* sink, pcm_sink_alsa_t* alsa)
+{
+    snd_pcm_hw_params_t* hw_params = NULL;
+    snd_pcm_sw_params_t* sw_params = NULL;
+    snd_pcm_uframes_t buffer_size = 0, period_size = 0;
+    unsigned int rate = sink->sample_rate;
+    unsigned int buffer_time = sink->buffer_time;
+    unsigned int period_time = sink->period_time;
+    int err;
+
+    alsa->access = (true == sink->prefer_mmap) ?SND_PCM_ACCESS_MMAP_INTERLEAVED :SND_PCM_ACCESS_RW_INTERLEAVED;
+    
+    if((err = snd_pcm_hw_params_malloc(&hw_params)) < 0)
+        return err;
+
+    if((err = snd_pcm_sw_params_malloc(&sw_params)) < 0) {
+        snd_pcm_hw_params_free(hw_params);
+        return err;
+    }
+
+    if((err = snd_pcm_hw_params_any(alsa->handle, hw_params)) < 0)
+        goto exit;
+
+    snd_pcm_hw_params_set_rate_resample(alsa->handle, hw_params, 1);
+
+    if(snd_pcm_hw_params_set_access(alsa->handle, hw_params, alsa->access) < 0) {
+        alsa->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+        if((err = snd_pcm_hw_params_set_access(alsa->handle, hw_params, alsa->access)) < 0)
+            goto exit;
+    }
+
+    if((err = snd_pcm_hw_params_set_format(alsa->handle, hw_params, SND_PCM_FORMAT_S16_LE)) < 0 ||
+       (err = snd_pcm_hw_params_set_channels(alsa->handle, hw_params, sink->channels)) < 0 ||
+       (err = snd_pcm_hw_params_set_rate_near(alsa->handle, hw_params, &rate, NULL)) < 0 ||
+       (err = snd_pcm_hw_params_set_buffer_time_near(alsa->handle, hw_params, &buffer_time, NULL)) < 0 ||
+       (err = snd_pcm_hw_params_set_period_time_near(alsa->handle, hw_params, &period_time, NULL)) < 0 ||
+       (err = snd_pcm_hw_params(alsa->handle, hw_params)) < 0)
+    {
+        goto exit;
+    }
+
+    snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size);
+    snd_pcm_hw_params_get_period_size(hw_params, &period_size, NULL);
+    alsa->can_pause = (0 != snd_pcm_hw_params_can_pause(hw_params)) ?true :false;
+    alsa->buffer_size = buffer_size;
+    alsa->start_threshold = (buffer_size/period_size)*period_size;
+
+    /* start once the buffer is full, wake up for every period */
+    if((err = snd_pcm_sw_params_current(alsa->handle, sw_params)) < 0 ||
+       (err = snd_pcm_sw_params_set_start_threshold(alsa->handle, sw_params, alsa->start_threshold)) < 0 ||
+       (err = snd_pcm_sw_params_set_avail_min(alsa->handle, sw_params, period_size)) < 0 ||
+       (err = snd_pcm_sw_params(alsa->handle, sw_params)) < 0)
+    {
+        goto exit;
+    }
+
+    sink->buffer_frames = buffer_size;
+    sink->period_frames = period_size;
+    LOG_I(pcm_sink, "rate:%d, buffer:%d frames, period:%d frames, %s", 
+        rate, (int)buffer_size, (int)period_size, (SND_PCM_ACCESS_MMAP_INTERLEAVED == alsa->access) ?"mmap" :"rw");
+
+exit:
+    snd_pcm_sw_params_free(sw_params);
+    snd_pcm_hw_params_free(hw_params);
+    return err;
+}
+
+static int pcm_sink_alsa_open(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa;
+    const char* device = ('\0' != sink->config.path[0]) ?sink->config.path :"default";
+    int err;
+
+    alsa = malloc(sizeof(pcm_sink_alsa_t));
+    if(NULL == alsa)
+        return -ENOMEM;
+
+    memset(alsa, 0, sizeof(pcm_sink_alsa_t));
+    
+    if((err = snd_pcm_open(&alsa->handle, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0) {
+        LOG_E(pcm_sink, "open %s error: %s", device, snd_strerror(err));
+        free(alsa);
+        return err;
+    }
+    
+    if((err = pcm_sink_alsa_config(sink, alsa)) < 0) {
+        LOG_E(pcm_sink, "config %s error: %s", device, snd_strerror(err));
+        snd_pcm_close(alsa->handle);
+        free(alsa);
+        return err;
+    }
+
+    sink->priv = alsa;
+    return 0;
+}
+
+static void pcm_sink_alsa_close(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    
+    snd_pcm_close(alsa->handle);
+    snd_config_update_free_global();
+    free(alsa);
+}
+
+/* copy straight into the DMA area */
+static snd_pcm_sframes_t pcm_sink_alsa_mmap_write(pcm_sink_alsa_t* alsa, const uint8_t* buf, snd_pcm_uframes_t frames, int frame_size)
+{
+    snd_pcm_t* pcm_handle = alsa->handle;
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset, size;
+    snd_pcm_sframes_t avail, committed;
+    int err;
+
+    avail = snd_pcm_avail_update(pcm_handle);
+    if(avail < 0)
+        return avail;
+
+    /* full, wait for the next poll() */
+    if(0 == avail)
+        return -EAGAIN;
+
+    size = ((snd_pcm_uframes_t)avail < frames) ?(snd_pcm_uframes_t)avail :frames;
+    
+    if((err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &size)) < 0)
+        return err;
+
+    memcpy((uint8_t*)areas[0].addr + areas[0].first/8 + offset*areas[0].step/8, buf, size*frame_size);
+
+    committed = snd_pcm_mmap_commit(pcm_handle, offset, size);
+    if(committed < 0)
+        return committed;
+
+    /* mmap_commit ignores the start threshold, writei would have started here */
+    if(SND_PCM_STATE_PREPARED == snd_pcm_state(pcm_handle) &&
+       alsa->buffer_size - (avail - committed) >= alsa->start_threshold)
+    {
+        if((err = snd_pcm_start(pcm_handle)) < 0)
+            return err;
+    }
+
+    return committed;
+}
+
+static int pcm_sink_alsa_write(pcm_sink_t* sink, const uint8_t* buf, int frames)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    snd_pcm_sframes_t written;
+    
+    if(SND_PCM_ACCESS_MMAP_INTERLEAVED == alsa->access)
+        written = pcm_sink_alsa_mmap_write(alsa, buf, frames, sink->frame_size);
+    else
+        written = snd_pcm_writei(alsa->handle, buf, frames);
+
+    if(-EAGAIN == written)
+        return 0;
+    
+    if(written < 0)
+        written = snd_pcm_recover(alsa->handle, written, 0);
+
+    return written;
+}
+
+static int pcm_sink_alsa_pause(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    
+    if(SND_PCM_STATE_RUNNING == snd_pcm_state(alsa->handle) && true == alsa->can_pause) {
+        if(0 == snd_pcm_pause(alsa->handle, 1))
+            return 0;
+    }
+
+    return snd_pcm_drop(alsa->handle);
+}
+
+static int pcm_sink_alsa_resume(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    
+    if(SND_PCM_STATE_PAUSED == snd_pcm_state(alsa->handle))
+        return snd_pcm_pause(alsa->handle, 0);
+
+    return snd_pcm_prepare(alsa->handle);
+}
+
+static int pcm_sink_alsa_drain(pcm_sink_t* sink, int timeout)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    
+    /* a tail shorter than the start threshold never started the stream */
+    if(SND_PCM_STATE_PREPARED == snd_pcm_state(alsa->handle) &&
+       snd_pcm_avail_update(alsa->handle) < (snd_pcm_sframes_t)alsa->buffer_size)
+    {
+        snd_pcm_start(alsa->handle);
+    }
+
+    return snd_pcm_wait(alsa->handle, timeout);
+}
+
+static int pcm_sink_alsa_delay(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    snd_pcm_sframes_t delay = 0;
+
+    if(snd_pcm_delay(alsa->handle, &delay) < 0 || delay < 0)
+        return 0;
+
+    return delay;
+}
+
+static int pcm_sink_alsa_poll_descriptors_count(pcm_sink_t* sink)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    int count = snd_pcm_poll_descriptors_count(alsa->handle);
+    
+    return (count > 0) ?count :0;
+}
+
+static int pcm_sink_alsa_poll_descriptors(pcm_sink_t* sink, struct pollfd* fds, int space)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    int count = snd_pcm_poll_descriptors(alsa->handle, fds, space);
+    
+    return (count > 0) ?count :0;
+}
+
+static bool pcm_sink_alsa_poll_ready(pcm_sink_t* sink, struct pollfd* fds, int count)
+{
+    pcm_sink_alsa_t* alsa = sink->priv;
+    unsigned short revents = 0;
+    
+    snd_pcm_poll_descriptors_revents(alsa->handle, fds, count, &revents);
+    
+    /* an xrun shows up as POLLERR, the write recovers it */
+    return (0 != (revents & (POLLOUT |POLLERR))) ?true :false;
+}
+
+const pcm_sink_ops_t pcm_sink_alsa_ops = {
+    .open                   = pcm_sink_alsa_open,
+    .close                  = pcm_sink_alsa_close,
+    .write                  = pcm_sink_alsa_write,
+    .pause                  = pcm_sink_alsa_pause,
+    .resume                 = pcm_sink_alsa_resume,
+    .drain                  = pcm_sink_alsa_drain,
+    .delay                  = pcm_sink_alsa_delay,
+    .poll_descriptors_count = pcm_sink_alsa_poll_descriptors_count,
+    .poll_descriptors       = pcm_sink_alsa_poll_descriptors,
+    .poll_ready             = pcm_sink_alsa_poll_ready,
+};
+
@@ -1,5 +1,6 @@
 #include "pcm_trans.h"
-#include <alsa/asoundlib.h>
+#include "pcm_convert.h"
+#include <sys/eventfd.h>
 
 typedef enum {
     PCM_TRANS_EVENT_NONE            = 0x000000UL,
@@ -17,22 +18,79 @@ typedef enum {
 #define I2S_DATA_REQUEST_SIZE       (I2S_TX_BUFFER_SIZE*sizeof(uint32_t))
 #define I2S_DATA_NOTIFY_SIZE        (I2S_RX_BUFFER_SIZE*sizeof(uint32_t))
 
+#define PCM_TRANS_GAIN_BLOCK        64          /* frames per gain ramp step */
+#define PCM_TRANS_CONV_SIZE         I2S_DATA_REQUEST_SIZE
+
+typedef struct {
+    uint32_t            buffer_time;    /* us */
+    uint32_t            period_time;    /* us */
+    bool                mmap;
+
+} pcm_trans_profile_config_t;
+
+static const pcm_trans_profile_config_t pcm_trans_profile_configs[] = {
+    [PCM_TRANS_PROFILE_LONG_FORM]   = { 500000, 125000, false },
+    [PCM_TRANS_PROFILE_LOW_LATENCY] = { 20000,  5000,   true },
+};
+
+typedef struct {
+    bool                                used;
+    bool                                active;         /* false while paused */
+    volatile bool                       no_data;        /* the source has nothing more */
+    volatile bool                       done;           /* and all of it has been played */
+    bool                                draining;
+    uint64_t                            done_frames;    /* sink position of the last frame */
+    uint64_t                            out_frames;     /* device frames taken from the stream since open/flush */
+    uint64_t                            out_end;        /* sink position right after the last of them */
+    uint32_t                            sample_rate;
+    uint8_t                             channels;
+    int32_t                             gain;           /* Q15 */
+    int32_t                             target_gain;
+    int32_t                             gain_step;      /* per PCM_TRANS_GAIN_BLOCK frames */
+    resampler_t                         resampler;
+    uint8_t*                            conv_buf;       /* resampled to the device format, NULL when it already matches */
+    int                                 conv_offset;
+    int                                 conv_size;
+    p_pcm_trans_data_peek_callback      peek_callback;
+    p_pcm_trans_data_consume_callback   consume_callback;
+    void*                               param;
+
+} pcm_trans_stream_t;
+
 static uint8_t i2s_data_request_buffer[I2S_DATA_REQUEST_SIZE];
 static uint8_t i2s_data_notify_buffer[I2S_DATA_NOTIFY_SIZE];
 
 static EventGroupHandle_t event_handle;
+static int event_fd;                            /* mirrors event_handle so poll() can wait on it */
 static uint8_t i2s_tx_channels;
 static uint8_t i2s_rx_channels;
 static uint32_t i2s_tx_sample_rate;
+static pcm_trans_profile_t i2s_tx_profile;          /* profile of the open device */
+static pcm_trans_profile_t pcm_trans_tx_profile;    /* profile for the next start */
+static pcm_sink_t pcm_trans_sink;
+static pcm_sink_config_t pcm_trans_sink_config;     /* sink for the next start */
+static bool pcm_trans_sink_changed;
+static uint32_t pcm_trans_device_sample_rate;       /* fixed device format, 0 follows the streams */
+static uint8_t pcm_trans_device_channels;
+static resampler_quality_t pcm_trans_device_quality;
 
 static bool pcm_trans_tx_no_data;
+static bool pcm_trans_tx_warm;                  /* last start reused the open device */
+static bool pcm_trans_wait_first_sample;        /* log the start/resume to first sample latency */
+static uint32_t pcm_trans_start_tick;
+static uint64_t pcm_trans_tx_played;            /* sink frames heard at the last write */
+static uint32_t pcm_trans_tx_played_tick;
 static pcm_trans_state_t pcm_trans_cur_state;
 static p_pcm_trans_data_request_callback pcm_trans_data_request_callback;
 static p_pcm_trans_data_notify_callback pcm_trans_data_notify_callback;
 static void* pcm_trans_data_request_param;
 static void* pcm_trans_data_notify_param;
+static pcm_trans_stream_t pcm_trans_streams[PCM_TRANS_MAX_STREAMS];
+static SemaphoreHandle_t stream_mutex;          /* held by the task while it reads or writes stream data */
+static uint32_t pcm_trans_flush_generation;     /* bumped by a flush, the task drops the mixed tail it kept */
 
 static pthread_t       pcm_thread;
+static bool            pcm_thread_created;     /* until pcm_trans_stop_tx joins it, also after it left on an error */
 
 static void* pcm_trans_task(void* param);
 static uint32_t pcm_trans_wait_event(uint32_t events, uint32_t timeout);
@@ -45,10 +103,28 @@ int pcm_trans_init(void)
     pcm_trans_data_notify_callback = NULL;
     pcm_trans_data_request_param = NULL;
     pcm_trans_data_notify_param = NULL;
+    memset(pcm_trans_streams, 0, sizeof(pcm_trans_streams));
     
+    stream_mutex = xSemaphoreCreateMutex();
     event_handle = xEventGroupCreate();
+    event_fd = eventfd(0, EFD_NONBLOCK |EFD_CLOEXEC);
     i2s_tx_channels = 1;
     i2s_rx_channels = 1;
+    i2s_tx_profile = PCM_TRANS_PROFILE_LONG_FORM;
+    pcm_trans_tx_profile = PCM_TRANS_PROFILE_LONG_FORM;
+    memset(&pcm_trans_sink_config, 0, sizeof(pcm_sink_config_t));
+#ifdef PCM_SINK_WITH_ALSA
+    pcm_trans_sink_config.type = PCM_SINK_ALSA;
+#else
+    /* built without alsa: paced, so playback still keeps time */
+    pcm_trans_sink_config.type = PCM_SINK_NULL;
+#endif
+    pcm_trans_sink_config.paced = true;
+    strcpy(pcm_trans_sink_config.path, "default");
+    pcm_trans_sink_changed = false;
+    pcm_trans_device_sample_rate = 0;
+    pcm_trans_device_channels = 0;
+    pcm_trans_device_quality = RESAMPLER_QUALITY_MEDIUM;
     pcm_trans_cur_state = PCM_TRANS_STA_EXIT;
 	
     return PCM_TRANS_SUCCESS;
@@ -56,46 +132,139 @@ int pcm_trans_init(void)
 
 int pcm_trans_deinit(void)
 {
+    pcm_trans_stop_tx();
+    
     vEventGroupDelete(event_handle);
+    vSemaphoreDelete(stream_mutex);
+    if(event_fd >= 0)
+        close(event_fd);
     
     return PCM_TRANS_SUCCESS;
 }
 
 int pcm_trans_start_tx(uint32_t sample_rate, uint8_t channels, bool only_init)
 {
+    /* the thread and the device are still up (warm pause), reopen only for a new format */
+    if(PCM_TRANS_STA_EXIT != pcm_trans_cur_state)
+    {
+        /* a new profile reopens it too, streams mixed in by others never get here */
+        if(sample_rate == i2s_tx_sample_rate && channels == i2s_tx_channels && false == pcm_trans_sink_changed &&
+           pcm_trans_tx_profile == i2s_tx_profile) {
+            pcm_trans_tx_no_data = false;
+            pcm_trans_tx_warm = true;
+            pcm_trans_start_tick = xTaskGetTickCount();
+            pcm_trans_wait_first_sample = true;
+
+            if(false == only_init) {
+                pcm_trans_resume_tx();
+            }
+
+            LOG_I(pcm_trans, "pcm_trans_start_tx reuse device, sample_rate:%d, channels:%d", sample_rate, channels);
+            return PCM_TRANS_SUCCESS;
+        }
+    }
+
+    /* also joins a thread that left on an error */
+    pcm_trans_stop_tx();
+
+    pcm_trans_tx_warm = false;
+    pcm_trans_start_tick = xTaskGetTickCount();
+    pcm_trans_wait_first_sample = true;
+
     pcm_trans_cur_state = PCM_TRANS_STA_IDLE;
     i2s_tx_channels = channels;
     i2s_tx_sample_rate = sample_rate;
+    i2s_tx_profile = pcm_trans_tx_profile;
+    pcm_trans_sink_changed = false;
     pcm_trans_tx_no_data = false;
 
     pcm_trans_clear_event(PCM_TRANS_EVENT_ALL);
-    pthread_create(&pcm_thread, NULL, pcm_trans_task, NULL);
+    pcm_thread_created = (0 == pthread_create(&pcm_thread, NULL, pcm_trans_task, NULL)) ?true :false;
 
     if(false == only_init) {
         pcm_trans_resume_tx();
     }
 
-    LOG_I(pcm_trans, "pcm_trans_start_tx sample_rate:%d, channels:%d", sample_rate, channels);
+    LOG_I(pcm_trans, "pcm_trans_start_tx sample_rate:%d, channels:%d, profile:%d, sink:%s", 
+        sample_rate, channels, i2s_tx_profile, pcm_sink_type_name(pcm_trans_sink_config.type));
     
     return PCM_TRANS_SUCCESS;
 }
 
+/* takes effect at the next pcm_trans_start_tx, a different profile reopens the device */
+int pcm_trans_set_tx_profile(pcm_trans_profile_t profile)
+{
+    if(profile > PCM_TRANS_PROFILE_LOW_LATENCY)
+        return PCM_TRANS_ERR_PROFILE;
+
+    pcm_trans_tx_profile = profile;
+    return PCM_TRANS_SUCCESS;
+}
+
+/* takes effect at the next pcm_trans_start_tx, alsa "default" unless changed */
+int pcm_trans_set_tx_sink(const pcm_sink_config_t* config)
+{
+    if(NULL == config || config->type > PCM_SINK_MEMORY)
+        return PCM_TRANS_ERR_SINK;
+
+    if(PCM_SINK_WAV == config->type && '\0' == config->path[0])
+        return PCM_TRANS_ERR_SINK;
+
+    pcm_trans_sink_config = *config;
+    pcm_trans_sink_changed = true;
+    return PCM_TRANS_SUCCESS;
+}
+
+/* 
+ * Runs the device at one format and resamples every stream that differs, so
+ * the device stays open across tracks. Applies to streams opened afterwards,
+ * a sample_rate of 0 goes back to opening the device at the stream format.
+ */
+int pcm_trans_set_tx_device_format(uint32_t sample_rate, uint8_t channels, resampler_quality_t quality)
+{
+    if(0 != sample_rate && (channels < 1 || channels > 2))
+        return PCM_TRANS_ERR_CHANNEL;
+
+    if(quality > RESAMPLER_QUALITY_HIGH)
+        return PCM_TRANS_ERR_FORMAT;
+
+    pcm_trans_device_sample_rate = sample_rate;
+    pcm_trans_device_channels = (0 != sample_rate) ?channels :0;
+    pcm_trans_device_quality = quality;
+
+    LOG_I(pcm_trans, "device format %d/%d, resampler quality %d", sample_rate, channels, quality);
+    return PCM_TRANS_SUCCESS;
+}
+
+/* frames handed to the sink since the last cold start */
+uint64_t pcm_trans_get_tx_frames(void)
+{
+    return pcm_trans_sink.frames_written;
+}
+
 int pcm_trans_stop_tx(void)
 {
-    if(PCM_TRANS_STA_EXIT != pcm_trans_cur_state) {
+    /* every way out of the task sets STOP_DONE, one it already took on an error is still there */
+    if(true == pcm_thread_created) {
         pcm_trans_set_event(PCM_TRANS_EVENT_TX_STOP);
         pcm_trans_wait_event(PCM_TRANS_EVENT_TX_STOP_DONE, portMAX_DELAY);
         LOG_I(pcm_trans, "pcm_trans_stop_tx");
 
         pthread_join(pcm_thread, NULL);
+        pcm_thread_created = false;
     }
     
     return PCM_TRANS_SUCCESS;
 }
 
+/* 
+ * Warm pause: the device is paused (or dropped when the hardware can not
+ * pause) and the thread parks on its event, pcm_trans_start_tx with the same
+ * format or pcm_trans_resume_tx picks up from there.
+ */
 int pcm_trans_pause_tx(void)
 {
-    if(PCM_TRANS_STA_TX_RUN == pcm_trans_cur_state) {
+    if(PCM_TRANS_STA_EXIT != pcm_trans_cur_state) {
         pcm_trans_set_event(PCM_TRANS_EVENT_TX_PAUSE);
         LOG_I(pcm_trans, "pcm_trans_pause_tx");
     }
@@ -105,7 +274,8 @@ int pcm_trans_pause_tx(void)
 
 int pcm_trans_resume_tx(void)
 {
-    if(PCM_TRANS_STA_TX_RUN != pcm_trans_cur_state) {
+    /* also while running, it may be about to pause itself for lack of data */
+    if(PCM_TRANS_STA_EXIT != pcm_trans_cur_state) {
         pcm_trans_set_event(PCM_TRANS_EVENT_TX_RESUME);
         //LOG_I(pcm_trans, "pcm_trans_resume_tx");
     }
@@ -126,6 +296,506 @@ int pcm_trans_register_data_notify_callback(p_pcm_trans_data_notify_callback cal
     return PCM_TRANS_SUCCESS;
 }
 
+/* 
+ * Streams share the device format and each has its own source and Q15 gain.
+ * peek hands out data in place, consume reports how much of it was taken. A
+ * single stream at unity gain is written to the sink in place, otherwise the
+ * active streams are mixed into the request buffer.
+ */
+static bool pcm_trans_stream_conflict(int stream, uint32_t sample_rate, uint8_t channels, bool* p_others_active)
+{
+    pcm_trans_stream_t* s;
+    bool conflict = false;
+    int i;
+
+    *p_others_active = false;
+    
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        s = &pcm_trans_streams[i];
+        if(i == stream || false == s->used || false == s->active)
+            continue;
+
+        /* a fixed device format resamples instead */
+        *p_others_active = true;
+        if(0 == pcm_trans_device_sample_rate && (s->sample_rate != sample_rate || s->channels != channels))
+            conflict = true;
+    }
+
+    return conflict;
+}
+
+static int pcm_trans_stream_start(int stream, bool others_active)
+{
+    pcm_trans_stream_t* s = &pcm_trans_streams[stream];
+
+    /* the device already runs this format for the others, leave it as it is */
+    if(true == others_active)
+        return pcm_trans_resume_tx();
+
+    if(0 != pcm_trans_device_sample_rate)
+        return pcm_trans_start_tx(pcm_trans_device_sample_rate, pcm_trans_device_channels, false);
+
+    return pcm_trans_start_tx(s->sample_rate, s->channels, false);
+}
+
+static bool pcm_trans_stream_valid(int stream)
+{
+    return (stream >= 0 && stream < PCM_TRANS_MAX_STREAMS && true == pcm_trans_streams[stream].used) ?true :false;
+}
+
+int pcm_trans_open_stream(int* p_stream, uint32_t sample_rate, uint8_t channels, p_pcm_trans_data_peek_callback peek_callback, p_pcm_trans_data_consume_callback consume_callback, void* param)
+{
+    pcm_trans_stream_t* s;
+    bool others_active;
+    int i;
+
+    if(NULL == p_stream || NULL == peek_callback || NULL == consume_callback)
+        return PCM_TRANS_ERR_STREAM;
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+
+    if(true == pcm_trans_stream_conflict(-1, sample_rate, channels, &others_active)) {
+        xSemaphoreGive(stream_mutex);
+        LOG_W(pcm_trans, "open stream %d/%d conflicts with the device format %d/%d", sample_rate, channels, i2s_tx_sample_rate, i2s_tx_channels);
+        return PCM_TRANS_ERR_FORMAT;
+    }
+
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        if(false == pcm_trans_streams[i].used)
+            break;
+    }
+
+    if(i >= PCM_TRANS_MAX_STREAMS) {
+        xSemaphoreGive(stream_mutex);
+        return PCM_TRANS_ERR_STREAM;
+    }
+
+    s = &pcm_trans_streams[i];
+    memset(s, 0, sizeof(pcm_trans_stream_t));
+    s->used = true;
+    s->active = true;
+    s->sample_rate = sample_rate;
+    s->channels = channels;
+    s->gain = PCM_TRANS_GAIN_UNITY;
+    s->target_gain = PCM_TRANS_GAIN_UNITY;
+    s->peek_callback = peek_callback;
+    s->consume_callback = consume_callback;
+    s->param = param;
+
+    if(0 != pcm_trans_device_sample_rate && (sample_rate != pcm_trans_device_sample_rate || channels != pcm_trans_device_channels))
+    {
+        if(RESAMPLER_SUCCESS != resampler_init(&s->resampler, sample_rate, pcm_trans_device_sample_rate, channels, pcm_trans_device_channels, pcm_trans_device_quality) ||
+           NULL == (s->conv_buf = malloc(PCM_TRANS_CONV_SIZE)))
+        {
+            resampler_deinit(&s->resampler);
+            s->used = false;
+            xSemaphoreGive(stream_mutex);
+            LOG_W(pcm_trans, "open stream %d/%d can not be resampled to %d/%d", sample_rate, channels, pcm_trans_device_sample_rate, pcm_trans_device_channels);
+            return PCM_TRANS_ERR_FORMAT;
+        }
+    }
+    
+    xSemaphoreGive(stream_mutex);
+
+    *p_stream = i;
+    LOG_I(pcm_trans, "open stream %d, mixed: %d", i, others_active);
+    
+    return pcm_trans_stream_start(i, others_active);
+}
+
+/* 
+ * The device is closed with the last stream, paused with the last active one.
+ * A fixed device format keeps it open and only pauses.
+ */
+int pcm_trans_close_stream(int stream)
+{
+    bool others_used = false, others_active = false;
+    int i;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return PCM_TRANS_ERR_STREAM;
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+    
+    pcm_trans_streams[stream].used = false;
+    pcm_trans_streams[stream].active = false;
+    
+    if(NULL != pcm_trans_streams[stream].conv_buf) {
+        resampler_deinit(&pcm_trans_streams[stream].resampler);
+        free(pcm_trans_streams[stream].conv_buf);
+        pcm_trans_streams[stream].conv_buf = NULL;
+    }
+
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        if(true == pcm_trans_streams[i].used) {
+            others_used = true;
+            if(true == pcm_trans_streams[i].active)
+                others_active = true;
+        }
+    }
+    
+    xSemaphoreGive(stream_mutex);
+
+    if(false == others_used && 0 == pcm_trans_device_sample_rate)
+        pcm_trans_stop_tx();
+    else if(false == others_used)
+        pcm_trans_pause_tx();
+    else if(false == others_active)
+        pcm_trans_pause_tx();
+
+    return PCM_TRANS_SUCCESS;
+}
+
+int pcm_trans_pause_stream(int stream)
+{
+    bool others_active;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return PCM_TRANS_ERR_STREAM;
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+    pcm_trans_streams[stream].active = false;
+    pcm_trans_stream_conflict(stream, 0, 0, &others_active);
+    xSemaphoreGive(stream_mutex);
+
+    if(false == others_active)
+        pcm_trans_pause_tx();
+
+    return PCM_TRANS_SUCCESS;
+}
+
+int pcm_trans_resume_stream(int stream)
+{
+    pcm_trans_stream_t* s;
+    bool others_active;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return PCM_TRANS_ERR_STREAM;
+
+    s = &pcm_trans_streams[stream];
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+
+    if(true == pcm_trans_stream_conflict(stream, s->sample_rate, s->channels, &others_active)) {
+        xSemaphoreGive(stream_mutex);
+        return PCM_TRANS_ERR_FORMAT;
+    }
+
+    s->active = true;
+    xSemaphoreGive(stream_mutex);
+
+    return pcm_trans_stream_start(stream, others_active);
+}
+
+/* drops what the stream holds converted and its end of data, for a source that jumped */
+int pcm_trans_flush_stream(int stream)
+{
+    pcm_trans_stream_t* s;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return PCM_TRANS_ERR_STREAM;
+
+    s = &pcm_trans_streams[stream];
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+
+    s->conv_offset = 0;
+    s->conv_size = 0;
+    if(NULL != s->conv_buf)
+        resampler_reset(&s->resampler);
+
+    s->no_data = false;
+    s->draining = false;
+    s->done = false;
+    s->out_frames = 0;
+    s->out_end = 0;
+    pcm_trans_flush_generation++;
+    
+    xSemaphoreGive(stream_mutex);
+
+    return PCM_TRANS_SUCCESS;
+}
+
+/* moves to gain (Q15) over ramp_ms, 0 jumps right away */
+int pcm_trans_set_stream_gain(int stream, int gain, int ramp_ms)
+{
+    pcm_trans_stream_t* s;
+    uint32_t blocks;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return PCM_TRANS_ERR_STREAM;
+
+    s = &pcm_trans_streams[stream];
+
+    if(gain < 0)
+        gain = 0;
+    else if(gain > PCM_TRANS_GAIN_UNITY)
+        gain = PCM_TRANS_GAIN_UNITY;
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+    
+    blocks = (uint64_t)ramp_ms*((0 != pcm_trans_device_sample_rate) ?pcm_trans_device_sample_rate :s->sample_rate)/1000/PCM_TRANS_GAIN_BLOCK;
+    s->target_gain = gain;
+    s->gain_step = (blocks > 0) ?(gain - s->gain)/(int32_t)blocks :(gain - s->gain);
+    if(0 == s->gain_step && gain != s->gain)
+        s->gain_step = (gain > s->gain) ?1 :-1;
+    
+    xSemaphoreGive(stream_mutex);
+
+    return PCM_TRANS_SUCCESS;
+}
+
+/* called from the peek callback, the task holds stream_mutex */
+void pcm_trans_set_stream_no_data(int stream)
+{
+    if(true == pcm_trans_stream_valid(stream))
+        pcm_trans_streams[stream].no_data = true;
+}
+
+/* 
+ * ms of the stream that have been heard since open/flush: what it gave the
+ * sink less what of it the sink still queues. Only reads what the task kept
+ * at its last write, cheap enough to poll.
+ */
+uint32_t pcm_trans_get_stream_position(int stream)
+{
+    pcm_trans_stream_t* s;
+    uint64_t played, written, end, queued, frames;
+    uint32_t sample_rate;
+
+    if(false == pcm_trans_stream_valid(stream))
+        return 0;
+
+    s = &pcm_trans_streams[stream];
+
+    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+
+    written = pcm_trans_sink.frames_written;
+    sample_rate = pcm_trans_sink.sample_rate;
+    played = pcm_trans_tx_played;
+
+    /* the device went on playing since */
+    if(PCM_TRANS_STA_TX_RUN == pcm_trans_cur_state)
+        played += (uint64_t)(xTaskGetTickCount() - pcm_trans_tx_played_tick)*sample_rate/1000;
+    if(played > written)
+        played = written;
+
+    end = (s->out_end < written) ?s->out_end :written;
+    queued = (end > played) ?(end - played) :0;
+    frames = (queued < s->out_frames) ?(s->out_frames - queued) :0;
+
+    xSemaphoreGive(stream_mutex);
+
+    return (0 != sample_rate) ?(uint32_t)(frames*1000/sample_rate) :0;
+}
+
+bool pcm_trans_is_stream_done(int stream)
+{
+    if(false == pcm_trans_stream_valid(stream))
+        return false;
+    
+    return pcm_trans_streams[stream].done;
+}
+
+static void pcm_trans_stream_mix(pcm_trans_stream_t* s, int16_t* dst, const int16_t* src, int samples)
+{
+    int block = PCM_TRANS_GAIN_BLOCK*i2s_tx_channels;
+    int offset, count;
+
+    for(offset = 0; offset < samples; offset += block)
+    {
+        count = (samples - offset < block) ?(samples - offset) :block;
+        
+        if(s->gain > 0)
+            pcm_convert_mix_s16(dst + offset, src + offset, count, s->gain);
+
+        if(s->gain != s->target_gain) {
+            s->gain += s->gain_step;
+            if((s->gain_step > 0 && s->gain > s->target_gain) || (s->gain_step < 0 && s->gain < s->target_gain))
+                s->gain = s->target_gain;
+        }
+    }
+}
+
+/* 
+ * Streams in the device format are peeked in place, the others are resampled
+ * into conv_buf first and their source is consumed as the resampler takes it.
+ */
+static int pcm_trans_stream_peek(pcm_trans_stream_t* s, uint8_t** p_buf, int size)
+{
+    uint8_t* src;
+    int in_frame_size = s->channels*sizeof(int16_t);
+    int out_frame_size = i2s_tx_channels*sizeof(int16_t);
+    int avail, used, frames;
+
+    if(NULL == s->conv_buf)
+        return s->peek_callback(s->param, p_buf, size);
+
+    if(s->conv_offset > 0) {
+        memmove(s->conv_buf, s->conv_buf + s->conv_offset, s->conv_size);
+        s->conv_offset = 0;
+    }
+
+    while(s->conv_size < size && PCM_TRANS_CONV_SIZE - s->conv_size >= out_frame_size)
+    {
+        avail = s->peek_callback(s->param, &src, PCM_TRANS_CONV_SIZE);
+        if(avail < in_frame_size)
+            break;
+
+        frames = resampler_process(&s->resampler, (const int16_t*)src, avail/in_frame_size, &used, 
+            (int16_t*)(s->conv_buf + s->conv_size), (PCM_TRANS_CONV_SIZE - s->conv_size)/out_frame_size);
+        
+        if(used > 0)
+            s->consume_callback(s->param, used*in_frame_size);
+
+        s->conv_size += frames*out_frame_size;
+        if(0 == used && 0 == frames)
+            break;
+    }
+
+    *p_buf = s->conv_buf;
+    return s->conv_size;
+}
+
+static void pcm_trans_stream_consume(pcm_trans_stream_t* s, int size)
+{
+    if(NULL == s->conv_buf) {
+        s->consume_callback(s->param, size);
+        return;
+    }
+    
+    s->conv_offset += size;
+    s->conv_size -= size;
+}
+
+/* 
+ * Fills *p_buf with up to size bytes of output. *p_direct is the stream
+ * handed out in place (consume after the write), -1 when the data was mixed
+ * and already consumed.
+ */
+static int pcm_trans_stream_fetch(pcm_sink_t* sink, uint8_t** p_buf, int size, int* p_direct)
+{
+    pcm_trans_stream_t* s;
+    uint8_t* bufs[PCM_TRANS_MAX_STREAMS];
+    int avail[PCM_TRANS_MAX_STREAMS];
+    int i, count = 0, length = 0, direct = -1;
+
+    *p_direct = -1;
+    
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++)
+    {
+        s = &pcm_trans_streams[i];
+        avail[i] = 0;
+        
+        if(false == s->used || false == s->active || true == s->draining)
+            continue;
+
+        avail[i] = pcm_trans_stream_peek(s, &bufs[i], size);
+        
+        if(avail[i] <= 0) {
+            avail[i] = 0;
+            if(true == s->no_data) {
+                s->draining = true;
+                s->done_frames = sink->frames_written;
+            }
+            continue;
+        }
+
+        count++;
+        direct = i;
+        length = (0 == length || avail[i] < length) ?avail[i] :length;
+    }
+
+    if(0 == count)
+        return 0;
+
+    s = &pcm_trans_streams[direct];
+    if(1 == count && PCM_TRANS_GAIN_UNITY == s->gain && PCM_TRANS_GAIN_UNITY == s->target_gain && NULL == s->conv_buf) {
+        *p_direct = direct;
+        *p_buf = bufs[direct];
+        return avail[direct];
+    }
+
+    length -= length % sink->frame_size;
+    if(length <= 0)
+        return 0;
+    
+    memset(i2s_data_request_buffer, 0, length);
+    
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        if(avail[i] <= 0)
+            continue;
+
+        s = &pcm_trans_streams[i];
+        pcm_trans_stream_mix(s, (int16_t*)i2s_data_request_buffer, (const int16_t*)bufs[i], length/sizeof(int16_t));
+        pcm_trans_stream_consume(s, length);
+
+        /* written from frames_written on, nothing is pending when fetching */
+        s->out_frames += length/sink->frame_size;
+        s->out_end = sink->frames_written + length/sink->frame_size;
+    }
+
+    *p_buf = i2s_data_request_buffer;
+    return length;
+}
+
+/* a draining stream is done once the sink played past its last frame, or when flushed */
+static void pcm_trans_stream_check_done(pcm_sink_t* sink, bool flush)
+{
+    pcm_trans_stream_t* s;
+    uint64_t played = 0;
+    bool need_played = true;
+    int i;
+
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++)
+    {
+        s = &pcm_trans_streams[i];
+        if(false == s->used || false == s->draining || true == s->done)
+            continue;
+
+        if(true == need_played) {
+            played = sink->frames_written - pcm_sink_delay(sink);
+            need_played = false;
+        }
+
+        if(true == flush || played >= s->done_frames)
+            s->done = true;
+    }
+}
+
+/* nothing left to play: every active stream ran out for good */
+static bool pcm_trans_stream_all_done(void)
+{
+    pcm_trans_stream_t* s;
+    bool any = false;
+    int i;
+
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        s = &pcm_trans_streams[i];
+        if(false == s->used || false == s->active)
+            continue;
+
+        if(false == s->draining)
+            return false;
+        
+        any = true;
+    }
+
+    return any;
+}
+
+static bool pcm_trans_stream_any_used(void)
+{
+    int i;
+
+    for(i = 0; i < PCM_TRANS_MAX_STREAMS; i++) {
+        if(true == pcm_trans_streams[i].used)
+            return true;
+    }
+
+    return false;
+}
+
 void pcm_trans_set_tx_no_data(void)
 {
     pcm_trans_tx_no_data = true;
@@ -148,41 +818,72 @@ static uint32_t pcm_trans_wait_event(uint32_t events, uint32_t timeout)
 
 static void pcm_trans_set_event(uint32_t events)
 {
+    uint64_t value = 1;
+    
 	xEventGroupSetBits(event_handle, events);
+    if(event_fd >= 0)
+        write(event_fd, &value, sizeof(value));
 }
 
 static void pcm_trans_clear_event(uint32_t events)
 {
+    uint64_t value;
+    
 	xEventGroupClearBits(event_handle, events);
+    if(event_fd >= 0)
+        read(event_fd, &value, sizeof(value));
 }
 
 void* pcm_trans_task(void* param)
 {
-    snd_pcm_t* pcm_handle;
+    pcm_sink_t* sink = &pcm_trans_sink;
+    const pcm_trans_profile_config_t* profile = &pcm_trans_profile_configs[i2s_tx_profile];
     uint32_t events;
-    int err, input_size;
+    uint8_t* input_buf;
+    int err, input_size, request_size, frame_size;
+    int pending_size = 0, pending_offset = 0, direct;
+    uint32_t flush_generation = 0;
+    bool device_paused = false, all_done;
+    struct pollfd* fds;
+    int sink_fd_count, nfds, timeout;
     
-    if((err = snd_pcm_open(&pcm_handle, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-        printf("Playback open error: %s\n", snd_strerror(err));
-    }
-    
-    if((err = snd_pcm_set_params(pcm_handle, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, i2s_tx_channels, i2s_tx_sample_rate, 1, 500000)) < 0) {
-        printf("Playback open error: %s\n", snd_strerror(err));
+    if((err = pcm_sink_open(sink, &pcm_trans_sink_config, i2s_tx_sample_rate, i2s_tx_channels, profile->buffer_time, profile->period_time, profile->mmap)) < 0) {
+        printf("Playback open error: %s\n", strerror(-err));
+        pcm_trans_cur_state = PCM_TRANS_STA_EXIT;
+        pcm_trans_set_event(PCM_TRANS_EVENT_TX_STOP_DONE);
+        return NULL;
     }
 
+    pcm_trans_tx_played = 0;
+    pcm_trans_tx_played_tick = xTaskGetTickCount();
+
+    /* low latency: hand the sink one period at a time */
+    frame_size = sink->frame_size;
+    request_size = I2S_DATA_REQUEST_SIZE;
+    if(PCM_TRANS_PROFILE_LOW_LATENCY == i2s_tx_profile && sink->period_frames > 0 && sink->period_frames*frame_size < I2S_DATA_REQUEST_SIZE)
+        request_size = sink->period_frames*frame_size;
+
+    /* fds[0] is the control eventfd, the rest belong to the sink */
+    sink_fd_count = pcm_sink_poll_descriptors_count(sink);
+    fds = malloc((sink_fd_count + 1)*sizeof(struct pollfd));
+    fds[0].fd = event_fd;
+    fds[0].events = POLLIN;
+
     pcm_trans_cur_state = PCM_TRANS_STA_TX_PAUSE;
     
+    /* handle the events posted before the thread got here */
+    events = PCM_TRANS_EVENT_ALL;
+    
     while(1)
     {
-        events = 
-            PCM_TRANS_EVENT_TX_STOP |
-            PCM_TRANS_EVENT_TX_PAUSE |
-            PCM_TRANS_EVENT_TX_RESUME;
-
-        if(PCM_TRANS_STA_TX_RUN != pcm_trans_cur_state)
-            events = pcm_trans_wait_event(events, portMAX_DELAY);
-        else
+        if(PCM_TRANS_EVENT_NONE != events) {
+            events = 
+                PCM_TRANS_EVENT_TX_STOP |
+                PCM_TRANS_EVENT_TX_PAUSE |
+                PCM_TRANS_EVENT_TX_RESUME;
+            
             events = pcm_trans_wait_event(events, 0);
+        }
         
         if(PCM_TRANS_EVENT_TX_STOP & events) {
             pcm_trans_cur_state = PCM_TRANS_STA_EXIT;
@@ -190,40 +891,124 @@ void* pcm_trans_task(void* param)
             break;
         }
         else if(PCM_TRANS_EVENT_TX_PAUSE & events) {
+            if(false == device_paused) {
+                pcm_sink_pause(sink);
+                device_paused = true;
+            }
             pcm_trans_cur_state = PCM_TRANS_STA_TX_PAUSE;
         }
         else if(PCM_TRANS_EVENT_TX_RESUME & events) {
+            if(true == device_paused) {
+                pcm_sink_resume(sink);
+                device_paused = false;
+            }
             pcm_trans_cur_state = PCM_TRANS_STA_TX_RUN;
         }
 
+        /* one poll() for control events and, while running, room in the sink */
+        nfds = 1;
+        timeout = -1;
+        if(PCM_TRANS_STA_TX_RUN == pcm_trans_cur_state) {
+            nfds += pcm_sink_poll_descriptors(sink, &fds[1], sink_fd_count);
+            
+            /* a sink with nothing to wait on takes data right away */
+            if(1 == nfds)
+                timeout = 0;
+        }
+        
+        if(poll(fds, nfds, timeout) < 0 && EINTR != errno) {
+            printf("pcm poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        events = PCM_TRANS_EVENT_NONE;
+        if(POLLIN & fds[0].revents) {
+            uint64_t value;
+            read(event_fd, &value, sizeof(value));
+            events = PCM_TRANS_EVENT_ALL;
+            continue;
+        }
+
         if(PCM_TRANS_STA_TX_RUN != pcm_trans_cur_state)
             continue;
 
-        if(NULL != pcm_trans_data_request_callback) {
-            input_size = I2S_DATA_REQUEST_SIZE;
-            input_size = pcm_trans_data_request_callback(pcm_trans_data_request_param, i2s_data_request_buffer, input_size);
+        if(nfds > 1 && false == pcm_sink_poll_ready(sink, &fds[1], nfds - 1))
+            continue;
+
+        /* a short non-blocking write leaves the rest of a copied request here */
+        xSemaphoreTake(stream_mutex, portMAX_DELAY);
+        direct = -1;
+
+        /* the tail was mixed before a flush, from data the source jumped away from */
+        if(flush_generation != pcm_trans_flush_generation) {
+            flush_generation = pcm_trans_flush_generation;
+            pending_size = 0;
+        }
+        
+        if(pending_size > 0) {
+            input_buf = i2s_data_request_buffer + pending_offset;
+            input_size = pending_size;
         }
         else {
-            input_size = 0;
+            input_buf = i2s_data_request_buffer;
+            
+            if(true == pcm_trans_stream_any_used()) {
+                input_size = pcm_trans_stream_fetch(sink, &input_buf, request_size, &direct);
+            }
+            else if(NULL != pcm_trans_data_request_callback) {
+                input_size = request_size;
+                input_size = pcm_trans_data_request_callback(pcm_trans_data_request_param, i2s_data_request_buffer, input_size);
+            }
+            else {
+                input_size = 0;
+            }
         }
             
         if(input_size > 0)
         {
-            int frame_size = i2s_tx_channels*2;
-            snd_pcm_sframes_t frames = snd_pcm_writei(pcm_handle, i2s_data_request_buffer, input_size/frame_size);
-
-            if (frames < 0)
-                frames = snd_pcm_recover(pcm_handle, frames, 0);
+            int frames;
             
+            frames = pcm_sink_write(sink, input_buf, input_size/frame_size);
             if (frames < 0) {
-                printf("snd_pcm_writei failed: %s\n", snd_strerror(frames));
+                xSemaphoreGive(stream_mutex);
+                printf("pcm sink write failed: %s\n", strerror(-frames));
                 break;
             }
+
+            if(direct >= 0) {
+                pcm_trans_stream_consume(&pcm_trans_streams[direct], frames*frame_size);
+                pcm_trans_streams[direct].out_frames += frames;
+                pcm_trans_streams[direct].out_end = sink->frames_written;
+            }
+            else {
+                pending_offset = (input_buf - i2s_data_request_buffer) + frames*frame_size;
+                pending_size = input_size - frames*frame_size;
+            }
+
+            pcm_trans_tx_played = sink->frames_written - pcm_sink_delay(sink);
+            pcm_trans_tx_played_tick = xTaskGetTickCount();
+
+            pcm_trans_stream_check_done(sink, false);
+            xSemaphoreGive(stream_mutex);
+
+            if(true == pcm_trans_wait_first_sample && frames > 0) {
+                pcm_trans_wait_first_sample = false;
+                LOG_I(pcm_trans, "first sample %d ms after %s start", 
+                    xTaskGetTickCount() - pcm_trans_start_tick, (true == pcm_trans_tx_warm) ?"warm" :"cold");
+            }
         }
         else
         {
-            if(true == pcm_trans_tx_no_data) {
-                snd_pcm_wait(pcm_handle, 2000);
+            all_done = (true == pcm_trans_stream_any_used()) ?pcm_trans_stream_all_done() :pcm_trans_tx_no_data;
+            xSemaphoreGive(stream_mutex);
+            
+            if(true == all_done) {
+                pcm_sink_drain(sink, 2000);
+                
+                xSemaphoreTake(stream_mutex, portMAX_DELAY);
+                pcm_trans_stream_check_done(sink, true);
+                xSemaphoreGive(stream_mutex);
+                
                 pcm_trans_cur_state = PCM_TRANS_STA_TX_DONE;
             }
             else {
@@ -234,8 +1019,14 @@ void* pcm_trans_task(void* param)
         }
     }
 
-    snd_pcm_close(pcm_handle);
-    snd_config_update_free_global();
+    free(fds);
+    pcm_sink_close(sink);
+
+    /* left on an error: pcm_trans_stop_tx or the next start joins us */
+    if(PCM_TRANS_STA_EXIT != pcm_trans_cur_state) {
+        pcm_trans_cur_state = PCM_TRANS_STA_EXIT;
+        pcm_trans_set_event(PCM_TRANS_EVENT_TX_STOP_DONE);
+    }
 
     return NULL;
 }
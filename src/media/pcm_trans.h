@@ -3,6 +3,8 @@
 
 #include "typedefs.h"
 #include "common_event.h"
+#include "pcm_sink.h"
+#include "resampler.h"
 
 typedef enum {
     PCM_TRANS_STA_IDLE = 0,
@@ -20,21 +22,49 @@ typedef enum {
 	PCM_TRANS_ERR_SAMPLE_RATE,
 	PCM_TRANS_ERR_CHANNEL,
 	PCM_TRANS_ERR_HAL_I2S,
+	PCM_TRANS_ERR_PROFILE,
+	PCM_TRANS_ERR_SINK,
+	PCM_TRANS_ERR_STREAM,
+	PCM_TRANS_ERR_FORMAT,
 
 } pcm_trans_err_t;
 
+typedef enum {
+    PCM_TRANS_PROFILE_LONG_FORM = 0,    /* 500 ms buffer, few wakeups, resource playback */
+    PCM_TRANS_PROFILE_LOW_LATENCY,      /* 20 ms buffer / 5 ms periods, mmap access, prompts */
+
+} pcm_trans_profile_t;
+
+#define PCM_TRANS_MAX_STREAMS       4
+#define PCM_TRANS_GAIN_UNITY        32768       /* Q15 */
+
 typedef int(*p_pcm_trans_data_request_callback)(void* param, uint8_t* buf, int size);
 typedef int(*p_pcm_trans_data_notify_callback)(void* param, uint8_t* buf, int size);
+typedef int(*p_pcm_trans_data_peek_callback)(void* param, uint8_t** p_buf, int size);
+typedef void(*p_pcm_trans_data_consume_callback)(void* param, int size);
 
 int pcm_trans_init(void);
 int pcm_trans_start_tx(uint32_t sample_rate, uint8_t channels, bool only_init);
 int pcm_trans_start_rx(uint32_t sample_rate, uint8_t channels, bool only_init);
+int pcm_trans_set_tx_profile(pcm_trans_profile_t profile);
+int pcm_trans_set_tx_sink(const pcm_sink_config_t* config);
+int pcm_trans_set_tx_device_format(uint32_t sample_rate, uint8_t channels, resampler_quality_t quality);
+uint64_t pcm_trans_get_tx_frames(void);
 int pcm_trans_stop_tx(void);
 int pcm_trans_pause_tx(void);
 int pcm_trans_resume_tx(void);
 int pcm_trans_stop_rx(void);
 int pcm_trans_register_data_request_callback(p_pcm_trans_data_request_callback callback, void* param);
 int pcm_trans_register_data_notify_callback(p_pcm_trans_data_notify_callback callback, void* param);
+int pcm_trans_open_stream(int* p_stream, uint32_t sample_rate, uint8_t channels, p_pcm_trans_data_peek_callback peek_callback, p_pcm_trans_data_consume_callback consume_callback, void* param);
+int pcm_trans_close_stream(int stream);
+int pcm_trans_pause_stream(int stream);
+int pcm_trans_resume_stream(int stream);
+int pcm_trans_flush_stream(int stream);
+int pcm_trans_set_stream_gain(int stream, int gain, int ramp_ms);
+void pcm_trans_set_stream_no_data(int stream);
+bool pcm_trans_is_stream_done(int stream);
+uint32_t pcm_trans_get_stream_position(int stream);
 void pcm_trans_set_tx_no_data(void);
 int pcm_trans_wait_tx_done(void);
 bool pcm_trans_is_tx_done(void);
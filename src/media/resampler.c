@@ -0,0 +1,396 @@
+#include "resampler.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLER_X86
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#endif
+
+#define malloc(x)           pvPortMalloc(x)
+#define free(x)             vPortFree(x)
+
+log_create_module(resampler, PRINT_LEVEL_INFO);
+
+typedef int32_t(*p_resampler_dot_func)(const int16_t* coeffs, const int16_t* samples, int taps);
+
+typedef struct {
+    int         taps;
+    double      cutoff;         /* of the narrower band edge */
+    double      beta;           /* kaiser window */
+
+} resampler_preset_t;
+
+static const resampler_preset_t resampler_presets[] = {
+    [RESAMPLER_QUALITY_LOW]     = { 8,  0.80, 5.0 },
+    [RESAMPLER_QUALITY_MEDIUM]  = { 16, 0.88, 7.0 },
+    [RESAMPLER_QUALITY_HIGH]    = { 32, 0.94, 9.0 },
+};
+
+static uint32_t resampler_gcd(uint32_t a, uint32_t b)
+{
+    uint32_t t;
+    
+    while(0 != b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* zeroth order modified bessel function, for the kaiser window */
+static double resampler_bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for(k = 1; k < 32; k++) {
+        term *= (x/(2*k))*(x/(2*k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+static void resampler_design(resampler_t* resampler, const resampler_preset_t* preset)
+{
+    int length = resampler->L*preset->taps;
+    double center = (length - 1)/2.0;
+    double fc = preset->cutoff*0.5/((resampler->L > resampler->M) ?resampler->L :resampler->M);
+    double i0_beta = resampler_bessel_i0(preset->beta);
+    double h, x, w, sum;
+    uint32_t p;
+    int k, n, q, total;
+
+    for(p = 0; p < resampler->L; p++)
+    {
+        double phase[32];
+        
+        sum = 0;
+        for(k = 0; k < preset->taps; k++) {
+            n = p + k*resampler->L;
+            x = n - center;
+            h = (0 == x) ?2*fc :sin(2*M_PI*fc*x)/(M_PI*x);
+            w = resampler_bessel_i0(preset->beta*sqrt(1 - (x/center)*(x/center)))/i0_beta;
+            phase[k] = h*w;
+            sum += phase[k];
+        }
+
+        /* every phase gets unity dc gain, the rounding error goes to the center tap */
+        total = 0;
+        for(k = 0; k < preset->taps; k++) {
+            q = (int)lrint(phase[k]/sum*32768.0);
+            if(q > 32767)
+                q = 32767;
+            resampler->coeffs[p*preset->taps + (preset->taps - 1 - k)] = q;
+            total += q;
+        }
+        
+        q = resampler->coeffs[p*preset->taps + preset->taps/2] + (32768 - total);
+        resampler->coeffs[p*preset->taps + preset->taps/2] = (q > 32767) ?32767 :q;
+    }
+}
+
+static int32_t resampler_dot_scalar(const int16_t* coeffs, const int16_t* samples, int taps)
+{
+    int32_t sum = 0;
+    int k;
+
+    for(k = 0; k < taps; k++)
+        sum += coeffs[k]*samples[k];
+
+    return sum;
+}
+
+#ifdef RESAMPLER_X86
+__attribute__((target("sse2")))
+static int32_t resampler_dot_sse2(const int16_t* coeffs, const int16_t* samples, int taps)
+{
+    __m128i acc = _mm_setzero_si128();
+    int k;
+
+    for(k = 0; k < taps; k += 8)
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)&coeffs[k]), _mm_loadu_si128((const __m128i*)&samples[k])));
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+    return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2")))
+static int32_t resampler_dot_avx2(const int16_t* coeffs, const int16_t* samples, int taps)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m128i sum;
+    int k = 0;
+
+    for(; k + 16 <= taps; k += 16)
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)&coeffs[k]), _mm256_loadu_si256((const __m256i*)&samples[k])));
+
+    sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    
+    /* 8 taps left over for the low preset */
+    if(k < taps)
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)&coeffs[k]), _mm_loadu_si128((const __m128i*)&samples[k])));
+
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+#ifdef RESAMPLER_NEON
+static int32_t resampler_dot_neon(const int16_t* coeffs, const int16_t* samples, int taps)
+{
+    int32x4_t acc = vdupq_n_s32(0);
+    int16x8_t c, s;
+    int k;
+
+    for(k = 0; k < taps; k += 8) {
+        c = vld1q_s16(&coeffs[k]);
+        s = vld1q_s16(&samples[k]);
+        acc = vmlal_s16(acc, vget_low_s16(c), vget_low_s16(s));
+        acc = vmlal_s16(acc, vget_high_s16(c), vget_high_s16(s));
+    }
+
+#ifdef __aarch64__
+    return vaddvq_s32(acc);
+#else
+    /* no across-vector add on 32-bit arm */
+    {
+        int32x2_t sum = vpadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+        return vget_lane_s32(vpadd_s32(sum, sum), 0);
+    }
+#endif
+}
+#endif
+
+static int32_t resampler_dot_select(const int16_t* coeffs, const int16_t* samples, int taps);
+
+static p_resampler_dot_func resampler_dot = resampler_dot_select;
+static const char* resampler_kernel_name = "none";
+
+static int32_t resampler_dot_select(const int16_t* coeffs, const int16_t* samples, int taps)
+{
+    p_resampler_dot_func kernel = resampler_dot_scalar;
+    const char* name = "scalar";
+
+#if defined(RESAMPLER_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernel = resampler_dot_avx2;
+        name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        kernel = resampler_dot_sse2;
+        name = "sse2";
+    }
+#elif defined(RESAMPLER_NEON)
+    kernel = resampler_dot_neon;
+    name = "neon";
+#endif
+
+    /* every caller picks the same kernel, so racing here is harmless */
+    resampler_kernel_name = name;
+    resampler_dot = kernel;
+    LOG_I(resampler, "resampler kernel: %s", name);
+
+    return kernel(coeffs, samples, taps);
+}
+
+static int16_t resampler_round(int32_t sum)
+{
+    sum = (sum + (1 << 14)) >> 15;
+    return (sum > INT16_MAX) ?INT16_MAX :(sum < INT16_MIN) ?INT16_MIN :sum;
+}
+
+int resampler_get_taps(resampler_quality_t quality)
+{
+    return (quality <= RESAMPLER_QUALITY_HIGH) ?resampler_presets[quality].taps :0;
+}
+
+const char* resampler_get_kernel_name(void)
+{
+    if(resampler_dot_select == resampler_dot) {
+        int16_t zero[8] = {0};
+        resampler_dot_select(zero, zero, 8);
+    }
+
+    return resampler_kernel_name;
+}
+
+int resampler_init(resampler_t* resampler, uint32_t in_rate, uint32_t out_rate, uint8_t in_channels, uint8_t out_channels, resampler_quality_t quality)
+{
+    const resampler_preset_t* preset;
+    uint32_t gcd;
+    int c;
+
+    memset(resampler, 0, sizeof(resampler_t));
+
+    if(0 == in_rate || 0 == out_rate || quality > RESAMPLER_QUALITY_HIGH ||
+       in_channels < 1 || in_channels > 2 || out_channels < 1 || out_channels > 2)
+    {
+        return RESAMPLER_ERR_PARAM;
+    }
+
+    gcd = resampler_gcd(in_rate, out_rate);
+    preset = &resampler_presets[quality];
+    
+    resampler->in_rate = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->L = out_rate/gcd;
+    resampler->M = in_rate/gcd;
+    resampler->taps = preset->taps;
+    resampler->in_channels = in_channels;
+    resampler->out_channels = out_channels;
+
+    if(resampler->L > RESAMPLER_MAX_PHASES) {
+        LOG_E(resampler, "%d -> %d needs %d phases", in_rate, out_rate, resampler->L);
+        return RESAMPLER_ERR_RATIO;
+    }
+
+    resampler->coeffs = malloc(resampler->L*resampler->taps*sizeof(int16_t));
+    for(c = 0; c < in_channels; c++)
+        resampler->history[c] = malloc((resampler->taps - 1 + RESAMPLER_BLOCK_SIZE)*sizeof(int16_t));
+
+    if(NULL == resampler->coeffs || NULL == resampler->history[0] || (2 == in_channels && NULL == resampler->history[1])) {
+        resampler_deinit(resampler);
+        return RESAMPLER_ERR_MEMORY;
+    }
+
+    resampler_design(resampler, preset);
+    resampler_reset(resampler);
+    
+    LOG_I(resampler, "%d -> %d, L:%d, M:%d, taps:%d, channels %d -> %d", 
+        in_rate, out_rate, resampler->L, resampler->M, resampler->taps, in_channels, out_channels);
+    
+    return RESAMPLER_SUCCESS;
+}
+
+void resampler_deinit(resampler_t* resampler)
+{
+    int c;
+    
+    if(NULL != resampler->coeffs)
+        free(resampler->coeffs);
+
+    for(c = 0; c < 2; c++) {
+        if(NULL != resampler->history[c])
+            free(resampler->history[c]);
+    }
+
+    memset(resampler, 0, sizeof(resampler_t));
+}
+
+/* forget the history, the next input starts from silence */
+void resampler_reset(resampler_t* resampler)
+{
+    int c;
+    
+    for(c = 0; c < resampler->in_channels; c++)
+        memset(resampler->history[c], 0, (resampler->taps - 1)*sizeof(int16_t));
+
+    resampler->fill = resampler->taps - 1;
+    resampler->pos = resampler->taps - 1;
+    resampler->phase = 0;
+}
+
+/* 
+ * Converts interleaved S16 until the input is used up or out_frames are
+ * written, returns the frames written and *p_used the input frames taken.
+ */
+int resampler_process(resampler_t* resampler, const int16_t* in, int in_frames, int* p_used, int16_t* out, int out_frames)
+{
+    const int16_t* coeffs;
+    int16_t left, right;
+    int used = 0, produced = 0;
+    int keep, count, i, c;
+
+    /* same rate, only the channels are mapped */
+    if(resampler->L == resampler->M)
+    {
+        count = (in_frames < out_frames) ?in_frames :out_frames;
+        
+        for(i = 0; i < count; i++) {
+            left = in[i*resampler->in_channels];
+            right = in[i*resampler->in_channels + resampler->in_channels - 1];
+            
+            if(1 == resampler->out_channels) {
+                out[i] = (int16_t)(((int32_t)left + right) >> 1);
+            }
+            else {
+                out[2*i] = left;
+                out[2*i + 1] = right;
+            }
+        }
+
+        *p_used = count;
+        return count;
+    }
+
+    while(produced < out_frames)
+    {
+        if(resampler->pos >= resampler->fill)
+        {
+            if(used >= in_frames)
+                break;
+
+            /* slide the history down to what the next output still needs */
+            keep = resampler->pos - (resampler->taps - 1);
+            if(keep > 0) {
+                for(c = 0; c < resampler->in_channels; c++)
+                    memmove(resampler->history[c], resampler->history[c] + keep, (resampler->fill - keep)*sizeof(int16_t));
+                
+                resampler->fill -= keep;
+                resampler->pos -= keep;
+            }
+
+            count = resampler->taps - 1 + RESAMPLER_BLOCK_SIZE - resampler->fill;
+            if(count > in_frames - used)
+                count = in_frames - used;
+
+            if(1 == resampler->in_channels) {
+                memcpy(resampler->history[0] + resampler->fill, in + used, count*sizeof(int16_t));
+            }
+            else {
+                for(i = 0; i < count; i++) {
+                    resampler->history[0][resampler->fill + i] = in[2*(used + i)];
+                    resampler->history[1][resampler->fill + i] = in[2*(used + i) + 1];
+                }
+            }
+
+            resampler->fill += count;
+            used += count;
+            continue;
+        }
+
+        coeffs = resampler->coeffs + resampler->phase*resampler->taps;
+        i = resampler->pos - (resampler->taps - 1);
+        
+        left = resampler_round(resampler_dot(coeffs, resampler->history[0] + i, resampler->taps));
+        right = (2 == resampler->in_channels) ?resampler_round(resampler_dot(coeffs, resampler->history[1] + i, resampler->taps)) :left;
+
+        if(1 == resampler->out_channels) {
+            out[produced] = (2 == resampler->in_channels) ?(int16_t)(((int32_t)left + right) >> 1) :left;
+        }
+        else {
+            out[2*produced] = left;
+            out[2*produced + 1] = right;
+        }
+        
+        produced++;
+
+        resampler->phase += resampler->M;
+        resampler->pos += resampler->phase/resampler->L;
+        resampler->phase %= resampler->L;
+    }
+
+    *p_used = used;
+    return produced;
+}
+
@@ -0,0 +1,53 @@
+#ifndef __RESAMPLER_H
+#define __RESAMPLER_H
+
+#include "typedefs.h"
+
+#define RESAMPLER_MAX_PHASES    1024
+#define RESAMPLER_BLOCK_SIZE    1024        /* input frames buffered per refill */
+
+typedef enum {
+    RESAMPLER_QUALITY_LOW = 0,      /* 8 taps per phase */
+    RESAMPLER_QUALITY_MEDIUM,       /* 16 taps per phase */
+    RESAMPLER_QUALITY_HIGH,         /* 32 taps per phase */
+
+} resampler_quality_t;
+
+typedef enum {
+    RESAMPLER_SUCCESS = 0,
+    RESAMPLER_ERR_PARAM,
+    RESAMPLER_ERR_RATIO,
+    RESAMPLER_ERR_MEMORY,
+
+} resampler_return_t;
+
+/* 
+ * Polyphase FIR: up by L, low pass, down by M with in_rate*L == out_rate*M.
+ * Phase p of the prototype filter is stored reversed and contiguous, so every
+ * output sample is one taps long dot product against the input history.
+ */
+typedef struct {
+    uint32_t            in_rate;
+    uint32_t            out_rate;
+    uint32_t            L;
+    uint32_t            M;
+    int                 taps;
+    uint8_t             in_channels;
+    uint8_t             out_channels;       /* 1 <-> 2 is up/down mixed */
+    int16_t*            coeffs;             /* L x taps, Q15 */
+    int16_t*            history[2];         /* planar, taps - 1 + RESAMPLER_BLOCK_SIZE */
+    int                 fill;               /* valid samples in history */
+    int                 pos;                /* newest input sample of the next output */
+    uint32_t            phase;
+
+} resampler_t;
+
+int resampler_init(resampler_t* resampler, uint32_t in_rate, uint32_t out_rate, uint8_t in_channels, uint8_t out_channels, resampler_quality_t quality);
+void resampler_deinit(resampler_t* resampler);
+void resampler_reset(resampler_t* resampler);
+int resampler_process(resampler_t* resampler, const int16_t* in, int in_frames, int* p_used, int16_t* out, int out_frames);
+int resampler_get_taps(resampler_quality_t quality);
+const char* resampler_get_kernel_name(void);
+
+#endif
+
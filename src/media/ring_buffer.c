@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
 #include "ring_buffer.h"
 #include <string.h>
 
+#ifdef DEF_LINUX_PLATFORM
+#include <sys/mman.h>
+#endif
+
 #define malloc(x)           pvPortMalloc(x)
 #define free(x)             vPortFree(x)
 
@@ -21,7 +26,52 @@ static int roundUpToPowerOfTwo(int i)
     return i + 1;
 }
 
-int ring_buffer_init(ring_buffer_t* ring_buffer, uint32_t size)
+#ifdef DEF_LINUX_PLATFORM
+/* map one memfd twice back to back so any region of the ring is contiguous */
+static uint8_t* ring_buffer_map_mirror(uint32_t size)
+{
+    uint8_t* base;
+    int fd;
+
+    if(0 != size % getpagesize())
+        return NULL;
+
+    fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+
+    if(0 != ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = (uint8_t*)mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == base) {
+        close(fd);
+        return NULL;
+    }
+
+    if(MAP_FAILED == mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ||
+       MAP_FAILED == mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0))
+    {
+        munmap(base, 2*size);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    return base;
+}
+#endif
+
+/*
+ * in is only stored by the producer and out only by the consumer. Each side
+ * reads the other index with acquire and publishes its own with release, so
+ * the buffer contents are visible before the index that covers them. In
+ * RING_BUF_MODE_MUTEX the same code simply runs under the mutex.
+ */
+
+int ring_buffer_init(ring_buffer_t* ring_buffer, uint32_t size, ring_buffer_mode_t mode)
 {
     if (!isPowerOfTwo(size))
     {
@@ -30,23 +80,43 @@ int ring_buffer_init(ring_buffer_t* ring_buffer, uint32_t size)
         size = roundUpToPowerOfTwo(size);
     }
         
-	ring_buffer->buffer    = (uint8_t*)malloc(size);
+    ring_buffer->buffer    = NULL;
+    ring_buffer->mirrored  = false;
+#ifdef DEF_LINUX_PLATFORM
+    ring_buffer->buffer    = ring_buffer_map_mirror(size);
+    ring_buffer->mirrored  = (NULL != ring_buffer->buffer) ?true :false;
+#endif
+    if(NULL == ring_buffer->buffer)
+        ring_buffer->buffer = (uint8_t*)malloc(size);
     if(NULL == ring_buffer->buffer) 
     {
         return RING_BUF_ERR_MALLOC;
     }
     memset(ring_buffer->buffer, 0, size);
     
-    ring_buffer->mutex     = xSemaphoreCreateMutex();
-	ring_buffer->in       = 0;
-	ring_buffer->out       = 0;
+    ring_buffer->mode      = mode;
+    ring_buffer->mutex     = (RING_BUF_MODE_MUTEX == mode) ?xSemaphoreCreateMutex() :NULL;
+	atomic_init(&ring_buffer->in, 0);
+	atomic_init(&ring_buffer->out, 0);
 	ring_buffer->size  = size;
+    ring_buffer->low_watermark      = 0;
+    ring_buffer->high_watermark     = size;
+    ring_buffer->watermark_callback = NULL;
+    ring_buffer->watermark_param    = NULL;
     
     return RING_BUF_SUCCESS;
 }
 
 int ring_buffer_deinit(ring_buffer_t* ring_buffer)
 {
+#ifdef DEF_LINUX_PLATFORM
+    if(true == ring_buffer->mirrored) {
+        munmap(ring_buffer->buffer, 2*ring_buffer->size);
+        ring_buffer->buffer = NULL;
+        ring_buffer->mirrored = false;
+    }
+#endif
+
 	if(NULL != ring_buffer->buffer) {
 		free(ring_buffer->buffer);
 		ring_buffer->buffer = NULL;
@@ -62,6 +132,9 @@ int ring_buffer_deinit(ring_buffer_t* ring_buffer)
 
 static int ring_buffer_lock(ring_buffer_t* ring_buffer, bool from_isr)
 {
+    if(RING_BUF_MODE_SPSC == ring_buffer->mode)
+        return RING_BUF_SUCCESS;
+
     if(true == from_isr)
         xSemaphoreTakeFromISR(ring_buffer->mutex, NULL);
     else
@@ -72,6 +145,9 @@ static int ring_buffer_lock(ring_buffer_t* ring_buffer, bool from_isr)
 
 static int ring_buffer_unlock(ring_buffer_t* ring_buffer, bool from_isr)
 {
+    if(RING_BUF_MODE_SPSC == ring_buffer->mode)
+        return RING_BUF_SUCCESS;
+
     if(true == from_isr)
         xSemaphoreGiveFromISR(ring_buffer->mutex, NULL);
     else
@@ -80,52 +156,181 @@ static int ring_buffer_unlock(ring_buffer_t* ring_buffer, bool from_isr)
     return RING_BUF_SUCCESS;
 }
 
+/*
+ * Watermarks are level triggered: every pop/consume that leaves the ring at
+ * or below low and every push/commit that leaves it at or above high calls
+ * the callback, outside the lock. The callback has to be cheap and must not
+ * mind being called again for the same level.
+ */
+int ring_buffer_set_watermark(ring_buffer_t* ring_buffer, uint32_t low, uint32_t high, p_ring_buffer_watermark_callback callback, void* param)
+{
+    if(low > high || high > ring_buffer->size)
+        return RING_BUF_ERR_SIZE;
+
+    ring_buffer->watermark_callback = NULL;
+    ring_buffer->low_watermark      = low;
+    ring_buffer->high_watermark     = high;
+    ring_buffer->watermark_param    = param;
+    ring_buffer->watermark_callback = callback;
+
+    return RING_BUF_SUCCESS;
+}
+
+static void ring_buffer_notify_low(ring_buffer_t* ring_buffer, uint32_t out)
+{
+    p_ring_buffer_watermark_callback callback = ring_buffer->watermark_callback;
+
+    if(NULL != callback && 
+       atomic_load_explicit(&ring_buffer->in, memory_order_acquire) - out <= ring_buffer->low_watermark)
+    {
+        callback(ring_buffer->watermark_param, RING_BUF_WATERMARK_LOW);
+    }
+}
+
+static void ring_buffer_notify_high(ring_buffer_t* ring_buffer, uint32_t in)
+{
+    p_ring_buffer_watermark_callback callback = ring_buffer->watermark_callback;
+
+    if(NULL != callback && 
+       in - atomic_load_explicit(&ring_buffer->out, memory_order_acquire) >= ring_buffer->high_watermark)
+    {
+        callback(ring_buffer->watermark_param, RING_BUF_WATERMARK_HIGH);
+    }
+}
+
 uint32_t ring_buffer_push(ring_buffer_t* ring_buffer, const void* buffer, uint32_t size, bool from_isr)
 {
     uint32_t len = 0;
+    uint32_t in, out;
 
     ring_buffer_lock(ring_buffer, from_isr);
+
+    in  = atomic_load_explicit(&ring_buffer->in, memory_order_relaxed);
+    out = atomic_load_explicit(&ring_buffer->out, memory_order_acquire);
 	
-	size = min(size, ring_buffer->size - ring_buffer->in + ring_buffer->out);
+	size = min(size, ring_buffer->size - in + out);
     
     /* first put the data starting from fifo->in to buffer out */
-    len  = min(size, ring_buffer->size - (ring_buffer->in & (ring_buffer->size - 1)));
-    memcpy(ring_buffer->buffer + (ring_buffer->in & (ring_buffer->size - 1)), buffer, len);
+    len  = min(size, ring_buffer->size - (in & (ring_buffer->size - 1)));
+    memcpy(ring_buffer->buffer + (in & (ring_buffer->size - 1)), buffer, len);
     /* then put the rest (if any) at the beginning of the buffer */
     memcpy(ring_buffer->buffer, buffer + len, size - len);
 	
-    ring_buffer->in += size;
+    atomic_store_explicit(&ring_buffer->in, in + size, memory_order_release);
  
     ring_buffer_unlock(ring_buffer, from_isr);
+
+    ring_buffer_notify_high(ring_buffer, in + size);
     return size;
 }
 
 uint32_t ring_buffer_pop(ring_buffer_t* ring_buffer, void* buffer, uint32_t size, bool from_isr)
 {
     uint32_t len = 0;
+    uint32_t in, out;
 
     ring_buffer_lock(ring_buffer, from_isr);
 
-    size = min(size, ring_buffer->in - ring_buffer->out);
+    out = atomic_load_explicit(&ring_buffer->out, memory_order_relaxed);
+    in  = atomic_load_explicit(&ring_buffer->in, memory_order_acquire);
+
+    size = min(size, in - out);
     
     /* first get the data from fifo->out until the out of the buffer */
-    len = min(size, ring_buffer->size - (ring_buffer->out & (ring_buffer->size - 1)));
-    memcpy(buffer, ring_buffer->buffer + (ring_buffer->out & (ring_buffer->size - 1)), len);
+    len = min(size, ring_buffer->size - (out & (ring_buffer->size - 1)));
+    memcpy(buffer, ring_buffer->buffer + (out & (ring_buffer->size - 1)), len);
     /* then get the rest (if any) from the beginning of the buffer */
     memcpy(buffer + len, ring_buffer->buffer, size - len);
 
-    ring_buffer->out += size;
+    atomic_store_explicit(&ring_buffer->out, out + size, memory_order_release);
     
     ring_buffer_unlock(ring_buffer, from_isr);
+
+    ring_buffer_notify_low(ring_buffer, out + size);
     return size;
 }
 
+/*
+ * Zero copy access. reserve/peek return how many bytes can be written/read
+ * in place at *p_buf (at most size), commit/consume then publish them. With
+ * a mirrored buffer that is everything free/available, otherwise only the
+ * part up to the end of the buffer.
+ */
+uint32_t ring_buffer_reserve(ring_buffer_t* ring_buffer, uint8_t** p_buf, uint32_t size, bool from_isr)
+{
+    uint32_t offset, in, out;
+
+    ring_buffer_lock(ring_buffer, from_isr);
+
+    in  = atomic_load_explicit(&ring_buffer->in, memory_order_relaxed);
+    out = atomic_load_explicit(&ring_buffer->out, memory_order_acquire);
+
+    offset = in & (ring_buffer->size - 1);
+    size = min(size, ring_buffer->size - in + out);
+    if(false == ring_buffer->mirrored)
+        size = min(size, ring_buffer->size - offset);
+
+    ring_buffer_unlock(ring_buffer, from_isr);
+
+    *p_buf = ring_buffer->buffer + offset;
+    return size;
+}
+
+int ring_buffer_commit(ring_buffer_t* ring_buffer, uint32_t size, bool from_isr)
+{
+    uint32_t in;
+
+    ring_buffer_lock(ring_buffer, from_isr);
+    in = atomic_load_explicit(&ring_buffer->in, memory_order_relaxed) + size;
+    atomic_store_explicit(&ring_buffer->in, in, memory_order_release);
+    ring_buffer_unlock(ring_buffer, from_isr);
+
+    ring_buffer_notify_high(ring_buffer, in);
+
+    return RING_BUF_SUCCESS;
+}
+
+uint32_t ring_buffer_peek(ring_buffer_t* ring_buffer, uint8_t** p_buf, uint32_t size, bool from_isr)
+{
+    uint32_t offset, in, out;
+
+    ring_buffer_lock(ring_buffer, from_isr);
+
+    out = atomic_load_explicit(&ring_buffer->out, memory_order_relaxed);
+    in  = atomic_load_explicit(&ring_buffer->in, memory_order_acquire);
+
+    offset = out & (ring_buffer->size - 1);
+    size = min(size, in - out);
+    if(false == ring_buffer->mirrored)
+        size = min(size, ring_buffer->size - offset);
+
+    ring_buffer_unlock(ring_buffer, from_isr);
+
+    *p_buf = ring_buffer->buffer + offset;
+    return size;
+}
+
+int ring_buffer_consume(ring_buffer_t* ring_buffer, uint32_t size, bool from_isr)
+{
+    uint32_t out;
+
+    ring_buffer_lock(ring_buffer, from_isr);
+    out = atomic_load_explicit(&ring_buffer->out, memory_order_relaxed) + size;
+    atomic_store_explicit(&ring_buffer->out, out, memory_order_release);
+    ring_buffer_unlock(ring_buffer, from_isr);
+
+    ring_buffer_notify_low(ring_buffer, out);
+
+    return RING_BUF_SUCCESS;
+}
+
+/* in RING_BUF_MODE_SPSC both the producer and the consumer must be idle */
 int ring_buffer_clear(ring_buffer_t* ring_buffer, bool from_isr)
 {
     ring_buffer_lock(ring_buffer, from_isr);
     
-    ring_buffer->in   = 0;
-    ring_buffer->out   = 0;
+    atomic_store_explicit(&ring_buffer->in, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring_buffer->out, 0, memory_order_release);
 
     ring_buffer_unlock(ring_buffer, from_isr);
     return RING_BUF_SUCCESS;
@@ -133,10 +338,16 @@ int ring_buffer_clear(ring_buffer_t* ring_buffer, bool from_isr)
 
 int ring_buffer_get_count(ring_buffer_t* ring_buffer)
 {
-    return (ring_buffer->in - ring_buffer->out);
+    uint32_t out = atomic_load_explicit(&ring_buffer->out, memory_order_acquire);
+    uint32_t in  = atomic_load_explicit(&ring_buffer->in, memory_order_acquire);
+
+    return (in - out);
 }
 
 int ring_buffer_get_free_count(ring_buffer_t* ring_buffer)
 {
-    return (ring_buffer->size - ring_buffer->in + ring_buffer->out);
+    uint32_t in  = atomic_load_explicit(&ring_buffer->in, memory_order_acquire);
+    uint32_t out = atomic_load_explicit(&ring_buffer->out, memory_order_acquire);
+
+    return (ring_buffer->size - in + out);
 }
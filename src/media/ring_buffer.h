@@ -2,6 +2,9 @@
 #define __RING_BUFFER_H
 
 #include "typedefs.h"
+#include <stdatomic.h>
+
+#define RING_BUF_CACHE_LINE     64
 
 typedef enum {
     RING_BUF_SUCCESS = 0,
@@ -11,22 +14,50 @@ typedef enum {
 
 } ring_buffer_return_t;
 
+typedef enum {
+    RING_BUF_MODE_MUTEX = 0,    /* any number of producers/consumers */
+    RING_BUF_MODE_SPSC,         /* one producer thread + one consumer thread, lock free */
+
+} ring_buffer_mode_t;
+
+typedef enum {
+    RING_BUF_WATERMARK_LOW = 0,     /* count <= low after a pop/consume, wake the producer */
+    RING_BUF_WATERMARK_HIGH,        /* count >= high after a push/commit, wake the consumer */
+
+} ring_buffer_watermark_t;
+
+typedef void(*p_ring_buffer_watermark_callback)(void* param, ring_buffer_watermark_t watermark);
+
 typedef struct {
     SemaphoreHandle_t mutex;
     uint8_t* buffer;      /* the buffer holding the data */
-	uint32_t in;         /* data is added at offset (in % size) */
-	uint32_t out;         /* data is extracted from off. (out % size) */
 	uint32_t size;    /* the size of the allocated buffer */
+    bool mirrored;        /* buffer is mapped twice back to back, [size, 2*size) aliases [0, size) */
+    ring_buffer_mode_t mode;
+
+    uint32_t low_watermark;
+    uint32_t high_watermark;
+    p_ring_buffer_watermark_callback watermark_callback;
+    void* watermark_param;
+
+    /* written by the producer/consumer only, kept on separate cache lines */
+	_Atomic uint32_t in  __attribute__((aligned(RING_BUF_CACHE_LINE)));    /* data is added at offset (in % size) */
+	_Atomic uint32_t out __attribute__((aligned(RING_BUF_CACHE_LINE)));    /* data is extracted from off. (out % size) */
 
 } ring_buffer_t;
 
-int ring_buffer_init(ring_buffer_t* ring_buffer, uint32_t size);
+int ring_buffer_init(ring_buffer_t* ring_buffer, uint32_t size, ring_buffer_mode_t mode);
 int ring_buffer_deinit(ring_buffer_t* ring_buffer);
 int ring_buffer_clear(ring_buffer_t* ring_buffer, bool from_isr);
 //int ring_buffer_push(ring_buffer_t* ring_buffer, const uint8_t* buffer, uint32_t size, bool from_isr);
 uint32_t ring_buffer_push(ring_buffer_t* ring_buffer, const void* buffer, uint32_t size, bool from_isr);
 uint32_t ring_buffer_pop(ring_buffer_t* ring_buffer, void* buffer, uint32_t size, bool from_isr);
 //int ring_buffer_pop(ring_buffer_t* ring_buffer, uint8_t* buffer, uint32_t* p_size, bool from_isr);
+uint32_t ring_buffer_reserve(ring_buffer_t* ring_buffer, uint8_t** p_buf, uint32_t size, bool from_isr);
+int ring_buffer_commit(ring_buffer_t* ring_buffer, uint32_t size, bool from_isr);
+uint32_t ring_buffer_peek(ring_buffer_t* ring_buffer, uint8_t** p_buf, uint32_t size, bool from_isr);
+int ring_buffer_consume(ring_buffer_t* ring_buffer, uint32_t size, bool from_isr);
+int ring_buffer_set_watermark(ring_buffer_t* ring_buffer, uint32_t low, uint32_t high, p_ring_buffer_watermark_callback callback, void* param);
 int ring_buffer_get_count(ring_buffer_t* ring_buffer);
 int ring_buffer_get_free_count(ring_buffer_t* ring_buffer);
 
@@ -3,20 +3,36 @@
 #define malloc(x)           pvPortMalloc(x)
 #define free(x)             vPortFree(x)
 
+/* 
+ * No node is allocated here, push allocates them as the buffer first fills,
+ * at most what max_size takes plus the one a partly drained head adds.
+ * Drained nodes go back to free_nodes, push and pop do not touch the heap
+ * once the buffer has been full; a buffer never pushed to costs nothing.
+ */
 int common_buffer_init(common_buffer_t* com_buffer, uint32_t node_size, uint32_t max_size)
 {
-    com_buffer->mutex     = xSemaphoreCreateMutex();
-    com_buffer->count     = 0;
-    com_buffer->node_size = node_size;
-    com_buffer->max_size  = max_size;
-    com_buffer->head      = NULL;
-    com_buffer->tail      = NULL;
+    com_buffer->mutex       = xSemaphoreCreateMutex();
+    com_buffer->event_handle = xEventGroupCreate();
+    com_buffer->count       = 0;
+    com_buffer->node_size   = node_size;
+    com_buffer->max_size    = max_size;
+    com_buffer->head        = NULL;
+    com_buffer->tail        = NULL;
+    com_buffer->free_nodes  = NULL;
+    com_buffer->reserve_node = NULL;
+    com_buffer->reserve_tail = false;
+    com_buffer->data_waiters = 0;
+    com_buffer->free_waiters = 0;
+    com_buffer->alloc_count = 0;
+    com_buffer->reuse_count = 0;
     
     return COMMON_BUF_SUCCESS;
 }
 
 int common_buffer_deinit(common_buffer_t* com_buffer)
 {
+    common_node_t* tmp;
+
     if(NULL != com_buffer->mutex) {
         common_buffer_clear(com_buffer);
         
@@ -24,6 +40,17 @@ int common_buffer_deinit(common_buffer_t* com_buffer)
         com_buffer->mutex = NULL;
     }
 
+    if(NULL != com_buffer->event_handle) {
+        vEventGroupDelete(com_buffer->event_handle);
+        com_buffer->event_handle = NULL;
+    }
+
+    while(com_buffer->free_nodes) {
+        tmp = com_buffer->free_nodes;
+        com_buffer->free_nodes = tmp->next;
+        free(tmp);
+    }
+
 	return COMMON_BUF_SUCCESS;
 }
 
@@ -39,38 +66,52 @@ static int common_buffer_unlock(common_buffer_t* com_buffer)
     return COMMON_BUF_SUCCESS;
 }
 
-static int common_buffer_create_node(common_node_t** pp_node, uint32_t size)
+/* header and payload in one block, the payload is not cleared */
+static int common_buffer_alloc_node(common_buffer_t* com_buffer, common_node_t** pp_node)
 {
-    int ret = COMMON_BUF_SUCCESS;
-    common_node_t* tmp = (common_node_t*)malloc(sizeof(common_node_t));
+    common_node_t* tmp = (common_node_t*)malloc(sizeof(common_node_t) + com_buffer->node_size);
     
     if(NULL == tmp) {
-        ret = COMMON_BUF_ERR_MALLOC;
-        goto END;
+        return COMMON_BUF_ERR_MALLOC;
     }
 
-    memset(tmp, 0, sizeof(common_node_t));
-	
-	tmp->size = size;
-    tmp->buffer = (uint8_t*)malloc(size);
-    if(NULL == tmp->buffer) {
-        free(tmp);
-        ret = COMMON_BUF_ERR_MALLOC;
-        goto END;
+    tmp->buffer = (uint8_t*)(tmp + 1);
+    tmp->size   = com_buffer->node_size;
+    tmp->next   = NULL;
+    com_buffer->alloc_count++;
+
+    *pp_node = tmp;
+    return COMMON_BUF_SUCCESS;
+}
+
+static int common_buffer_create_node(common_buffer_t* com_buffer, common_node_t** pp_node)
+{
+    int ret = COMMON_BUF_SUCCESS;
+    common_node_t* tmp = com_buffer->free_nodes;
+    
+    if(NULL != tmp) {
+        com_buffer->free_nodes = tmp->next;
+        com_buffer->reuse_count++;
+    }
+    else {
+        ret = common_buffer_alloc_node(com_buffer, &tmp);
+        if(COMMON_BUF_SUCCESS != ret)
+            return ret;
     }
 
-    memset(tmp->buffer, 0, size);
+    tmp->beg   = 0;
+    tmp->end   = 0;
+    tmp->count = 0;
+    tmp->next  = NULL;
 
     *pp_node = tmp;
-
-END:
     return ret;
 }
 
-static int common_buffer_destroy_node(common_node_t* node)
+static int common_buffer_destroy_node(common_buffer_t* com_buffer, common_node_t* node)
 {
-    free(node->buffer);
-    free(node);
+    node->next = com_buffer->free_nodes;
+    com_buffer->free_nodes = node;
     return COMMON_BUF_SUCCESS;
 }
 
@@ -131,14 +172,22 @@ int common_buffer_clear(common_buffer_t* com_buffer)
 		tmp = com_buffer->head;
         com_buffer->head = com_buffer->head->next;
 
-		common_buffer_destroy_node(tmp);
+		common_buffer_destroy_node(com_buffer, tmp);
+    }
+
+    if(NULL != com_buffer->reserve_node) {
+        common_buffer_destroy_node(com_buffer, com_buffer->reserve_node);
+        com_buffer->reserve_node = NULL;
     }
 
     com_buffer->count = 0;
     com_buffer->head  = NULL;
     com_buffer->tail  = NULL;
+    com_buffer->reserve_tail = false;
 
     common_buffer_unlock(com_buffer);
+
+    xEventGroupSetBits(com_buffer->event_handle, COMMON_BUF_EVENT_FREE);
     return ret;
 }
 
@@ -159,7 +208,7 @@ int common_buffer_push(common_buffer_t* com_buffer, const uint8_t* buffer, uint3
 	{
 		if(NULL==com_buffer->tail || com_buffer->tail->count >= com_buffer->tail->size)
 		{
-			ret = common_buffer_create_node(&tmp, com_buffer->node_size);
+			ret = common_buffer_create_node(com_buffer, &tmp);
 			
 			if(COMMON_BUF_SUCCESS != ret)
 				break;
@@ -182,6 +231,9 @@ int common_buffer_push(common_buffer_t* com_buffer, const uint8_t* buffer, uint3
 
 END:
     common_buffer_unlock(com_buffer);
+
+    if(pos > 0)
+        xEventGroupSetBits(com_buffer->event_handle, COMMON_BUF_EVENT_DATA);
     return ret;
 }
 
@@ -198,7 +250,7 @@ int common_buffer_pop(common_buffer_t* com_buffer, uint8_t* buffer, uint32_t* p_
 	if(size > com_buffer->count)
 		size = com_buffer->count;
 
-	if(NULL == com_buffer->head) {
+	if(NULL == com_buffer->head || 0 == com_buffer->count) {
 		ret = COMMON_BUF_ERR_EMPTY;
 		goto END;
 	}
@@ -218,7 +270,15 @@ int common_buffer_pop(common_buffer_t* com_buffer, uint8_t* buffer, uint32_t* p_
 		pos += len;
 		com_buffer->count -= len;
 		
-		if(com_buffer->head->count <= 0)
+		/* the tail stays, rewound only when no reservation points into it */
+		if(com_buffer->head->count <= 0 && com_buffer->head == com_buffer->tail)
+		{
+			if(!com_buffer->reserve_tail) {
+				com_buffer->head->beg = 0;
+				com_buffer->head->end = 0;
+			}
+		}
+		else if(com_buffer->head->count <= 0)
 		{
 			tmp = com_buffer->head;
 			com_buffer->head = com_buffer->head->next;
@@ -227,16 +287,231 @@ int common_buffer_pop(common_buffer_t* com_buffer, uint8_t* buffer, uint32_t* p_
 				com_buffer->tail = NULL;
 			}
 			
-			common_buffer_destroy_node(tmp);
+			common_buffer_destroy_node(com_buffer, tmp);
 		}
 	}
 
 END:
 	*p_size = size;
     common_buffer_unlock(com_buffer);
+
+    if(pos > 0)
+        xEventGroupSetBits(com_buffer->event_handle, COMMON_BUF_EVENT_FREE);
+    return ret;
+}
+
+/* 
+ * Contiguous free space at the tail, for the producer to fill in place
+ * without the lock. common_buffer_commit adds what was written. Pop may
+ * run meanwhile, clear may not.
+ */
+int common_buffer_reserve(common_buffer_t* com_buffer, uint8_t** p_buf, uint32_t* p_size)
+{
+    int ret = COMMON_BUF_SUCCESS;
+    common_node_t* node;
+    uint32_t size;
+
+    common_buffer_lock(com_buffer);
+    *p_size = 0;
+
+    if(com_buffer->count >= com_buffer->max_size) {
+        ret = COMMON_BUF_ERR_SIZE;
+        goto END;
+    }
+
+    node = com_buffer->tail;
+
+    if(NULL == node || node->count >= node->size)
+    {
+        if(NULL == com_buffer->reserve_node) {
+            ret = common_buffer_create_node(com_buffer, &com_buffer->reserve_node);
+            if(COMMON_BUF_SUCCESS != ret)
+                goto END;
+        }
+
+        node = com_buffer->reserve_node;
+    }
+    else if(NULL != com_buffer->reserve_node)
+    {
+        /* left by a commit of 0, the tail has room again */
+        common_buffer_destroy_node(com_buffer, com_buffer->reserve_node);
+        com_buffer->reserve_node = NULL;
+    }
+
+    /* to the end of the node, or up to beg once end has wrapped */
+    size = (node->end < node->beg) ?(node->beg - node->end) :(node->size - node->end);
+
+    if(size > com_buffer->max_size - com_buffer->count)
+        size = com_buffer->max_size - com_buffer->count;
+
+    *p_buf  = &node->buffer[node->end];
+    *p_size = size;
+    com_buffer->reserve_tail = (node == com_buffer->tail);
+
+END:
+    common_buffer_unlock(com_buffer);
+    return ret;
+}
+
+int common_buffer_commit(common_buffer_t* com_buffer, uint32_t size)
+{
+    common_node_t* node;
+
+    common_buffer_lock(com_buffer);
+    com_buffer->reserve_tail = false;
+
+    if(0 == size) {
+        common_buffer_unlock(com_buffer);
+        return COMMON_BUF_SUCCESS;
+    }
+
+    node = (NULL != com_buffer->reserve_node) ?com_buffer->reserve_node :com_buffer->tail;
+
+    if(NULL == node) {
+        common_buffer_unlock(com_buffer);
+        return COMMON_BUF_ERR_EMPTY;
+    }
+
+    node->end    = (node->end + size) % node->size;
+    node->count += size;
+    com_buffer->count += size;
+
+    if(node == com_buffer->reserve_node)
+    {
+        com_buffer->reserve_node = NULL;
+        node->next = NULL;
+
+        if(NULL == com_buffer->head) {
+            com_buffer->head = com_buffer->tail = node;
+        }
+        else {
+            com_buffer->tail->next = node;
+            com_buffer->tail = node;
+        }
+    }
+
+    common_buffer_unlock(com_buffer);
+
+    xEventGroupSetBits(com_buffer->event_handle, COMMON_BUF_EVENT_DATA);
+    return COMMON_BUF_SUCCESS;
+}
+
+static void common_buffer_add_waiter(common_buffer_t* com_buffer, uint32_t* p_waiters)
+{
+    common_buffer_lock(com_buffer);
+    (*p_waiters)++;
+    common_buffer_unlock(com_buffer);
+}
+
+/* a wakeup that came while the last waiter returned for another reason goes with it */
+static void common_buffer_remove_waiter(common_buffer_t* com_buffer, uint32_t* p_waiters, uint32_t wake_event)
+{
+    common_buffer_lock(com_buffer);
+    
+    if(0 == --(*p_waiters))
+        xEventGroupClearBits(com_buffer->event_handle, wake_event);
+    
+    common_buffer_unlock(com_buffer);
+}
+
+/* 
+ * Blocks until count bytes are buffered. Returns COMMON_BUF_ERR_WAKEUP early
+ * when common_buffer_wakeup is called, for the caller to look at why.
+ */
+int common_buffer_wait_for(common_buffer_t* com_buffer, uint32_t count, uint32_t timeout)
+{
+    uint32_t begTick = xTaskGetTickCount(), used, events;
+    int ret;
+
+    if(count > com_buffer->max_size)
+        count = com_buffer->max_size;
+
+    common_buffer_add_waiter(com_buffer, &com_buffer->data_waiters);
+
+    while(1)
+    {
+        if(com_buffer->count >= count) {
+            ret = COMMON_BUF_SUCCESS;
+            break;
+        }
+
+        used = xTaskGetTickCount() - begTick;
+        if(used >= timeout) {
+            ret = COMMON_BUF_ERR_TIMEOUT;
+            break;
+        }
+
+        events = xEventGroupWaitBits(com_buffer->event_handle, 
+            COMMON_BUF_EVENT_DATA |COMMON_BUF_EVENT_WAKE_DATA, pdTRUE, pdFALSE, timeout - used);
+
+        if(COMMON_BUF_EVENT_WAKE_DATA & events) {
+            ret = (com_buffer->count >= count) ?COMMON_BUF_SUCCESS :COMMON_BUF_ERR_WAKEUP;
+            break;
+        }
+    }
+
+    common_buffer_remove_waiter(com_buffer, &com_buffer->data_waiters, COMMON_BUF_EVENT_WAKE_DATA);
+    return ret;
+}
+
+/* the same for the producer, until free_count bytes can be pushed */
+int common_buffer_wait_free(common_buffer_t* com_buffer, uint32_t free_count, uint32_t timeout)
+{
+    uint32_t begTick = xTaskGetTickCount(), used, events;
+    int ret;
+
+    if(free_count > com_buffer->max_size)
+        free_count = com_buffer->max_size;
+
+    common_buffer_add_waiter(com_buffer, &com_buffer->free_waiters);
+
+    while(1)
+    {
+        if(com_buffer->max_size - com_buffer->count >= free_count) {
+            ret = COMMON_BUF_SUCCESS;
+            break;
+        }
+
+        used = xTaskGetTickCount() - begTick;
+        if(used >= timeout) {
+            ret = COMMON_BUF_ERR_TIMEOUT;
+            break;
+        }
+
+        events = xEventGroupWaitBits(com_buffer->event_handle, 
+            COMMON_BUF_EVENT_FREE |COMMON_BUF_EVENT_WAKE_FREE, pdTRUE, pdFALSE, timeout - used);
+
+        if(COMMON_BUF_EVENT_WAKE_FREE & events) {
+            ret = (com_buffer->max_size - com_buffer->count >= free_count) ?COMMON_BUF_SUCCESS :COMMON_BUF_ERR_WAKEUP;
+            break;
+        }
+    }
+
+    common_buffer_remove_waiter(com_buffer, &com_buffer->free_waiters, COMMON_BUF_EVENT_WAKE_FREE);
     return ret;
 }
 
+/* 
+ * Ends the waits in progress on both sides, e.g. when the producer stops.
+ * A side nobody waits on is left alone, its next wait is not cut short.
+ */
+void common_buffer_wakeup(common_buffer_t* com_buffer)
+{
+    uint32_t events = 0;
+
+    common_buffer_lock(com_buffer);
+
+    if(com_buffer->data_waiters > 0)
+        events |= COMMON_BUF_EVENT_WAKE_DATA;
+    if(com_buffer->free_waiters > 0)
+        events |= COMMON_BUF_EVENT_WAKE_FREE;
+
+    if(0 != events)
+        xEventGroupSetBits(com_buffer->event_handle, events);
+    
+    common_buffer_unlock(com_buffer);
+}
+
 int common_buffer_get_count(common_buffer_t* com_buffer)
 {
     return com_buffer->count;
@@ -247,3 +522,13 @@ int common_buffer_get_free_count(common_buffer_t* com_buffer)
     return com_buffer->max_size - com_buffer->count;
 }
 
+uint32_t common_buffer_get_alloc_count(common_buffer_t* com_buffer)
+{
+    return com_buffer->alloc_count;
+}
+
+uint32_t common_buffer_get_reuse_count(common_buffer_t* com_buffer)
+{
+    return com_buffer->reuse_count;
+}
+
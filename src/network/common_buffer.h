@@ -2,6 +2,7 @@
 #define __COMMON_BUFFER_H
 
 #include "typedefs.h"
+#include "common_event.h"
 
 #define COMMON_BUF_HTTP_MAX_SIZE      (640*1024)
 #define COMMON_BUF_HTTP_NODE_SIZE     10240
@@ -11,11 +12,23 @@ typedef enum {
     COMMON_BUF_ERR_EMPTY,
     COMMON_BUF_ERR_MALLOC,
 	COMMON_BUF_ERR_SIZE,
+    COMMON_BUF_ERR_TIMEOUT,
+    COMMON_BUF_ERR_WAKEUP,
 
 } common_buffer_return_t;
 
+typedef enum {
+    COMMON_BUF_EVENT_NONE       = 0x000000UL,
+    COMMON_BUF_EVENT_ALL        = 0xFFFFFFUL,
+    COMMON_BUF_EVENT_DATA       = 0x000001UL,
+    COMMON_BUF_EVENT_FREE       = 0x000002UL,
+    COMMON_BUF_EVENT_WAKE_DATA  = 0x000004UL,
+    COMMON_BUF_EVENT_WAKE_FREE  = 0x000008UL,
+
+} common_buffer_event_t;
+
 typedef struct common_node_s {
-    uint8_t* buffer;
+    uint8_t* buffer;        /* right after the node, one allocation */
 	uint32_t beg;
 	uint32_t end;
 	uint32_t count;
@@ -27,11 +40,19 @@ typedef struct common_node_s {
 
 typedef struct {
     SemaphoreHandle_t mutex;
+    EventGroupHandle_t event_handle; /* set by push/commit and pop/clear, see common_buffer_wait_for */
     uint32_t          count;
     uint32_t          node_size;
     uint32_t          max_size;
     common_node_t*    head;
     common_node_t*    tail;
+    common_node_t*    free_nodes;   /* drained nodes, taken again by push */
+    common_node_t*    reserve_node; /* taken by common_buffer_reserve, linked at commit */
+    bool              reserve_tail; /* a reservation points into the tail until commit */
+    uint32_t          data_waiters; /* in common_buffer_wait_for, common_buffer_wakeup wakes only these */
+    uint32_t          free_waiters; /* in common_buffer_wait_free */
+    uint32_t          alloc_count;  /* nodes allocated since init */
+    uint32_t          reuse_count;  /* nodes push took from free_nodes */
 
 } common_buffer_t;
 
@@ -40,8 +61,15 @@ int common_buffer_deinit(common_buffer_t* com_buffer);
 int common_buffer_clear(common_buffer_t* com_buffer);
 int common_buffer_push(common_buffer_t* com_buffer, const uint8_t* buffer, uint32_t size);
 int common_buffer_pop(common_buffer_t* com_buffer, uint8_t* buffer, uint32_t* p_size);
+int common_buffer_reserve(common_buffer_t* com_buffer, uint8_t** p_buf, uint32_t* p_size);
+int common_buffer_commit(common_buffer_t* com_buffer, uint32_t size);
+int common_buffer_wait_for(common_buffer_t* com_buffer, uint32_t count, uint32_t timeout);
+int common_buffer_wait_free(common_buffer_t* com_buffer, uint32_t free_count, uint32_t timeout);
+void common_buffer_wakeup(common_buffer_t* com_buffer);
 int common_buffer_get_count(common_buffer_t* com_buffer);
 int common_buffer_get_free_count(common_buffer_t* com_buffer);
+uint32_t common_buffer_get_alloc_count(common_buffer_t* com_buffer);
+uint32_t common_buffer_get_reuse_count(common_buffer_t* com_buffer);
 
 
 #endif
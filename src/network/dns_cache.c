@@ -0,0 +1,430 @@
+#include "dns_cache.h"
+#include "httpclient.h"
+#include "typedefs.h"
+#include <string.h>
+#include <netdb.h>
+
+#define malloc(x)   pvPortMalloc(x)
+#define free(x)     vPortFree(x)
+
+log_create_module(dns_cache, PRINT_LEVEL_INFO);
+
+#define DNS_CACHE_TASK_STACK_SIZE       (4096/sizeof(StackType_t))
+
+/* 
+ * host:port -> addresses, and failures for a shorter while. A lookup that
+ * is under way is waited for on its resolve_mutex, never done twice.
+ * Prefetches are resolved by dns_cache_task, started with the first one.
+ */
+
+typedef enum {
+    DNS_CACHE_STA_EMPTY = 0,
+    DNS_CACHE_STA_RESOLVING,
+    DNS_CACHE_STA_VALID,
+    DNS_CACHE_STA_FAILED,
+
+} dns_cache_state_t;
+
+typedef struct {
+    dns_cache_state_t   state;
+    char                host[DNS_CACHE_MAX_HOST_SIZE];
+    int                 port;
+    uint32_t            expire_tick;
+    uint32_t            last_used;
+    int                 count;
+    dns_cache_addr_t    addrs[DNS_CACHE_MAX_ADDRS];
+    SemaphoreHandle_t   resolve_mutex;      /* held over getaddrinfo */
+    
+} dns_cache_entry_t;
+
+typedef struct {
+    char                host[DNS_CACHE_MAX_HOST_SIZE];
+    int                 port;
+    
+} dns_cache_request_t;
+
+static dns_cache_entry_t    g_entries[DNS_CACHE_MAX_ENTRIES];
+static dns_cache_request_t  g_requests[DNS_CACHE_MAX_PREFETCH];
+static int                  g_request_count = 0;
+static dns_cache_stats_t    g_stats;
+static SemaphoreHandle_t    g_mutex = NULL;
+static EventGroupHandle_t   g_event_handle = NULL;
+static TaskHandle_t         g_task_handle;
+static bool                 g_task_started = false;
+static pthread_once_t       g_init_once = PTHREAD_ONCE_INIT;
+
+#define dns_cache_lock()        do { xSemaphoreTake(g_mutex, portMAX_DELAY); } while(0)
+#define dns_cache_unlock()      do { xSemaphoreGive(g_mutex); } while(0)
+
+static void dns_cache_task(void* param);
+
+static void dns_cache_init_once(void)
+{
+    int i;
+    
+    memset(g_entries, 0, sizeof(g_entries));
+    memset(&g_stats, 0, sizeof(g_stats));
+
+    for(i = 0; i < DNS_CACHE_MAX_ENTRIES; i++) {
+        g_entries[i].resolve_mutex = xSemaphoreCreateMutex();
+    }
+
+    g_event_handle = xEventGroupCreate();
+    g_mutex        = xSemaphoreCreateMutex();
+}
+
+/* the first resolve may come from any task, taskENTER_CRITICAL is empty on linux */
+static void dns_cache_init(void)
+{
+    pthread_once(&g_init_once, dns_cache_init_once);
+}
+
+static bool dns_cache_is_fresh(dns_cache_entry_t* entry)
+{
+    return ((int32_t)(entry->expire_tick - xTaskGetTickCount()) > 0) ?true :false;
+}
+
+static dns_cache_entry_t* dns_cache_find(const char* host, int port)
+{
+    int i;
+
+    for(i = 0; i < DNS_CACHE_MAX_ENTRIES; i++)
+    {
+        if(DNS_CACHE_STA_EMPTY != g_entries[i].state && port == g_entries[i].port && 0 == strcmp(host, g_entries[i].host))
+            return &g_entries[i];
+    }
+
+    return NULL;
+}
+
+/* an empty entry, else the least recently used one not being resolved */
+static dns_cache_entry_t* dns_cache_alloc(const char* host, int port)
+{
+    dns_cache_entry_t* entry = NULL;
+    int i;
+
+    for(i = 0; i < DNS_CACHE_MAX_ENTRIES; i++)
+    {
+        if(DNS_CACHE_STA_RESOLVING == g_entries[i].state)
+            continue;
+
+        if(DNS_CACHE_STA_EMPTY == g_entries[i].state) {
+            entry = &g_entries[i];
+            break;
+        }
+
+        if(NULL == entry || (int32_t)(g_entries[i].last_used - entry->last_used) < 0)
+            entry = &g_entries[i];
+    }
+
+    if(NULL != entry) {
+        strcpy(entry->host, host);
+        entry->port  = port;
+        entry->count = 0;
+    }
+
+    return entry;
+}
+
+static int dns_cache_lookup(const char* host, int port, dns_cache_addr_t* addrs)
+{
+    struct addrinfo hints, *addr_list, *cur;
+    char port_str[8];
+    int count = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if(0 != getaddrinfo(host, port_str, &hints, &addr_list)) {
+        return 0;
+    }
+
+    for(cur = addr_list; NULL != cur && count < DNS_CACHE_MAX_ADDRS; cur = cur->ai_next)
+    {
+        if(cur->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        addrs[count].family   = cur->ai_family;
+        addrs[count].addr_len = cur->ai_addrlen;
+        memcpy(&addrs[count].addr, cur->ai_addr, cur->ai_addrlen);
+        count++;
+    }
+
+    freeaddrinfo(addr_list);
+    
+    return count;
+}
+
+static dns_cache_return_t dns_cache_resolve_inner(const char* host, int port, dns_cache_addr_t* addrs, int* p_count, bool prefetch)
+{
+    dns_cache_entry_t* entry;
+    SemaphoreHandle_t resolve_mutex;
+    dns_cache_return_t ret;
+    uint32_t begin_tick;
+
+    *p_count = 0;
+
+    dns_cache_lock();
+
+    if(false == prefetch) {
+        g_stats.lookups++;
+    }
+
+    /* under way on another task, its result is taken */
+    while(NULL != (entry = dns_cache_find(host, port)) && DNS_CACHE_STA_RESOLVING == entry->state)
+    {
+        resolve_mutex = entry->resolve_mutex;
+        
+        dns_cache_unlock();
+        xSemaphoreTake(resolve_mutex, portMAX_DELAY);
+        xSemaphoreGive(resolve_mutex);
+        dns_cache_lock();
+    }
+
+    if(NULL != entry && true == dns_cache_is_fresh(entry))
+    {
+        entry->last_used = xTaskGetTickCount();
+        
+        if(DNS_CACHE_STA_VALID == entry->state) {
+            memcpy(addrs, entry->addrs, entry->count *sizeof(dns_cache_addr_t));
+            *p_count = entry->count;
+            ret = DNS_CACHE_SUCCESS;
+            
+            if(false == prefetch)
+                g_stats.hits++;
+        }
+        else {
+            ret = DNS_CACHE_ERR_UNRESOLVED;
+            
+            if(false == prefetch)
+                g_stats.negative_hits++;
+        }
+
+        dns_cache_unlock();
+        return ret;
+    }
+
+    if(NULL == entry) {
+        entry = dns_cache_alloc(host, port);
+    }
+
+    /* every entry is being resolved, this one goes uncached */
+    if(NULL == entry) {
+        dns_cache_unlock();
+        *p_count = dns_cache_lookup(host, port, addrs);
+        return (*p_count > 0) ?DNS_CACHE_SUCCESS :DNS_CACHE_ERR_UNRESOLVED;
+    }
+
+    entry->state = DNS_CACHE_STA_RESOLVING;
+    xSemaphoreTake(entry->resolve_mutex, portMAX_DELAY);
+    
+    dns_cache_unlock();
+
+    begin_tick = xTaskGetTickCount();
+    entry->count = dns_cache_lookup(host, port, entry->addrs);
+
+    dns_cache_lock();
+
+    g_stats.resolves++;
+    g_stats.resolve_ms += (xTaskGetTickCount() - begin_tick) *portTICK_RATE_MS;
+
+    entry->last_used = xTaskGetTickCount();
+    
+    if(entry->count > 0) {
+        entry->state       = DNS_CACHE_STA_VALID;
+        entry->expire_tick = entry->last_used + DNS_CACHE_TTL;
+        
+        memcpy(addrs, entry->addrs, entry->count *sizeof(dns_cache_addr_t));
+        *p_count = entry->count;
+        ret = DNS_CACHE_SUCCESS;
+    }
+    else {
+        LOG_W(dns_cache, "can not resolve %s:%d", host, port);
+        
+        entry->state       = DNS_CACHE_STA_FAILED;
+        entry->expire_tick = entry->last_used + DNS_CACHE_NEGATIVE_TTL;
+        ret = DNS_CACHE_ERR_UNRESOLVED;
+    }
+
+    xSemaphoreGive(entry->resolve_mutex);
+    dns_cache_unlock();
+    
+    return ret;
+}
+
+/* 
+ * Up to DNS_CACHE_MAX_ADDRS addresses of host, from the cache while they
+ * are fresh. Blocks for getaddrinfo otherwise, or for the lookup another
+ * task has under way.
+ */
+dns_cache_return_t dns_cache_resolve(const char* host, int port, dns_cache_addr_t* addrs, int* p_count)
+{
+    if(NULL == host || NULL == addrs || NULL == p_count || strlen(host) >= DNS_CACHE_MAX_HOST_SIZE) {
+        return DNS_CACHE_ERR_PARAM;
+    }
+
+    dns_cache_init();
+    
+    return dns_cache_resolve_inner(host, port, addrs, p_count, false);
+}
+
+/* resolves host on dns_cache_task, for a connection that is about to be made */
+dns_cache_return_t dns_cache_prefetch(const char* host, int port)
+{
+    dns_cache_entry_t* entry;
+    int i;
+    
+    if(NULL == host || strlen(host) >= DNS_CACHE_MAX_HOST_SIZE) {
+        return DNS_CACHE_ERR_PARAM;
+    }
+
+    dns_cache_init();
+    dns_cache_lock();
+
+    entry = dns_cache_find(host, port);
+    
+    if(NULL != entry && (DNS_CACHE_STA_RESOLVING == entry->state || true == dns_cache_is_fresh(entry))) {
+        dns_cache_unlock();
+        return DNS_CACHE_SUCCESS;
+    }
+
+    for(i = 0; i < g_request_count; i++)
+    {
+        if(port == g_requests[i].port && 0 == strcmp(host, g_requests[i].host)) {
+            dns_cache_unlock();
+            return DNS_CACHE_SUCCESS;
+        }
+    }
+
+    if(g_request_count >= DNS_CACHE_MAX_PREFETCH) {
+        dns_cache_unlock();
+        return DNS_CACHE_ERR_FULL;
+    }
+
+    if(false == g_task_started)
+    {
+        if(0 != xTaskCreate(
+            dns_cache_task, 
+            "dns_cache_task", 
+            DNS_CACHE_TASK_STACK_SIZE, 
+            NULL,
+            TASK_PRIORITY_NORMAL,
+            &g_task_handle))
+        {
+            LOG_E(dns_cache, "xTaskCreate failed!");
+            dns_cache_unlock();
+            return DNS_CACHE_ERR_TASK;
+        }
+
+        g_task_started = true;
+    }
+
+    strcpy(g_requests[g_request_count].host, host);
+    g_requests[g_request_count].port = port;
+    g_request_count++;
+    g_stats.prefetches++;
+    
+    dns_cache_unlock();
+
+    xEventGroupSetBits(g_event_handle, DNS_CACHE_EVENT_PREFETCH);
+    
+    return DNS_CACHE_SUCCESS;
+}
+
+dns_cache_return_t dns_cache_prefetch_url(const char* url)
+{
+    char scheme[8], host[DNS_CACHE_MAX_HOST_SIZE];
+    dns_cache_return_t ret;
+    char* path;
+    int port = 0;
+
+    if(NULL == url) {
+        return DNS_CACHE_ERR_PARAM;
+    }
+
+    path = (char*)malloc(strlen(url)+1);
+    if(NULL == path) {
+        return DNS_CACHE_ERR_MALLOC;
+    }
+
+    ret = (HTTPCLIENT_OK == httpclient_parse_url(url, scheme, sizeof(scheme), host, sizeof(host), &port, path, strlen(url)+1)) ?DNS_CACHE_SUCCESS :DNS_CACHE_ERR_PARAM;
+    free(path);
+
+    if(DNS_CACHE_SUCCESS != ret) {
+        return ret;
+    }
+
+    if(0 == port) {
+        port = (0 == strcmp(scheme, "https")) ?HTTPS_PORT :HTTP_PORT;
+    }
+    
+    return dns_cache_prefetch(host, port);
+}
+
+/* no address of host:port could be connected, look it up again next time */
+void dns_cache_forget(const char* host, int port)
+{
+    dns_cache_entry_t* entry;
+
+    if(NULL == host || NULL == g_mutex) {
+        return;
+    }
+
+    dns_cache_lock();
+
+    entry = dns_cache_find(host, port);
+    
+    if(NULL != entry && DNS_CACHE_STA_VALID == entry->state) {
+        entry->state = DNS_CACHE_STA_EMPTY;
+    }
+    
+    dns_cache_unlock();
+}
+
+void dns_cache_get_stats(dns_cache_stats_t* stats)
+{
+    if(NULL == g_mutex) {
+        memset(stats, 0, sizeof(dns_cache_stats_t));
+        return;
+    }
+
+    dns_cache_lock();
+    *stats = g_stats;
+    dns_cache_unlock();
+}
+
+static void dns_cache_task(void* param)
+{
+    dns_cache_request_t request;
+    dns_cache_addr_t addrs[DNS_CACHE_MAX_ADDRS];
+    int count;
+
+    while(1)
+    {
+        xEventGroupWaitBits(g_event_handle, DNS_CACHE_EVENT_PREFETCH, pdTRUE, pdFALSE, portMAX_DELAY);
+
+        while(1)
+        {
+            dns_cache_lock();
+            
+            if(0 == g_request_count) {
+                dns_cache_unlock();
+                break;
+            }
+
+            request = g_requests[0];
+            g_request_count--;
+            memmove(&g_requests[0], &g_requests[1], g_request_count *sizeof(dns_cache_request_t));
+            
+            dns_cache_unlock();
+
+            dns_cache_resolve_inner(request.host, request.port, addrs, &count, true);
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
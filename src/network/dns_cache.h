@@ -0,0 +1,56 @@
+#ifndef __DNS_CACHE_H
+#define __DNS_CACHE_H
+
+#include "typedefs.h"
+#include "common_event.h"
+#include <sys/socket.h>
+
+#define DNS_CACHE_MAX_ENTRIES       16
+#define DNS_CACHE_MAX_HOST_SIZE     128
+#define DNS_CACHE_MAX_ADDRS         4
+#define DNS_CACHE_MAX_PREFETCH      4
+#define DNS_CACHE_TTL               (300*1000/portTICK_RATE_MS)     /* getaddrinfo does not tell the record's */
+#define DNS_CACHE_NEGATIVE_TTL      (10*1000/portTICK_RATE_MS)
+
+typedef enum {
+    DNS_CACHE_SUCCESS = 0,
+    DNS_CACHE_ERR_PARAM,
+    DNS_CACHE_ERR_MALLOC,
+    DNS_CACHE_ERR_UNRESOLVED,
+    DNS_CACHE_ERR_FULL,
+    DNS_CACHE_ERR_TASK,
+
+} dns_cache_return_t;
+
+typedef enum {
+    DNS_CACHE_EVENT_NONE        = 0x000000UL,
+    DNS_CACHE_EVENT_ALL         = 0xFFFFFFUL,
+    DNS_CACHE_EVENT_PREFETCH    = 0x000001UL,
+
+} dns_cache_event_t;
+
+typedef struct {
+    int                         family;
+    socklen_t                   addr_len;
+    struct sockaddr_storage     addr;
+    
+} dns_cache_addr_t;
+
+typedef struct {
+    uint32_t    lookups;
+    uint32_t    hits;
+    uint32_t    negative_hits;      /* failed lookups answered from the cache */
+    uint32_t    resolves;           /* getaddrinfo calls */
+    uint32_t    resolve_ms;         /* the time they took */
+    uint32_t    prefetches;
+    
+} dns_cache_stats_t;
+
+dns_cache_return_t dns_cache_resolve(const char* host, int port, dns_cache_addr_t* addrs, int* p_count);
+dns_cache_return_t dns_cache_prefetch(const char* host, int port);
+dns_cache_return_t dns_cache_prefetch_url(const char* url);
+void dns_cache_forget(const char* host, int port);
+void dns_cache_get_stats(dns_cache_stats_t* stats);
+
+#endif
+
@@ -1,6 +1,9 @@
 #include "http_download_process.h"
 #include "typedefs.h"
+#include "dns_cache.h"
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #define malloc(x)   pvPortMalloc(x)
 #define free(x)     vPortFree(x)
@@ -8,9 +11,19 @@
 #define HTTP_DOWNLOAD_MAX_ERR_CONN_COUNT        5
 #define HTTP_DOWNLOAD_MAX_ERR_RECV_COUNT        15
 #define HTTP_DOWNLOAD_RECV_BUF_SIZE             (2048 * 1 + 1)
+#define HTTP_DOWNLOAD_STREAM_MIN_FREE           (HTTP_DOWNLOAD_RECV_BUF_SIZE - 1)
 #define HTTP_DOWNLOAD_TASK_STACK_SIZE           (10240/sizeof(StackType_t))
 #define HTTP_DOWNLOAD_MONITOR_INTERVAL          (2000/portTICK_RATE_MS)
 #define HTTP_DOWNLOAD_MAX_WAIT_TIME             (30000/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_WAIT_FREE_INTERVAL        (100/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_WAIT_DATA_INTERVAL        (100/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE       3072
+#define HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT       (3000/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_ENGINE_RETRY_DELAY        (500/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_ENGINE_FREE_INTERVAL      (50/portTICK_RATE_MS)
+#define HTTP_DOWNLOAD_ENGINE_RECV_ROUNDS        16
+#define HTTP_DOWNLOAD_ENGINE_MAX_STEPS          8
+#define HTTP_DOWNLOAD_REVALIDATE_TIMEOUT        3000
 
 log_create_module(http_download_proc, PRINT_LEVEL_INFO);
 
@@ -19,6 +32,8 @@ static http_download_handle_t g_last_alloc_handle = 0;
 static void http_download_set_event(http_download_proc_t* http_proc, uint32_t events);
 static uint32_t http_download_wait_event(http_download_proc_t* http_proc, uint32_t events, uint32_t timeout);
 static void http_download_clear_event(http_download_proc_t* http_proc, uint32_t events);
+static void http_download_engine_callback(void* param, uint32_t events);
+static void http_download_url_to_http(char* url);
 
 http_download_proc_return_t http_download_init(http_download_proc_t* http_proc)
 {
@@ -28,6 +43,8 @@ http_download_proc_return_t http_download_init(http_download_proc_t* http_proc)
     http_proc->event_handle    = xEventGroupCreate();
     http_proc->range_enable    = true;
     http_proc->download_handle = 0;
+    http_proc->engine_id       = -1;
+    http_proc->engine_sock     = -1;
 
     xTaskCreate(
         http_download_task, 
@@ -40,6 +57,34 @@ http_download_proc_return_t http_download_init(http_download_proc_t* http_proc)
 	return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* 
+ * Same as http_download_init, but the download runs on the shared
+ * http_engine task over a non-blocking socket, without a task of its own.
+ */
+http_download_proc_return_t http_download_init_engine(http_download_proc_t* http_proc)
+{
+    memset(http_proc, 0, sizeof(http_download_proc_t));
+    
+    http_proc->cur_state       = HTTP_DOWNLOAD_STA_IDLE;
+    http_proc->event_handle    = xEventGroupCreate();
+    http_proc->range_enable    = true;
+    http_proc->download_handle = 0;
+    http_proc->engine_id       = -1;
+    http_proc->engine_sock     = -1;
+
+    if(HTTP_ENGINE_SUCCESS != http_engine_attach(http_download_engine_callback, http_proc, &http_proc->engine_id)) {
+        LOG_E(http_download_proc, "http_engine_attach failed!");
+        
+        vEventGroupDelete(http_proc->event_handle);
+        http_proc->event_handle = NULL;
+        http_proc->engine_id    = -1;
+        
+        return HTTP_DOWNLOAD_PROC_ERR_MALLOC;
+    }
+    
+	return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
 http_download_proc_return_t http_download_deinit(http_download_proc_t* http_proc)
 {
     http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_EXIT);
@@ -49,6 +94,10 @@ http_download_proc_return_t http_download_deinit(http_download_proc_t* http_proc
     {
         LOG_E(http_download_proc, "http_download_wait_event timeout!");
     }
+
+    if(http_proc->engine_id >= 0) {
+        http_engine_detach(http_proc->engine_id);
+    }
     
     if(NULL != http_proc->event_handle) {
         vEventGroupDelete(http_proc->event_handle);
@@ -56,17 +105,44 @@ http_download_proc_return_t http_download_deinit(http_download_proc_t* http_proc
     }
     
 #ifdef DEF_LINUX_PLATFORM
-    pthread_join(http_proc->task_handle, NULL);
+    if(http_proc->engine_id < 0) {
+        pthread_join(http_proc->task_handle, NULL);
+    }
 #endif
+
+    http_proc->engine_id = -1;
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
 http_download_proc_return_t http_download_start(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable)
+{
+    return http_download_start_at(http_proc, http_buffer, url, range_enable, 0);
+}
+
+/* a restart of the same url is checked against the length it reported */
+static http_download_proc_return_t http_download_check_start(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, int start_pos)
+{
+    if(NULL==url || NULL==http_buffer || start_pos < 0) {
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    if(NULL != http_proc->url && 0 == strcmp(http_proc->url, url) && http_proc->total_length > 0 && start_pos >= http_proc->total_length) {
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+/* 
+ * Downloads from byte start_pos on: asked for with a range request, skipped
+ * over when the server does not do ranges.
+ */
+http_download_proc_return_t http_download_start_at(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable, int start_pos)
 {
     int url_len;
     
-    if(NULL==url || NULL==http_buffer) {
+    if(HTTP_DOWNLOAD_PROC_SUCCESS != http_download_check_start(http_proc, http_buffer, url, start_pos)) {
         return HTTP_DOWNLOAD_PROC_ERR_PARAM;
     }
 
@@ -85,6 +161,7 @@ http_download_proc_return_t http_download_start(http_download_proc_t* http_proc,
     http_proc->http_buffer     = http_buffer;
     http_proc->last_error      = HTTP_DOWNLOAD_PROC_SUCCESS;
     http_proc->range_enable    = range_enable;
+    http_proc->start_pos       = start_pos;
     http_proc->download_handle = ++g_last_alloc_handle;
     
     http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_START);
@@ -98,11 +175,45 @@ http_download_proc_return_t http_download_start(http_download_proc_t* http_proc,
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* 
+ * Restarts the download of url at byte start_pos, what is buffered is
+ * dropped. When that can not start, it goes on from fallback_pos so the
+ * reader keeps its place, and the error is returned.
+ */
+http_download_proc_return_t http_download_move_to(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable, int start_pos, int fallback_pos)
+{
+    http_download_proc_return_t ret;
+
+    /* refused before anything is stopped, the old download goes on */
+    ret = http_download_check_start(http_proc, http_buffer, url, start_pos);
+    if(HTTP_DOWNLOAD_PROC_SUCCESS != ret) {
+        return ret;
+    }
+
+    http_download_stop(http_proc);
+    common_buffer_clear(http_buffer);
+
+    ret = http_download_start_at(http_proc, http_buffer, url, range_enable, start_pos);
+    if(HTTP_DOWNLOAD_PROC_SUCCESS != ret) {
+        LOG_E(http_download_proc, "fail to start at %d, back to %d!", start_pos, fallback_pos);
+        
+        if(HTTP_DOWNLOAD_PROC_SUCCESS != http_download_start_at(http_proc, http_buffer, url, range_enable, fallback_pos)) {
+            LOG_E(http_download_proc, "fail to start at %d!", fallback_pos);
+        }
+    }
+
+    return ret;
+}
+
 http_download_proc_return_t http_download_stop(http_download_proc_t* http_proc)
 {
     if(HTTP_DOWNLOAD_STA_IDLE != http_proc->cur_state) {
         http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_STOP |HTTP_DOWNLOAD_EVENT_RESUME);
 
+        if(NULL != http_proc->http_buffer) {
+            common_buffer_wakeup(http_proc->http_buffer);
+        }
+
         if(HTTP_DOWNLOAD_EVENT_NONE==http_download_wait_event(http_proc, 
             HTTP_DOWNLOAD_EVENT_STOPPED, HTTP_DOWNLOAD_MAX_WAIT_TIME))
         {
@@ -130,6 +241,10 @@ http_download_proc_return_t http_download_pause(http_download_proc_t* http_proc)
     
     if(HTTP_DOWNLOAD_STA_PAUSE != http_proc->cur_state) {
         http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_PAUSE);
+
+        if(NULL != http_proc->http_buffer) {
+            common_buffer_wakeup(http_proc->http_buffer);
+        }
     }
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
@@ -146,9 +261,33 @@ http_download_proc_return_t http_download_resume(http_download_proc_t* http_proc
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* takes effect with the next http_download_start */
+http_download_proc_return_t http_download_set_segment(http_download_proc_t* http_proc, bool enable)
+{
+    http_proc->segment_enable = enable;
+    
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+/* 
+ * For the next http_download_start: the first range request carries it as
+ * If-Range, so a changed resource comes whole instead of the range. NULL
+ * or "" sends none.
+ */
+http_download_proc_return_t http_download_set_if_range(http_download_proc_t* http_proc, const char* validator)
+{
+    if(NULL != validator && strlen(validator) >= HTTPCLIENT_IF_RANGE_SIZE) {
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    strcpy(http_proc->validator, (NULL != validator) ?validator :"");
+    
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
 http_download_proc_return_t http_download_wait_buffer(http_download_proc_t* http_proc, uint32_t size, uint32_t timeout)
 {
-    uint32_t begTick = xTaskGetTickCount();
+    uint32_t begTick = xTaskGetTickCount(), used;
 
     while(1)
     {
@@ -156,7 +295,8 @@ http_download_proc_return_t http_download_wait_buffer(http_download_proc_t* http
             return HTTP_DOWNLOAD_PROC_SUCCESS;
         }
         
-        if((xTaskGetTickCount()-begTick) > timeout) {
+        used = xTaskGetTickCount()-begTick;
+        if(used > timeout) {
             LOG_E(http_download_proc, "[%d] Wait download timeout!", http_proc->download_handle);
                 
             return HTTP_DOWNLOAD_PROC_ERR_TIMEOUT;
@@ -180,7 +320,9 @@ http_download_proc_return_t http_download_wait_buffer(http_download_proc_t* http
             return HTTP_DOWNLOAD_PROC_ERR_DOWNLOAD_PAUSE;
         }
         
-        vTaskDelay(50/portTICK_RATE_MS);
+        /* woken by the data, or by the task going idle or pausing, looked at each interval for a wakeup before the wait */
+        common_buffer_wait_for(http_proc->http_buffer, size, 
+            (timeout-used < HTTP_DOWNLOAD_WAIT_DATA_INTERVAL) ?(timeout-used) :HTTP_DOWNLOAD_WAIT_DATA_INTERVAL);
     }
 }
 
@@ -212,12 +354,113 @@ int http_download_get_total_length(http_download_proc_t* http_proc)
     return http_proc->total_length;
 }
 
+/* the response's, valid once http_download_get_total_length is known; "" when the server sent none */
+void http_download_get_validator(http_download_proc_t* http_proc, char* validator, int size)
+{
+    strncpy(validator, http_proc->validator, size-1);
+    validator[size-1] = '\0';
+}
+
+/* 
+ * Whether url still is what a copy with this validator and length holds:
+ * the last byte asked for with If-Range. SUCCESS when the range comes, or
+ * the whole resource with the same validator and length from a server
+ * without ranges, HTTP_DOWNLOAD_PROC_CHANGED when not, an error when there
+ * is no answer to go by, e.g. offline or a redirect.
+ */
+http_download_proc_return_t http_download_revalidate(const char* url, const char* validator, int total_length)
+{
+    httpclient_t client;
+    httpclient_data_t client_data;
+    httpclient_data_ext_t* ext;
+    http_download_proc_return_t ret;
+    char buf[16];
+    char* http_url;
+    int http_ret;
+
+    if(NULL == url || NULL == validator || '\0' == validator[0] || total_length <= 0) {
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    http_url = (char*)malloc(strlen(url) + 1);
+    ext = (httpclient_data_ext_t*)malloc(sizeof(httpclient_data_ext_t));
+    
+    if(NULL == http_url || NULL == ext) {
+        ret = HTTP_DOWNLOAD_PROC_ERR_MALLOC;
+        goto exit;
+    }
+
+    strcpy(http_url, url);
+    http_download_url_to_http(http_url);
+
+    memset(&client, 0, sizeof(httpclient_t));
+    
+    if(HTTPCLIENT_OK != httpclient_connect(&client, http_url)) {
+        ret = HTTP_DOWNLOAD_PROC_ERR_CONN;
+        goto exit;
+    }
+
+    memset(&client_data, 0, sizeof(httpclient_data_t));
+    memset(ext, 0, sizeof(httpclient_data_ext_t));
+    
+    client_data.response_buf     = buf;
+    client_data.response_buf_len = sizeof(buf);
+    client_data.ext              = ext;
+
+    if(httpclient_send_request_with_range(&client, http_url, HTTPCLIENT_GET, &client_data, total_length - 1, total_length - 1, validator) < 0) {
+        httpclient_close(&client);
+        ret = HTTP_DOWNLOAD_PROC_ERR_SEND;
+        goto exit;
+    }
+
+    httpclient_set_response_timeout(&client, HTTP_DOWNLOAD_REVALIDATE_TIMEOUT);
+    
+    http_ret = httpclient_recv_response(&client, &client_data);
+    if(http_ret < 0) {
+        httpclient_close(&client);
+        ret = HTTP_DOWNLOAD_PROC_ERR_RECV;
+        goto exit;
+    }
+
+    /* ext->if_range now is the response's validator */
+    if(206 == client.response_code) {
+        ret = (0 == ext->range_len || total_length == ext->range_len) ?HTTP_DOWNLOAD_PROC_SUCCESS :HTTP_DOWNLOAD_PROC_CHANGED;
+    }
+    else if(200 == client.response_code) {
+        ret = (0 == strcmp(ext->if_range, validator) && total_length == client_data.response_content_len) ?HTTP_DOWNLOAD_PROC_SUCCESS :HTTP_DOWNLOAD_PROC_CHANGED;
+    }
+    else {
+        ret = HTTP_DOWNLOAD_PROC_ERR_RESPONSE;
+    }
+
+    LOG_I(http_download_proc, "revalidate %s: %d, %s", url, client.response_code, 
+        (HTTP_DOWNLOAD_PROC_SUCCESS == ret) ?"unchanged" :(HTTP_DOWNLOAD_PROC_CHANGED == ret) ?"changed" :"unknown");
+
+    /* the rest of a whole body is not worth reading */
+    if(HTTPCLIENT_OK == http_ret)
+        httpclient_release(&client);
+    else
+        httpclient_close(&client);
+
+exit:
+    if(NULL != http_url)
+        free(http_url);
+    if(NULL != ext)
+        free(ext);
+    
+    return ret;
+}
+
 static void http_download_set_event(http_download_proc_t* http_proc, uint32_t events)
 {
     if(NULL==http_proc->event_handle)
         return;
     
     xEventGroupSetBits(http_proc->event_handle, events);
+
+    if(http_proc->engine_id >= 0) {
+        http_engine_kick(http_proc->engine_id);
+    }
 }
 
 static uint32_t http_download_wait_event(http_download_proc_t* http_proc, uint32_t events, uint32_t timeout)
@@ -236,20 +479,25 @@ static void http_download_clear_event(http_download_proc_t* http_proc, uint32_t
     xEventGroupClearBits(http_proc->event_handle, events);
 }
 
-static http_download_proc_return_t http_download_proc_url_preprocess(http_download_proc_t* http_proc)
+static void http_download_url_to_http(char* url)
 {
     // https --> http
     const char* str_cmp = "https";
     int i;
     
-    if(0 == strncasecmp(http_proc->url, str_cmp, strlen(str_cmp))) {
+    if(0 == strncasecmp(url, str_cmp, strlen(str_cmp))) {
         for(i=strlen(str_cmp); i<2048; i++) {
-            http_proc->url[i-1] = http_proc->url[i];
+            url[i-1] = url[i];
 
-            if(http_proc->url[i]=='\0')
+            if(url[i]=='\0')
                 break;
         }
     }
+}
+
+static http_download_proc_return_t http_download_proc_url_preprocess(http_download_proc_t* http_proc)
+{
+    http_download_url_to_http(http_proc->url);
         
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
@@ -259,7 +507,14 @@ static http_download_proc_return_t http_download_proc_open_client(http_download_
     int ret;
     
     if(true == http_proc->http_opened) {
-        return HTTP_DOWNLOAD_PROC_SUCCESS;
+        if(true == httpclient_is_alive(&http_proc->client)) {
+            return HTTP_DOWNLOAD_PROC_SUCCESS;
+        }
+
+        /* the server ended the idle connection, no error */
+        LOG_I(http_download_proc, "[%d] connection closed by server, reconnect", http_proc->download_handle);
+        httpclient_close(&http_proc->client);
+        http_proc->http_opened = false;
     }
     
     memset(&http_proc->client, 0, sizeof(http_proc->client));
@@ -282,20 +537,43 @@ static http_download_proc_return_t http_download_proc_open_client(http_download_
 
     http_proc->http_opened    = true;
     http_proc->err_conn_count = 0;
+
+    if(true == http_proc->client.reused) {
+        http_proc->reuse_count++;
+    }
+    else {
+        http_proc->conn_count++;
+    }
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* a connection that is not in the middle of a response goes to the idle pool */
 static http_download_proc_return_t http_download_proc_close_client(http_download_proc_t* http_proc)
 {
     if(true == http_proc->http_opened) {
-        httpclient_close(&http_proc->client);
+        if(true == http_proc->response_done && false == http_proc->client_data.is_more) {
+            httpclient_release(&http_proc->client);
+        }
+        else {
+            httpclient_close(&http_proc->client);
+        }
+        
         http_proc->http_opened = false;
     }
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+static void http_download_proc_segment_free(http_download_proc_t* http_proc)
+{
+    if(NULL != http_proc->segment) {
+        http_segment_deinit(http_proc->segment);
+        free(http_proc->segment);
+        http_proc->segment = NULL;
+    }
+}
+
 static http_download_proc_return_t http_download_proc_start(http_download_proc_t* http_proc)
 {
     http_proc->recv_buf = (char*)malloc(HTTP_DOWNLOAD_RECV_BUF_SIZE);
@@ -311,28 +589,65 @@ static http_download_proc_return_t http_download_proc_start(http_download_proc_t
     memset(http_proc->recv_buf, 0, HTTP_DOWNLOAD_RECV_BUF_SIZE);
     memset(http_proc->client_data_ext, 0, sizeof(httpclient_data_ext_t));
 
+    /* without it everything goes over the one connection */
+    http_proc->segment = NULL;
+
+    if(true == http_proc->segment_enable && true == http_proc->range_enable) {
+        http_proc->segment = (http_segment_t*)malloc(sizeof(http_segment_t));
+        
+        if(NULL != http_proc->segment && HTTP_SEGMENT_SUCCESS != http_segment_init(http_proc->segment)) {
+            free(http_proc->segment);
+            http_proc->segment = NULL;
+        }
+    }
+
     http_proc->err_conn_count               = 0;
     http_proc->err_recv_count               = 0;
     http_proc->client_data_ext->is_range    = false;
-    http_proc->pre_download_pos             = 0;
+    http_proc->pre_download_pos             = http_proc->start_pos;
+
+    if(strlen(http_proc->validator) > 0) {
+        strcpy(http_proc->client_data_ext->if_range, http_proc->validator);
+        http_proc->client_data_ext->is_range = true;
+    }
+
     http_proc->redirect                     = false;
     http_proc->is_chunked                   = false;
     http_proc->total_length                 = -1;
     http_proc->length_received              = false;
     http_proc->http_opened                  = false;
+    http_proc->response_done                = false;
+    http_proc->request_count                = 0;
+    http_proc->conn_count                   = 0;
+    http_proc->reuse_count                  = 0;
     http_proc->http_ret                     = 0;
     http_proc->last_monitor_tick            = xTaskGetTickCount();
-    http_proc->last_monitor_pos             = 0;
+    http_proc->last_monitor_pos             = http_proc->start_pos;
     http_proc->range_forecast               = http_proc->range_enable;
     http_proc->close_if_rang_end            = false;
+    http_proc->body_stream                  = false;
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
 static http_download_proc_return_t http_download_proc_stop(http_download_proc_t* http_proc)
 {
+    httpclient_pool_stats_t stats;
+    
     http_download_proc_close_client(http_proc);
 
+    if(http_proc->request_count > 0 && http_proc->conn_count + http_proc->reuse_count > 0) {
+        httpclient_get_pool_stats(&stats);
+
+        /* every request that did not need a new connection saved a connect */
+        LOG_I(http_download_proc, "[%d] requests: %d, connections: %d (%d from the pool), %.2f requests/connection, connect time saved: %d ms", 
+            http_proc->download_handle, http_proc->request_count, http_proc->conn_count + http_proc->reuse_count, http_proc->reuse_count,
+            (double)http_proc->request_count/(http_proc->conn_count + http_proc->reuse_count),
+            (stats.connects > 0) ?(http_proc->request_count - http_proc->conn_count)*stats.connect_ms/stats.connects :0);
+    }
+
+    http_download_proc_segment_free(http_proc);
+
     if(NULL != http_proc->client_data_ext) {
         free(http_proc->client_data_ext);
         http_proc->client_data_ext = NULL;
@@ -365,6 +680,8 @@ static http_download_proc_return_t http_download_proc_conn(http_download_proc_t*
     memset(&http_proc->client_data, 0, sizeof(httpclient_data_t));
     memset(http_proc->client_data_ext->remain_data_buf, 0, HTTPCLIENT_CHUNK_SIZE);
 
+    http_proc->response_done = false;
+
     http_proc->client_data_ext->remain_data_len = 0;
     http_proc->cur_download_pos                 = 0;
     http_proc->client_data.response_buf         = http_proc->recv_buf;
@@ -384,6 +701,11 @@ static http_download_proc_return_t http_download_proc_conn(http_download_proc_t*
                 range_count = http_proc->total_length - http_proc->pre_download_pos;
             }
         }
+        else if(true==http_proc->range_forecast && NULL != http_proc->segment)
+        {
+            /* just enough to learn the length, the rest goes segmented */
+            range_count = HTTP_SEGMENT_SIZE;
+        }
         else if(true==http_proc->range_forecast)
         {
             range_count = common_buffer_get_free_count(http_proc->http_buffer);
@@ -423,12 +745,30 @@ static http_download_proc_return_t http_download_proc_conn(http_download_proc_t*
     if(http_proc->http_ret < 0) {
         return HTTP_DOWNLOAD_PROC_ERR_SEND;
     }
+
+    http_proc->request_count++;
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
 static http_download_proc_return_t http_download_proc_recv(http_download_proc_t* http_proc)
 {
+    /* 
+     * Only the header and the first part of the body go through recv_buf.
+     * Once nothing is left to skip, the rest is received by
+     * http_download_proc_push_data into http_buffer itself.
+     */
+    http_proc->body_stream = false;
+
+    if(true == http_proc->client_data.is_more && 
+        (true == http_proc->client_data_ext->is_range || http_proc->cur_download_pos >= http_proc->pre_download_pos)) 
+    {
+        http_proc->body_stream = true;
+        http_proc->recv_len = 0;
+        http_proc->read_pos = 0;
+        return HTTP_DOWNLOAD_PROC_SUCCESS;
+    }
+
     httpclient_set_response_timeout(&http_proc->client, 3000);
 
     http_proc->http_ret = httpclient_recv_response(&http_proc->client, &http_proc->client_data);
@@ -490,11 +830,13 @@ static http_download_proc_return_t http_download_proc_recv(http_download_proc_t*
         }
     }
 
-    if(false==http_proc->range_enable)
+    /* Accept-Ranges on a whole response, as when If-Range did not match */
+    if(false==http_proc->range_enable || 200 == httpclient_get_response_code(&http_proc->client))
     {
         http_proc->client_data_ext->is_range = false;
     }
-    else if(true==http_proc->range_forecast)
+
+    if(true==http_proc->range_enable && true==http_proc->range_forecast)
     {
         if(false==http_proc->client_data_ext->is_range) {
             http_proc->range_forecast = false;
@@ -502,6 +844,8 @@ static http_download_proc_return_t http_download_proc_recv(http_download_proc_t*
         }
     }
 
+    memcpy(http_proc->validator, http_proc->client_data_ext->if_range, HTTPCLIENT_IF_RANGE_SIZE);
+
     if(true == http_proc->client_data.is_chunked)
     {
         http_proc->is_chunked = true;
@@ -554,32 +898,94 @@ static http_download_proc_return_t http_download_proc_recv(http_download_proc_t*
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* one receive of body data into the free space at the tail of http_buffer */
+static http_download_proc_return_t http_download_proc_recv_stream(http_download_proc_t* http_proc, int* p_len)
+{
+    uint8_t* buf;
+    uint32_t size;
+
+    *p_len = 0;
+
+    if(common_buffer_get_free_count(http_proc->http_buffer) < HTTP_DOWNLOAD_STREAM_MIN_FREE ||
+        COMMON_BUF_SUCCESS != common_buffer_reserve(http_proc->http_buffer, &buf, &size) || 0 == size)
+    {
+        return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
+    }
+
+    httpclient_set_response_timeout(&http_proc->client, 3000);
+    http_proc->http_ret = httpclient_recv_body(&http_proc->client, &http_proc->client_data, (char*)buf, size, p_len);
+    httpclient_set_response_timeout(&http_proc->client, 0x7FFFFFFF);
+
+    if(http_proc->http_ret < 0)
+    {
+        LOG_E(http_download_proc, "[%d] recv_error: %d, err_count: %d, received: %d", http_proc->download_handle, http_proc->http_ret, http_proc->err_recv_count, http_proc->pre_download_pos);
+
+        if(HTTPCLIENT_ERROR_CONN != http_proc->http_ret)
+            http_proc->err_recv_count++;
+        
+        if(http_proc->err_recv_count >= HTTP_DOWNLOAD_MAX_ERR_RECV_COUNT) {
+            return HTTP_DOWNLOAD_PROC_ERR_TRY_RECV;
+        }
+        else {
+            return HTTP_DOWNLOAD_PROC_ERR_RECV;
+        }
+    }
+
+    common_buffer_commit(http_proc->http_buffer, *p_len);
+
+    if(true == http_proc->is_chunked) {
+        http_proc->total_length = http_proc->client_data.response_content_len;
+    }
+
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+static void http_download_proc_monitor(http_download_proc_t* http_proc)
+{
+    double speed, progress;
+
+    if((xTaskGetTickCount() - http_proc->last_monitor_tick) >= HTTP_DOWNLOAD_MONITOR_INTERVAL) {
+        speed  = http_proc->pre_download_pos - http_proc->last_monitor_pos;
+        speed /= (xTaskGetTickCount()-http_proc->last_monitor_tick);
+
+        progress = 100.0*http_proc->pre_download_pos/http_proc->total_length;
+
+        LOG_I(http_download_proc, "[%d] download: %.2f%%(%d/%d) %.2fkB/s", http_proc->download_handle, progress, http_proc->pre_download_pos, http_proc->total_length, speed);
+
+        http_proc->last_monitor_pos  = http_proc->pre_download_pos;
+        http_proc->last_monitor_tick = xTaskGetTickCount();
+    }
+}
+
 static http_download_proc_return_t http_download_proc_push_data(http_download_proc_t* http_proc)
 {
     int len = http_proc->recv_len - http_proc->read_pos;
-    double speed, progress;
+    http_download_proc_return_t ret;
     
-    if(common_buffer_get_free_count(http_proc->http_buffer) < len)
+    if(true == http_proc->body_stream)
+    {
+        ret = http_download_proc_recv_stream(http_proc, &len);
+        if(HTTP_DOWNLOAD_PROC_SUCCESS != ret)
+            return ret;
+    }
+    else if(common_buffer_get_free_count(http_proc->http_buffer) < len)
     {
         return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
     }
     else
     {
         common_buffer_push(http_proc->http_buffer, &http_proc->recv_buf[http_proc->read_pos], len);
+        http_proc->read_pos += len;
+    }
+
+    {
         http_proc->pre_download_pos += len;
         http_proc->cur_download_pos += len;
-        http_proc->read_pos         += len;
-
-        if((xTaskGetTickCount() - http_proc->last_monitor_tick) >= HTTP_DOWNLOAD_MONITOR_INTERVAL) {
-            speed  = http_proc->pre_download_pos - http_proc->last_monitor_pos;
-            speed /= (xTaskGetTickCount()-http_proc->last_monitor_tick);
 
-            progress = 100.0*http_proc->pre_download_pos/http_proc->total_length;
+        http_download_proc_monitor(http_proc);
 
-            LOG_I(http_download_proc, "[%d] download: %.2f%%(%d/%d) %.2fkB/s", http_proc->download_handle, progress, http_proc->pre_download_pos, http_proc->total_length, speed);
-
-            http_proc->last_monitor_pos  = http_proc->pre_download_pos;
-            http_proc->last_monitor_tick = xTaskGetTickCount();
+        if(HTTPCLIENT_RETRIEVE_MORE_DATA != http_proc->http_ret) {
+            http_proc->response_done = true;
         }
 
         if(false==http_proc->client_data_ext->is_range && HTTPCLIENT_RETRIEVE_MORE_DATA!=http_proc->http_ret) {
@@ -604,26 +1010,107 @@ static http_download_proc_return_t http_download_proc_push_data(http_download_pr
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* blocks until the consumer frees enough, or for at most one wait interval */
 static http_download_proc_return_t http_download_wait_free(http_download_proc_t* http_proc)
 {
-    int len = http_proc->recv_len - http_proc->read_pos;
+    int len = (true == http_proc->body_stream) ?HTTP_DOWNLOAD_STREAM_MIN_FREE :(http_proc->recv_len - http_proc->read_pos);
     
-    if(common_buffer_get_free_count(http_proc->http_buffer) < len) {
+    if(COMMON_BUF_SUCCESS != common_buffer_wait_free(http_proc->http_buffer, len, HTTP_DOWNLOAD_WAIT_FREE_INTERVAL)) {
         return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
     }
 
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* the next range starts once at least half of http_buffer is free */
 static http_download_proc_return_t http_download_wait_range(http_download_proc_t* http_proc)
 {
-    if(common_buffer_get_free_count(http_proc->http_buffer) <= common_buffer_get_count(http_proc->http_buffer)) {
+    if(COMMON_BUF_SUCCESS != common_buffer_wait_free(http_proc->http_buffer, 
+        http_proc->http_buffer->max_size/2 + 1, HTTP_DOWNLOAD_WAIT_FREE_INTERVAL)) 
+    {
         return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
     }
     
     return HTTP_DOWNLOAD_PROC_SUCCESS;
 }
 
+/* 
+ * The next range is fetched segmented when the length and ranges are known
+ * and at least two segments fit in http_buffer: at prefill, and catching
+ * up after the consumer drained it.
+ */
+static int http_download_proc_segment_window(http_download_proc_t* http_proc)
+{
+    int window;
+    
+    if(NULL == http_proc->segment || false == http_proc->length_received || 
+        true == http_proc->is_chunked || false == http_proc->client_data_ext->is_range) 
+    {
+        return 0;
+    }
+
+    window = common_buffer_get_free_count(http_proc->http_buffer);
+
+    if(window > http_proc->total_length - http_proc->pre_download_pos) {
+        window = http_proc->total_length - http_proc->pre_download_pos;
+    }
+
+    return (window >= 2*HTTP_SEGMENT_SIZE) ?window :0;
+}
+
+static http_download_proc_return_t http_download_proc_segment_start(http_download_proc_t* http_proc, int window)
+{
+    char* if_range = NULL;
+
+    if(strlen(http_proc->client_data_ext->if_range) > 0) {
+        if_range = http_proc->client_data_ext->if_range;
+    }
+    
+    /* back to the idle pool, for the segment workers to take */
+    http_download_proc_close_client(http_proc);
+
+    http_proc->range_end = http_proc->pre_download_pos + window;
+
+    if(HTTP_SEGMENT_SUCCESS != http_segment_start(http_proc->segment, http_proc->url, http_proc->pre_download_pos, http_proc->range_end, if_range)) {
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+    
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+static http_download_proc_return_t http_download_proc_segment_push(http_download_proc_t* http_proc)
+{
+    http_segment_return_t ret;
+    int len;
+
+    ret = http_segment_push(http_proc->segment, http_proc->http_buffer, &len, HTTP_DOWNLOAD_WAIT_FREE_INTERVAL);
+
+    http_proc->pre_download_pos += len;
+    http_download_proc_monitor(http_proc);
+
+    if(HTTP_SEGMENT_SUCCESS == ret) {
+        return HTTP_DOWNLOAD_PROC_SUCCESS;
+    }
+
+    http_segment_stop(http_proc->segment);
+
+    if(HTTP_SEGMENT_DONE != ret)
+    {
+        /* pushed in order up to pre_download_pos, the one connection goes on from there */
+        LOG_E(http_download_proc, "[%d] segmented fetch failed at %d, fall back to one connection", http_proc->download_handle, http_proc->pre_download_pos);
+        
+        http_download_proc_segment_free(http_proc);
+        return HTTP_DOWNLOAD_PROC_ERR_RECV;
+    }
+
+    if(http_proc->pre_download_pos >= http_proc->total_length) {
+        LOG_I(http_download_proc, "[%d] all range end, download_pos:%d", http_proc->download_handle, http_proc->pre_download_pos);
+        return HTTP_DOWNLOAD_PROC_ALL_END;
+    }
+
+    return HTTP_DOWNLOAD_PROC_RANGE_END;
+}
+
 void http_download_task(void *param)
 {
 	http_download_proc_t* http_proc = (http_download_proc_t*)param;
@@ -687,16 +1174,37 @@ void http_download_task(void *param)
             http_download_proc_stop(http_proc);
             http_proc->cur_state = HTTP_DOWNLOAD_STA_IDLE;
             LOG_I(http_download_proc, "[%d] STA_STOP --> STA_IDLE", http_proc->download_handle);
+
+            if(NULL != http_proc->http_buffer) {
+                common_buffer_wakeup(http_proc->http_buffer);
+            }
 			break;
 			
 		case HTTP_DOWNLOAD_STA_PAUSE:
             http_download_proc_close_client(http_proc);
+
+            if(NULL != http_proc->segment) {
+                http_segment_stop(http_proc->segment);
+            }
+
+            if(NULL != http_proc->http_buffer) {
+                common_buffer_wakeup(http_proc->http_buffer);
+            }
+
             http_download_wait_event(http_proc, HTTP_DOWNLOAD_EVENT_RESUME, portMAX_DELAY);
             http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
             LOG_I(http_download_proc, "[%d] STA_PAUSE --> STA_CONN", http_proc->download_handle);
 			break;
 			
 		case HTTP_DOWNLOAD_STA_CONN:
+            if(http_download_proc_segment_window(http_proc) > 0 &&
+                HTTP_DOWNLOAD_PROC_SUCCESS == http_download_proc_segment_start(http_proc, http_download_proc_segment_window(http_proc)))
+            {
+                http_proc->cur_state = HTTP_DOWNLOAD_STA_SEGMENT;
+                LOG_I(http_download_proc, "[%d] STA_CONN --> STA_SEGMENT", http_proc->download_handle);
+                break;
+            }
+
             http_proc->last_error = http_download_proc_conn(http_proc);
             
             if(HTTP_DOWNLOAD_PROC_SUCCESS == http_proc->last_error ) {
@@ -762,17 +1270,28 @@ void http_download_task(void *param)
                 http_proc->cur_state = HTTP_DOWNLOAD_STA_WAIT_RANGE;
                 LOG_I(http_download_proc, "[%d] STA_PUSH_DATA --> STA_WAIT_RANGE", http_proc->download_handle);
 
-                if(true == http_proc->close_if_rang_end) {
+                if(true == http_proc->close_if_rang_end || false == http_proc->client.keep_alive || 
+                    true == http_proc->client_data.is_more) 
+                {
                     http_download_proc_close_client(http_proc);
                 }
             }
-            else if( HTTP_DOWNLOAD_PROC_ALL_END == http_proc->last_error )
+            else if( HTTP_DOWNLOAD_PROC_ALL_END == http_proc->last_error ||
+                     HTTP_DOWNLOAD_PROC_ERR_TRY_RECV == http_proc->last_error )
             {
                 http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
                 LOG_I(http_download_proc, "[%d] STA_PUSH_DATA --> STA_STOP", http_proc->download_handle);
             }
-			break;
-			
+            else if( HTTP_DOWNLOAD_PROC_ERR_RECV == http_proc->last_error )
+            {
+                http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+                LOG_I(http_download_proc, "[%d] STA_PUSH_DATA --> STA_CONN", http_proc->download_handle);
+
+                http_download_proc_close_client(http_proc);
+                vTaskDelay(500/portTICK_RATE_MS);
+            }
+			break;
+			
 		case HTTP_DOWNLOAD_STA_WAIT_FREE:
             http_proc->last_error = http_download_wait_free(http_proc);
 
@@ -780,10 +1299,6 @@ void http_download_task(void *param)
             {
                 http_proc->cur_state = HTTP_DOWNLOAD_STA_PUSH_DATA;
                 LOG_I(http_download_proc, "[%d] STA_WAIT_FREE --> STA_PUSH_DATA", http_proc->download_handle);
-            }
-            else
-            {
-                vTaskDelay(100/portTICK_RATE_MS);
             }
 			break;
 
@@ -795,9 +1310,25 @@ void http_download_task(void *param)
                 http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
                 LOG_I(http_download_proc, "[%d] STA_WAIT_RANG --> STA_CONN", http_proc->download_handle);
             }
-            else
+            break;
+
+        case HTTP_DOWNLOAD_STA_SEGMENT:
+            http_proc->last_error = http_download_proc_segment_push(http_proc);
+
+            if( HTTP_DOWNLOAD_PROC_RANGE_END == http_proc->last_error )
+            {
+                http_proc->cur_state = HTTP_DOWNLOAD_STA_WAIT_RANGE;
+                LOG_I(http_download_proc, "[%d] STA_SEGMENT --> STA_WAIT_RANGE", http_proc->download_handle);
+            }
+            else if( HTTP_DOWNLOAD_PROC_ALL_END == http_proc->last_error )
+            {
+                http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+                LOG_I(http_download_proc, "[%d] STA_SEGMENT --> STA_STOP", http_proc->download_handle);
+            }
+            else if( HTTP_DOWNLOAD_PROC_ERR_RECV == http_proc->last_error )
             {
-                vTaskDelay(100/portTICK_RATE_MS);
+                http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+                LOG_I(http_download_proc, "[%d] STA_SEGMENT --> STA_CONN", http_proc->download_handle);
             }
             break;
 		}
@@ -806,3 +1337,696 @@ void http_download_task(void *param)
     vTaskDelete(NULL);
 }
 
+
+/* 
+ * The same download on http_engine: every step returns as soon as the socket
+ * would block, the engine calls back on socket readiness, the step's timer or
+ * an event set by the API functions. http_segment is not used, it needs
+ * tasks of its own.
+ */
+static http_download_proc_return_t http_download_engine_start(http_download_proc_t* http_proc)
+{
+    http_download_proc_return_t ret = http_download_proc_start(http_proc);
+
+    http_download_proc_segment_free(http_proc);
+
+    if(HTTP_DOWNLOAD_PROC_SUCCESS != ret) {
+        return ret;
+    }
+
+    http_proc->engine_response = (http_engine_response_t*)malloc(sizeof(http_engine_response_t));
+    if(NULL == http_proc->engine_response) {
+        return HTTP_DOWNLOAD_PROC_ERR_MALLOC;
+    }
+
+    http_proc->engine_sock  = -1;
+    http_proc->engine_retry = false;
+    http_proc->engine_skip  = 0;
+    http_proc->recv_len     = 0;
+    http_proc->read_pos     = 0;
+    
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+static void http_download_engine_close(http_download_proc_t* http_proc)
+{
+    if(http_proc->engine_sock >= 0) {
+        http_engine_watch(http_proc->engine_id, -1, HTTP_ENGINE_EVENT_NONE);
+        close(http_proc->engine_sock);
+        http_proc->engine_sock = -1;
+    }
+
+    if(NULL != http_proc->engine_request) {
+        free(http_proc->engine_request);
+        http_proc->engine_request = NULL;
+    }
+}
+
+static void http_download_engine_stop(http_download_proc_t* http_proc)
+{
+    http_download_engine_close(http_proc);
+    http_engine_set_timer(http_proc->engine_id, 0);
+    
+    http_proc->engine_retry = false;
+
+    if(NULL != http_proc->engine_response) {
+        free(http_proc->engine_response);
+        http_proc->engine_response = NULL;
+    }
+
+    http_download_proc_stop(http_proc);
+}
+
+/* the connection is dropped, STA_CONN tries again after a delay */
+static void http_download_engine_retry(http_download_proc_t* http_proc)
+{
+    http_download_engine_close(http_proc);
+    
+    http_proc->engine_retry = true;
+    http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RETRY_DELAY);
+}
+
+static http_download_proc_return_t http_download_engine_conn_error(http_download_proc_t* http_proc, const char* reason)
+{
+    LOG_E(http_download_proc, "[%d] connect failed: %s, err_count: %d, url: %s", http_proc->download_handle, reason, http_proc->err_conn_count, http_proc->url);
+    
+    if(++http_proc->err_conn_count >= HTTP_DOWNLOAD_MAX_ERR_CONN_COUNT) {
+        return HTTP_DOWNLOAD_PROC_ERR_TRY_CONN;
+    }
+    
+    return HTTP_DOWNLOAD_PROC_ERR_CONN;
+}
+
+static http_download_proc_return_t http_download_engine_recv_error(http_download_proc_t* http_proc, const char* reason)
+{
+    LOG_E(http_download_proc, "[%d] recv_error: %s, err_count: %d, received: %d", http_proc->download_handle, reason, http_proc->err_recv_count, http_proc->pre_download_pos);
+
+    if(++http_proc->err_recv_count >= HTTP_DOWNLOAD_MAX_ERR_RECV_COUNT) {
+        return HTTP_DOWNLOAD_PROC_ERR_TRY_RECV;
+    }
+    
+    return HTTP_DOWNLOAD_PROC_ERR_RECV;
+}
+
+/* 
+ * Non-blocking connect to the resolved addresses from engine_addr_index on,
+ * skipping those that fail at once. When none is left the host is dropped
+ * from the dns cache, it may have moved.
+ */
+static http_download_proc_return_t http_download_engine_connect_addr(http_download_proc_t* http_proc, const char* reason)
+{
+    dns_cache_addr_t* addr;
+    int ret;
+
+    for(; http_proc->engine_addr_index < http_proc->engine_addr_count; http_proc->engine_addr_index++)
+    {
+        addr = &http_proc->engine_addrs[http_proc->engine_addr_index];
+        
+        http_proc->engine_sock = socket(addr->family, SOCK_STREAM |SOCK_NONBLOCK |SOCK_CLOEXEC, IPPROTO_TCP);
+        if(http_proc->engine_sock < 0) {
+            reason = strerror(errno);
+            continue;
+        }
+
+        ret = connect(http_proc->engine_sock, (struct sockaddr*)&addr->addr, addr->addr_len);
+
+        if(0 == ret || EINPROGRESS == errno) {
+            http_proc->engine_connected = (0 == ret) ?true :false;
+
+            http_engine_watch(http_proc->engine_id, http_proc->engine_sock, HTTP_ENGINE_EVENT_WRITE);
+            http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT);
+            return HTTP_DOWNLOAD_PROC_SUCCESS;
+        }
+
+        reason = strerror(errno);
+        close(http_proc->engine_sock);
+        http_proc->engine_sock = -1;
+    }
+
+    dns_cache_forget(http_proc->engine_host, http_proc->engine_port);
+    
+    return http_download_engine_conn_error(http_proc, reason);
+}
+
+/* the connect in progress failed, on to the next address */
+static http_download_proc_return_t http_download_engine_connect_next(http_download_proc_t* http_proc, const char* reason)
+{
+    LOG_W(http_download_proc, "[%d] connect to address %d of %d failed: %s", 
+        http_proc->download_handle, http_proc->engine_addr_index + 1, http_proc->engine_addr_count, reason);
+    
+    http_engine_watch(http_proc->engine_id, -1, HTTP_ENGINE_EVENT_NONE);
+    close(http_proc->engine_sock);
+    http_proc->engine_sock = -1;
+    
+    http_proc->engine_addr_index++;
+    
+    return http_download_engine_connect_addr(http_proc, reason);
+}
+
+/* starts a non-blocking connect and builds the request it sends */
+static http_download_proc_return_t http_download_engine_connect(http_download_proc_t* http_proc)
+{
+    char scheme[8];
+    char* path = http_proc->recv_buf;
+    http_download_proc_return_t ret;
+    int port, len;
+
+    if(NULL == http_proc->url || NULL == http_proc->http_buffer) {
+        LOG_E(http_download_proc, "url or http_buffer is null!");
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    http_download_proc_url_preprocess(http_proc);
+
+    /* recv_buf is not in use before the response */
+    if(HTTPCLIENT_OK != httpclient_parse_url(http_proc->url, scheme, sizeof(scheme), http_proc->engine_host, sizeof(http_proc->engine_host), &port, path, HTTP_DOWNLOAD_RECV_BUF_SIZE)) {
+        LOG_E(http_download_proc, "[%d] bad url: %s", http_proc->download_handle, http_proc->url);
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    /* https was turned into http above, like the threaded path does; the engine has no tls for anything else */
+    if(0 != strcasecmp(scheme, "http")) {
+        LOG_E(http_download_proc, "[%d] scheme %s is not supported by the engine, url: %s", http_proc->download_handle, scheme, http_proc->url);
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    if(0 == port) {
+        port = 80;
+    }
+
+    http_proc->engine_request = (char*)malloc(HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE);
+    if(NULL == http_proc->engine_request) {
+        return HTTP_DOWNLOAD_PROC_ERR_MALLOC;
+    }
+
+    /* one response runs to the end, nothing is left to reuse the connection for */
+    len = snprintf(http_proc->engine_request, HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE, 
+        "GET %s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\nUser-Agent: Mozilla/4.0 (compatible; MSIE 5.00; Windows 98)\r\nConnection: close\r\n", path, http_proc->engine_host);
+
+    if(true == http_proc->range_enable) {
+        len += snprintf(&http_proc->engine_request[len], HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE - len, "Range: bytes=%d-\r\n", http_proc->pre_download_pos);
+
+        if(true == http_proc->client_data_ext->is_range && strlen(http_proc->client_data_ext->if_range) > 0) {
+            len += snprintf(&http_proc->engine_request[len], HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE - len, "If-Range: %s\r\n", http_proc->client_data_ext->if_range);
+        }
+    }
+
+    len += snprintf(&http_proc->engine_request[len], HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE - len, "\r\n");
+
+    if(len >= HTTP_DOWNLOAD_ENGINE_REQUEST_SIZE) {
+        LOG_E(http_download_proc, "[%d] request too long", http_proc->download_handle);
+        return HTTP_DOWNLOAD_PROC_ERR_PARAM;
+    }
+
+    http_proc->engine_request_len = len;
+    http_proc->engine_sent        = 0;
+
+    /* the one blocking call on the engine task, unless the host was looked up or prefetched */
+    http_proc->engine_port       = port;
+    http_proc->engine_addr_index = 0;
+    
+    if(DNS_CACHE_SUCCESS != dns_cache_resolve(http_proc->engine_host, port, http_proc->engine_addrs, &http_proc->engine_addr_count)) {
+        return http_download_engine_conn_error(http_proc, "unresolved host");
+    }
+
+    ret = http_download_engine_connect_addr(http_proc, "no address");
+    if(HTTP_DOWNLOAD_PROC_SUCCESS == ret) {
+        http_proc->conn_count++;
+    }
+    
+    return ret;
+}
+
+static http_download_proc_return_t http_download_engine_conn(http_download_proc_t* http_proc, uint32_t events)
+{
+    http_download_proc_return_t ret;
+    socklen_t err_len = sizeof(int);
+    int err = 0, len;
+
+    if(http_proc->engine_sock < 0) {
+        ret = http_download_engine_connect(http_proc);
+        if(HTTP_DOWNLOAD_PROC_SUCCESS != ret)
+            return ret;
+    }
+
+    if(false == http_proc->engine_connected)
+    {
+        if(HTTP_ENGINE_EVENT_TIMER & events) {
+            ret = http_download_engine_connect_next(http_proc, "timeout");
+            return (HTTP_DOWNLOAD_PROC_SUCCESS == ret) ?HTTP_DOWNLOAD_PROC_PENDING :ret;
+        }
+        
+        if(0 == ((HTTP_ENGINE_EVENT_WRITE |HTTP_ENGINE_EVENT_ERROR) & events)) {
+            return HTTP_DOWNLOAD_PROC_PENDING;
+        }
+
+        if(0 != getsockopt(http_proc->engine_sock, SOL_SOCKET, SO_ERROR, &err, &err_len) || 0 != err) {
+            ret = http_download_engine_connect_next(http_proc, strerror(err));
+            return (HTTP_DOWNLOAD_PROC_SUCCESS == ret) ?HTTP_DOWNLOAD_PROC_PENDING :ret;
+        }
+
+        http_proc->engine_connected = true;
+    }
+
+    while(http_proc->engine_sent < http_proc->engine_request_len)
+    {
+        len = send(http_proc->engine_sock, &http_proc->engine_request[http_proc->engine_sent], 
+            http_proc->engine_request_len - http_proc->engine_sent, MSG_NOSIGNAL);
+
+        if(len < 0) {
+            if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                return (HTTP_ENGINE_EVENT_TIMER & events) ?http_download_engine_conn_error(http_proc, "send timeout") :HTTP_DOWNLOAD_PROC_PENDING;
+            }
+            
+            return http_download_engine_conn_error(http_proc, strerror(errno));
+        }
+
+        http_proc->engine_sent += len;
+    }
+
+    free(http_proc->engine_request);
+    http_proc->engine_request = NULL;
+    
+    http_proc->err_conn_count = 0;
+    http_proc->request_count++;
+    http_proc->recv_len = 0;
+    http_proc->read_pos = 0;
+
+    http_engine_response_reset(http_proc->engine_response);
+    http_engine_watch(http_proc->engine_id, http_proc->engine_sock, HTTP_ENGINE_EVENT_READ);
+    http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT);
+
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+/* what the header says about the download, as http_download_proc_recv does */
+static http_download_proc_return_t http_download_engine_response(http_download_proc_t* http_proc)
+{
+    http_engine_response_t* response = http_proc->engine_response;
+    int url_len;
+
+    if(response->status >= 300 && response->status < 400 && NULL != response->location && false == http_proc->redirect)
+    {
+        LOG_E(http_download_proc, "[%d] Redirected url is %s", http_proc->download_handle, response->location);
+
+        url_len = strlen(response->location);
+        
+        if(NULL != http_proc->url) {
+            free(http_proc->url);
+        }
+
+        http_proc->url = (char*)malloc(url_len+1);
+        if(NULL == http_proc->url) {
+            return HTTP_DOWNLOAD_PROC_ERR_MALLOC;
+        }
+
+        memcpy(http_proc->url, response->location, url_len+1);
+        
+        http_proc->redirect = true;
+        return HTTP_DOWNLOAD_PROC_REDIRECT;
+    }
+
+    if((200 != response->status && 206 != response->status) ||
+        (206 == response->status && response->range_begin != http_proc->pre_download_pos))
+    {
+        LOG_E(http_download_proc, "[%d] reponse error %d, range_begin: %d", http_proc->download_handle, response->status, response->range_begin);
+        
+        if(++http_proc->err_recv_count >= HTTP_DOWNLOAD_MAX_ERR_RECV_COUNT) {
+            return HTTP_DOWNLOAD_PROC_ERR_RESPONSE;
+        }
+        
+        return HTTP_DOWNLOAD_PROC_ERR_RECV;
+    }
+
+    /* a whole resource again, what http_buffer already has is dropped from it */
+    http_proc->client_data_ext->is_range = (206 == response->status) ?true :false;
+    http_proc->engine_skip = (206 == response->status) ?0 :http_proc->pre_download_pos;
+
+    if(NULL != response->etag || NULL != response->last_modified) {
+        strncpy(http_proc->client_data_ext->if_range, (NULL != response->etag) ?response->etag :response->last_modified, HTTPCLIENT_IF_RANGE_SIZE-1);
+        http_proc->client_data_ext->if_range[HTTPCLIENT_IF_RANGE_SIZE-1] = '\0';
+    }
+
+    memcpy(http_proc->validator, http_proc->client_data_ext->if_range, HTTPCLIENT_IF_RANGE_SIZE);
+
+    if(true == response->is_chunked)
+    {
+        http_proc->is_chunked = true;
+        LOG_I(http_download_proc, "[%d] chunked: true", http_proc->download_handle);
+    }
+    else if(false == http_proc->length_received)
+    {
+        if(206 == response->status && response->range_total > 0) {
+            http_proc->total_length = response->range_total;
+        }
+        else if(response->content_len >= 0) {
+            http_proc->total_length = http_proc->pre_download_pos + response->content_len - http_proc->engine_skip;
+        }
+
+        http_proc->length_received = (http_proc->total_length >= 0) ?true :false;
+        LOG_I(http_download_proc, "[%d] chunked: false, total_length: %d, is_range: %d\n", http_proc->download_handle, http_proc->total_length, http_proc->client_data_ext->is_range);
+    }
+
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+/* drops what comes before pre_download_pos from the len bytes at buf */
+static int http_download_engine_skip(http_download_proc_t* http_proc, char* buf, int len)
+{
+    int count = (http_proc->engine_skip < len) ?http_proc->engine_skip :len;
+
+    if(count > 0) {
+        memmove(buf, &buf[count], len - count);
+        http_proc->engine_skip -= count;
+    }
+
+    return len - count;
+}
+
+static http_download_proc_return_t http_download_engine_recv(http_download_proc_t* http_proc, uint32_t events)
+{
+    http_engine_response_t* response = http_proc->engine_response;
+    http_download_proc_return_t ret;
+    http_engine_return_t parse_ret;
+    int len, used;
+
+    len = recv(http_proc->engine_sock, http_proc->recv_buf, HTTP_DOWNLOAD_RECV_BUF_SIZE-1, 0);
+    
+    if(len < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+        return (HTTP_ENGINE_EVENT_TIMER & events) ?http_download_engine_recv_error(http_proc, "response timeout") :HTTP_DOWNLOAD_PROC_PENDING;
+    }
+    
+    if(len <= 0) {
+        return http_download_engine_recv_error(http_proc, (0 == len) ?"closed by server" :strerror(errno));
+    }
+
+    http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT);
+
+    parse_ret = http_engine_parse_header(response, http_proc->recv_buf, len, &used);
+
+    if(HTTP_ENGINE_MORE == parse_ret) {
+        return HTTP_DOWNLOAD_PROC_PENDING;
+    }
+    
+    if(HTTP_ENGINE_SUCCESS != parse_ret) {
+        return http_download_engine_recv_error(http_proc, "bad header");
+    }
+
+    ret = http_download_engine_response(http_proc);
+    if(HTTP_DOWNLOAD_PROC_SUCCESS != ret) {
+        return ret;
+    }
+
+    /* the rest of recv_buf is the start of the body */
+    len = http_engine_decode_body(response, &http_proc->recv_buf[used], len - used);
+    if(len < 0) {
+        return http_download_engine_recv_error(http_proc, "bad chunk");
+    }
+
+    http_proc->read_pos = used;
+    http_proc->recv_len = used + http_download_engine_skip(http_proc, &http_proc->recv_buf[used], len);
+
+    return HTTP_DOWNLOAD_PROC_SUCCESS;
+}
+
+static void http_download_engine_received(http_download_proc_t* http_proc, int len)
+{
+    http_proc->pre_download_pos += len;
+    http_proc->cur_download_pos += len;
+
+    if(true == http_proc->is_chunked) {
+        http_proc->total_length = http_proc->pre_download_pos;
+    }
+
+    http_download_proc_monitor(http_proc);
+}
+
+/* 
+ * Receives straight into http_buffer, a few rounds at most so that one busy
+ * download does not hold up the others.
+ */
+static http_download_proc_return_t http_download_engine_push_data(http_download_proc_t* http_proc, uint32_t events)
+{
+    http_engine_response_t* response = http_proc->engine_response;
+    int len = http_proc->recv_len - http_proc->read_pos;
+    uint8_t* buf;
+    uint32_t size;
+    int round;
+
+    if(len > 0) {
+        if(common_buffer_get_free_count(http_proc->http_buffer) < len) {
+            return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
+        }
+
+        common_buffer_push(http_proc->http_buffer, (uint8_t*)&http_proc->recv_buf[http_proc->read_pos], len);
+        http_proc->read_pos += len;
+        http_download_engine_received(http_proc, len);
+    }
+
+    for(round = 0; round < HTTP_DOWNLOAD_ENGINE_RECV_ROUNDS && false == response->done; round++)
+    {
+        if(common_buffer_get_free_count(http_proc->http_buffer) < HTTP_DOWNLOAD_STREAM_MIN_FREE ||
+            COMMON_BUF_SUCCESS != common_buffer_reserve(http_proc->http_buffer, &buf, &size) || 0 == size)
+        {
+            return HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL;
+        }
+
+        len = recv(http_proc->engine_sock, buf, size, 0);
+
+        if(len < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return (HTTP_ENGINE_EVENT_TIMER & events) ?http_download_engine_recv_error(http_proc, "timeout") :HTTP_DOWNLOAD_PROC_PENDING;
+        }
+
+        /* a body without length or chunks ends with the connection */
+        if(0 == len && false == response->is_chunked && response->body_left < 0) {
+            response->done = true;
+            break;
+        }
+
+        if(len <= 0) {
+            return http_download_engine_recv_error(http_proc, (0 == len) ?"closed by server" :strerror(errno));
+        }
+
+        http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT);
+
+        len = http_engine_decode_body(response, (char*)buf, len);
+        if(len < 0) {
+            return http_download_engine_recv_error(http_proc, "bad chunk");
+        }
+
+        len = http_download_engine_skip(http_proc, (char*)buf, len);
+        
+        common_buffer_commit(http_proc->http_buffer, len);
+        http_download_engine_received(http_proc, len);
+    }
+
+    if(false == response->done) {
+        return HTTP_DOWNLOAD_PROC_PENDING;
+    }
+
+    if(false == http_proc->length_received) {
+        http_proc->total_length    = http_proc->pre_download_pos;
+        http_proc->length_received = true;
+    }
+
+    LOG_I(http_download_proc, "[%d] all end, download_pos:%d", http_proc->download_handle, http_proc->pre_download_pos);
+    return HTTP_DOWNLOAD_PROC_ALL_END;
+}
+
+static void http_download_engine_step(http_download_proc_t* http_proc, uint32_t events)
+{
+    uint32_t proc_events;
+    int len;
+    
+    proc_events = http_download_wait_event(http_proc, HTTP_DOWNLOAD_EVENT_STOP |HTTP_DOWNLOAD_EVENT_PAUSE, 0);
+        
+    if(HTTP_DOWNLOAD_EVENT_STOP & proc_events) {
+        http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+        LOG_I(http_download_proc, "[%d] stop event occur", http_proc->download_handle);
+    }
+    else if(HTTP_DOWNLOAD_EVENT_PAUSE & proc_events) {
+        http_proc->cur_state = HTTP_DOWNLOAD_STA_PAUSE;
+        LOG_I(http_download_proc, "[%d] pause event occur", http_proc->download_handle);
+    }
+    
+    switch(http_proc->cur_state)
+    {
+    case HTTP_DOWNLOAD_STA_IDLE:
+        proc_events = http_download_wait_event(http_proc, HTTP_DOWNLOAD_EVENT_START |HTTP_DOWNLOAD_EVENT_EXIT, 0);
+
+        if(HTTP_DOWNLOAD_EVENT_EXIT & proc_events) {
+            http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_EXITED);
+            LOG_I(http_download_proc, "[%d] STA_IDLE --> STA_EXIT", http_proc->download_handle);
+        }
+        else if(HTTP_DOWNLOAD_EVENT_START & proc_events) {
+            http_download_clear_event(http_proc, HTTP_DOWNLOAD_EVENT_STOPPED);
+            
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_START;
+            LOG_I(http_download_proc, "[%d] STA_IDLE --> STA_START", http_proc->download_handle);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_START:
+        http_proc->last_error = http_download_engine_start(http_proc);
+        
+        if(HTTP_DOWNLOAD_PROC_SUCCESS == http_proc->last_error) {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+            LOG_I(http_download_proc, "[%d] STA_START --> STA_CONN", http_proc->download_handle);
+        }
+        else {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+            LOG_I(http_download_proc, "[%d] STA_START --> STA_STOP", http_proc->download_handle);
+        }
+
+        http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_STARTED);
+        break;
+        
+    case HTTP_DOWNLOAD_STA_STOP:
+        http_download_engine_stop(http_proc);
+        http_proc->cur_state = HTTP_DOWNLOAD_STA_IDLE;
+        LOG_I(http_download_proc, "[%d] STA_STOP --> STA_IDLE, last_error: %d", http_proc->download_handle, http_proc->last_error);
+
+        http_download_set_event(http_proc, HTTP_DOWNLOAD_EVENT_STOPPED);
+        http_download_clear_event(http_proc, HTTP_DOWNLOAD_EVENT_STARTED);
+
+        if(NULL != http_proc->http_buffer) {
+            common_buffer_wakeup(http_proc->http_buffer);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_PAUSE:
+        if(http_proc->engine_sock >= 0 || true == http_proc->engine_retry) {
+            http_download_engine_close(http_proc);
+            http_engine_set_timer(http_proc->engine_id, 0);
+            http_proc->engine_retry = false;
+
+            if(NULL != http_proc->http_buffer) {
+                common_buffer_wakeup(http_proc->http_buffer);
+            }
+        }
+
+        if(HTTP_DOWNLOAD_EVENT_RESUME & http_download_wait_event(http_proc, HTTP_DOWNLOAD_EVENT_RESUME, 0)) {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+            LOG_I(http_download_proc, "[%d] STA_PAUSE --> STA_CONN", http_proc->download_handle);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_CONN:
+        if(true == http_proc->engine_retry) {
+            if(0 == (HTTP_ENGINE_EVENT_TIMER & events))
+                break;
+
+            http_proc->engine_retry = false;
+            events = HTTP_ENGINE_EVENT_NONE;
+        }
+        
+        http_proc->last_error = http_download_engine_conn(http_proc, events);
+        
+        if(HTTP_DOWNLOAD_PROC_SUCCESS == http_proc->last_error ) {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_RECV;
+            LOG_I(http_download_proc, "[%d] STA_CONN --> STA_RECV", http_proc->download_handle);
+        }
+        else if(HTTP_DOWNLOAD_PROC_ERR_TRY_CONN == http_proc->last_error ||
+                HTTP_DOWNLOAD_PROC_ERR_PARAM == http_proc->last_error ||
+                HTTP_DOWNLOAD_PROC_ERR_MALLOC == http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+            LOG_I(http_download_proc, "[%d] STA_CONN --> STA_STOP", http_proc->download_handle);
+        }
+        else if(HTTP_DOWNLOAD_PROC_PENDING != http_proc->last_error ) {
+            http_download_engine_retry(http_proc);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_RECV:
+        http_proc->last_error = http_download_engine_recv(http_proc, events);
+
+        if( HTTP_DOWNLOAD_PROC_SUCCESS == http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_PUSH_DATA;
+        }
+        else if( HTTP_DOWNLOAD_PROC_REDIRECT == http_proc->last_error )
+        {
+            http_download_engine_close(http_proc);
+            
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+            LOG_I(http_download_proc, "[%d] STA_RECV --> STA_CONN", http_proc->download_handle);
+        }
+        else if( HTTP_DOWNLOAD_PROC_ERR_RECV == http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+            LOG_I(http_download_proc, "[%d] STA_RECV --> STA_CONN", http_proc->download_handle);
+
+            http_download_engine_retry(http_proc);
+        }
+        else if( HTTP_DOWNLOAD_PROC_PENDING != http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+            LOG_I(http_download_proc, "[%d] STA_RECV --> STA_STOP", http_proc->download_handle);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_PUSH_DATA:
+        http_proc->last_error = http_download_engine_push_data(http_proc, events);
+
+        if( HTTP_DOWNLOAD_PROC_ERR_BUF_TOO_SMALL == http_proc->last_error )
+        {
+            /* the socket is left alone, TCP holds the server back meanwhile */
+            http_engine_watch(http_proc->engine_id, http_proc->engine_sock, HTTP_ENGINE_EVENT_NONE);
+            http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_FREE_INTERVAL);
+            
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_WAIT_FREE;
+        }
+        else if( HTTP_DOWNLOAD_PROC_ERR_RECV == http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_CONN;
+            LOG_I(http_download_proc, "[%d] STA_PUSH_DATA --> STA_CONN", http_proc->download_handle);
+
+            http_download_engine_retry(http_proc);
+        }
+        else if( HTTP_DOWNLOAD_PROC_ALL_END == http_proc->last_error ||
+                 HTTP_DOWNLOAD_PROC_ERR_TRY_RECV == http_proc->last_error )
+        {
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_STOP;
+            LOG_I(http_download_proc, "[%d] STA_PUSH_DATA --> STA_STOP", http_proc->download_handle);
+        }
+        break;
+        
+    case HTTP_DOWNLOAD_STA_WAIT_FREE:
+        len = (http_proc->recv_len > http_proc->read_pos) ?(http_proc->recv_len - http_proc->read_pos) :HTTP_DOWNLOAD_STREAM_MIN_FREE;
+        
+        if(common_buffer_get_free_count(http_proc->http_buffer) >= len) {
+            http_engine_watch(http_proc->engine_id, http_proc->engine_sock, HTTP_ENGINE_EVENT_READ);
+            http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_RECV_TIMEOUT);
+            
+            http_proc->cur_state = HTTP_DOWNLOAD_STA_PUSH_DATA;
+        }
+        else {
+            http_engine_set_timer(http_proc->engine_id, HTTP_DOWNLOAD_ENGINE_FREE_INTERVAL);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* on the engine task: steps on while the state moves, up to a bound */
+static void http_download_engine_callback(void* param, uint32_t events)
+{
+    http_download_proc_t* http_proc = (http_download_proc_t*)param;
+    http_download_status_t last_state;
+    int i;
+
+    for(i = 0; i < HTTP_DOWNLOAD_ENGINE_MAX_STEPS; i++)
+    {
+        last_state = http_proc->cur_state;
+        http_download_engine_step(http_proc, events);
+
+        /* the events were for the state they came in */
+        events = HTTP_ENGINE_EVENT_NONE;
+        
+        if(last_state == http_proc->cur_state)
+            break;
+    }
+}
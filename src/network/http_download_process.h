@@ -5,6 +5,9 @@
 #include "common_event.h"
 #include "common_buffer.h"
 #include "httpclient.h"
+#include "http_segment.h"
+#include "http_engine.h"
+#include "dns_cache.h"
 
 typedef enum {
 	HTTP_DOWNLOAD_STA_IDLE = 0,
@@ -16,6 +19,7 @@ typedef enum {
 	HTTP_DOWNLOAD_STA_PUSH_DATA,
 	HTTP_DOWNLOAD_STA_WAIT_FREE,
 	HTTP_DOWNLOAD_STA_WAIT_RANGE,
+	HTTP_DOWNLOAD_STA_SEGMENT,
 	
 } http_download_status_t;
 
@@ -37,6 +41,8 @@ typedef enum {
     HTTP_DOWNLOAD_PROC_ERR_TIMEOUT,
     HTTP_DOWNLOAD_PROC_ERR_DOWNLOAD_FAILED,
     HTTP_DOWNLOAD_PROC_ERR_DOWNLOAD_PAUSE,
+    HTTP_DOWNLOAD_PROC_PENDING,
+    HTTP_DOWNLOAD_PROC_CHANGED,
 	
 } http_download_proc_return_t;
 
@@ -67,14 +73,22 @@ typedef struct {
     httpclient_data_t           client_data;
     httpclient_data_ext_t*      client_data_ext;
     bool                        http_opened;
+    bool                        response_done;      /* the last response was received to its end */
+    uint16_t                    request_count;      /* requests of this download */
+    uint16_t                    conn_count;         /* new connections they took */
+    uint16_t                    reuse_count;        /* connections taken from the idle pool */
     uint16_t                    err_conn_count;
     uint16_t                    err_recv_count;
     char*                       recv_buf;
     int                         recv_len;
+    bool                        body_stream;        /* the body goes on, received straight into http_buffer */
     int                         read_pos;
     int                         pre_download_pos;
     int                         cur_download_pos;
+    int                         start_pos;
     bool                        range_enable;
+    bool                        segment_enable;     /* large ranges are fetched by http_segment */
+    http_segment_t*             segment;            /* NULL when segment_enable is off or it failed */
     bool                        range_forecast;
     int                         range_end;
     bool                        close_if_rang_end;
@@ -82,24 +96,46 @@ typedef struct {
     bool                        is_chunked;
     bool                        length_received;
     int                         total_length;
+    char                        validator[HTTPCLIENT_IF_RANGE_SIZE];    /* ETag or Last-Modified, preset for If-Range or from the response */
     int                         http_ret;
     http_download_proc_return_t last_error;
     uint32_t                    last_monitor_tick;
     int                         last_monitor_pos;
+    int                         engine_id;          /* http_engine watch, -1 when the download has its own task */
+    int                         engine_sock;        /* non-blocking, -1 when closed */
+    bool                        engine_connected;
+    char                        engine_host[HTTPCLIENT_HOST_SIZE];
+    int                         engine_port;
+    dns_cache_addr_t            engine_addrs[DNS_CACHE_MAX_ADDRS];
+    int                         engine_addr_count;
+    int                         engine_addr_index;  /* the one being connected, the rest are tried after it */
+    bool                        engine_retry;       /* STA_CONN waits out the retry delay */
+    char*                       engine_request;
+    int                         engine_request_len;
+    int                         engine_sent;
+    int                         engine_skip;        /* body bytes before pre_download_pos, to drop */
+    http_engine_response_t*     engine_response;
 	
 } http_download_proc_t;
 
 http_download_proc_return_t http_download_init(http_download_proc_t* http_proc);
+http_download_proc_return_t http_download_init_engine(http_download_proc_t* http_proc);
 http_download_proc_return_t http_download_deinit(http_download_proc_t* http_proc);
 http_download_proc_return_t http_download_start(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable);
+http_download_proc_return_t http_download_start_at(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable, int start_pos);
+http_download_proc_return_t http_download_move_to(http_download_proc_t* http_proc, common_buffer_t* http_buffer, char* url, bool range_enable, int start_pos, int fallback_pos);
 http_download_proc_return_t http_download_stop(http_download_proc_t* http_proc);
 http_download_proc_return_t http_download_pause(http_download_proc_t* http_proc);
 http_download_proc_return_t http_download_resume(http_download_proc_t* http_proc);
+http_download_proc_return_t http_download_set_segment(http_download_proc_t* http_proc, bool enable);
+http_download_proc_return_t http_download_set_if_range(http_download_proc_t* http_proc, const char* validator);
 http_download_proc_return_t http_download_wait_buffer(http_download_proc_t* http_proc, uint32_t size, uint32_t timeout);
 bool http_download_is_finish(http_download_proc_t* http_proc);
 bool http_download_is_stopped(http_download_proc_t* http_proc);
 http_download_proc_return_t http_download_get_last_error(http_download_proc_t* http_proc);
 int http_download_get_total_length(http_download_proc_t* http_proc);
+void http_download_get_validator(http_download_proc_t* http_proc, char* validator, int size);
+http_download_proc_return_t http_download_revalidate(const char* url, const char* validator, int total_length);
 void http_download_task(void *param);
 
 #endif
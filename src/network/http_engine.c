@@ -0,0 +1,552 @@
+#include "http_engine.h"
+#include "typedefs.h"
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define malloc(x)   pvPortMalloc(x)
+#define free(x)     vPortFree(x)
+
+log_create_module(http_engine, PRINT_LEVEL_INFO);
+
+#define HTTP_ENGINE_TASK_STACK_SIZE             (10240/sizeof(StackType_t))
+#define HTTP_ENGINE_MAX_EVENTS                  16
+#define HTTP_ENGINE_KICK_ID                     HTTP_ENGINE_MAX_WATCH
+
+typedef struct {
+    SemaphoreHandle_t           mutex;              /* held by the task while callbacks run */
+    TaskHandle_t                task_handle;
+    bool                        started;
+    int                         epoll_fd;
+    int                         event_fd;           /* wakes the task for http_engine_kick */
+    http_engine_watch_t         watches[HTTP_ENGINE_MAX_WATCH];
+    
+} http_engine_t;
+
+static http_engine_t g_engine;
+static pthread_once_t g_engine_once = PTHREAD_ONCE_INIT;
+
+static void http_engine_task(void *param);
+
+static void http_engine_init(void)
+{
+    g_engine.mutex = xSemaphoreCreateMutex();
+}
+
+/* downloads attach from any task, taskENTER_CRITICAL is empty on linux */
+static void http_engine_lock(void)
+{
+    pthread_once(&g_engine_once, http_engine_init);
+
+    xSemaphoreTake(g_engine.mutex, portMAX_DELAY);
+}
+
+static void http_engine_unlock(void)
+{
+    xSemaphoreGive(g_engine.mutex);
+}
+
+/* the task is started with the first attach and kept for the process */
+static http_engine_return_t http_engine_start(void)
+{
+    struct epoll_event event;
+    
+    g_engine.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    g_engine.event_fd = eventfd(0, EFD_NONBLOCK |EFD_CLOEXEC);
+
+    if(g_engine.epoll_fd < 0 || g_engine.event_fd < 0) {
+        LOG_E(http_engine, "epoll/eventfd failed: %s", strerror(errno));
+        goto FAIL;
+    }
+
+    event.events   = EPOLLIN;
+    event.data.u64 = HTTP_ENGINE_KICK_ID;
+    
+    if(0 != epoll_ctl(g_engine.epoll_fd, EPOLL_CTL_ADD, g_engine.event_fd, &event)) {
+        LOG_E(http_engine, "epoll_ctl failed: %s", strerror(errno));
+        goto FAIL;
+    }
+
+    if(0 != xTaskCreate(
+        http_engine_task, 
+        "http_engine_task", 
+        HTTP_ENGINE_TASK_STACK_SIZE, 
+        NULL,
+        TASK_PRIORITY_NORMAL,
+        &g_engine.task_handle))
+    {
+        LOG_E(http_engine, "xTaskCreate failed!");
+        goto FAIL;
+    }
+
+    g_engine.started = true;
+    return HTTP_ENGINE_SUCCESS;
+
+FAIL:
+    if(g_engine.epoll_fd >= 0)
+        close(g_engine.epoll_fd);
+    if(g_engine.event_fd >= 0)
+        close(g_engine.event_fd);
+    
+    return HTTP_ENGINE_ERR_SYS;
+}
+
+http_engine_return_t http_engine_attach(p_http_engine_callback callback, void* param, int* p_id)
+{
+    http_engine_return_t ret = HTTP_ENGINE_ERR_FULL;
+    http_engine_watch_t* watch;
+    int i;
+
+    if(NULL == callback || NULL == p_id) {
+        return HTTP_ENGINE_ERR_PARAM;
+    }
+
+    http_engine_lock();
+
+    if(false == g_engine.started && HTTP_ENGINE_SUCCESS != http_engine_start()) {
+        http_engine_unlock();
+        return HTTP_ENGINE_ERR_SYS;
+    }
+
+    for(i = 0; i < HTTP_ENGINE_MAX_WATCH; i++) {
+        watch = &g_engine.watches[i];
+        
+        if(false == watch->in_use) {
+            watch->in_use     = true;
+            watch->serial++;
+            watch->fd         = -1;
+            watch->registered = false;
+            watch->timer_on   = false;
+            watch->callback   = callback;
+            watch->param      = param;
+            atomic_store(&watch->kicked, false);
+
+            *p_id = i;
+            ret = HTTP_ENGINE_SUCCESS;
+            break;
+        }
+    }
+
+    http_engine_unlock();
+    return ret;
+}
+
+/* not from a callback, it waits for the one running to return */
+http_engine_return_t http_engine_detach(int id)
+{
+    http_engine_watch_t* watch;
+    
+    if(id < 0 || id >= HTTP_ENGINE_MAX_WATCH) {
+        return HTTP_ENGINE_ERR_PARAM;
+    }
+
+    http_engine_lock();
+
+    watch = &g_engine.watches[id];
+
+    if(true == watch->registered) {
+        epoll_ctl(g_engine.epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    }
+
+    watch->in_use     = false;
+    watch->fd         = -1;
+    watch->registered = false;
+    watch->timer_on   = false;
+
+    http_engine_unlock();
+    return HTTP_ENGINE_SUCCESS;
+}
+
+/* 
+ * From the watch's own callback only. fd -1 drops the socket, events NONE
+ * keeps it but stops waiting on it; the caller closes it.
+ */
+http_engine_return_t http_engine_watch(int id, int fd, uint32_t events)
+{
+    http_engine_watch_t* watch = &g_engine.watches[id];
+    struct epoll_event event;
+    int op;
+
+    if(fd != watch->fd && true == watch->registered) {
+        epoll_ctl(g_engine.epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+        watch->registered = false;
+    }
+
+    /* events already waited for on the old socket are dropped by the task */
+    if(fd != watch->fd) {
+        watch->serial++;
+    }
+
+    watch->fd = fd;
+
+    if(fd < 0) {
+        return HTTP_ENGINE_SUCCESS;
+    }
+
+    /* a hangup is reported even with no events asked for, so nothing stays registered */
+    if(HTTP_ENGINE_EVENT_NONE == events) {
+        if(true == watch->registered) {
+            epoll_ctl(g_engine.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            watch->registered = false;
+        }
+        
+        return HTTP_ENGINE_SUCCESS;
+    }
+
+    event.events   = ((HTTP_ENGINE_EVENT_READ & events) ?EPOLLIN :0) |((HTTP_ENGINE_EVENT_WRITE & events) ?EPOLLOUT :0);
+    event.data.u64 = ((uint64_t)watch->serial << 32) |(uint32_t)id;
+    op = (true == watch->registered) ?EPOLL_CTL_MOD :EPOLL_CTL_ADD;
+
+    if(0 != epoll_ctl(g_engine.epoll_fd, op, fd, &event)) {
+        LOG_E(http_engine, "[%d] epoll_ctl failed: %s", id, strerror(errno));
+        return HTTP_ENGINE_ERR_SYS;
+    }
+
+    watch->registered = true;
+    return HTTP_ENGINE_SUCCESS;
+}
+
+/* From the watch's own callback only, one timer per watch, 0 cancels it */
+http_engine_return_t http_engine_set_timer(int id, uint32_t timeout)
+{
+    http_engine_watch_t* watch = &g_engine.watches[id];
+
+    watch->timer_on  = (timeout > 0) ?true :false;
+    watch->wake_tick = xTaskGetTickCount() + timeout;
+
+    return HTTP_ENGINE_SUCCESS;
+}
+
+/* from any task: the callback runs soon with HTTP_ENGINE_EVENT_KICK */
+void http_engine_kick(int id)
+{
+    uint64_t value = 1;
+
+    if(id < 0 || id >= HTTP_ENGINE_MAX_WATCH) {
+        return;
+    }
+    
+    atomic_store(&g_engine.watches[id].kicked, true);
+    write(g_engine.event_fd, &value, sizeof(value));
+}
+
+/* ms to the first timer, -1 when none is on */
+static int http_engine_next_timeout(void)
+{
+    uint32_t now = xTaskGetTickCount();
+    int i, left, timeout = -1;
+
+    for(i = 0; i < HTTP_ENGINE_MAX_WATCH; i++) {
+        if(true == g_engine.watches[i].in_use && true == g_engine.watches[i].timer_on) {
+            left = (int)(g_engine.watches[i].wake_tick - now);
+
+            if(left < 0)
+                left = 0;
+            
+            if(timeout < 0 || left < timeout)
+                timeout = left;
+        }
+    }
+
+    return (timeout < 0) ?-1 :timeout*portTICK_RATE_MS;
+}
+
+static void http_engine_task(void *param)
+{
+    struct epoll_event events[HTTP_ENGINE_MAX_EVENTS];
+    uint32_t pending[HTTP_ENGINE_MAX_WATCH];
+    http_engine_watch_t* watch;
+    uint32_t now, id;
+    uint64_t value;
+    int i, count;
+
+    LOG_I(http_engine, "engine task running");
+    
+    while(1)
+    {
+        http_engine_lock();
+        count = http_engine_next_timeout();
+        http_engine_unlock();
+
+        count = epoll_wait(g_engine.epoll_fd, events, HTTP_ENGINE_MAX_EVENTS, count);
+        
+        if(count < 0) {
+            if(EINTR == errno)
+                continue;
+
+            LOG_E(http_engine, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        memset(pending, 0, sizeof(pending));
+        
+        http_engine_lock();
+
+        for(i = 0; i < count; i++) {
+            id = (uint32_t)events[i].data.u64;
+
+            if(HTTP_ENGINE_KICK_ID == id) {
+                read(g_engine.event_fd, &value, sizeof(value));
+                continue;
+            }
+
+            /* waited for before a detach, an attach or a new socket took the slot */
+            if(false == g_engine.watches[id].in_use || (uint32_t)(events[i].data.u64 >> 32) != g_engine.watches[id].serial) {
+                continue;
+            }
+            
+            if(EPOLLIN & events[i].events)
+                pending[id] |= HTTP_ENGINE_EVENT_READ;
+            if(EPOLLOUT & events[i].events)
+                pending[id] |= HTTP_ENGINE_EVENT_WRITE;
+            if((EPOLLERR |EPOLLHUP) & events[i].events)
+                pending[id] |= HTTP_ENGINE_EVENT_ERROR;
+        }
+
+        now = xTaskGetTickCount();
+
+        for(i = 0; i < HTTP_ENGINE_MAX_WATCH; i++) {
+            watch = &g_engine.watches[i];
+
+            if(false == watch->in_use)
+                continue;
+
+            if(true == watch->timer_on && (int)(now - watch->wake_tick) >= 0) {
+                watch->timer_on = false;
+                pending[i] |= HTTP_ENGINE_EVENT_TIMER;
+            }
+
+            if(true == atomic_exchange(&watch->kicked, false)) {
+                pending[i] |= HTTP_ENGINE_EVENT_KICK;
+            }
+
+            if(HTTP_ENGINE_EVENT_NONE != pending[i]) {
+                watch->callback(watch->param, pending[i]);
+            }
+        }
+
+        http_engine_unlock();
+    }
+
+    vTaskDelete(NULL);
+}
+
+void http_engine_response_reset(http_engine_response_t* response)
+{
+    memset(response, 0, sizeof(http_engine_response_t));
+
+    response->content_len = -1;
+    response->range_begin = -1;
+    response->range_total = -1;
+    response->body_left   = -1;
+}
+
+static void http_engine_parse_field(http_engine_response_t* response, char* name, char* value)
+{
+    int begin, end, total;
+    
+    if(0 == strcasecmp(name, "Content-Length")) {
+        response->content_len = atoi(value);
+    }
+    else if(0 == strcasecmp(name, "Content-Range")) {
+        total = -1;
+        
+        if(sscanf(value, "bytes %d-%d/%d", &begin, &end, &total) >= 2) {
+            response->range_begin = begin;
+            response->range_total = total;
+        }
+    }
+    else if(0 == strcasecmp(name, "Transfer-Encoding")) {
+        response->is_chunked = (0 == strncasecmp(value, "chunked", 7)) ?true :false;
+    }
+    else if(0 == strcasecmp(name, "Location")) {
+        response->location = value;
+    }
+    else if(0 == strcasecmp(name, "ETag")) {
+        response->etag = value;
+    }
+    else if(0 == strcasecmp(name, "Last-Modified")) {
+        response->last_modified = value;
+    }
+}
+
+/* header holds up to the blank line, the lines are split in place */
+static http_engine_return_t http_engine_parse_lines(http_engine_response_t* response)
+{
+    char *line, *next, *value;
+    int minor;
+
+    if(2 != sscanf(response->header, "HTTP/1.%d %d", &minor, &response->status)) {
+        return HTTP_ENGINE_ERR_FORMAT;
+    }
+
+    line = strstr(response->header, "\r\n") + 2;
+
+    while(NULL != (next = strstr(line, "\r\n")))
+    {
+        *next = '\0';
+        value = strchr(line, ':');
+
+        if(NULL != value) {
+            *value++ = '\0';
+            
+            while(' ' == *value || '\t' == *value)
+                value++;
+
+            http_engine_parse_field(response, line, value);
+        }
+        
+        line = next + 2;
+    }
+
+    if((response->status >= 100 && response->status < 200) || 204 == response->status || 304 == response->status) {
+        response->body_left = 0;
+    }
+    else if(true == response->is_chunked) {
+        response->body_left   = 0;
+        response->chunk_state = HTTP_ENGINE_CHUNK_SIZE;
+        return HTTP_ENGINE_SUCCESS;
+    }
+    else if(response->content_len >= 0) {
+        response->body_left = response->content_len;
+    }
+
+    response->done = (0 == response->body_left) ?true :false;
+    return HTTP_ENGINE_SUCCESS;
+}
+
+/* 
+ * Takes the header from data as it arrives. *p_used is what was taken,
+ * the rest is the start of the body once HTTP_ENGINE_SUCCESS is returned.
+ */
+http_engine_return_t http_engine_parse_header(http_engine_response_t* response, const char* data, int len, int* p_used)
+{
+    int room = HTTP_ENGINE_HEADER_SIZE - 1 - response->header_len;
+    int from = (response->header_len > 3) ?(response->header_len - 3) :0;
+    char* end;
+
+    if(len > room)
+        len = room;
+
+    memcpy(&response->header[response->header_len], data, len);
+    response->header_len += len;
+    response->header[response->header_len] = '\0';
+
+    end = strstr(&response->header[from], "\r\n\r\n");
+    
+    if(NULL == end) {
+        *p_used = len;
+        return (response->header_len >= HTTP_ENGINE_HEADER_SIZE - 1) ?HTTP_ENGINE_ERR_FORMAT :HTTP_ENGINE_MORE;
+    }
+
+    *p_used = len - (response->header_len - (end + 4 - response->header));
+    response->header_len = end + 4 - response->header;
+    end[2] = '\0';
+
+    return http_engine_parse_lines(response);
+}
+
+static void http_engine_chunk_size_end(http_engine_response_t* response)
+{
+    response->chunk_state = (response->body_left > 0) ?HTTP_ENGINE_CHUNK_DATA :HTTP_ENGINE_CHUNK_TRAILER;
+    response->chunk_line  = 0;
+}
+
+/* 
+ * Body bytes as received, decoded in place: what is left at the start of
+ * data is content, the count of it is returned, -1 for broken framing.
+ */
+int http_engine_decode_body(http_engine_response_t* response, char* data, int len)
+{
+    int in = 0, out = 0, count, digit;
+    char c;
+
+    if(false == response->is_chunked)
+    {
+        if(response->body_left >= 0) {
+            if(len > response->body_left)
+                len = response->body_left;
+
+            response->body_left -= len;
+            response->done = (0 == response->body_left) ?true :false;
+        }
+        
+        return len;
+    }
+
+    while(in < len && false == response->done)
+    {
+        switch(response->chunk_state)
+        {
+        case HTTP_ENGINE_CHUNK_SIZE:
+            c = data[in++];
+            
+            if(c >= '0' && c <= '9')
+                digit = c - '0';
+            else if(c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                digit = -1;
+
+            if(digit >= 0) {
+                if(response->body_left >= 0x08000000)
+                    return -1;
+                
+                response->body_left = response->body_left*16 + digit;
+            }
+            else if('\n' == c) {
+                http_engine_chunk_size_end(response);
+            }
+            else if('\r' != c) {
+                response->chunk_state = HTTP_ENGINE_CHUNK_EXT;
+            }
+            break;
+
+        case HTTP_ENGINE_CHUNK_EXT:
+            if('\n' == data[in++])
+                http_engine_chunk_size_end(response);
+            break;
+
+        case HTTP_ENGINE_CHUNK_DATA:
+            count = len - in;
+            
+            if(count > response->body_left)
+                count = response->body_left;
+
+            memmove(&data[out], &data[in], count);
+            in  += count;
+            out += count;
+            
+            response->body_left -= count;
+            if(0 == response->body_left)
+                response->chunk_state = HTTP_ENGINE_CHUNK_DATA_END;
+            break;
+
+        case HTTP_ENGINE_CHUNK_DATA_END:
+            if('\n' == data[in++]) {
+                response->chunk_state = HTTP_ENGINE_CHUNK_SIZE;
+                response->body_left   = 0;
+            }
+            break;
+
+        case HTTP_ENGINE_CHUNK_TRAILER:
+            c = data[in++];
+
+            /* the body ends with an empty line */
+            if('\n' == c) {
+                if(0 == response->chunk_line)
+                    response->done = true;
+                
+                response->chunk_line = 0;
+            }
+            else if('\r' != c) {
+                response->chunk_line++;
+            }
+            break;
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,84 @@
+#ifndef __HTTP_ENGINE_H
+#define __HTTP_ENGINE_H
+
+#include "typedefs.h"
+#include <stdatomic.h>
+
+#define HTTP_ENGINE_MAX_WATCH       64
+#define HTTP_ENGINE_HEADER_SIZE     2048
+
+typedef enum {
+    HTTP_ENGINE_SUCCESS = 0,
+    HTTP_ENGINE_MORE,
+    HTTP_ENGINE_ERR_PARAM,
+    HTTP_ENGINE_ERR_FULL,
+    HTTP_ENGINE_ERR_SYS,
+    HTTP_ENGINE_ERR_FORMAT,
+
+} http_engine_return_t;
+
+typedef enum {
+    HTTP_ENGINE_EVENT_NONE      = 0x000000UL,
+    HTTP_ENGINE_EVENT_READ      = 0x000001UL,
+    HTTP_ENGINE_EVENT_WRITE     = 0x000002UL,
+    HTTP_ENGINE_EVENT_ERROR     = 0x000004UL,     /* error or hangup on the socket */
+    HTTP_ENGINE_EVENT_TIMER     = 0x000008UL,
+    HTTP_ENGINE_EVENT_KICK      = 0x000010UL,     /* http_engine_kick from another task */
+
+} http_engine_event_t;
+
+typedef enum {
+    HTTP_ENGINE_CHUNK_SIZE = 0,
+    HTTP_ENGINE_CHUNK_EXT,
+    HTTP_ENGINE_CHUNK_DATA,
+    HTTP_ENGINE_CHUNK_DATA_END,
+    HTTP_ENGINE_CHUNK_TRAILER,
+
+} http_engine_chunk_state_t;
+
+/* runs on the engine task, with no other callback running */
+typedef void (*p_http_engine_callback)(void* param, uint32_t events);
+
+typedef struct {
+    bool                        in_use;
+    int                         fd;                 /* -1 when there is no socket */
+    bool                        registered;         /* fd is in the epoll set */
+    uint32_t                    serial;             /* in the epoll data, events of an earlier attach or fd are dropped */
+    bool                        timer_on;
+    uint32_t                    wake_tick;
+    atomic_bool                 kicked;
+    p_http_engine_callback      callback;
+    void*                       param;
+    
+} http_engine_watch_t;
+
+/* one response, fed as it comes in */
+typedef struct {
+    char                        header[HTTP_ENGINE_HEADER_SIZE];
+    int                         header_len;
+    int                         status;
+    int                         content_len;        /* -1 when the server did not say */
+    int                         range_begin;        /* from Content-Range, -1 when there is none */
+    int                         range_total;
+    bool                        is_chunked;
+    const char*                 location;           /* into header, NULL when there is none */
+    const char*                 etag;
+    const char*                 last_modified;
+    int                         body_left;          /* of the content or of the current chunk, -1 up to the close */
+    http_engine_chunk_state_t   chunk_state;
+    int                         chunk_line;         /* bytes of the current trailer line */
+    bool                        done;
+    
+} http_engine_response_t;
+
+http_engine_return_t http_engine_attach(p_http_engine_callback callback, void* param, int* p_id);
+http_engine_return_t http_engine_detach(int id);
+http_engine_return_t http_engine_watch(int id, int fd, uint32_t events);
+http_engine_return_t http_engine_set_timer(int id, uint32_t timeout);
+void http_engine_kick(int id);
+
+void http_engine_response_reset(http_engine_response_t* response);
+http_engine_return_t http_engine_parse_header(http_engine_response_t* response, const char* data, int len, int* p_used);
+int http_engine_decode_body(http_engine_response_t* response, char* data, int len);
+
+#endif
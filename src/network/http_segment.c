@@ -0,0 +1,485 @@
+#include "http_segment.h"
+#include "typedefs.h"
+#include <string.h>
+
+#define malloc(x)   pvPortMalloc(x)
+#define free(x)     vPortFree(x)
+
+log_create_module(http_segment, PRINT_LEVEL_INFO);
+
+#define HTTP_SEGMENT_TASK_STACK_SIZE            (10240/sizeof(StackType_t))
+#define HTTP_SEGMENT_HEAD_SIZE                  1024
+#define HTTP_SEGMENT_RECV_TIMEOUT               3000
+#define HTTP_SEGMENT_WAIT_INTERVAL              (100/portTICK_RATE_MS)
+#define HTTP_SEGMENT_INIT_CONN                  2
+
+static void http_segment_task(void *param);
+
+static void http_segment_lock(http_segment_t* segment)
+{
+    xSemaphoreTake(segment->mutex, portMAX_DELAY);
+}
+
+static void http_segment_unlock(http_segment_t* segment)
+{
+    xSemaphoreGive(segment->mutex);
+}
+
+http_segment_return_t http_segment_init(http_segment_t* segment)
+{
+    int i;
+    
+    memset(segment, 0, sizeof(http_segment_t));
+
+    segment->mutex        = xSemaphoreCreateMutex();
+    segment->event_handle = xEventGroupCreate();
+    segment->conn_limit   = HTTP_SEGMENT_INIT_CONN;
+    segment->conn_step    = 1;
+
+    for(i = 0; i < HTTP_SEGMENT_SLOTS; i++) {
+        segment->slots[i].index  = -1;
+        segment->slots[i].buffer = (uint8_t*)malloc(HTTP_SEGMENT_SIZE + 1);
+        
+        if(NULL == segment->slots[i].buffer) {
+            http_segment_deinit(segment);
+            return HTTP_SEGMENT_ERR_MALLOC;
+        }
+    }
+
+    for(i = 0; i < HTTP_SEGMENT_MAX_CONN; i++) {
+        segment->workers[i].segment = segment;
+        segment->workers[i].socket  = -1;
+        segment->workers[i].client_data_ext = (httpclient_data_ext_t*)malloc(sizeof(httpclient_data_ext_t));
+
+        if(NULL == segment->workers[i].client_data_ext) {
+            http_segment_deinit(segment);
+            return HTTP_SEGMENT_ERR_MALLOC;
+        }
+    }
+
+    return HTTP_SEGMENT_SUCCESS;
+}
+
+http_segment_return_t http_segment_deinit(http_segment_t* segment)
+{
+    int i;
+
+    if(NULL != segment->mutex) {
+        http_segment_stop(segment);
+    }
+
+    for(i = 0; i < HTTP_SEGMENT_SLOTS; i++) {
+        if(NULL != segment->slots[i].buffer) {
+            free(segment->slots[i].buffer);
+            segment->slots[i].buffer = NULL;
+        }
+    }
+
+    for(i = 0; i < HTTP_SEGMENT_MAX_CONN; i++) {
+        if(NULL != segment->workers[i].client_data_ext) {
+            free(segment->workers[i].client_data_ext);
+            segment->workers[i].client_data_ext = NULL;
+        }
+    }
+
+    if(NULL != segment->event_handle) {
+        vEventGroupDelete(segment->event_handle);
+        segment->event_handle = NULL;
+    }
+
+    if(NULL != segment->mutex) {
+        vSemaphoreDelete(segment->mutex);
+        segment->mutex = NULL;
+    }
+
+    return HTTP_SEGMENT_SUCCESS;
+}
+
+/* 
+ * Fetches [begin, end) as HTTP_SEGMENT_SIZE ranges over conn_limit
+ * connections. url and if_range must stay valid until http_segment_stop.
+ */
+http_segment_return_t http_segment_start(http_segment_t* segment, const char* url, int begin, int end, const char* if_range)
+{
+    int i;
+    
+    if(NULL == url || end <= begin) {
+        return HTTP_SEGMENT_ERR_PARAM;
+    }
+
+    http_segment_stop(segment);
+
+    segment->url        = url;
+    segment->if_range   = if_range;
+    segment->begin      = begin;
+    segment->end        = end;
+    segment->count      = (end - begin + HTTP_SEGMENT_SIZE - 1)/HTTP_SEGMENT_SIZE;
+    segment->next_fetch = 0;
+    segment->next_push  = 0;
+    segment->abort      = false;
+    segment->error      = false;
+    segment->start_tick = xTaskGetTickCount();
+
+    for(i = 0; i < HTTP_SEGMENT_SLOTS; i++) {
+        segment->slots[i].index = -1;
+    }
+
+    segment->running = (segment->count < segment->conn_limit) ?segment->count :segment->conn_limit;
+    segment->started = segment->running;
+    xEventGroupClearBits(segment->event_handle, HTTP_SEGMENT_EVENT_ALL);
+
+    LOG_I(http_segment, "fetch %d-%d, %d segments over %d connections", begin, end - 1, segment->count, segment->running);
+
+    for(i = 0; i < segment->running; i++) {
+        xTaskCreate(
+            http_segment_task, 
+            "http_segment_task", 
+            HTTP_SEGMENT_TASK_STACK_SIZE, 
+            &segment->workers[i],
+            TASK_PRIORITY_NORMAL,
+            &segment->workers[i].task_handle);
+    }
+
+    return HTTP_SEGMENT_SUCCESS;
+}
+
+http_segment_return_t http_segment_stop(http_segment_t* segment)
+{
+    int i, workers;
+    
+    http_segment_lock(segment);
+
+    workers = segment->running;
+    segment->abort = true;
+
+    /* a worker blocked in recv returns at once */
+    for(i = 0; i < HTTP_SEGMENT_MAX_CONN; i++) {
+        if(segment->workers[i].socket >= 0) {
+            shutdown(segment->workers[i].socket, SHUT_RDWR);
+        }
+    }
+    
+    http_segment_unlock(segment);
+
+    xEventGroupSetBits(segment->event_handle, HTTP_SEGMENT_EVENT_SLOT);
+
+    while(workers > 0)
+    {
+        xEventGroupWaitBits(segment->event_handle, HTTP_SEGMENT_EVENT_EXITED, pdTRUE, pdFALSE, HTTP_SEGMENT_WAIT_INTERVAL);
+
+        http_segment_lock(segment);
+        workers = segment->running;
+        http_segment_unlock(segment);
+    }
+
+#ifdef DEF_LINUX_PLATFORM
+    for(i = 0; i < segment->started; i++) {
+        pthread_join(segment->workers[i].task_handle, NULL);
+    }
+#endif
+
+    segment->started = 0;
+    segment->count   = 0;
+    
+    return HTTP_SEGMENT_SUCCESS;
+}
+
+/* 
+ * Hill climbing on the connection count: go on the way the last change
+ * went while it pays, turn back when the rate drops.
+ */
+static void http_segment_adapt(http_segment_t* segment)
+{
+    uint32_t used = xTaskGetTickCount() - segment->start_tick;
+    uint32_t rate = (uint32_t)((uint64_t)(segment->end - segment->begin)*1000/(used > 0 ?used :1));
+
+    /* a window of one segment says nothing about more connections */
+    if(segment->count >= 2 && segment->last_rate > 0)
+    {
+        if(rate < segment->last_rate - segment->last_rate/10) {
+            segment->conn_step = -segment->conn_step;
+        }
+        else if(rate <= segment->last_rate + segment->last_rate/10) {
+            segment->last_rate = rate;
+            return;
+        }
+
+        segment->conn_limit += segment->conn_step;
+
+        if(segment->conn_limit > HTTP_SEGMENT_MAX_CONN) {
+            segment->conn_limit = HTTP_SEGMENT_MAX_CONN;
+            segment->conn_step  = -1;
+        }
+        else if(segment->conn_limit < 1) {
+            segment->conn_limit = 1;
+            segment->conn_step  = 1;
+        }
+    }
+
+    LOG_I(http_segment, "window %d bytes in %d ms, %d kB/s, next with %d connections", 
+        segment->end - segment->begin, used, rate/1024, segment->conn_limit);
+
+    if(segment->count >= 2) {
+        segment->last_rate = rate;
+    }
+}
+
+/* 
+ * Gives the next in-order bytes to buffer, as much as it takes. Waits up to
+ * timeout for data or room when there is nothing to do, *p_len is 0 then.
+ */
+http_segment_return_t http_segment_push(http_segment_t* segment, common_buffer_t* buffer, int* p_len, uint32_t timeout)
+{
+    http_segment_slot_t* slot;
+    bool error, slot_freed = false;
+    int len, room;
+    
+    *p_len = 0;
+
+    http_segment_lock(segment);
+
+    if(segment->next_push >= segment->count) {
+        http_segment_unlock(segment);
+        return HTTP_SEGMENT_DONE;
+    }
+
+    slot  = &segment->slots[segment->next_push % HTTP_SEGMENT_SLOTS];
+    len   = (slot->index == segment->next_push) ?(slot->filled - slot->pushed) :0;
+    error = segment->error;
+    
+    http_segment_unlock(segment);
+
+    if(0 == len)
+    {
+        if(true == error) {
+            LOG_E(http_segment, "segment %d failed, pushed up to %d", segment->next_push, segment->begin + segment->next_push*HTTP_SEGMENT_SIZE + slot->pushed);
+            return HTTP_SEGMENT_ERR_FETCH;
+        }
+        
+        xEventGroupWaitBits(segment->event_handle, HTTP_SEGMENT_EVENT_DATA, pdTRUE, pdFALSE, timeout);
+        return HTTP_SEGMENT_SUCCESS;
+    }
+
+    room = common_buffer_get_free_count(buffer);
+    if(len > room)
+        len = room;
+
+    if(0 == len) {
+        common_buffer_wait_free(buffer, slot->filled - slot->pushed, timeout);
+        return HTTP_SEGMENT_SUCCESS;
+    }
+
+    common_buffer_push(buffer, &slot->buffer[slot->pushed], len);
+    *p_len = len;
+
+    http_segment_lock(segment);
+    
+    slot->pushed += len;
+    
+    if(slot->pushed >= slot->size) {
+        slot->index = -1;
+        segment->next_push++;
+        slot_freed = true;
+    }
+    
+    http_segment_unlock(segment);
+
+    if(true == slot_freed) {
+        xEventGroupSetBits(segment->event_handle, HTTP_SEGMENT_EVENT_SLOT);
+
+        if(segment->next_push >= segment->count) {
+            http_segment_adapt(segment);
+        }
+    }
+
+    return HTTP_SEGMENT_SUCCESS;
+}
+
+static void http_segment_close(http_segment_worker_t* worker, bool reuse)
+{
+    http_segment_t* segment = worker->segment;
+
+    if(false == worker->http_opened) {
+        return;
+    }
+
+    http_segment_lock(segment);
+    worker->socket = -1;
+    http_segment_unlock(segment);
+
+    if(true == reuse) {
+        httpclient_release(&worker->client);
+    }
+    else {
+        httpclient_close(&worker->client);
+    }
+    
+    worker->http_opened = false;
+}
+
+static void http_segment_fill(http_segment_t* segment, http_segment_slot_t* slot, int len)
+{
+    http_segment_lock(segment);
+    slot->filled += len;
+    http_segment_unlock(segment);
+
+    xEventGroupSetBits(segment->event_handle, HTTP_SEGMENT_EVENT_DATA);
+}
+
+/* one range request, the body goes straight into the slot */
+static bool http_segment_is_aborted(http_segment_t* segment)
+{
+    bool abort;
+
+    http_segment_lock(segment);
+    abort = segment->abort;
+    http_segment_unlock(segment);
+
+    return abort;
+}
+
+static http_segment_return_t http_segment_fetch(http_segment_worker_t* worker, http_segment_slot_t* slot)
+{
+    http_segment_t* segment = worker->segment;
+    int begin = segment->begin + slot->index*HTTP_SEGMENT_SIZE;
+    int ret, len;
+    bool abort;
+
+    if(true == worker->http_opened && false == httpclient_is_alive(&worker->client)) {
+        http_segment_close(worker, false);
+    }
+
+    if(false == worker->http_opened)
+    {
+        memset(&worker->client, 0, sizeof(httpclient_t));
+
+        if(HTTPCLIENT_OK != httpclient_connect(&worker->client, (char*)segment->url)) {
+            LOG_E(http_segment, "httpclient_connect failed, url: %s", segment->url);
+            return HTTP_SEGMENT_ERR_FETCH;
+        }
+
+        worker->http_opened = true;
+
+        http_segment_lock(segment);
+        worker->socket = worker->client.socket;
+        abort = segment->abort;
+        http_segment_unlock(segment);
+
+        if(true == abort) {
+            return HTTP_SEGMENT_ERR_FETCH;
+        }
+    }
+
+    memset(&worker->client_data, 0, sizeof(httpclient_data_t));
+    worker->client_data_ext->remain_data_len = 0;
+    
+    worker->client_data.response_buf     = (char*)slot->buffer;
+    worker->client_data.response_buf_len = ((slot->size < HTTP_SEGMENT_HEAD_SIZE) ?slot->size :HTTP_SEGMENT_HEAD_SIZE) + 1;
+    worker->client_data.ext              = worker->client_data_ext;
+
+    ret = httpclient_send_request_with_range(&worker->client, (char*)segment->url, HTTPCLIENT_GET, 
+        &worker->client_data, begin, begin + slot->size - 1, segment->if_range);
+    if(ret < 0) {
+        return HTTP_SEGMENT_ERR_FETCH;
+    }
+
+    httpclient_set_response_timeout(&worker->client, HTTP_SEGMENT_RECV_TIMEOUT);
+
+    ret = httpclient_recv_response(&worker->client, &worker->client_data);
+    if(ret < 0) {
+        LOG_E(http_segment, "segment %d recv_error: %d", slot->index, ret);
+        return HTTP_SEGMENT_ERR_FETCH;
+    }
+
+    /* anything but the range asked for, e.g. the whole file after If-Range, is of no use */
+    if(206 != worker->client.response_code || false == worker->client_data_ext->is_range ||
+        begin != worker->client_data_ext->range_beg || slot->size != worker->client_data.response_content_len) 
+    {
+        LOG_E(http_segment, "segment %d bad response %d, %d+%d", slot->index, worker->client.response_code, 
+            worker->client_data_ext->range_beg, worker->client_data.response_content_len);
+        return HTTP_SEGMENT_ERR_FETCH;
+    }
+
+    len = (HTTPCLIENT_RETRIEVE_MORE_DATA == ret) ?(worker->client_data.response_buf_len - 1) :worker->client_data.response_content_len;
+    http_segment_fill(segment, slot, len);
+
+    while(HTTPCLIENT_RETRIEVE_MORE_DATA == ret && false == http_segment_is_aborted(segment))
+    {
+        ret = httpclient_recv_body(&worker->client, &worker->client_data, 
+            (char*)&slot->buffer[slot->filled], slot->size - slot->filled, &len);
+        
+        if(ret < 0) {
+            LOG_E(http_segment, "segment %d recv_error: %d, filled: %d", slot->index, ret, slot->filled);
+            return HTTP_SEGMENT_ERR_FETCH;
+        }
+
+        http_segment_fill(segment, slot, len);
+    }
+
+    return (HTTPCLIENT_OK == ret) ?HTTP_SEGMENT_SUCCESS :HTTP_SEGMENT_ERR_FETCH;
+}
+
+static void http_segment_task(void *param)
+{
+    http_segment_worker_t* worker = (http_segment_worker_t*)param;
+    http_segment_t* segment = worker->segment;
+    http_segment_slot_t* slot;
+    bool reuse = true;
+    int index;
+
+    while(1)
+    {
+        http_segment_lock(segment);
+
+        index = segment->next_fetch;
+        
+        if(true == segment->abort || true == segment->error || index >= segment->count) {
+            http_segment_unlock(segment);
+            break;
+        }
+
+        /* the slot is free once the segment HTTP_SEGMENT_SLOTS before has been pushed */
+        if(index >= segment->next_push + HTTP_SEGMENT_SLOTS) {
+            http_segment_unlock(segment);
+            xEventGroupWaitBits(segment->event_handle, HTTP_SEGMENT_EVENT_SLOT, pdTRUE, pdFALSE, HTTP_SEGMENT_WAIT_INTERVAL);
+            continue;
+        }
+
+        slot = &segment->slots[index % HTTP_SEGMENT_SLOTS];
+        slot->index  = index;
+        slot->size   = segment->end - (segment->begin + index*HTTP_SEGMENT_SIZE);
+        slot->filled = 0;
+        slot->pushed = 0;
+
+        if(slot->size > HTTP_SEGMENT_SIZE)
+            slot->size = HTTP_SEGMENT_SIZE;
+        
+        segment->next_fetch++;
+
+        /* pass the wakeup on to a worker still waiting for a slot */
+        if(segment->next_fetch < segment->count && segment->next_fetch < segment->next_push + HTTP_SEGMENT_SLOTS) {
+            xEventGroupSetBits(segment->event_handle, HTTP_SEGMENT_EVENT_SLOT);
+        }
+
+        http_segment_unlock(segment);
+
+        if(HTTP_SEGMENT_SUCCESS != http_segment_fetch(worker, slot)) {
+            reuse = false;
+
+            http_segment_lock(segment);
+            segment->error = true;
+            http_segment_unlock(segment);
+            break;
+        }
+    }
+
+    http_segment_close(worker, reuse);
+
+    http_segment_lock(segment);
+    segment->running--;
+    http_segment_unlock(segment);
+
+    xEventGroupSetBits(segment->event_handle, HTTP_SEGMENT_EVENT_DATA |HTTP_SEGMENT_EVENT_EXITED);
+    
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,82 @@
+#ifndef __HTTP_SEGMENT_H
+#define __HTTP_SEGMENT_H
+
+#include "typedefs.h"
+#include "common_event.h"
+#include "common_buffer.h"
+#include "httpclient.h"
+
+#define HTTP_SEGMENT_SIZE           (32*1024)
+#define HTTP_SEGMENT_MAX_CONN       4
+#define HTTP_SEGMENT_SLOTS          (HTTP_SEGMENT_MAX_CONN*2)
+
+typedef enum {
+    HTTP_SEGMENT_SUCCESS = 0,
+    HTTP_SEGMENT_DONE,
+    HTTP_SEGMENT_ERR_PARAM,
+    HTTP_SEGMENT_ERR_MALLOC,
+    HTTP_SEGMENT_ERR_FETCH,
+
+} http_segment_return_t;
+
+typedef enum {
+    HTTP_SEGMENT_EVENT_NONE     = 0x000000UL,
+    HTTP_SEGMENT_EVENT_ALL      = 0xFFFFFFUL,
+    HTTP_SEGMENT_EVENT_DATA     = 0x000001UL,
+    HTTP_SEGMENT_EVENT_SLOT     = 0x000002UL,
+    HTTP_SEGMENT_EVENT_EXITED   = 0x000004UL,
+
+} http_segment_event_t;
+
+typedef struct {
+    uint8_t*                    buffer;             /* HTTP_SEGMENT_SIZE, +1 for the terminator httpclient writes */
+    int                         index;              /* segment in the slot, -1 when free */
+    int                         size;
+    int                         filled;             /* received from the start of the segment */
+    int                         pushed;             /* of filled, given to common_buffer */
+    
+} http_segment_slot_t;
+
+struct http_segment_s;
+
+typedef struct {
+    struct http_segment_s*      segment;
+    TaskHandle_t                task_handle;
+    httpclient_t                client;
+    httpclient_data_t           client_data;
+    httpclient_data_ext_t*      client_data_ext;
+    bool                        http_opened;
+    int                         socket;             /* published for http_segment_stop, -1 when closed */
+    
+} http_segment_worker_t;
+
+typedef struct http_segment_s {
+    SemaphoreHandle_t           mutex;
+    EventGroupHandle_t          event_handle;
+    const char*                 url;
+    const char*                 if_range;
+    int                         begin;
+    int                         end;
+    int                         count;              /* segments in [begin, end) */
+    int                         next_fetch;
+    int                         next_push;
+    int                         started;            /* workers of this window */
+    int                         running;            /* of those, not exited yet */
+    bool                        abort;
+    bool                        error;
+    http_segment_slot_t         slots[HTTP_SEGMENT_SLOTS];
+    http_segment_worker_t       workers[HTTP_SEGMENT_MAX_CONN];
+    int                         conn_limit;         /* workers for the next window, adapted to throughput */
+    int                         conn_step;
+    uint32_t                    last_rate;          /* bytes/s of the last window */
+    uint32_t                    start_tick;
+    
+} http_segment_t;
+
+http_segment_return_t http_segment_init(http_segment_t* segment);
+http_segment_return_t http_segment_deinit(http_segment_t* segment);
+http_segment_return_t http_segment_start(http_segment_t* segment, const char* url, int begin, int end, const char* if_range);
+http_segment_return_t http_segment_push(http_segment_t* segment, common_buffer_t* buffer, int* p_len, uint32_t timeout);
+http_segment_return_t http_segment_stop(http_segment_t* segment);
+
+#endif
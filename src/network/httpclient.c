@@ -18,6 +18,7 @@
 #include "typedefs.h"
 
 #include "httpclient.h"
+#include "dns_cache.h"
 
 #ifndef DEF_LINUX_PLATFORM
 #include "lwip/sockets.h"
@@ -84,14 +85,34 @@ struct Timer {
     unsigned int end_time;
 };
 
+/* a connection httpclient_release left open, shared by all clients */
+typedef struct {
+    bool used;
+    int socket;
+    int port;
+    char host[HTTPCLIENT_HOST_SIZE];
+    unsigned int idle_since;
+} httpclient_idle_conn_t;
+
+static httpclient_idle_conn_t g_idle_pool[HTTPCLIENT_POOL_SIZE];
+static httpclient_pool_stats_t g_pool_stats;
+static SemaphoreHandle_t g_pool_mutex = NULL;
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
 //char head_buf[512] = {0};
 // static int httpclient_parse_host(char *url, char *host, size_t maxhost_len);
-static int httpclient_parse_url(const char *url, char *scheme, size_t max_scheme_len, char *host, size_t maxhost_len, int *port, char *path, size_t max_path_len);
 static int httpclient_tcp_send_all(int sock_fd, char *data, int length);
 static int httpclient_conn(httpclient_t *client, char *host);
 static int httpclient_recv(httpclient_t *client, char *buf, int min_len, int max_len, int *p_read_len);
 static int httpclient_retrieve_content(httpclient_t *client, char *data, int len, httpclient_data_t *client_data);
 static int httpclient_response_parse(httpclient_t *client, char *data, int len, httpclient_data_t *client_data);
+static int httpclient_recv_raw(httpclient_t *client, char *buf, int len, int *p_read_len);
+static int httpclient_recv_trailer(httpclient_t *client, char *data, int len);
+static void httpclient_pool_lock(void);
+static void httpclient_pool_unlock(void);
+static int httpclient_pool_take(const char *host, int port);
+static bool httpclient_sock_alive(int sock);
+static bool httpclient_has_token(const char *value, int value_len, const char *token);
 #ifdef MTK_HTTPCLIENT_SSL_ENABLE
 static int httpclient_ssl_conn(httpclient_t *client, char *host);
 static int httpclient_ssl_send_all(mbedtls_ssl_context *ssl, const char *data, size_t length);
@@ -122,33 +143,27 @@ static void httpclient_base64enc(char *out, const char *in)
 
 int httpclient_conn(httpclient_t *client, char *host)
 {
-    struct addrinfo hints, *addr_list, *cur;
+    dns_cache_addr_t addrs[DNS_CACHE_MAX_ADDRS];
+    int count = 0, i;
     int ret = 0;
-    char port[10] = {0};
 	struct timeval tv_out;
-    
-    memset( &hints, 0, sizeof( hints ) );
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
 
-    snprintf(port, sizeof(port), "%d", client->remote_port) ;
-    if ( getaddrinfo( host, port , &hints, &addr_list ) != 0 ) {
-        DBG("getaddrinfo != 0, return HTTPCLIENT_UNRESOLVED_DNS");
+    /* looked up once per DNS_CACHE_TTL, not for every connection */
+    if ( dns_cache_resolve( host, client->remote_port, addrs, &count ) != DNS_CACHE_SUCCESS ) {
+        DBG("dns_cache_resolve failed, return HTTPCLIENT_UNRESOLVED_DNS");
         return HTTPCLIENT_UNRESOLVED_DNS;
     }
 
     /* Try the sockaddrs until a connection succeeds */
     ret = HTTPCLIENT_UNRESOLVED_DNS;
-    for ( cur = addr_list; cur != NULL; cur = cur->ai_next ) {
-        client->socket = (int) socket( cur->ai_family, cur->ai_socktype,
-                                        cur->ai_protocol );
+    for ( i = 0; i < count; i++ ) {
+        client->socket = (int) socket( addrs[i].family, SOCK_STREAM, IPPROTO_TCP );
         if ( client->socket < 0 ) {
             ret = HTTPCLIENT_ERROR_CONN;
             continue;
         }
 
-        if ( connect( client->socket, cur->ai_addr, (int)cur->ai_addrlen ) == 0 ) {
+        if ( connect( client->socket, (struct sockaddr *)&addrs[i].addr, addrs[i].addr_len ) == 0 ) {
 			/* Fix bug: Set socket recv timeout time, because httpclient_recv is in way of blocking
 			 * when receiving the first byte data.
 			 */
@@ -164,7 +179,10 @@ int httpclient_conn(httpclient_t *client, char *host)
         ret = HTTPCLIENT_ERROR_CONN;
     }
 
-    freeaddrinfo( addr_list );
+    /* the host may have moved */
+    if ( ret != 0 ) {
+        dns_cache_forget( host, client->remote_port );
+    }
 
     return ret;
 }
@@ -413,7 +431,7 @@ int httpclient_send_header(httpclient_t *client, char *url, int method, httpclie
     memset(send_buf, 0, HTTPCLIENT_SEND_BUF_SIZE);
     len = 0 ; /* Reset send buffer */
 
-    snprintf(buf, HTTPCLIENT_SEND_BUF_SIZE, "%s %s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\nReferer: http://%s\r\nUser-Agent: Mozilla/4.0 (compatible; MSIE 5.00; Windows 98)\r\nPragma: no-cache\r\nCache-Control: no-cache\r\n", meth, path, host,host); /* Write request */
+    snprintf(buf, HTTPCLIENT_SEND_BUF_SIZE, "%s %s HTTP/1.1\r\nHost: %s\r\nAccept: */*\r\nReferer: http://%s\r\nUser-Agent: Mozilla/4.0 (compatible; MSIE 5.00; Windows 98)\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n", meth, path, host,host); /* Write request */
 
     if(begin >= 0)
     {
@@ -489,9 +507,16 @@ int httpclient_send_header(httpclient_t *client, char *url, int method, httpclie
     }
 #endif
 
+    /* the response says whether the connection is kept after it */
+    client->keep_alive = false;
+
     ret = httpclient_tcp_send_all(client->socket, send_buf, len);
     if (ret > 0) {
         DBG("Written %d bytes, socket = %d", ret, client->socket);
+
+        httpclient_pool_lock();
+        g_pool_stats.requests++;
+        httpclient_pool_unlock();
     } else if ( ret == 0 ) {
         WARN("ret == 0,Connection was closed by server");
         res = HTTPCLIENT_CLOSED; /* Connection was closed by server */
@@ -629,6 +654,36 @@ int httpclient_recv(httpclient_t *client, char *buf, int min_len, int max_len, i
     return HTTPCLIENT_OK;
 }
 
+/* one blocking read of up to len bytes, buf is not NULL-terminated */
+int httpclient_recv_raw(httpclient_t *client, char *buf, int len, int *p_read_len)
+{
+    int ret = 0;
+
+    *p_read_len = 0;
+
+    if (client->is_http) {
+        ret = recv(client->socket, buf, len, 0);
+    }
+#ifdef MTK_HTTPCLIENT_SSL_ENABLE
+    else {
+        httpclient_ssl_t *ssl = (httpclient_ssl_t *)client->ssl;
+        mbedtls_ssl_set_bio(&ssl->ssl_ctx, &ssl->net_ctx, mbedtls_net_send, mbedtls_net_recv, NULL);
+        ret = mbedtls_ssl_read(&ssl->ssl_ctx, (unsigned char *)buf, len);
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            ret = 0;
+        }
+    }
+#endif
+
+    if (ret < 0) {
+        ERR("Connection error (recv returned %d)", ret);
+        return HTTPCLIENT_ERROR_CONN;
+    }
+
+    *p_read_len = ret;
+    return HTTPCLIENT_OK;
+}
+
 static void InitTimer(Timer *timer)
 {
     timer->end_time = 0;
@@ -680,6 +735,40 @@ static char expired(Timer *timer)
     }
 }
 
+/* the trailer fields after the last chunk, up to the empty line; data holds the len bytes read past it */
+static int httpclient_recv_trailer(httpclient_t *client, char *data, int len)
+{
+    int pos, n, ret;
+
+    while (true) {
+        for (pos = 0; pos + 1 < len; pos++) {
+            if (data[pos] == '\r' && data[pos + 1] == '\n') {
+                break;
+            }
+        }
+
+        if (pos + 1 < len) {
+            memmove(data, &data[pos + 2], len - (pos + 2));
+            len -= pos + 2;
+
+            if (pos == 0) {
+                return HTTPCLIENT_OK;
+            }
+            continue;
+        }
+
+        if (len >= HTTPCLIENT_CHUNK_SIZE - 1) {
+            return HTTPCLIENT_ERROR_PRTCL;
+        }
+
+        ret = httpclient_recv(client, data + len, 1, HTTPCLIENT_CHUNK_SIZE - len - 1, &n);
+        if (ret != HTTPCLIENT_OK || n == 0) {
+            return HTTPCLIENT_ERROR_CONN;
+        }
+        len += n;
+    }
+}
+
 int httpclient_retrieve_content(httpclient_t *client, char *data, int len, httpclient_data_t *client_data)
 {
     int count = 0;
@@ -777,9 +866,12 @@ int httpclient_retrieve_content(httpclient_t *client, char *data, int len, httpc
             len -= (crlf_pos + 2);
 
             if ( readLen == 0 ) {
-                /* Last chunk */
+                /* Last chunk, its trailer is read as well so the connection can take the next request */
                 client_data->is_more = false;
                 DBG("no more (last chunk)");
+                if (httpclient_recv_trailer(client, data, len) != HTTPCLIENT_OK) {
+                    client->keep_alive = false;
+                }
                 break;
             }
         } else {
@@ -880,9 +972,120 @@ int httpclient_retrieve_content(httpclient_t *client, char *data, int len, httpc
     return HTTPCLIENT_OK;
 }
 
+HTTPCLIENT_RESULT httpclient_recv_body(httpclient_t *client, httpclient_data_t *client_data, char *buf, int max_len, int *p_read_len)
+{
+    httpclient_data_ext_t *ext = client_data->ext;
+    int len = 0, pos, out, n, ret;
+    unsigned int chunk_len;
+
+    *p_read_len = 0;
+
+    if (client->socket < 0 || NULL == ext) {
+        return HTTPCLIENT_ERROR_CONN;
+    }
+
+    if (!client_data->is_more) {
+        return HTTPCLIENT_OK;
+    }
+
+    if (ext->remain_data_len > 0) {
+        /* what the last httpclient_recv_response read past response_buf comes first */
+        len = MIN(ext->remain_data_len, max_len);
+        memcpy(buf, ext->remain_data_buf, len);
+        memmove(ext->remain_data_buf, ext->remain_data_buf + len, ext->remain_data_len - len);
+        ext->remain_data_len -= len;
+    } else {
+        n = max_len;
+        if (!client_data->is_chunked) {
+            n = MIN(n, client_data->retrieve_len);
+        }
+
+        ret = httpclient_recv_raw(client, buf, n, &len);
+        if (ret != HTTPCLIENT_OK) {
+            return (HTTPCLIENT_RESULT)ret;
+        }
+
+        if (len == 0) {
+            /* all of the content is in, only the connection can not be used again */
+            if (ext->chunk_trailer) {
+                client->keep_alive = false;
+                client_data->is_more = false;
+                return HTTPCLIENT_OK;
+            }
+            DBG("closed in the body");
+            return HTTPCLIENT_ERROR_CONN;
+        }
+    }
+
+    if (!client_data->is_chunked) {
+        len = MIN(len, client_data->retrieve_len);
+        client_data->retrieve_len -= len;
+        client_data->is_more = (client_data->retrieve_len > 0);
+        *p_read_len = len;
+        return client_data->is_more ? HTTPCLIENT_RETRIEVE_MORE_DATA : HTTPCLIENT_OK;
+    }
+
+    /* chunk data stays where it is or moves down over the framing before it */
+    for (pos = 0, out = 0; pos < len && client_data->is_more; ) {
+        if (client_data->retrieve_len > 0) {
+            n = MIN(client_data->retrieve_len, len - pos);
+            if (out != pos) {
+                memmove(buf + out, buf + pos, n);
+            }
+            out += n;
+            pos += n;
+            client_data->retrieve_len -= n;
+            continue;
+        }
+
+        /* the CRLF ending the last chunk, then the size line of the next */
+        if (ext->chunk_line_len < HTTPCLIENT_CHUNK_LINE_SIZE - 1) {
+            ext->chunk_line[ext->chunk_line_len++] = buf[pos];
+        }
+
+        if (buf[pos++] != '\n') {
+            continue;
+        }
+
+        ext->chunk_line[ext->chunk_line_len] = '\0';
+        ext->chunk_line_len = 0;
+
+        /* trailer fields after the last chunk, the empty line ends the body */
+        if (ext->chunk_trailer) {
+            if (0 == strcmp(ext->chunk_line, "\r\n")) {
+                client_data->is_more = false;
+            }
+            continue;
+        }
+
+        if (0 == strcmp(ext->chunk_line, "\r\n")) {
+            continue;
+        }
+
+        if (sscanf(ext->chunk_line, "%x", &chunk_len) != 1) {
+            ERR("Could not read chunk length");
+            return HTTPCLIENT_ERROR_PRTCL;
+        }
+
+        client_data->retrieve_len = chunk_len;
+        client_data->response_content_len += chunk_len;
+
+        if (chunk_len == 0) {
+            DBG("no more (last chunk)");
+            ext->chunk_trailer = true;
+        }
+    }
+
+    *p_read_len = out;
+    return client_data->is_more ? HTTPCLIENT_RETRIEVE_MORE_DATA : HTTPCLIENT_OK;
+}
+
 int httpclient_response_parse(httpclient_t *client, char *data, int len, httpclient_data_t *client_data)
 {
     int crlf_pos;
+    int minor_version = 0;
+    bool keep_alive;
+    bool has_etag = false;
     int header_buf_len = client_data->header_buf_len;
     char *header_buf = client_data->header_buf;
 
@@ -896,6 +1099,8 @@ int httpclient_response_parse(httpclient_t *client, char *data, int len, httpcli
         client_data->ext->range_end = 0;
         client_data->ext->range_len = 0;
         client_data->ext->is_range  = false;
+        client_data->ext->chunk_line_len = 0;
+        client_data->ext->chunk_trailer = false;
     }
 
     char *crlf_ptr = strstr(data, "\r\n");
@@ -908,12 +1113,15 @@ int httpclient_response_parse(httpclient_t *client, char *data, int len, httpcli
     data[crlf_pos] = '\0';
 
     /* Parse HTTP response */
-    if ( sscanf(data, "HTTP/%*d.%*d %d %*[^\r\n]", &(client->response_code)) != 1 ) {
+    if ( sscanf(data, "HTTP/%*d.%d %d %*[^\r\n]", &minor_version, &(client->response_code)) != 2 ) {
         /* Cannot match string, error */
         ERR("Not a correct HTTP answer : %s", data);
         return HTTPCLIENT_ERROR_PRTCL;
     }
 
+    /* HTTP/1.1 keeps the connection unless told otherwise, 1.0 only when told */
+    keep_alive = (minor_version >= 1);
+
     if ( (client->response_code < 200) || (client->response_code >= 400) ) {
         /* Did not return a 2xx code; TODO fetch headers/(&data?) anyway and implement a mean of writing/reading headers */
         WARN("Response code %d", client->response_code);
@@ -1015,11 +1223,28 @@ int httpclient_response_parse(httpclient_t *client, char *data, int len, httpcli
                     }
                 }
             }
+            else if (key_len == strlen("Connection") && 0 == strncasecmp(key_ptr, "Connection", key_len))
+            {
+                if (httpclient_has_token(value_ptr, value_len, "close")) {
+                    keep_alive = false;
+                } else if (httpclient_has_token(value_ptr, value_len, "keep-alive")) {
+                    keep_alive = true;
+                }
+            }
             else if (0 == strncasecmp(key_ptr, "ETag", key_len))
             {
                 if(NULL != client_data->ext && value_len < HTTPCLIENT_IF_RANGE_SIZE) {
                     memcpy(client_data->ext->if_range, value_ptr, value_len);
                     client_data->ext->if_range[value_len] = '\0';
+                    has_etag = true;
+                }
+            } 
+            else if (0 == strncasecmp(key_ptr, "Last-Modified", key_len))
+            {
+                /* If-Range takes the date as well, an ETag is preferred */
+                if(NULL != client_data->ext && false == has_etag && value_len < HTTPCLIENT_IF_RANGE_SIZE) {
+                    memcpy(client_data->ext->if_range, value_ptr, value_len);
+                    client_data->ext->if_range[value_len] = '\0';
                 }
             } 
             else if (0 == strncasecmp(key_ptr, "Location", key_len))
@@ -1038,10 +1263,162 @@ int httpclient_response_parse(httpclient_t *client, char *data, int len, httpcli
         }
     }
 
+    /* a body without a length ends when the server closes */
+    client->keep_alive = keep_alive && (client_data->is_chunked || client_data->response_content_len >= 0);
+
     return httpclient_retrieve_content(client, data, len, client_data);
 }
 
 
+/* whether the comma separated list in value has token, whole and in any case */
+static bool httpclient_has_token(const char *value, int value_len, const char *token)
+{
+    int token_len = strlen(token);
+    int beg = 0, end, len;
+
+    while (beg < value_len) {
+        while (beg < value_len && (',' == value[beg] || ' ' == value[beg] || '\t' == value[beg])) {
+            beg++;
+        }
+
+        for (end = beg; end < value_len && ',' != value[end]; end++);
+
+        for (len = end - beg; len > 0 && (' ' == value[beg + len - 1] || '\t' == value[beg + len - 1]); len--);
+
+        if (len == token_len && 0 == strncasecmp(&value[beg], token, token_len)) {
+            return true;
+        }
+
+        beg = end;
+    }
+
+    return false;
+}
+
+static void httpclient_pool_init(void)
+{
+    g_pool_mutex = xSemaphoreCreateMutex();
+}
+
+/* any task may be the first, taskENTER_CRITICAL is empty on linux */
+static void httpclient_pool_lock(void)
+{
+    pthread_once(&g_pool_once, httpclient_pool_init);
+
+    xSemaphoreTake(g_pool_mutex, portMAX_DELAY);
+}
+
+static void httpclient_pool_unlock(void)
+{
+    xSemaphoreGive(g_pool_mutex);
+}
+
+/* nothing to read is how an idle connection looks, 0 is the server's FIN */
+static bool httpclient_sock_alive(int sock)
+{
+    char c;
+    int ret = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* an idle connection to host:port, -1 when there is none left open */
+static int httpclient_pool_take(const char *host, int port)
+{
+    int i, sock = -1;
+    unsigned int now = http_current_time_ms();
+
+    httpclient_pool_lock();
+
+    for (i = 0; i < HTTPCLIENT_POOL_SIZE && sock < 0; i++) {
+        httpclient_idle_conn_t *conn = &g_idle_pool[i];
+
+        if (!conn->used || conn->port != port || 0 != strcmp(conn->host, host)) {
+            continue;
+        }
+
+        conn->used = false;
+
+        if (now - conn->idle_since < HTTPCLIENT_POOL_IDLE_TIMEOUT && httpclient_sock_alive(conn->socket)) {
+            sock = conn->socket;
+            g_pool_stats.reuses++;
+        } else {
+            close(conn->socket);
+        }
+    }
+
+    httpclient_pool_unlock();
+    return sock;
+}
+
+void httpclient_release(httpclient_t *client)
+{
+    int i, slot = -1;
+    unsigned int now = http_current_time_ms();
+
+    if (!client->is_http || client->socket < 0 || !client->keep_alive) {
+        httpclient_close(client);
+        return;
+    }
+
+    httpclient_pool_lock();
+
+    /* a free slot, else the one idle the longest */
+    for (i = 0; i < HTTPCLIENT_POOL_SIZE; i++) {
+        httpclient_idle_conn_t *conn = &g_idle_pool[i];
+
+        if (conn->used && now - conn->idle_since >= HTTPCLIENT_POOL_IDLE_TIMEOUT) {
+            close(conn->socket);
+            conn->used = false;
+        }
+
+        if (!conn->used) {
+            slot = i;
+            break;
+        }
+
+        if (slot < 0 || conn->idle_since < g_idle_pool[slot].idle_since) {
+            slot = i;
+        }
+    }
+
+    if (g_idle_pool[slot].used) {
+        close(g_idle_pool[slot].socket);
+    }
+
+    g_idle_pool[slot].used       = true;
+    g_idle_pool[slot].socket     = client->socket;
+    g_idle_pool[slot].port       = client->remote_port;
+    g_idle_pool[slot].idle_since = now;
+    strncpy(g_idle_pool[slot].host, client->host, HTTPCLIENT_HOST_SIZE - 1);
+    g_idle_pool[slot].host[HTTPCLIENT_HOST_SIZE - 1] = '\0';
+
+    httpclient_pool_unlock();
+
+    DBG("httpclient_release() socket:%d, host:%s", client->socket, client->host);
+    client->socket = -1;
+}
+
+bool httpclient_is_alive(httpclient_t *client)
+{
+    if (client->socket < 0) {
+        return false;
+    }
+
+    if (!client->is_http) {
+        return true;
+    }
+
+    return httpclient_sock_alive(client->socket);
+}
+
+void httpclient_get_pool_stats(httpclient_pool_stats_t *stats)
+{
+    httpclient_pool_lock();
+    memcpy(stats, &g_pool_stats, sizeof(httpclient_pool_stats_t));
+    httpclient_pool_unlock();
+}
+
 HTTPCLIENT_RESULT httpclient_connect(httpclient_t *client, char *url)
 {
 #ifdef DOWNLOAD_DATA
@@ -1087,9 +1464,34 @@ HTTPCLIENT_RESULT httpclient_connect(httpclient_t *client, char *url)
         
     DBG("http?:%d, port:%d, host:%s", client->is_http, client->remote_port, host);
 
-    client->socket = -1;
-    if (client->is_http) 
-        ret = httpclient_conn(client, host);
+    strncpy(client->host, host, HTTPCLIENT_HOST_SIZE - 1);
+    client->host[HTTPCLIENT_HOST_SIZE - 1] = '\0';
+
+    client->socket     = -1;
+    client->keep_alive = false;
+    client->reused     = false;
+
+    if (client->is_http) {
+        client->socket = httpclient_pool_take(host, client->remote_port);
+
+        if (client->socket >= 0) {
+            DBG("reuse idle connection, socket = %d", client->socket);
+            client->reused = true;
+            httpclient_set_response_timeout(client, 3000);
+            ret = 0;
+        } else {
+            unsigned int begin = http_current_time_ms();
+
+            ret = httpclient_conn(client, host);
+
+            if (0 == ret) {
+                httpclient_pool_lock();
+                g_pool_stats.connects++;
+                g_pool_stats.connect_ms += http_current_time_ms() - begin;
+                httpclient_pool_unlock();
+            }
+        }
+    }
 #ifdef MTK_HTTPCLIENT_SSL_ENABLE
     else {
         ret = httpclient_ssl_conn(client, host);
@@ -70,6 +70,15 @@ extern "C"
 /** @brief   This macro defines the deault HTTPS port.  */
 #define HTTPS_PORT 443
 
+/** @brief   This macro defines the host name size kept for the idle connection pool.  */
+#define HTTPCLIENT_HOST_SIZE            64
+
+/** @brief   This macro defines how many idle HTTP connections are kept for reuse.  */
+#define HTTPCLIENT_POOL_SIZE            4
+
+/** @brief   This macro defines how long an idle connection is kept, in ms.  */
+#define HTTPCLIENT_POOL_IDLE_TIMEOUT    30000
+
 /**
  * @}
  */
@@ -113,6 +122,9 @@ typedef struct {
     char *auth_user;                /**< Username for basic authentication. */
     char *auth_password;            /**< Password for basic authentication. */
     bool is_http;                   /**< Http connection? if 1, http; if 0, https. */
+    bool keep_alive;                /**< The server keeps the connection open after the last response. */
+    bool reused;                    /**< #httpclient_connect() took the connection from the idle pool. */
+    char host[HTTPCLIENT_HOST_SIZE];    /**< Host the connection goes to. */
 #ifdef MTK_HTTPCLIENT_SSL_ENABLE
     const char *server_cert;        /**< Server certification. */
     const char *client_cert;        /**< Client certification. */
@@ -127,6 +139,7 @@ typedef struct {
 #define HTTPCLIENT_CHUNK_SIZE        2048
 #define HTTPCLIENT_IF_RANGE_SIZE     128
 #define HTTPCLIENT_LOCATION_SIZE     512
+#define HTTPCLIENT_CHUNK_LINE_SIZE   32
 
 
 typedef struct {
@@ -138,6 +151,9 @@ typedef struct {
     char location[HTTPCLIENT_LOCATION_SIZE];
     char remain_data_buf[HTTPCLIENT_CHUNK_SIZE];
     int remain_data_len;
+    char chunk_line[HTTPCLIENT_CHUNK_LINE_SIZE];    /* chunk framing httpclient_recv_body is in the middle of */
+    int chunk_line_len;
+    bool chunk_trailer;          /* the last chunk is in, the lines up to the empty one are left */
 
 } httpclient_data_ext_t;
 
@@ -159,6 +175,14 @@ typedef struct {
     
 } httpclient_data_t;
 
+/** @brief   This structure defines the idle connection pool statistics, see #httpclient_get_pool_stats().  */
+typedef struct {
+    uint32_t connects;           /**< New HTTP connections made by #httpclient_connect(). */
+    uint32_t connect_ms;         /**< Time those took, DNS included. */
+    uint32_t reuses;             /**< Connections #httpclient_connect() took from the idle pool. */
+    uint32_t requests;           /**< HTTP requests sent. */
+} httpclient_pool_stats_t;
+
 /**
  * @}
  */
@@ -309,12 +333,57 @@ HTTPCLIENT_RESULT httpclient_send_request_with_range(httpclient_t *client, char
  */
 HTTPCLIENT_RESULT httpclient_recv_response(httpclient_t *client, httpclient_data_t *client_data);
 
+/**
+ * @brief            This function receives the rest of the response body straight into the caller's buffer.
+ *                   It continues a #httpclient_recv_response() that returned #HTTPCLIENT_RETRIEVE_MORE_DATA, client_data->ext must be set.
+ *                   The chunk framing of a chunked body is taken out in place, only data is left in buf.
+ * @param[in]        client is a pointer to the #httpclient_t.
+ * @param[in, out]   client_data is a pointer to the #httpclient_data_t instance of the response.
+ * @param[out]       buf receives the body data, it is not NULL-terminated.
+ * @param[in]        max_len is the size of buf.
+ * @param[out]       p_read_len is the number of body bytes in buf, may be 0 when only framing came.
+ * @return           #HTTPCLIENT_RETRIEVE_MORE_DATA while the body goes on, #HTTPCLIENT_OK at its end, else see #HTTPCLIENT_RESULT.
+ */
+HTTPCLIENT_RESULT httpclient_recv_body(httpclient_t *client, httpclient_data_t *client_data, char *buf, int max_len, int *p_read_len);
+
 /**
  * @brief            This function closes the HTTP connection.
  * @param[in]        client is a pointer to the #httpclient_t.
  */
 void httpclient_close(httpclient_t *client);
 
+/**
+ * @brief            This function puts the HTTP connection into the idle pool, for #httpclient_connect() to the same host to take.
+ *                   Call it only after the last response was received to its end. It closes the connection when
+ *                   the server does not keep it alive, or it is an HTTPS one.
+ * @param[in]        client is a pointer to the #httpclient_t.
+ */
+void httpclient_release(httpclient_t *client);
+
+/**
+ * @brief            This function checks that the server has not closed an idle connection.
+ * @param[in]        client is a pointer to the #httpclient_t.
+ * @return           true, if another request can be sent on it.
+ */
+bool httpclient_is_alive(httpclient_t *client);
+
+/**
+ * @brief            This function gets the idle connection pool statistics, counted since startup.
+ * @param[out]       stats is a pointer to the #httpclient_pool_stats_t to fill.
+ */
+void httpclient_get_pool_stats(httpclient_pool_stats_t *stats);
+
+/**
+ * @brief            This function splits an URL into its scheme, host, port and path.
+ * @param[in]        url is the URL to split, http[s]://host[:port]/path.
+ * @param[out]       scheme receives the scheme, max_scheme_len is its size.
+ * @param[out]       host receives the host, maxhost_len is its size.
+ * @param[out]       port receives the port, 0 when the URL has none.
+ * @param[out]       path receives the path without the fragment, max_path_len is its size.
+ * @return           #HTTPCLIENT_OK, or #HTTPCLIENT_ERROR_PARSE when it does not fit.
+ */
+int httpclient_parse_url(const char *url, char *scheme, size_t max_scheme_len, char *host, size_t maxhost_len, int *port, char *path, size_t max_path_len);
+
 /**
  * @brief            This function gets the HTTP response code assigned to the last request.
  * @param[in]        client is a pointer to the #httpclient_t.